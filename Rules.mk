@@ -27,6 +27,29 @@ else ifeq ($(logfile),y)
 FLAGS += -DLOGFILE=1
 endif
 
+# Cycle-counter profiling of hot paths, reported via the serial console
+ifeq ($(prof),y)
+FLAGS += -DPROFILE=1
+endif
+
+# Timeline trace of hot-path events, written to FFTRACE.BIN between images
+# and to the serial console on a crash
+ifeq ($(trace),y)
+FLAGS += -DTRACE=1
+endif
+
+# exFAT volumes in the main firmware. FatFS's exFAT code and 64-bit file
+# sizes cost Flash, and its 64-bit divisions need libgcc
+ifeq ($(exfat),y)
+FLAGS += -DEXFAT=1
+LIBS += -lgcc
+endif
+
+# Second-level sector cache in an SPI NOR flash, for boards modded with one
+ifeq ($(norcache),y)
+FLAGS += -DNOR_CACHE=1
+endif
+
 ifeq ($(quickdisk),y)
 FLAGS += -DQUICKDISK=1
 floppy=n
@@ -78,7 +101,7 @@ build.o: $(OBJS)
 
 %.elf: $(OBJS) %.ld Makefile
 	@echo LD $@
-	$(CC) $(LDFLAGS) -T$(*F).ld $(OBJS) -o $@
+	$(CC) $(LDFLAGS) -T$(*F).ld $(OBJS) $(LIBS) -o $@
 	chmod a-x $@
 
 %.hex: %.elf
@@ -0,0 +1,239 @@
+/*
+ * bench.c
+ * 
+ * Drive an image handler through full revolutions of every track, exactly
+ * as the floppy read path does, and time the encode and flux stages.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include "bench.h"
+
+extern uint8_t *bench_file;
+
+/* Buffer sizes match the firmware's async (ring_io) configuration at high
+ * data rates on a 64kB part (see ram_kb and floppy_mount()): the data buffer
+ * gets what is left of the arena. */
+#define WRITE_BC_BYTES  (4*1024)
+#define DATA_BYTES      (44*1024)
+
+/* Give up on a track which produces no flux for this many iterations. */
+#define MAX_STALL 1000
+
+static uint32_t write_bc[WRITE_BC_BYTES/4];
+static uint32_t data[DATA_BYTES/4];
+static uint16_t flux[1024];
+static struct image image;
+static struct slot slot;
+static bool_t reserved;
+
+/* FNV-1a, over the flux samples of a revolution starting at the index. The
+ * flux stream is deterministic, so its hash is checked against known output
+ * (bench/check.txt). */
+static uint32_t digest(uint32_t h, const uint16_t *p, unsigned int nr)
+{
+    while (nr--) {
+        h = (h ^ (*p & 0xff)) * 16777619u;
+        h = (h ^ (*p++ >> 8)) * 16777619u;
+    }
+    return h;
+}
+
+static bool_t bench_track(struct image *im, uint16_t track,
+                          unsigned int revs, struct bench_result *res)
+{
+    uint32_t rev_ticks, start_pos = 0;
+    uint64_t ticks = 0, t;
+    unsigned int i, stall = 0;
+    uint16_t nr;
+
+    t = host_ns();
+    image_setup_track(im, track, &start_pos);
+    res->setup_ns += host_ns() - t;
+
+    rev_ticks = sysclk_stk(im->stk_per_rev);
+
+    while (ticks < (uint64_t)revs * rev_ticks) {
+        bool_t progress;
+
+        t = host_ns();
+        progress = image_read_track(im);
+        res->read_ns += host_ns() - t;
+
+        t = host_ns();
+        nr = image_rdata_flux(im, flux, ARRAY_SIZE(flux));
+        res->flux_ns += host_ns() - t;
+
+        for (i = 0; i < nr; i++) {
+            if (ticks < rev_ticks)
+                res->digest = digest(res->digest, &flux[i], 1);
+            ticks += flux[i] + 1;
+        }
+        res->flux += nr;
+
+        if (nr || progress)
+            stall = 0;
+        else if (++stall >= MAX_STALL)
+            return FALSE;
+    }
+
+    res->disk_ns += ((uint64_t)revs * rev_ticks * 1000) / SYSCLK_MHZ;
+    res->bitcells += (uint64_t)revs * im->tracklen_bc;
+    return TRUE;
+}
+
+static void bench_open(const char *name, void *p, uint32_t size)
+{
+    struct image *im = &image;
+
+    bench_file = p;
+
+    memset(&slot, 0, sizeof(slot));
+    snprintf(slot.name, sizeof(slot.name), "%s", name);
+    filename_extension(name, slot.type, sizeof(slot.type));
+    slot.size = size;
+    /* A first cluster and directory entry, as from a real slot. */
+    slot.firstCluster = 2;
+    slot.dir_sect = 1;
+
+    memset(im, 0, sizeof(*im));
+    im->write_bc_window = ~0;
+    im->bufs.write_bc.len = sizeof(write_bc);
+    im->bufs.write_bc.p = write_bc;
+    im->bufs.read_bc.len = im->bufs.write_bc.len / 2;
+    im->bufs.read_bc.p = (char *)im->bufs.write_bc.p
+        + im->bufs.read_bc.len;
+    im->bufs.write_data.len = sizeof(data);
+    im->bufs.write_data.p = data;
+    im->bufs.read_data = im->bufs.staging = im->bufs.write_data;
+    if (!reserved) {
+        ring_io_reserve(sizeof(data));
+        reserved = TRUE;
+    }
+
+    image_open(im, &slot, NULL, FALSE);
+}
+
+void bench_image(const char *name, void *p, uint32_t size,
+                 unsigned int revs, struct bench_result *res)
+{
+    struct image *im = &image;
+    const struct image_type *type;
+    const char *ext;
+    unsigned int cyl, side;
+
+    memset(res, 0, sizeof(*res));
+    res->digest = 2166136261u;
+
+    bench_open(name, p, size);
+
+    ext = slot.type;
+    for (type = &image_type[0]; type->handler != NULL; type++) {
+        if (type->handler == im->disk_handler) {
+            ext = type->ext;
+            break;
+        }
+    }
+    snprintf(res->handler, sizeof(res->handler), "%s", ext);
+
+    /* Firmware track numbering is (cyl << 1) | side. */
+    for (cyl = 0; cyl < im->nr_cyls; cyl++) {
+        for (side = 0; side < im->nr_sides; side++) {
+            if (!bench_track(im, (cyl << 1) | side, revs, res))
+                res->stalls++;
+            res->nr_tracks++;
+        }
+    }
+}
+
+/* Raw geometry cache (raw_cache in img.c). */
+const struct image_handler *raw_cache_handler(unsigned int i);
+
+/* Open the image once more, and check that a write invalidates the cached
+ * geometry after the mount has cleared the directory entry. Returns zero on
+ * success, non-zero if the entry was never cached or survived the write. */
+int bench_raw_cache(const char *name, void *p, uint32_t size)
+{
+    struct image *im = &image;
+    uint32_t pos = 0;
+
+    raw_cache_init();
+    bench_open(name, p, size);
+    if (raw_cache_handler(0) != im->disk_handler)
+        return -1; /* not cached */
+
+    /* As floppy_mount(): no further changes to the directory entry. */
+    im->fp.dir_sect = 0;
+    im->fp.dir_ptr = NULL;
+
+    /* Any write, even one which decodes nothing, drops the entry. */
+    image_setup_track(im, 0, &pos);
+    im->disk_handler->write_track(im);
+    return (raw_cache_handler(0) == NULL) ? 0 : 1;
+}
+
+/* MFM decode: mfm_to_bin() and mfm_ring_to_bin() against the per-word
+ * mfmtobin() loop they replaced. Sizes are those of a sector write. */
+#define MFM_RING_WORDS 4096
+#define MFM_SECT_BYTES 512
+
+static uint16_t mfm_ring[MFM_RING_WORDS];
+static uint8_t mfm_ref[MFM_SECT_BYTES], mfm_out[MFM_SECT_BYTES];
+
+static void mfm_ref_to_bin(unsigned int idx, unsigned int nr)
+{
+    unsigned int i;
+    for (i = 0; i < nr; i++)
+        mfm_ref[i] = mfmtobin(mfm_ring[(idx + i) & (MFM_RING_WORDS-1)]);
+}
+
+unsigned int bench_mfm(unsigned int iters, uint64_t *ref_ns,
+                       uint64_t *new_ns, uint64_t *bytes)
+{
+    const unsigned int mask = MFM_RING_WORDS - 1;
+    unsigned int i, idx, nr, bad = 0;
+    uint32_t x = 0x12345678;
+    uint64_t t;
+
+    for (i = 0; i < MFM_RING_WORDS; i++) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        mfm_ring[i] = x;
+    }
+
+    *ref_ns = *new_ns = *bytes = 0;
+    for (i = 0; i < iters; i++) {
+        /* Every start alignment and length parity, and every few
+         * iterations a sector which wraps the ring. */
+        idx = (i * 517) & mask;
+        nr = MFM_SECT_BYTES - (i & 1);
+        if ((i & 7) == 7)
+            idx = MFM_RING_WORDS - (i & 255) - 1;
+
+        t = host_ns();
+        mfm_ref_to_bin(idx, nr);
+        *ref_ns += host_ns() - t;
+
+        t = host_ns();
+        mfm_ring_to_bin(mfm_ring, mask, idx, mfm_out, nr);
+        *new_ns += host_ns() - t;
+
+        *bytes += nr;
+        if (memcmp(mfm_ref, mfm_out, nr))
+            bad++;
+    }
+
+    return bad;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
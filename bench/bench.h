@@ -0,0 +1,61 @@
+/*
+ * bench.h
+ * 
+ * Interface between the firmware-side benchmark driver (bench.c, stubs.c)
+ * and the host-side harness (host.c). Only C99 scalar types cross this
+ * boundary: the firmware and libc headers are never mixed in one file.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+struct bench_result {
+    char handler[8];            /* Image type, as matched by image_open() */
+    unsigned int nr_tracks;
+    uint64_t disk_ns;           /* Real time taken by a drive to read it */
+    uint64_t bitcells;          /* Bitcells covered by generated flux */
+    uint64_t flux;              /* Flux samples generated */
+    uint64_t read_ns;           /* Time in image_read_track() */
+    uint64_t flux_ns;           /* Time in image_rdata_flux() */
+    uint64_t setup_ns;          /* Time in image_setup_track() */
+    unsigned int stalls;        /* Tracks that stopped producing flux */
+    uint32_t digest;            /* Hash of every track's first revolution */
+};
+
+/* bench.c: Mount the image at @p and generate @revs revolutions of flux on
+ * every track. Failure to mount is fatal (via F_die). */
+void bench_image(const char *name, void *p, uint32_t size,
+                 unsigned int revs, struct bench_result *res);
+
+/* bench.c: Mount a raw image with the geometry cache enabled, and check
+ * that a write to it drops its cache entry. Returns 0 if so. */
+int bench_raw_cache(const char *name, void *p, uint32_t size);
+
+/* bench.c: Decode @iters sectors of random MFM with both mfm_ring_to_bin()
+ * and a per-word mfmtobin() loop. Returns the number which differ. */
+unsigned int bench_mfm(unsigned int iters, uint64_t *ref_ns,
+                       uint64_t *new_ns, uint64_t *bytes);
+
+/* ring_check.c: Check ring_io's write path. Returns NULL on success, else a
+ * description of the first check to fail. */
+const char *bench_ring_io(void);
+
+/* async_check.c: Check when fs_async lets a read overtake queued writeback.
+ * Returns NULL on success, else a description of the first check to fail. */
+const char *bench_fs_async(void);
+
+/* host.c */
+uint64_t host_ns(void);
+void host_die(const char *msg, int code) __attribute__((noreturn));
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
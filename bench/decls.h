@@ -0,0 +1,53 @@
+/*
+ * decls.h
+ * 
+ * Host build of the firmware headers, for the image-handler benchmark.
+ * Shadows inc/decls.h: the ARMv7-M intrinsics are replaced by portable
+ * equivalents and everything else is pulled in unmodified.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <limits.h>
+
+#include "types.h"
+#include "stm32f10x_regs.h"
+#include "stm32f10x.h"
+#include "host_intrinsics.h"
+
+#include "time.h"
+#include "../src/fatfs/ff.h"
+#include "util.h"
+#include "prof.h"
+#include "trace.h"
+#include "list.h"
+#include "cache.h"
+#include "da.h"
+#include "hxc.h"
+#include "cancellation.h"
+#include "spi.h"
+#include "timer.h"
+#include "thread.h"
+#include "fs.h"
+#include "fs_async.h"
+#include "ring_io.h"
+#include "floppy.h"
+#include "zimg.h"
+#include "volume.h"
+#include "config.h"
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,245 @@
+/*
+ * host.c
+ * 
+ * Host side of the image-handler benchmark: map image files, keep time,
+ * and report throughput. This is the only file built against libc headers.
+ * 
+ * Usage: ffbench [-c] [-r revs] image...
+ *        ffbench -m
+ *        ffbench -i
+ *        ffbench -a
+ *        ffbench -w image...
+ * 
+ * Per image, reports bitcells encoded per second by image_read_track(),
+ * flux samples generated per second by image_rdata_flux(), mean time in
+ * image_setup_track(), and overall speed relative to a real drive.
+ * With -c, reports instead a hash of the flux generated for the first
+ * revolution of every track, for comparison against known output.
+ * With -m, compares mfm_ring_to_bin() against a per-word mfmtobin() loop,
+ * for speed and for identical output. With -i, runs regression checks of
+ * ring_io's write path (ring_check.c). With -a, checks when the fs_async
+ * scheduler lets a read overtake queued writeback (async_check.c). With -w,
+ * checks that a write to a raw image invalidates its cached geometry.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bench.h"
+
+uint64_t host_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void host_die(const char *msg, int code)
+{
+    fprintf(stderr, "** %s (%d)\n", msg, code);
+    exit(1);
+}
+
+#if !defined(NDEBUG)
+int vprintk(const char *format, va_list ap)
+{
+    return vfprintf(stderr, format, ap);
+}
+
+int printk(const char *format, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, format);
+    n = vprintk(format, ap);
+    va_end(ap);
+
+    return n;
+}
+#endif
+
+/* Units of @n per second, in millions. */
+static double mrate(uint64_t n, uint64_t ns)
+{
+    return ns ? (n * 1e3) / ns : 0;
+}
+
+static int mfm(void)
+{
+    uint64_t ref_ns, new_ns, bytes;
+    unsigned int bad = bench_mfm(100000, &ref_ns, &new_ns, &bytes);
+
+    printf("%-20s %12s %12s\n", "mfm decode", "per-word", "batched");
+    printf("%-20s %12.2f %12.2f\n", "Mbytes/s",
+           mrate(bytes, ref_ns), mrate(bytes, new_ns));
+    if (bad)
+        printf("** %u sectors decoded differently\n", bad);
+
+    return bad ? 1 : 0;
+}
+
+static int ring_io(void)
+{
+    const char *fail = bench_ring_io();
+
+    if (fail) {
+        printf("** ring_io: %s\n", fail);
+        return 1;
+    }
+    printf("ring_io: write path ok\n");
+    return 0;
+}
+
+static int fs_async(void)
+{
+    const char *fail = bench_fs_async();
+
+    if (fail) {
+        printf("** fs_async: %s\n", fail);
+        return 1;
+    }
+    printf("fs_async: read ordering ok\n");
+    return 0;
+}
+
+static void *map_image(const char *path, uint32_t *size)
+{
+    struct stat st;
+    void *p;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        perror(path);
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size == 0 || st.st_size > UINT32_MAX) {
+        fprintf(stderr, "%s: bad image size\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    /* Private mapping: handler writes are discarded. */
+    p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror(path);
+        return NULL;
+    }
+
+    *size = st.st_size;
+    return p;
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_result res;
+    uint64_t busy_ns;
+    unsigned int revs = 10;
+    uint32_t size;
+    void *p;
+    int i, opt, rc = 0, check = 0, wrcache = 0;
+
+    while ((opt = getopt(argc, argv, "acimr:w")) != -1) {
+        switch (opt) {
+        case 'a':
+            return fs_async();
+        case 'i':
+            return ring_io();
+        case 'm':
+            return mfm();
+        case 'c':
+            check = 1;
+            revs = 1;
+            break;
+        case 'r':
+            revs = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            wrcache = 1;
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if ((optind >= argc) || (revs == 0))
+        goto usage;
+
+    if (!check && !wrcache)
+        printf("%-20s %-5s %6s %12s %12s %10s %9s\n", "image", "type",
+               "tracks", "Mbitcells/s", "Mflux/s", "setup_us", "realtime");
+
+    for (i = optind; i < argc; i++) {
+        const char *name = strrchr(argv[i], '/');
+        name = name ? name + 1 : argv[i];
+        if ((p = map_image(argv[i], &size)) == NULL) {
+            rc = 1;
+            continue;
+        }
+        if (wrcache) {
+            int bad = bench_raw_cache(name, p, size);
+            munmap(p, size);
+            printf("%-20s %s\n", name, !bad ? "invalidated on write"
+                   : (bad < 0) ? "** not cached" : "** stale after write");
+            if (bad)
+                rc = 1;
+            continue;
+        }
+        bench_image(name, p, size, revs, &res);
+        munmap(p, size);
+        if (check) {
+            printf("%-20s %-5s %6u %08x\n", name, res.handler,
+                   res.nr_tracks, res.digest);
+            if (res.stalls)
+                rc = 1;
+            continue;
+        }
+        busy_ns = res.setup_ns + res.read_ns + res.flux_ns;
+        printf("%-20s %-5s %6u %12.2f %12.2f %10.1f %8.1fx",
+               name, res.handler, res.nr_tracks,
+               mrate(res.bitcells, res.read_ns),
+               mrate(res.flux, res.flux_ns),
+               res.nr_tracks ? res.setup_ns / (1e3 * res.nr_tracks) : 0,
+               busy_ns ? (double)res.disk_ns / busy_ns : 0);
+        if (res.stalls) {
+            printf("  (%u tracks stalled)", res.stalls);
+            rc = 1;
+        }
+        printf("\n");
+    }
+
+    return rc;
+
+usage:
+    fprintf(stderr, "Usage: %s [-c] [-r revs] image...\n"
+            "       %s -m\n"
+            "       %s -i\n"
+            "       %s -a\n"
+            "       %s -w image...\n",
+            argv[0], argv[0], argv[0], argv[0], argv[0]);
+    return 1;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
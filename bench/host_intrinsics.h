@@ -0,0 +1,80 @@
+/*
+ * host_intrinsics.h
+ * 
+ * Portable stand-ins for inc/intrinsics.h. The benchmark is single threaded
+ * and has no interrupts, so IRQ and exception control are no-ops.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+struct exception_frame {
+    uint32_t r0, r1, r2, r3, r12, lr, pc, psr;
+};
+
+#define _STR(x) #x
+#define STR(x) _STR(x)
+
+/* Force a compilation error if condition is true */
+#define BUILD_BUG_ON(cond) ({ _Static_assert(!(cond), "!(" #cond ")"); })
+
+#define aligned(x) __attribute__((aligned(x)))
+#define packed __attribute((packed))
+#define always_inline __inline__ __attribute__((always_inline))
+#define noinline __attribute__((noinline))
+#define ramfunc
+
+#define likely(x)     __builtin_expect(!!(x),1)
+#define unlikely(x)   __builtin_expect(!!(x),0)
+
+#define illegal() __builtin_trap()
+
+#define barrier() asm volatile ("" ::: "memory")
+#define cpu_sync() barrier()
+#define cpu_relax() barrier()
+
+#define read_special(reg) 0u
+#define write_special(reg,val) ((void)(val))
+
+#define in_exception() 0
+
+#define global_disable_exceptions() barrier()
+#define global_enable_exceptions() barrier()
+
+#define IRQ_global_disable() barrier()
+#define IRQ_global_enable() barrier()
+
+#define IRQ_save(newpri) ({ barrier(); 0; })
+#define IRQ_restore(oldpri) ({ (void)(oldpri); barrier(); })
+
+static inline uint16_t _rev16(uint16_t x)
+{
+    return __builtin_bswap16(x);
+}
+
+static inline uint32_t _rev32(uint32_t x)
+{
+    return __builtin_bswap32(x);
+}
+
+static inline uint32_t _rbit32(uint32_t x)
+{
+    x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+    x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+    x = ((x >> 4) & 0x0f0f0f0f) | ((x & 0x0f0f0f0f) << 4);
+    return _rev32(x);
+}
+
+#define cmpxchg(ptr,o,n) __sync_val_compare_and_swap((ptr),(o),(n))
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
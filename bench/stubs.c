@@ -0,0 +1,309 @@
+/*
+ * stubs.c
+ * 
+ * Minimal firmware environment for the image handlers: synchronous FatFS
+ * and async-I/O calls over an in-memory image file, plus no-op volume,
+ * display and configuration hooks.
+ * 
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include "bench.h"
+
+/* The one open image file, shared by every FIL the handlers create. */
+uint8_t *bench_file;
+
+struct ff_cfg ff_cfg = {
+    .version = FFCFG_VERSION,
+    .size = sizeof(struct ff_cfg),
+#define x(n,o,v) .o = v,
+#include "ff_cfg_defaults.h"
+#undef x
+};
+
+const char fw_ver[] = FW_VER;
+unsigned int ram_kb = 64;
+uint8_t display_type = DT_NONE;
+
+void F_die(FRESULT fr)
+{
+    host_die("F_die", fr);
+}
+
+void fatfs_from_slot(FIL *file, const struct slot *slot, BYTE mode)
+{
+    memset(file, 0, sizeof(*file));
+    file->obj.attr = slot->attributes;
+    file->obj.sclust = slot->firstCluster;
+    file->obj.objsize = slot->size;
+    file->dir_sect = slot->dir_sect;
+    file->dir_ptr = (void *)(uintptr_t)slot->dir_ptr;
+    file->flag = mode;
+}
+
+void F_read(FIL *fp, void *buff, UINT btr, UINT *br)
+{
+    UINT nr = min_t(UINT, btr, f_size(fp) - fp->fptr);
+    memcpy(buff, bench_file + fp->fptr, nr);
+    fp->fptr += nr;
+    if (br != NULL)
+        *br = nr;
+}
+
+void F_write(FIL *fp, const void *buff, UINT btw, UINT *bw)
+{
+    /* The image is mapped privately: writes never reach the host file. */
+    UINT nr = min_t(UINT, btw, f_size(fp) - fp->fptr);
+    memcpy(bench_file + fp->fptr, buff, nr);
+    fp->fptr += nr;
+    if (bw != NULL)
+        *bw = nr;
+}
+
+void F_lseek(FIL *fp, FSIZE_t ofs)
+{
+    fp->fptr = min_t(FSIZE_t, ofs, f_size(fp));
+}
+
+void F_sync(FIL *fp)
+{
+}
+
+void F_close(FIL *fp)
+{
+}
+
+/* Async I/O completes synchronously: every FOP is already done. Reads and
+ * writes are counted, for ring_check.c. */
+unsigned int bench_nr_reads, bench_rd_bytes, bench_nr_writes;
+
+FOP F_lseek_async(FIL *fp, FSIZE_t ofs)
+{
+    F_lseek(fp, ofs);
+    return 0;
+}
+
+FOP F_read_async(FIL *fp, void *buff, UINT btr, UINT *br)
+{
+    bench_nr_reads++;
+    bench_rd_bytes += btr;
+    F_read(fp, buff, btr, br);
+    return 0;
+}
+
+FOP F_write_async(FIL *fp, const void *buff, UINT btw, UINT *bw)
+{
+    bench_nr_writes++;
+    F_write(fp, buff, btw, bw);
+    return 0;
+}
+
+FOP F_sync_async(FIL *fp)
+{
+    return 0;
+}
+
+/* No fast-seek map is built, so ring_io never goes direct to the volume. */
+FOP disk_read_async(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count)
+{
+    host_die("disk_read_async", 0);
+}
+
+FOP disk_write_async(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count)
+{
+    host_die("disk_write_async", 0);
+}
+
+FOP disk_ioctl_async(BYTE pdrv, BYTE cmd, void* buff, DRESULT *res)
+{
+    if (res != NULL)
+        *res = RES_OK;
+    return 0;
+}
+
+bool_t F_async_isdone(FOP oper)
+{
+    return TRUE;
+}
+
+void F_async_wait(FOP oper)
+{
+}
+
+FOP F_async_get_completed_op(void)
+{
+    return 0;
+}
+
+bool_t F_async_idle(void)
+{
+    return TRUE;
+}
+
+void F_async_notify(void)
+{
+}
+
+void F_async_cancel(FOP oper)
+{
+}
+
+/* Extent-mapped writes: the handlers are given no extent map. */
+void flashfloppy_wrote_sectors(FIL *fp, LBA_t sect, UINT cnt,
+                               const BYTE *buff)
+{
+}
+
+/* Files are never extended: see image_extend(). */
+FRESULT f_expand(FIL *fp, FSIZE_t fsz, BYTE opt)
+{
+    return FR_DENIED;
+}
+
+/* Arena space, claimed once by ring_io_reserve(). */
+void *arena_alloc(uint32_t sz)
+{
+    static uint32_t pool[256], used;
+    void *p = &pool[used];
+    used += (sz + 3) / 4;
+    if (used > ARRAY_SIZE(pool))
+        host_die("arena_alloc", sz);
+    return p;
+}
+
+/* Persistent arena space, claimed once by raw_cache_init(). */
+void *arena_persist_alloc(uint32_t sz)
+{
+    static uint32_t pool[1024], used;
+    void *p = &pool[used];
+    used += (sz + 3) / 4;
+    if (used > ARRAY_SIZE(pool))
+        host_die("arena_persist_alloc", sz);
+    return p;
+}
+
+void thread_yield(void)
+{
+}
+
+time_t time_now(void)
+{
+    return (host_ns() * TIME_MHZ) / 1000;
+}
+
+bool_t volume_interrupt(void)
+{
+    return FALSE;
+}
+
+void volume_cache_init(void *start, void *end)
+{
+}
+
+void volume_cache_destroy(void)
+{
+}
+
+void volume_cache_writeback(void *stage, unsigned int len)
+{
+}
+
+bool_t volume_prefetch(LBA_t sector, void *buf)
+{
+    return FALSE;
+}
+
+void volume_cache_pin_metadata(FATFS *fs)
+{
+}
+
+bool_t volume_cache_pin(LBA_t sector)
+{
+    return FALSE;
+}
+
+/* No IMG.CFG: handlers fall back to their built-in geometry tables. */
+bool_t get_img_cfg(struct slot *slot)
+{
+    return FALSE;
+}
+
+int get_next_opt(struct opts *opts)
+{
+    return OPT_eof;
+}
+
+uint16_t get_slot_nr(void)
+{
+    return 0;
+}
+
+bool_t set_slot_nr(uint16_t slot_nr)
+{
+    return FALSE;
+}
+
+void set_slot_name(const char *name)
+{
+}
+
+void floppy_set_cyl(uint8_t unit, uint8_t cyl)
+{
+}
+
+void lcd_write(int col, int row, int min, const char *str)
+{
+}
+
+void led_7seg_write_string(const char *p)
+{
+}
+
+int led_7seg_nr_digits(void)
+{
+    return 0;
+}
+
+void filename_extension(const char *filename, char *extension, size_t size)
+{
+    const char *p;
+    unsigned int i;
+
+    extension[0] = '\0';
+    if ((p = strrchr(filename, '.')) == NULL)
+        return;
+
+    for (i = 0; i < (size-1); i++)
+        if ((extension[i] = tolower(p[i+1])) == '\0')
+            break;
+    extension[i] = '\0';
+}
+
+int strcmp_ci(const char *s1, const char *s2)
+{
+    for (;;) {
+        int diff = tolower(*s1) - tolower(*s2);
+        if (diff || !*s1)
+            return diff;
+        s1++; s2++;
+    }
+    return 0;
+}
+
+void memcpy_fast(void *dest, const void *src, size_t n)
+{
+    memcpy(dest, src, n);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -24,12 +24,57 @@ void cache_update(struct cache *c, uint32_t id, const void *dat);
 void cache_update_N(struct cache *c, uint32_t id,
                     const void *dat, unsigned int N);
 
+/* Insert @N items read from backing store. Items which are cached and dirty
+ * are instead copied out to @dat, as they are newer than the data read. */
+void cache_fill_N(struct cache *c, uint32_t id, void *dat, unsigned int N);
+
+/* Update item @id with data @dat and mark it dirty: it will not be evicted
+ * until cleaned. Returns FALSE, and does nothing, if the cache's dirty limit
+ * (half of items) is reached: the caller should clean some items. */
+bool_t cache_write(struct cache *c, uint32_t id, const void *dat);
+
+/* Number of dirty items. */
+unsigned int cache_nr_dirty(struct cache *c);
+
+/* Find the lowest-numbered dirty item. Returns FALSE if there are none. */
+bool_t cache_first_dirty(struct cache *c, uint32_t *id);
+
+/* Mark item @id clean. Returns a pointer to its data, which the caller must
+ * write back before next updating the cache, or NULL if @id is not dirty. */
+const void *cache_clean(struct cache *c, uint32_t id);
+
+/* Write-back of item @id, with data @dat as cleaned, failed: mark it dirty
+ * again. If it has been rewritten since, the newer data is kept. Returns
+ * FALSE, and does nothing, if the dirty limit has been reached meanwhile. */
+bool_t cache_redirty(struct cache *c, uint32_t id, const void *dat);
+
+/* Pin cached item @id so that it is never evicted. Returns FALSE if the item
+ * is not cached, or if the cache's pin limit (a quarter of items) is hit. */
+bool_t cache_pin(struct cache *c, uint32_t id);
+
+/* Return pinned item @id to the LRU. No effect if the item is not pinned. */
+void cache_unpin(struct cache *c, uint32_t id);
+
+/* Log hit/miss/eviction counts. */
+void cache_stats(struct cache *c);
+void cache_counts(struct cache *c, uint32_t *hits, uint32_t *misses);
+
 #else
 
 #define cache_init(a,b,c) NULL
 #define cache_lookup(a,b) NULL
 #define cache_update(a,b,c) ((void)0)
 #define cache_update_N(a,b,c,d) ((void)0)
+#define cache_fill_N(a,b,c,d) ((void)0)
+#define cache_write(a,b,c) FALSE
+#define cache_nr_dirty(a) 0
+#define cache_first_dirty(a,b) FALSE
+#define cache_clean(a,b) NULL
+#define cache_redirty(a,b,c) FALSE
+#define cache_pin(a,b) FALSE
+#define cache_unpin(a,b) ((void)0)
+#define cache_stats(a) ((void)0)
+#define cache_counts(a,b,c) ((void)0)
 
 #endif
 
@@ -18,6 +18,14 @@ struct opts {
     const struct opt *opts;
     char *arg;
     int argmax;
+    /* File offset of the most recently returned "[section]" header. */
+    uint32_t section_ofs;
+    /* Optional: maps an option name to its index in opts[], or -1. */
+    int (*lookup)(const char *name);
+    /* Optional read-ahead buffer: if set, the file is read in bulk rather
+     * than a byte at a time. Do not seek the file while it is in use. */
+    char *rbuf;
+    unsigned int rbuf_len, rbuf_pos, rbuf_fill;
 };
 
 int get_next_opt(struct opts *opts);
@@ -62,6 +70,7 @@ struct packed ff_cfg {
 #define TWOBUTTON_rotary      2
 #define TWOBUTTON_rotary_fast 3
 #define TWOBUTTON_htu         4
+#define TWOBUTTON_letter      5
 #define TWOBUTTON_mask        7
 #define TWOBUTTON_reverse     (1u<<7)
     uint8_t twobutton_action;
@@ -142,6 +151,7 @@ struct packed ff_cfg {
 #define SORT_never  0
 #define SORT_always 1
 #define SORT_small  2
+#define SORT_index  3
     uint8_t folder_sort;
 #define MOTOR_ignore 0xff
     uint8_t motor_delay; /* / 10ms */
@@ -161,7 +171,12 @@ struct packed ff_cfg {
 #define WDRAIN_instant  0
 #define WDRAIN_realtime 1
 #define WDRAIN_eot      2
+#define WDRAIN_adaptive 3
     uint8_t write_drain;
+    uint16_t write_back_ms; /* 0 = write-through */
+    uint8_t nav_scan_window; /* Unsorted folders: entries scanned each side */
+    uint8_t pin_boot_kb; /* Image head kept resident in the prefetch cache */
+    bool_t perf_report; /* Append a summary to FFPERF.TXT on eject */
 };
 
 extern struct ff_cfg ff_cfg;
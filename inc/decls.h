@@ -23,6 +23,8 @@
 #include "time.h"
 #include "../src/fatfs/ff.h"
 #include "util.h"
+#include "prof.h"
+#include "trace.h"
 #include "list.h"
 #include "cache.h"
 #include "da.h"
@@ -35,7 +37,9 @@
 #include "fs_async.h"
 #include "ring_io.h"
 #include "floppy.h"
+#include "zimg.h"
 #include "volume.h"
+#include "nor_cache.h"
 #include "config.h"
 
 /*
@@ -48,6 +48,19 @@ struct image_bufs {
     struct image_buf write_data;
     /* Read buffer for track data to be used for generating flux pattern. */
     struct image_buf read_data;
+    /* The whole staging area, as laid out at mount. Each image open carves
+     * the handler's state from its tail, and shares the remainder between
+     * write_data and read_data. */
+    struct image_buf staging;
+};
+
+/* A fully-encoded revolution of the current track, replayed into read_bc in
+ * place of re-encoding the track from sector data. */
+struct bc_cache {
+    uint16_t *p; /* Raw bitcell words, from start of revolution */
+    uint16_t nr; /* Words per revolution */
+    uint16_t pos; /* Record or replay cursor, in words */
+    uint8_t state;
 };
 
 struct adf_image {
@@ -59,20 +72,53 @@ struct adf_image {
     uint32_t written_secs;
     uint16_t trash_bc; /* Number of bitcells to throw away. */
     uint8_t sec_map[2][22];
-    struct image_buf write_buffer;
-    uint16_t *write_offsets; /* File offset of each 512 byte buffer segment */
-    FOP write_op;
-    uint8_t write_cnt;
-    uint8_t sync_state;
     bool_t ring_io_inited;
+    /* Encoded header and data checksum MFM longs of the current cylinder,
+     * by side and sector position, and a valid bit per position. */
+    struct adf_sec_hdr {
+        uint32_t info_e, info_o, hdr_csum, dat_csum;
+    } *sec_hdr;
+    uint32_t sec_hdr_valid[2];
+};
+
+struct ffx_image {
+    struct ring_io ring_io;
+    /* Checkpoints of the current track: (sample, SYSCLK ticks from index). */
+    struct ffx_cp {
+        uint32_t sample, ticks;
+    } *cp;
+    uint32_t nr;  /* Samples in the current track */
+    uint32_t pos; /* Samples passed to rdata_flux since the index */
 };
 
 struct hfe_image {
     struct ring_io ring_io;
-    uint16_t tlut_base;
+    struct zimg *z; /* HFZ: compressed container, else NULL */
+    /* Track LUT, loaded whole at open: (offset, len) per cylinder. */
+    struct hfe_trk {
+        uint16_t off, len;
+    } *tlut;
     uint16_t trk_len;
+    uint8_t nr_tracks;
     bool_t is_v3, double_step, fresh_seek;
     uint8_t next_index_pulses_pos;
+    /* HFEv3: (bitcell -> tick) checkpoints of the current track, one per
+     * 2^cp_shift bitcells, recorded while reading it from the index. Opcodes
+     * occupy bitcells but no ticks, so otherwise we can only guess where a
+     * rotational position lies in the track data. */
+#define HFE_MAX_CP 32
+    struct hfe_cp {
+        uint32_t ticks;
+        uint16_t bc_off; /* bitcells past (index << cp_shift) */
+        uint16_t ticks_per_cell;
+    } cp[HFE_MAX_CP];
+    uint32_t cp_next; /* bitcell at which to record cp[cp_nr], or ~0 */
+    uint8_t cp_nr, cp_shift;
+    bool_t cp_exact; /* cur_bc and cur_ticks agree exactly */
+    bool_t cp_full;  /* checkpoints cover the whole track */
+    /* HFEv3 OP_rand: PRNG state, and unused bytes of the last output. */
+    uint32_t rnd, rnd_mask;
+    uint8_t rnd_left;
 };
 
 struct qd_image {
@@ -80,6 +126,10 @@ struct qd_image {
     uint16_t tb;
     uint32_t trk_len;
     uint32_t win_start, win_end;
+    /* Leading portion of the track, kept resident outside the ring so that
+     * reads from the start of the track need not wait for the ring. */
+    uint8_t *pin_buf;
+    uint32_t pin_len, pin_pos;
 };
 
 struct raw_sec {
@@ -105,17 +155,31 @@ struct img_image {
      * (e.g., the other side of the cylinder). */
     uint32_t trk_len;
     uint16_t trk_sec, rd_sec_pos;
+    /* Fetched sector data: in place in the ring, or staged in read_data. */
+    uint8_t *sec_data;
     int32_t decode_pos;
     uint16_t decode_data_pos, crc;
     uint8_t layout; /* LAYOUT_* */
     uint8_t post_crc_syncs;
     int16_t write_sector;
+    /* Sector being written was found from its ID record (ie. a format). */
+    bool_t formatting;
     uint8_t *sec_map, *trk_map;
     struct raw_trk *trk, *trk_info;
     struct raw_sec *sec_info, *sec_info_base;
     /* If not NULL, replaces the default method for finding sector data. 
      * Sector data is at trk_off + file_sec_offsets[i]. */
     uint32_t *file_sec_offsets;
+    /* Precomputed at open: file offset of each track, in file order. */
+    uint32_t *trk_offs;
+    /* Precomputed at seek: sector data offsets (logical order) and encoded
+     * sector start offsets past the index gap (rotational order). */
+    uint32_t *sec_offs, *enc_offs;
+    /* Whole image is held in one ring, which persists across seeks. */
+    bool_t resident;
+    /* Aligned container: file bytes per track (else 0), and raw image size.*/
+    uint32_t trk_stride, aln_size;
+    bool_t aln_probed;
     /* Delay start of track this many bitcells past index. */
     uint32_t track_delay_bc;
     uint16_t gap_4;
@@ -126,23 +190,39 @@ struct img_image {
     void *heap_bottom;
     struct image_buf track_data;
     struct ring_io ring_io;
+    struct bc_cache bc_cache;
 };
 
 struct dsk_image {
     struct ring_io ring_io;
     struct image_buf track_data;
     uint32_t trk_off;
+    uint16_t *trk_map; /* EDSK: offset of each track, in 256-byte units */
     uint16_t trk_pos;
     uint16_t rd_sec_pos;
+    uint8_t *sec_data; /* Fetched sector data, in place in the ring. */
     int32_t decode_pos;
     uint16_t decode_data_pos, crc;
     bool_t extended;
     int8_t write_sector;
+    bool_t formatting; /* Sector being written was found from its ID record */
     uint16_t gap4;
     uint16_t trash_bc; /* Number of bitcells to throw away. */
     uint32_t idx_sz, idam_sz;
     uint16_t dam_sz_pre, dam_sz_post;
     uint8_t rev;
+    struct bc_cache bc_cache;
+    /* Current track layout, precomputed from the TIB at seek time. */
+    struct dsk_sec {
+        uint16_t off;     /* Offset of sector data within the track */
+        uint16_t data_sz; /* Data bytes emitted per revolution */
+        uint16_t enc_sz;  /* Encoded sector length (IDAM to end of gap3) */
+        uint16_t copies;  /* Weak sector: number of data copies */
+        bool_t gaps;      /* Data field includes its own trailing gaps */
+    } secs[29];
+    /* Recently used TIBs, keyed by track number (+1, 0 is empty). */
+    void *tib_cache;
+    uint8_t tib_tag[4], tib_next;
 };
 
 struct directaccess {
@@ -153,16 +233,49 @@ struct directaccess {
     uint16_t trash_bc; /* Number of bitcells to throw away. */
     uint8_t *rd_buf;
     FOP read_op;
+    /* Read-ahead into the volume cache: [ra_lba,ra_end) has been fetched. */
+    uint8_t *ra_buf;
+    LBA_t ra_lba, ra_end;
+    uint8_t ra_secs;
+    bool_t ra_seq; /* Host stepped lba_base sequentially */
     struct image_buf write_buffer;
     LBA_t *write_offsets; /* Disk offset of each 512 byte buffer segment */
     FOP write_op;
+    time_t last_write; /* Time of most recent buffered write */
     uint8_t write_cnt;
     uint8_t sync_state;
     bool_t read_op_started;
 };
 
+/* Speculative prefetch of a neighbouring cylinder into the volume cache. */
+struct image_prefetch {
+    /* Filled in by the image handler's prefetch() hook. */
+    FSIZE_t off;       /* File region to prefetch */
+    uint32_t len;
+    void *start, *end; /* Buffer space unused by current and target tracks */
+    /* Internal. */
+    void *cache_start, *cache_end;
+    uint32_t pin_off;  /* Progress pinning the image head (pin-boot-kb) */
+    bool_t pin_done;   /* Pin limit reached: leave the rest unpinned */
+    uint8_t cyl;
+    int8_t dir;        /* Direction of most recent step (+1/-1) */
+    uint8_t state;
+    bool_t busy;       /* Prefetch I/O in progress */
+};
+
 #define MAX_CUSTOM_PULSES 34 /* 33+1 for minor track misalignment */
 
+/* Map of image-file sectors to volume sectors, one extent per fragment. */
+struct image_extent {
+    uint32_t fsec; /* First file sector of this fragment */
+    LBA_t lba; /* Volume sector holding file sector @fsec */
+};
+struct image_extents {
+    uint16_t nr;
+    /* @nr extents, sorted by file sector, then an end-of-file sentinel. */
+    struct image_extent ext[0];
+};
+
 struct image {
     /* Handler for currently-selected type of disk image. */
     const struct image_handler *disk_handler;
@@ -172,6 +285,7 @@ struct image {
 
     /* FatFS. */
     FIL fp;
+    struct image_extents *extents; /* NULL if no fast-seek table */
 
     /* Info about image as a whole. */
     uint8_t nr_cyls, nr_sides;
@@ -204,13 +318,18 @@ struct image {
     uint32_t stk_per_rev; /* Nr STK ticks per revolution. */
     enum { SYNC_none=0, SYNC_fm, SYNC_mfm } sync;
 
+    struct image_prefetch prefetch;
+
+    /* Handler state, sized by the disk handler (see image_handler). */
     union {
-        struct adf_image adf;
-        struct hfe_image hfe;
-        struct qd_image qd;
-        struct img_image img;
-        struct dsk_image dsk;
-        struct directaccess da;
+        struct adf_image *adf;
+        struct hfe_image *hfe;
+        struct ffx_image *ffx;
+        struct qd_image *qd;
+        struct img_image *img;
+        struct dsk_image *dsk;
+        struct directaccess *da;
+        void *state;
     };
 
     struct slot *slot;
@@ -230,8 +349,15 @@ struct image_handler {
     uint16_t (*rdata_flux)(struct image *im, uint16_t *tbuf, uint16_t nr);
     bool_t (*write_track)(struct image *im);
     void (*sync)(struct image *im);
+    /* Describe the neighbouring cylinder in direction @dir for prefetch.
+     * Returns FALSE if the current track is not yet fully buffered. Sets
+     * pf->len to zero if there is nothing to prefetch. */
+    bool_t (*prefetch)(struct image *im, int dir, struct image_prefetch *pf);
 
     bool_t async;
+    /* Size of the handler's state (eg. struct adf_image), allocated afresh
+     * and zeroed at each open. */
+    uint16_t state_sz;
 };
 
 /* List of supported image types. */
@@ -243,6 +369,10 @@ extern const struct image_type {
 /* Is given file valid to open as an image? */
 bool_t image_valid(FILINFO *fp);
 
+/* Claim persistent arena space for the raw-image geometry cache, which lets
+ * a re-inserted image skip its probe. Call with the arena reset. */
+void raw_cache_init(void);
+
 /* Open specified image file on mass storage device. */
 void image_open(struct image *im, struct slot *slot, DWORD *cltbl,
         bool_t da_mode);
@@ -268,6 +398,40 @@ bool_t image_read_track(struct image *im);
 uint16_t image_rdata_flux(struct image *im, uint16_t *tbuf, uint16_t nr);
 uint16_t bc_rdata_flux(struct image *im, uint16_t *tbuf, uint16_t nr);
 
+/* Flux generator core shared by the rdata_flux handlers. @x holds bitcells
+ * @y..@end-1 of a window, MSB first (cell @y at bit 31). Emits a timer value
+ * per flux reversal, stepping directly between reversals, and returns the
+ * index of the next unconverted cell: @end unless *@todo reaches zero. */
+static always_inline uint32_t bc_to_flux(
+    uint32_t x, uint32_t y, uint32_t end, uint32_t ticks_per_cell,
+    uint32_t *p_ticks, uint16_t **p_tbuf, uint32_t *p_todo)
+{
+    uint32_t n, ticks = *p_ticks, todo = *p_todo;
+    uint16_t *tbuf = *p_tbuf;
+
+    while (x) {
+        n = __builtin_clz(x);
+        x <<= n;
+        x <<= 1; /* n+1 may be 32 */
+        n++;
+        y += n;
+        ticks += n * ticks_per_cell;
+        *tbuf++ = (ticks >> 4) - 1;
+        ticks &= 15;
+        if (!--todo)
+            goto out;
+    }
+
+    ticks += (end - y) * ticks_per_cell;
+    y = end;
+
+out:
+    *p_ticks = ticks;
+    *p_tbuf = tbuf;
+    *p_todo = todo;
+    return y;
+}
+
 /* Write track data from memory to mass storage. Returns TRUE if processing
  * was completed for the write at the tail of the pipeline. */
 bool_t image_write_track(struct image *im);
@@ -276,6 +440,43 @@ bool_t image_write_track(struct image *im);
  * processing may be interrupted, like before floppy_cancel(). */
 void image_sync(struct image *im);
 
+/* Extent map of a file with a fast-seek cluster table (@fp->cltbl). The map
+ * is built once at mount time, into @map of image_extents_size() bytes. */
+unsigned int image_extents_size(const DWORD *cltbl);
+void image_extents_init(struct image_extents *map, FIL *fp);
+/* Map file offset @ofs to its volume sector, in O(log n) fragments, and the
+ * number of file sectors contiguous on the volume from there (@nsec). Returns
+ * 0 if @ofs is not mapped. */
+LBA_t image_extents_lba(const struct image_extents *map, FSIZE_t ofs,
+                        uint32_t *nsec);
+
+/* Encoded-track cache. bc_cache_init() places a cache for a track of
+ * @tracklen_bc bitcells at the top of (@start,@end), if it fits; the cache
+ * then records the first full revolution encoded by the track handler. */
+void bc_cache_init(struct image *im, struct bc_cache *c,
+                   void *start, void *end, uint32_t tracklen_bc);
+/* Discard cached bitcells, e.g. when the track is written. */
+void bc_cache_invalidate(struct bc_cache *c);
+bool_t bc_cache_valid(struct bc_cache *c);
+/* Track handler has restarted its encoder at bitcell @bc (a multiple of 16),
+ * relative to the start of its revolution. */
+void bc_cache_seek(struct bc_cache *c, uint32_t bc);
+/* Track handler has encoded read_bc words from bitcell @prod onwards. If it
+ * has just reached the end of its revolution, @rev_end is TRUE. */
+void bc_cache_record(struct image *im, struct bc_cache *c,
+                     uint32_t prod, bool_t rev_end);
+/* Copy cached bitcells into read_bc. Returns FALSE if there is no space. */
+bool_t bc_cache_replay(struct image *im, struct bc_cache *c);
+
+/* Called from the I/O thread when idle: speculatively fetch file data for the
+ * next cylinder in the direction of head travel into the volume cache.
+ * Returns TRUE if there is more prefetch work to do. */
+bool_t image_prefetch(struct image *im);
+
+/* Image handlers must call this before reusing the buffer range
+ * (@start,@end), which may overlap the prefetch cache. */
+void image_prefetch_reserve(struct image *im, void *start, void *end);
+
 /* Rotational position of last-generated flux (SYSCLK ticks past index). */
 uint32_t image_ticks_since_index(struct image *im);
 
@@ -286,26 +487,52 @@ uint8_t mfmtobin(uint16_t x);
 void mfm_to_bin(const void *in, void *out, unsigned int nr);
 void mfm_ring_to_bin(const uint16_t *ring, unsigned int mask,
                      unsigned int idx, void *out, unsigned int nr);
+/* Encode @nr bytes into the MFM ring at @idx. @pr is the previous MFM word
+ * (only its final data bit matters); the last word emitted is returned. */
+uint16_t bin_to_mfm_ring(uint16_t *ring, unsigned int mask,
+                         unsigned int idx, const void *in, unsigned int nr,
+                         uint16_t pr);
 #define MFM_DAM_CRC  0xe295 /* 0xa1, 0xa1, 0xa1, 0xfb */
 #define FM_DAM_CRC   0xbf84 /* 0xfb */
 
-/* FM conversion. */
+/* FM conversion. Every FM clock bit is set, so the MFM table's data bits
+ * serve as-is. */
 #define FM_SYNC_CLK 0xc7
+static inline uint16_t bintofm(uint8_t x) { return mfmtab[x] | 0xaaaa; }
 uint16_t fm_sync(uint8_t dat, uint8_t clk);
+/* Encode @nr bytes into the FM ring at @idx. */
+void bin_to_fm_ring(uint16_t *ring, unsigned int mask,
+                    unsigned int idx, const void *in, unsigned int nr);
 
 /* External API. */
 void floppy_init(void);
 bool_t floppy_ribbon_is_reversed(void);
+/* Only one drive is emulated: @unit is ignored. */
 void floppy_insert(unsigned int unit, struct slot *slot);
 void floppy_sync(void);
 void floppy_cancel(void);
 bool_t floppy_handle(void); /* TRUE -> re-read config file */
+/* TRUE if floppy_handle() has nothing to do until an interrupt fires. */
+bool_t floppy_idle(void);
+/* Microseconds of buffered flux before the read stream underruns, or of
+ * buffer space before the write stream overruns. ~0 if neither is live. */
+uint32_t floppy_slack_us(void);
 void floppy_set_cyl(uint8_t unit, uint8_t cyl);
 struct track_info {
     uint8_t cyl, side:1, sel:1, writing:1, in_da_mode:1;
 };
 void floppy_get_track(struct track_info *ti);
 void floppy_set_fintf_mode(void);
+/* Flux-stream stalls since the current image was mounted. The report goes to
+ * printk (serial console or logfile); the summary fits one LCD row. */
+void floppy_stall_report(void);
+void floppy_stall_summary(char *msg, size_t size);
+/* Append the current image's performance summary to FFPERF.TXT, if enabled
+ * by perf-report. Call once the image is cancelled. */
+void floppy_perf_report(FIL *fp, const char *name);
+/* Live figures for the OSD overlay: buffer slack (S) and last seek-to-data
+ * latency (K) in ms, underruns (U), and storage queue depth (Q). */
+void floppy_perf_overlay(char *msg, size_t size);
 static inline bool_t in_da_mode(struct image *im, unsigned int cyl)
 {
     return cyl >= max_t(unsigned int, DA_FIRST_CYL, im->nr_cyls);
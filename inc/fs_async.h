@@ -42,5 +42,28 @@ void F_async_cancel_all(void);
  * to wait or be cancelled. */
 FOP F_async_get_completed_op(void);
 
-/* Executes async operations until none remain.  */
+/* Executes async operations until none remain. Reads are serviced ahead of
+ * queued writes and syncs, unless they depend on the outcome of that work. A
+ * read or write should be immediately preceded by F_lseek_async() on the same
+ * file: the two are then scheduled as one positioned operation. */
 void F_async_drain(void);
+
+/* Called by the I/O thread once drained: sleeps until an operation is queued
+ * or F_async_notify() is called. */
+void F_async_sleep(void);
+
+/* Wake the I/O thread for work other than queued operations. */
+void F_async_notify(void);
+
+/* Returns TRUE if no async operations are queued or in progress. */
+bool_t F_async_idle(void);
+
+/* Returns the classes with operations queued or in progress. */
+#define F_PENDING_read      1
+#define F_PENDING_writeback 2
+unsigned int F_async_pending(void);
+/* Returns the number of operations queued or in progress, in all classes. */
+unsigned int F_async_depth(void);
+
+/* Log, then reset, per-class queue depth and wait-time counters. */
+void F_async_stats(void);
@@ -65,6 +65,9 @@ struct packed v2_slot {
 };
 
 #define short_slot v2_slot
+/* Short slots flag an exFAT contiguous (NoFatChain) file in an attribute bit
+ * which FAT never sets. */
+#define SHORT_SLOT_CONTIG 0x80
 
 /*
  * Local variables:
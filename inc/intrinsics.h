@@ -23,6 +23,8 @@ struct exception_frame {
 #define packed __attribute((packed))
 #define always_inline __inline__ __attribute__((always_inline))
 #define noinline __attribute__((noinline))
+/* Execute from SRAM, free of Flash wait states. Copied in along with .data. */
+#define ramfunc __attribute__((section(".ramfuncs")))
 
 #define likely(x)     __builtin_expect(!!(x),1)
 #define unlikely(x)   __builtin_expect(!!(x),0)
@@ -0,0 +1,50 @@
+/*
+ * nor_cache.h
+ *
+ * Second-level sector cache in an external SPI NOR flash.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#if defined(NOR_CACHE) && !defined(BOOTLOADER)
+
+/* Forget all cached sectors: a (new) volume is being initialised. The chip is
+ * probed on first call. */
+void nor_cache_reset(void);
+
+/* The chip shares the SD card's bus: call the following only within a volume
+ * operation, which keeps other threads off it.
+ * 
+ * Copy out sector @sector if cached. Returns FALSE on a miss, or if the chip
+ * is busy erasing. */
+bool_t nor_cache_read(LBA_t sector, void *buf);
+
+/* Offer @count sectors just read from the volume. Only hot sectors are
+ * written to flash: metadata (@meta), and runs read from the volume before.
+ * May thread_yield() while the flash programs. */
+void nor_cache_fill(const void *buf, LBA_t sector, UINT count, bool_t meta);
+
+/* Sectors are being written to the volume: drop any cached copies. */
+void nor_cache_invalidate(LBA_t sector, UINT count);
+
+#else
+
+#define nor_cache_reset() ((void)0)
+#define nor_cache_read(a,b) FALSE
+#define nor_cache_fill(a,b,c,d) ((void)0)
+#define nor_cache_invalidate(a,b) ((void)0)
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,69 @@
+/*
+ * prof.h
+ *
+ * Hot-path profiling via the Cortex-M DWT cycle counter (build with prof=y).
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#if defined(PROFILE)
+
+#if defined(NDEBUG)
+#error "Profiling reports via the serial console: build with debug=y"
+#endif
+
+enum {
+    PROF_rdata_dma,   /* IRQ_rdata_dma */
+    PROF_wdata_dma,   /* IRQ_wdata_dma */
+    PROF_read_track,  /* image_read_track */
+    PROF_write_track, /* image_write_track */
+    PROF_ring_io,     /* ring_io_progress */
+    PROF_vol_status,  /* volume_ops->status */
+    PROF_vol_read,    /* volume_ops->read */
+    PROF_vol_write,   /* volume_ops->write */
+    PROF_vol_ioctl,   /* volume_ops->ioctl */
+    /* Sampled values rather than cycle counts. */
+    PROF_rio_lat_us,  /* ring_io batch completion time (us) */
+    PROF_rio_batch,   /* ring_io tuned batch_secs */
+    PROF_rio_trail,   /* ring_io tuned trailing_secs */
+    PROF_NR
+};
+#define PROF_first_value PROF_rio_lat_us
+
+void prof_init(void);
+void prof_record(unsigned int id, uint32_t cycles);
+/* Print statistics for one profiled site. Safe to call from any context. */
+void prof_print(unsigned int id);
+void prof_reset(void);
+
+#define prof_cycles() (dwt->cyccnt)
+#define prof_value(id, v) prof_record(PROF_##id, v)
+
+/* Execute @stmt, charging the elapsed cycles to PROF_<id>. Volume ops may
+ * yield, in which case they are charged wall time rather than CPU time. */
+#define PROF(id, stmt) do {                             \
+    uint32_t _t = prof_cycles();                        \
+    stmt;                                               \
+    prof_record(PROF_##id, prof_cycles() - _t);         \
+} while (0)
+
+#else /* !PROFILE */
+
+#define prof_init() ((void)0)
+#define prof_value(id, v) ((void)0)
+#define PROF(id, stmt) do { stmt; } while (0)
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -23,42 +23,96 @@
  * Instead of 'rd->cons != rd->prod' use 'rd->cons < rd->prod'.
  */
 
-#define RING_IO_MAX_RING_LEN (64 * 1024)
+struct image_extents;
+struct zimg;
 
 struct ring_io {
-    /* Options. Safe to change at any time. */
+    /* Options. Safe to change at any time. While max_batch_secs is non-zero,
+     * batch_secs and trailing_secs are instead tuned at runtime within the
+     * given bounds (see ring_io_tune()). */
     uint8_t batch_secs, trailing_secs;
+    uint8_t min_batch_secs, max_batch_secs;
+    uint8_t min_trailing_secs, max_trailing_secs;
+    /* Hold dirty data until ring_io_flush(), so that writeback does not
+     * compete with read-ahead while the caller is writing. Held data is then
+     * written in the largest batches possible. It is released early only if
+     * it spans half the ring (or the whole ring, if the file fits in it). */
+    bool_t hold_writes;
+    /* Extent map of the file. If set, sector-aligned reads and writes bypass
+     * FatFS and are issued directly to the volume. The file size must then
+     * be fixed. */
+    const struct image_extents *map;
+    /* Compressed container. If set, reads are fetched and decoded a block at
+     * a time, and the ring holds the uncompressed data. Read only. */
+    struct zimg *z;
 
     /* Internals. */
     FIL *fp;
     struct image_buf *read_data;
     FOP fop;
     void (*fop_cb)(struct ring_io*);
-    uint32_t unread_bitfield[(RING_IO_MAX_RING_LEN/512+31)/32];
-    uint32_t dirty_bitfield[(RING_IO_MAX_RING_LEN/512+31)/32];
+    uint32_t *unread_bitfield, *dirty_bitfield; /* See ring_io_reserve() */
+    uint16_t bf_words;
     FSIZE_t f_off;
     FSIZE_t f_shadow_off;
     uint32_t f_len;
     uint32_t ring_len, ring_off;
     uint16_t io_idx;
     uint8_t io_cnt;
+    time_t io_start; /* Issue time of the outstanding batch. */
+    time_t tune_time; /* Time and rd->cons of the last consumer-rate sample. */
+    uint32_t tune_cons;
     uint32_t wd_cons; /* Internal cursor of oldest write. Sector aligned. */
     uint32_t wd_prod; /* Internal cursor that follows rd->cons. */
     uint32_t rd_valid; /* Cursor of oldest valid read data. */
+    uint32_t alt_prod; /* Read cursor of the ring not in use (if shadow). */
+    /* Unread sector being overwritten from its start (see ring_io_writable):
+     * its ring index, file offset, and the bytes written so far. The rest is
+     * read and merged only if the sector is flushed before it is complete. */
+    FSIZE_t cover_off;
+    uint16_t cover_idx, cover_len;
     bool_t sync_needed:1;
     bool_t sync_requested:1;
     bool_t writing:1; /* The caller is writing, per ring_io_seek. */
     bool_t shadow_active:1; /* The caller is using shadow ring, per ring_io_seek. */
     bool_t disable_reading:1; /* Inhibit read ops in the I/O scheduler. */
+    bool_t tune_sampled:1; /* tune_time/tune_cons are valid. */
+    bool_t claiming:1; /* The writer claims sectors via ring_io_writable. */
 };
 
+/* Allocate per-sector state from the arena, enough for any ring (and its
+ * shadow) within @len bytes of buffer. Called at mount, before the data
+ * buffers are allocated: the ring length is then bounded only by the buffer
+ * passed to ring_io_init(). */
+void ring_io_reserve(uint32_t len);
 /* shadow_off != ~0 maintains a second parallel ring of the same size that
  * tracks the primary ring. */
 void ring_io_init(struct ring_io *rio, FIL *fp, struct image_buf *read_data,
         FSIZE_t off, FSIZE_t shadow_off, uint16_t sec_len);
+/* Tune batch_secs and trailing_secs at runtime within the given bounds. The
+ * batch size is chosen so that read-ahead stays ahead of the consumer given
+ * the measured per-batch completion time of the media. Trailing sectors use
+ * whatever ring space the read-ahead does not need. */
+void ring_io_tune(struct ring_io *rio, uint8_t min_batch, uint8_t max_batch,
+        uint8_t min_trailing, uint8_t max_trailing);
 void ring_io_sync(struct ring_io *rio);
-/* Stop all I/O activity and wait for outstanding I/O to complete. */
+/* Stop all I/O activity: cancel a pending read, and wait for outstanding I/O
+ * to complete. */
 void ring_io_shutdown(struct ring_io *rio);
+/* Abandon the ring, eg. at a cylinder change, in place of ring_io_sync() and
+ * ring_io_shutdown(). Dirty data is written back, but the caller does not
+ * wait for the final batch: the ring may be reinitialised at once. Writes
+ * into the new ring wait for the writeback, as does the next ring_io_sync(). */
+void ring_io_detach(struct ring_io *rio);
+/* write-drain=adaptive: Should dirty data be drained now, at a track change,
+ * rather than left to drain in the background? Yes if write batches have
+ * been completing within @budget_us. */
+bool_t ring_io_drain_eager(struct ring_io *rio, uint32_t budget_us);
+/* Log the learned write latency and drain decisions since last called. */
+void ring_io_stats(void);
+/* The same figures, without logging or resetting them. */
+void ring_io_write_stats(uint32_t *lat_us, uint16_t *nr_eager,
+                         uint16_t *nr_deferred);
 /* Seek ring to 'pos' in file; read_data.cons and .prod will be adjusted. If
  * 'writing', read data will be made available via read_data as normal, but
  * read_data.cons doubles as a write producer cursor.
@@ -67,6 +121,23 @@ void ring_io_shutdown(struct ring_io *rio);
 void ring_io_seek(
         struct ring_io *rio, uint32_t pos, bool_t writing, bool_t shadow);
 void ring_io_progress(struct ring_io *rio);
+/* Returns how many of the @len bytes at read_data.cons the caller may write
+ * now. When writing, sectors that the caller overwrites from their start need
+ * not be read first: they are claimed without waiting for the read, and only
+ * a sector flushed while partly written is read back to merge its tail.
+ * Read-ahead is then suspended until the next non-writing seek. The caller
+ * must write all the returned bytes before next yielding. */
+uint32_t ring_io_writable(struct ring_io *rio, uint32_t len);
+/* Returns TRUE if the old data of the @len bytes at read_data.cons is
+ * buffered, and so may be written by ring_io_rewrite(). */
+bool_t ring_io_buffered(struct ring_io *rio, uint32_t len);
+/* Write @len bytes from @src at read_data.cons, as the caller would itself.
+ * Data identical to the old is not marked for writeback, unless it shares a
+ * sector with changed data. Format writes commonly rewrite a track as it was,
+ * and so need not touch the media. */
+void ring_io_rewrite(struct ring_io *rio, const void *src, uint32_t len);
+/* Returns TRUE if the whole region is buffered and no I/O is outstanding. */
+bool_t ring_io_idle(struct ring_io *rio);
 void ring_io_flush(struct ring_io *rio);
 
 /* Find position in ring buffer. Sectors are guaranteed to be contiguous
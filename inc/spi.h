@@ -18,6 +18,12 @@ void spi_xmit16(SPI spi, uint16_t out);
 uint16_t spi_xchg16(SPI spi, uint16_t out);
 #define spi_recv16(spi) spi_xchg16(spi, 0xffffu)
 
+/* Block transfers in 16-bit frame mode. @bytes must be even and non-zero.
+ * Both return the CRC16-CCITT of the transferred data. */
+uint16_t spi_recv_block16(SPI spi, void *buf, uint16_t bytes, uint16_t crc);
+uint16_t spi_xmit_block16(SPI spi, const void *buf, uint16_t bytes,
+                          uint16_t crc);
+
 #define spi_xmit8(spi, x) spi_xmit16(spi, (uint8_t)(x))
 #define spi_xchg8(spi, x) (uint8_t)spi_xchg16(spi, (uint8_t)(x))
 #define spi_recv8(spi) spi_xchg8(spi, 0xffu)
@@ -14,6 +14,8 @@
 #define SCB volatile struct scb * const
 #define NVIC volatile struct nvic * const
 #define DBG volatile struct dbg * const
+#define DCB volatile struct dcb * const
+#define DWT volatile struct dwt * const
 #define FLASH volatile struct flash * const
 #define PWR volatile struct pwr * const
 #define BKP volatile struct bkp * const
@@ -33,6 +35,8 @@ static STK stk = (struct stk *)STK_BASE;
 static SCB scb = (struct scb *)SCB_BASE;
 static NVIC nvic = (struct nvic *)NVIC_BASE;
 static DBG dbg = (struct dbg *)DBG_BASE;
+static DCB dcb = (struct dcb *)DCB_BASE;
+static DWT dwt = (struct dwt *)DWT_BASE;
 static FLASH flash = (struct flash *)FLASH_BASE;
 static PWR pwr = (struct pwr *)PWR_BASE;
 static BKP bkp = (struct bkp *)BKP_BASE;
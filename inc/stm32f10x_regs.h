@@ -109,6 +109,28 @@ struct dbg {
 
 #define DBG_BASE 0xe0042000
 
+/* Debug control block */
+struct dcb {
+    uint32_t dhcsr;    /* 00: Debug halting control and status */
+    uint32_t dcrsr;    /* 04: Debug core register selector */
+    uint32_t dcrdr;    /* 08: Debug core register data */
+    uint32_t demcr;    /* 0C: Debug exception and monitor control */
+};
+
+#define DCB_DEMCR_TRCENA (1u<<24)
+
+#define DCB_BASE 0xe000edf0
+
+/* Data watchpoint and trace unit */
+struct dwt {
+    uint32_t ctrl;     /* 00: Control */
+    uint32_t cyccnt;   /* 04: Cycle count */
+};
+
+#define DWT_CTRL_CYCCNTENA (1u<<0)
+
+#define DWT_BASE 0xe0001000
+
 /* Flash memory interface */
 struct flash {
     uint32_t acr;      /* 00: Flash access control */
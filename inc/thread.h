@@ -10,18 +10,39 @@
  * See the file COPYING for more details, or visit <http://unlicense.org>.
  */
 
+/* Something a thread can wait for. Signalled by thread_notify(). */
+struct thread_event {
+    volatile bool_t signalled;
+};
+
 struct thread {
     /* Internal bookkeeping */
+    uint32_t *sp;
+    struct thread_event *waiting;
+    uint16_t last_run;
     bool_t exited;
 };
 
 /* Initialize a thread and queue it for execution. 'thread' must remain
- * allocated for the lifetime of the thread. */
+ * allocated for the lifetime of the thread. A few threads may run at once,
+ * each on its own stack. */
 void thread_start(struct thread *thread, uint32_t *stack, void (*func)(void*), void* arg);
 
-/* Yield execution to allow other threads to run. */
+/* Yield execution to allow other threads to run: the runnable thread which
+ * has waited longest is switched to. */
 void thread_yield(void);
 
+/* Sleep until @ev is signalled, then clear it. Meanwhile, thread_yield() in
+ * other threads does not switch to this one. Returns early if there is no
+ * other thread to run. */
+void thread_wait(struct thread_event *ev);
+
+/* Signal @ev, waking any thread waiting on it. Safe to call from IRQ context. */
+static inline void thread_notify(struct thread_event *ev)
+{
+    ev->signalled = TRUE;
+}
+
 /* Returns true if provided thread has exited. A thread cannot be joined
  * multiple times, unless it is started anew. */
 bool_t thread_tryjoin(struct thread *thread);
@@ -30,6 +51,10 @@ bool_t thread_tryjoin(struct thread *thread);
  * joined multiple times, unless it is started anew. */
 void thread_join(struct thread *thread);
 
+/* Yield to another runnable thread, if there is one. Otherwise sleep until
+ * the next interrupt: the caller must have nothing to do until one fires. */
+void thread_idle(void);
+
 /* Reinitializes threading subsystem to its initial state, throwing away all
- * threads but the current. */
+ * threads but the initial one. */
 void thread_reset(void);
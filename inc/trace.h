@@ -0,0 +1,67 @@
+/*
+ * trace.h
+ *
+ * Timeline trace of hot-path events (build with trace=y).
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#if defined(TRACE)
+
+/* Event IDs. Keep in sync with scripts/trace.py. */
+enum {
+    TRACE_step,         /* STEP pulse accepted: a=cyl b=inward */
+    TRACE_index,        /* INDEX timer fired */
+    TRACE_setup_track,  /* image_setup_track() begin: a=track b=writing */
+    TRACE_setup_done,   /* image_setup_track() end: a=track */
+    TRACE_flux_start,   /* RDATA flux output begins: a=track b=prefetch_us */
+    TRACE_rio_read,     /* ring_io read issued: a=ring b=secs c=file offset */
+    TRACE_rio_read_done, /* b=secs */
+    TRACE_rio_write,    /* ring_io write issued: a=ring b=secs c=file offset */
+    TRACE_rio_write_done, /* b=secs */
+    TRACE_fop_start,    /* async op begins: a=class b=queue wait (ticks) */
+    TRACE_fop_done,     /* async op ends: a=class b=ops covered */
+    TRACE_vol_read,     /* volume read begins: a=count b=sector */
+    TRACE_vol_read_done, /* a=result */
+    TRACE_vol_write,    /* volume write begins: a=count b=sector */
+    TRACE_vol_write_done, /* a=result */
+    TRACE_stall,        /* flux stall: a=type (STALL_*) b=track */
+    TRACE_late,         /* read stream missed its sync: a=track b=late_us
+                         * c=0 (setup_track) or 1 (flux prefetch) */
+    TRACE_wgate,        /* write stream: a=1 start b=track, a=0 stop */
+    TRACE_NR_EVENTS
+};
+
+/* Record an event in the trace ring. Safe to call from any context. */
+void trace_record(unsigned int id, uint16_t a, uint32_t b, uint32_t c);
+
+/* Write the trace ring, oldest record first, to FFTRACE.BIN in the current
+ * directory, then restart tracing. */
+void trace_dump(FIL *file);
+
+/* Crash path: the volume may be mid-operation, so print the trace ring to
+ * the serial console instead, oldest record first. Tracing stays frozen. */
+void trace_crash_dump(void);
+
+#define trace(id, a, b, c) trace_record(TRACE_##id, a, b, c)
+
+#else /* !TRACE */
+
+#define trace(id, a, b, c) ((void)0)
+#define trace_dump(f) ((void)0)
+#define trace_crash_dump() ((void)0)
+
+#endif
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -16,6 +16,9 @@ struct slot {
     uint32_t firstCluster;
     uint32_t size;
     uint32_t dir_sect, dir_ptr;
+    /* exFAT: chain status, and the containing directory (for f_sync). */
+    uint8_t stat;
+    uint32_t dir_scl, dir_size, dir_ofs;
 };
 void fatfs_from_slot(FIL *file, const struct slot *slot, BYTE mode);
 
@@ -50,6 +53,16 @@ void qsort_p(void *base, unsigned int nr,
 
 uint32_t rand(void);
 
+/* One xorshift32 step. For hot paths that keep their own generator state
+ * (never zero): inlined, and so free of any call into flash. */
+static inline uint32_t xorshift32(uint32_t x)
+{
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
 unsigned int popcount(uint32_t x);
 
 int vsnprintf(char *str, size_t size, const char *format, va_list ap)
@@ -69,6 +82,13 @@ int snprintf(char *str, size_t size, const char *format, ...)
 
 /* Arena-based memory allocation */
 void *arena_alloc(uint32_t sz);
+/* Free everything allocated since the arena_mark() which returned @mark.
+ * Scopes may nest. */
+void *arena_mark(void);
+void arena_release(void *mark);
+/* Allocate from the persistent tier, which arena_init() does not reclaim.
+ * Lives until reset: allocate only while the arena is (nearly) empty. */
+void *arena_persist_alloc(uint32_t sz);
 uint32_t arena_total(void);
 uint32_t arena_avail(void);
 void arena_init(void);
@@ -88,10 +108,13 @@ static inline int printk(const char *format, ...) { return 0; }
 #endif
 
 #if defined(LOGFILE)
-/* Logfile management */
-void logfile_flush(FIL *file);
+/* Logfile management. logfile_flush() writes out all buffered logging;
+ * logfile_poll() is called by the I/O thread to write it in the background. */
+void logfile_flush(void);
+void logfile_poll(void);
 #else /* !LOGFILE */
-#define logfile_flush(f) ((void)0)
+#define logfile_flush() ((void)0)
+#define logfile_poll() ((void)0)
 #endif
 
 #if !defined(NDEBUG)
@@ -139,12 +162,16 @@ extern uint8_t lcd_columns, lcd_rows;
 extern bool_t has_osd;
 extern uint8_t osd_buttons_tx; /* Gotek -> FF_OSD */
 extern uint8_t osd_buttons_rx; /* FF_OSD -> Gotek */
+/* Show @str on an extra OSD row, or remove the row if @str is NULL. */
+void osd_overlay_write(const char *str);
 
 /* USB stack processing */
 void usbh_msc_init(void);
 void usbh_msc_buffer_set(uint8_t *buf);
 void usbh_msc_process(void);
 bool_t usbh_msc_inserted(void);
+/* Called from the USB IRQ. Returns TRUE if a waiting thread should wake. */
+bool_t usbh_msc_irq(void);
 
 /* Navigation/UI frontend */
 uint16_t get_slot_nr(void);
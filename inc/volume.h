@@ -17,6 +17,15 @@ struct volume_ops {
     DRESULT (*read)(BYTE, BYTE *, LBA_t, UINT);
     DRESULT (*write)(BYTE, const BYTE *, LBA_t, UINT);
     DRESULT (*ioctl)(BYTE, BYTE, void *);
+    /* Optional. Queue a read or write to be issued as soon as the transfer
+     * about to be made completes; a later read or write which it prefixes
+     * then claims it. A zero @count waits out anything left unclaimed. */
+    void (*chain)(BYTE pdrv, bool_t write, const BYTE *buff,
+                  LBA_t sector, UINT count);
+    /* Optional. Make the read in progress, if any, fail with RES_ERROR as
+     * soon as the bus can be left in a clean state. The volume remains
+     * usable. Called from another thread. */
+    void (*abort)(void);
     bool_t (*connected)(void);
     bool_t (*readonly)(void);
 };
@@ -27,10 +36,51 @@ bool_t volume_readonly(void);
  * thread_yield(); FALSE if no I/O in progress. When TRUE, the thread will
  * yield as soon as calling this method would begin returning FALSE. */
 bool_t volume_interrupt(void);
+/* As volume_interrupt(), but also abandon a read in progress, if the backend
+ * supports it. Its caller sees the read fail: only data which is no longer
+ * wanted may be read this way. */
+bool_t volume_abort(void);
+/* Returns the backend with an operation in progress, or VOL_idle. */
+#define VOL_idle 0
+#define VOL_usb  1
+#define VOL_sd   2
+unsigned int volume_busy(void);
 
 void volume_cache_init(void *start, void *end);
 void volume_cache_destroy(void);
 void volume_cache_metadata_only(FIL *fp);
+/* Pin sectors read or written via @fs's sector window (FAT and directory
+ * sectors) in the cache, so that bulk file data cannot evict them. */
+void volume_cache_pin_metadata(FATFS *fs);
+/* Enable write-back of file data into the current cache. Dirty sectors are
+ * coalesced into multi-sector writes via @stage, of @len bytes. Dirty data
+ * is flushed when the cache is destroyed, or on demand (below). */
+void volume_cache_writeback(void *stage, unsigned int len);
+void volume_cache_flush(void);
+/* Flush if there is dirty data, and nothing has been written for @idle.
+ * Returns TRUE if dirty data remains. */
+bool_t volume_cache_flush_idle(time_t idle);
+/* Read @sector into the cache, via bounce buffer @buf, unless already cached.
+ * Does nothing and returns FALSE if there is no cache or the volume is busy. */
+bool_t volume_prefetch(LBA_t sector, void *buf);
+/* Pin cached @sector, so that it is never evicted. Returns FALSE if it is not
+ * cached, or the cache's pin limit is reached. */
+bool_t volume_cache_pin(LBA_t sector);
+/* Hits and misses in the current cache, or zero if there is none. */
+void volume_cache_counts(uint32_t *hits, uint32_t *misses);
+/* Hint that disk_read() (or disk_write(), if @write) of @count sectors at
+ * @sector via @buff will follow the next transfer. The driver may then issue
+ * it back to back with that transfer, if it would bypass the cache anyway.
+ * A caller which reuses @buff without making the hinted call must first
+ * retract the hint, by calling again with zero @count. */
+void volume_chain(BYTE pdrv, bool_t write, const BYTE *buff,
+                  LBA_t sector, UINT count);
+
+/* Benchmark the volume on a scratch file, using arena memory. The volume
+ * cache must be destroyed. Results are logged and written to FFBENCH.TXT; a
+ * one-line summary is returned in @msg. Returns TRUE if the volume is fast
+ * enough to stream HD HFE images. */
+bool_t volume_bench(char *msg, size_t len);
 
 /*
  * Local variables:
@@ -0,0 +1,75 @@
+/*
+ * zimg.h
+ *
+ * Block-compressed image container, decompressed transparently by ring_io.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* Container layout (little endian):
+ *  struct zimg_header;
+ *  uint32_t index[nr_blks+1]: file offset of each block, then of the end;
+ *  block data: each block is 2^blk_shift bytes of image data (the last zero
+ *  padded), LZ4 block-compressed, or stored as-is if it does not compress.
+ * Blocks are independent, so any block can be fetched and decoded alone. */
+struct zimg_header {
+    char sig[4]; /* "FFZ1" */
+    uint8_t blk_shift; /* 12-14: 4-16kB blocks */
+    uint8_t rsvd[3];
+    uint32_t raw_size; /* Size of the uncompressed image */
+    uint32_t nr_blks;
+};
+
+/* Index entries buffered at a time. */
+#define ZIMG_IDX_NR 63
+
+struct zimg {
+    FIL *fp;
+    uint32_t raw_size, nr_blks;
+    uint32_t blk_size;
+    uint8_t blk_shift;
+    /* Index window: entries [idx_base, idx_base+idx_nr]. */
+    uint16_t idx_nr;
+    uint32_t idx_base;
+    uint32_t idx[ZIMG_IDX_NR+1];
+    /* Decoded block (or ~0). */
+    uint32_t dec_blk;
+    uint8_t *dec;
+    /* Compressed data of stage_blk (or ~0), as read from the file. */
+    uint32_t stage_blk, stage_len;
+    uint8_t *stage;
+    /* Outstanding zimg_read_async(): where the decoded data goes. */
+    void *dst;
+    uint32_t dst_blk, dst_off, dst_len;
+    bool_t pending;
+};
+
+/* Probe @fp for a container. If found, the decoder state and its buffers
+ * are carved from the tail of @buf, which is shortened accordingly. Returns
+ * NULL if @fp is not a container, or @buf cannot spare the space. */
+struct zimg *zimg_open(FIL *fp, struct image_buf *buf);
+
+/* Synchronous read of @len bytes at uncompressed offset @off. No
+ * zimg_read_async() may be outstanding. */
+void zimg_read(struct zimg *z, FSIZE_t off, void *buf, UINT len);
+
+/* Start a read of *@cnt sectors at uncompressed offset @off: the count is
+ * truncated at the end of the containing block. Once the returned op is done,
+ * zimg_read_done() decodes the data into @buf. */
+FOP zimg_read_async(struct zimg *z, FSIZE_t off, void *buf, uint8_t *cnt);
+void zimg_read_done(struct zimg *z);
+/* The op returned by zimg_read_async() was cancelled. */
+void zimg_read_abort(struct zimg *z);
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
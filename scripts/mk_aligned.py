@@ -0,0 +1,79 @@
+# mk_aligned.py
+#
+# Rewrite a raw sector image (IMG, ST, etc.) into FlashFloppy's aligned
+# container, or unpack one. Each track is padded to a fixed stride so that
+# tracks start on sector or cluster boundaries, and each is fetched by one
+# contiguous read. Keep the original filename extension: the firmware still
+# selects the image type by extension. See src/image/img.c for the layout.
+#
+# Written & released by Keir Fraser <keir.xen@gmail.com>
+#
+# This is free and unencumbered software released into the public domain.
+# See the file COPYING for more details, or visit <http://unlicense.org>.
+
+import sys,struct,argparse
+
+hdr_fmt = "<8sIII"
+
+def pack(dat, nr_tracks, align):
+  if len(dat) % nr_tracks:
+    raise ValueError("%u bytes is not a whole number of %u tracks"
+                     % (len(dat), nr_tracks))
+  trk_len = len(dat) // nr_tracks
+  stride = (trk_len + align - 1) // align * align
+  out = bytearray(struct.pack(hdr_fmt, b"FFALIGN0", align, len(dat), stride))
+  out += bytes(align - len(out))
+  for t in range(nr_tracks):
+    out += dat[t*trk_len:(t+1)*trk_len]
+    out += bytes(stride - trk_len)
+  return out
+
+def unpack(dat, nr_tracks):
+  sig, data_off, raw_size, stride = struct.unpack(
+    hdr_fmt, dat[:struct.calcsize(hdr_fmt)])
+  if sig != b"FFALIGN0":
+    raise ValueError("not an aligned container")
+  trk_len = raw_size // nr_tracks
+  out = bytearray()
+  for t in range(nr_tracks):
+    off = data_off + t*stride
+    out += dat[off:off+trk_len]
+  return out
+
+def main(argv):
+  parser = argparse.ArgumentParser(
+    formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+  parser.add_argument("--tracks", type=int, default=160,
+                      help="number of tracks (cylinders x sides); all "
+                      "tracks must be the same size")
+  parser.add_argument("--align", type=int, default=512,
+                      help="track alignment, bytes: a multiple of 512, eg. "
+                      "the volume's cluster size")
+  parser.add_argument("--unpack", action="store_true",
+                      help="unpack a container instead")
+  parser.add_argument("infile", help="input filename")
+  parser.add_argument("outfile", help="output filename")
+  args = parser.parse_args(argv[1:])
+
+  if args.align <= 0 or args.align % 512:
+    print("--align must be a multiple of 512")
+    return 1
+
+  with open(args.infile, "rb") as f:
+    dat = f.read()
+  try:
+    if args.unpack:
+      out = unpack(dat, args.tracks)
+    else:
+      out = pack(dat, args.tracks, args.align)
+      assert unpack(out, args.tracks) == dat
+      print("%u -> %u bytes" % (len(dat), len(out)))
+  except ValueError as e:
+    print(e)
+    return 1
+  with open(args.outfile, "wb") as f:
+    f.write(out)
+  return 0
+
+if __name__ == "__main__":
+  sys.exit(main(sys.argv))
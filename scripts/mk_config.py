@@ -9,10 +9,33 @@
 
 import re, sys
 
+# Must match ffcfg_lookup() in src/main.c.
+def opt_hash(name, mul, bits):
+    h = 0
+    for c in name:
+        h = (h * 31 + ord(c)) & 0xffffffff
+    return ((h * mul) & 0xffffffff) >> (32 - bits)
+
+# Find a multiplier which maps every option name to a distinct table slot.
+def perfect_hash(names):
+    bits = 1
+    while (1 << bits) < 2 * len(names):
+        bits += 1
+    while True:
+        mul = 0x9e3779b1
+        for i in range(100000):
+            slots = set(opt_hash(n, mul, bits) for n in names)
+            if len(slots) == len(names):
+                return (mul, bits)
+            mul = (mul + 2) & 0xffffffff
+        bits += 1
+
 def main(argv):
     in_f = open(argv[1], "r")
     out_f = open(argv[2], "w")
     out_f.write("/* Autogenerated by " + argv[0] + " */\n")
+    out_f.write("#if defined(x)\n")
+    names = []
     for line in in_f:
         match = re.match("[ \t]*([A-Za-z0-9-]+)[ \t]*=[ \t]*"
                          "([A-Za-z0-9-,]+|\".*\")", line)
@@ -98,6 +121,18 @@ def main(argv):
                     'yes': 'TRUE'
                 }.get(val,val)
             out_f.write("x(%s, %s, %s)\n" % (opt, re.sub('-','_',opt), val))
+            names.append(opt)
+    # Included without x() defined: the option-name perfect hash.
+    mul, bits = perfect_hash(names)
+    table = [0xff] * (1 << bits)
+    for i, n in enumerate(names):
+        table[opt_hash(n, mul, bits)] = i
+    out_f.write("#else\n")
+    out_f.write("#define FFCFG_HASH_MUL 0x%08xu\n" % mul)
+    out_f.write("#define FFCFG_HASH_BITS %d\n" % bits)
+    out_f.write("#define FFCFG_HASH_TABLE { %s }\n"
+                % ", ".join(str(x) for x in table))
+    out_f.write("#endif\n")
 
 if __name__ == "__main__":
     main(sys.argv)
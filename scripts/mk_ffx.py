@@ -0,0 +1,154 @@
+# mk_ffx.py
+#
+# Convert an HFE (v1/v2) or SCP image to FlashFloppy's native flux (FFX)
+# format: per-track flux intervals, pre-quantised to RDATA timer reload
+# values. See src/image/ffx.c for the layout.
+#
+# Written & released by Keir Fraser <keir.xen@gmail.com>
+#
+# This is free and unencumbered software released into the public domain.
+# See the file COPYING for more details, or visit <http://unlicense.org>.
+
+import sys,struct,argparse
+
+NR_CP = 64
+
+# Read an HFE image. Returns (cyls, sides, bitcell ns, [[flux ns]]), where
+# tracks are ordered by cylinder, then side.
+def read_hfe(dat):
+  (sig, rev, nr_cyls, nr_sides, enc, bitrate, rpm, ifm, _,
+   tlut) = struct.unpack("<8sBBBBHHBBH", dat[:20])
+  if sig != b"HXCPICFE":
+    raise ValueError("not an HFE v1/v2 image (v3 is unsupported)")
+  cell_ns = 500000 / bitrate
+  tracks = []
+  for cyl in range(nr_cyls):
+    off, tlen = struct.unpack("<HH", dat[tlut*512+cyl*4:tlut*512+cyl*4+4])
+    for side in range(nr_sides):
+      bits = bytearray()
+      for pos in range(0, tlen//2, 256):
+        blk = off*512 + (pos//256)*512 + side*256
+        bits += dat[blk:blk+min(256, tlen//2-pos)]
+      flux, t = [], 0
+      for byte in bits:
+        for i in range(8): # LSB first
+          t += cell_ns
+          if byte & (1 << i):
+            flux.append(t)
+            t = 0
+      if t:
+        # Close the revolution: the tail becomes part of the final interval.
+        if flux:
+          flux[-1] += t
+        else:
+          flux.append(t)
+      tracks.append(flux)
+  return nr_cyls, nr_sides, cell_ns, tracks
+
+# Read an SCP image, taking the first revolution of each track.
+def read_scp(dat):
+  (sig, ver, dtype, nr_revs, start, end, flags, cell_width, heads,
+   res) = struct.unpack("<3sBBBBBBBBB", dat[:13])
+  if sig != b"SCP":
+    raise ValueError("not an SCP image")
+  if cell_width not in (0, 16):
+    raise ValueError("unsupported SCP cell width %u" % cell_width)
+  tick_ns = 25 * (res + 1)
+  nr_sides = 1 if heads else 2
+  nr_cyls = end // 2 + 1
+  offs = struct.unpack("<168I", dat[16:16+168*4])
+  tracks = []
+  for cyl in range(nr_cyls):
+    for side in range(nr_sides):
+      trk = cyl*2 + (heads - 1 if heads else side)
+      toff = offs[trk] if trk < 168 else 0
+      if toff == 0:
+        tracks.append([])
+        continue
+      _, length, doff = struct.unpack("<III", dat[toff+4:toff+16])
+      samples = struct.unpack(">%uH" % length,
+                              dat[toff+doff:toff+doff+length*2])
+      flux, hi = [], 0
+      for s in samples:
+        if s == 0:
+          hi += 65536
+          continue
+        flux.append((hi + s) * tick_ns)
+        hi = 0
+      tracks.append(flux)
+  return nr_cyls, nr_sides, 2000, tracks
+
+# Quantise a track to SYSCLK ticks, carrying the rounding error forward.
+# Returns (samples, revolution ticks, checkpoints).
+def quantise(flux, mhz, rpm):
+  if not flux:
+    # Unformatted: a flux transition every 1ms.
+    flux = [1000000] * (60000 // rpm)
+  samples, t, q = [], 0, 0
+  for ns in flux:
+    t += ns * mhz / 1000
+    ticks = int(round(t)) - q
+    # Gaps beyond the timer's range become flux every 65536 ticks.
+    while ticks > 65536:
+      samples.append(65535)
+      q += 65536
+      ticks -= 65536
+    ticks = max(ticks, 2)
+    samples.append(ticks - 1)
+    q += ticks
+  rev = q
+  slot = (rev + NR_CP - 1) // NR_CP
+  cps, start, i = [], 0, 0
+  for k in range(NR_CP):
+    while i+1 < len(samples) and start + samples[i] + 1 <= k * slot:
+      start += samples[i] + 1
+      i += 1
+    cps.append((i, start))
+  return samples, rev, cps
+
+def main(argv):
+  parser = argparse.ArgumentParser(
+    formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+  parser.add_argument("--mhz", type=int, default=72,
+                      help="sample clock: must match the firmware's SYSCLK")
+  parser.add_argument("--rpm", type=int, default=300,
+                      help="rotational rate for unformatted tracks, rpm")
+  parser.add_argument("infile", help="input filename (.hfe or .scp)")
+  parser.add_argument("outfile", help="output filename (.ffx)")
+  args = parser.parse_args(argv[1:])
+
+  with open(args.infile, "rb") as f:
+    dat = f.read()
+  try:
+    if dat[:3] == b"SCP":
+      nr_cyls, nr_sides, cell_ns, tracks = read_scp(dat)
+    else:
+      nr_cyls, nr_sides, cell_ns, tracks = read_hfe(dat)
+  except ValueError as e:
+    print(e)
+    return 1
+
+  hdr = struct.pack("<8sBBBBHH", b"FFXFLUX0", nr_cyls, nr_sides,
+                    args.mhz, 0, int(round(cell_ns)), 0)
+  lut = bytearray()
+  body = bytearray()
+  base = (len(hdr) + len(tracks)*12 + 511) & ~511
+  for flux in tracks:
+    samples, rev, cps = quantise(flux, args.mhz, args.rpm)
+    trk = bytearray()
+    for i, t in cps:
+      trk += struct.pack("<II", i, t)
+    trk += struct.pack("<%uH" % len(samples), *samples)
+    trk += bytes(-len(trk) % 512)
+    lut += struct.pack("<III", base + len(body), len(samples), rev)
+    body += trk
+  out = hdr + lut
+  out += bytes(base - len(out))
+  out += body
+  with open(args.outfile, "wb") as f:
+    f.write(out)
+  print("%u cyls, %u sides: %u bytes" % (nr_cyls, nr_sides, len(out)))
+  return 0
+
+if __name__ == "__main__":
+  sys.exit(main(sys.argv))
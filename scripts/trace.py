@@ -0,0 +1,197 @@
+# trace.py
+#
+# Render a FlashFloppy event trace (FFTRACE.BIN, from a trace=y build) as a
+# timeline, or summarise its latency metrics. Given a baseline trace of the
+# same workload, the summary flags regressions (and exits non-zero). A
+# captured serial console log is also accepted: on a crash, the firmware
+# prints the trace there, and the last such dump in the log is used.
+#
+# Written & released by Keir Fraser <keir.xen@gmail.com>
+#
+# This is free and unencumbered software released into the public domain.
+# See the file COPYING for more details, or visit <http://unlicense.org>.
+
+import sys,struct,argparse
+
+# Event names and argument labels. Keep in sync with inc/trace.h.
+events = [
+  ("step",           ("cyl", "in", None)),
+  ("index",          (None, None, None)),
+  ("setup_track",    ("trk", "wr", None)),
+  ("setup_done",     ("trk", None, None)),
+  ("flux_start",     ("trk", "prefetch_us", None)),
+  ("rio_read",       ("ring", "secs", "off")),
+  ("rio_read_done",  (None, "secs", None)),
+  ("rio_write",      ("ring", "secs", "off")),
+  ("rio_write_done", (None, "secs", None)),
+  ("fop_start",      ("class", "wait", None)),
+  ("fop_done",       ("class", "ops", None)),
+  ("vol_read",       ("count", "lba", None)),
+  ("vol_read_done",  ("res", None, None)),
+  ("vol_write",      ("count", "lba", None)),
+  ("vol_write_done", ("res", None, None)),
+  ("stall",          ("type", "trk", None)),
+  ("late",           ("trk", "us", "flux")),
+  ("wgate",          ("on", "trk", None)),
+]
+
+# Begin/end pairs: the end event is annotated with the elapsed time.
+pairs = {
+  "setup_done": "setup_track",
+  "rio_read_done": "rio_read",
+  "rio_write_done": "rio_write",
+  "fop_done": "fop_start",
+  "vol_read_done": "vol_read",
+  "vol_write_done": "vol_write",
+}
+
+# Keep in sync with STALL_* in src/floppy_generic.c.
+stall_names = ("underrun", "overrun", "kick", "prefetch")
+
+hdr_fmt = "<4sHHII"
+rec_fmt = "<IHHII"
+
+# Crash dump in a console log: "TRACE <mhz> <nr> <lost>", then <nr> lines of
+# "TR <time> <id> <a> <b> <c>" in hex. Returns (mhz, lost, raw records).
+def load_console(path, dat):
+  dump = None
+  for line in dat.decode("ascii", "replace").splitlines():
+    f = line.split()
+    if len(f) == 4 and f[0] == "TRACE":
+      dump = (int(f[1]), int(f[3]), [])
+    elif len(f) == 6 and f[0] == "TR" and dump is not None:
+      dump[2].append(tuple(int(x, 16) for x in f[1:]))
+  if dump is None:
+    raise ValueError("%s: not a trace file or console log" % path)
+  return dump
+
+# Returns (ticks per us, lost events, [(time, name, labels, (a, b, c))]).
+def load(path):
+  with open(path, "rb") as f:
+    dat = f.read()
+  if dat[:4] == b"FFTR":
+    sig, ver, mhz, nr, lost = struct.unpack(hdr_fmt, dat[:16])
+    if ver != 1:
+      raise ValueError("%s: not a v1 trace file" % path)
+    raw = [struct.unpack(rec_fmt, dat[16+i*16:32+i*16]) for i in range(nr)]
+  else:
+    mhz, lost, raw = load_console(path, dat)
+  recs = []
+  t = prev = None
+  for time, id, a, b, c in raw:
+    # Timestamps are 32-bit: accumulate deltas to handle wrap.
+    t = 0 if t is None else t + ((time - prev) & 0xffffffff)
+    prev = time
+    if id >= len(events):
+      name, labels = "ev%u" % id, ("a", "b", "c")
+    else:
+      name, labels = events[id]
+    recs.append((t, name, labels, (a, b, c)))
+  return mhz, lost, recs
+
+def timeline(mhz, recs, show):
+  begun = dict()
+  for t, name, labels, args in recs:
+    s = ""
+    for l, v in zip(labels, args):
+      if l is not None:
+        s += " %s=%s" % (l, ("%x" if l in ("off", "lba") else "%u") % v)
+    if name in pairs:
+      start = begun.pop(pairs[name], None)
+      if start is not None:
+        s += " [%uus]" % ((t - start) // mhz)
+    else:
+      begun[name] = t
+    if show is None or name in show:
+      print("%12.1f %-15s%s" % (t / mhz, name, s))
+
+def pct(vals, p):
+  vals = sorted(vals)
+  return vals[min(len(vals)-1, len(vals)*p//100)] if vals else 0
+
+# Latency metrics of a trace, by name in display order. Larger is worse.
+def metrics(mhz, recs):
+  m = dict()
+  counts = dict()
+  begun = dict()
+  durs = dict()
+  prefetch = []
+  for t, name, labels, args in recs:
+    a, b, c = args
+    if name == "stall":
+      key = stall_names[a] if a < len(stall_names) else "stall%u" % a
+      counts[key] = counts.get(key, 0) + 1
+    elif name == "late":
+      key = "late_flux" if c else "late_setup"
+      counts[key] = counts.get(key, 0) + 1
+    elif name == "flux_start":
+      prefetch.append(b)
+    if name in pairs:
+      start = begun.pop(pairs[name], None)
+      if start is not None:
+        durs.setdefault(pairs[name], []).append((t - start) // mhz)
+    else:
+      begun[name] = t
+  for k in stall_names + ("late_setup", "late_flux"):
+    m[k] = counts.get(k, 0)
+  m["prefetch_us_p50"] = pct(prefetch, 50)
+  m["prefetch_us_p99"] = pct(prefetch, 99)
+  m["prefetch_us_max"] = max(prefetch) if prefetch else 0
+  for k in ("setup_track", "rio_read", "rio_write"):
+    m["%s_us_p99" % k] = pct(durs.get(k, []), 99)
+    m["%s_us_max" % k] = max(durs.get(k, [0]))
+  return m
+
+def summary(mhz, recs, base):
+  m = metrics(mhz, recs)
+  bm = metrics(*base) if base else None
+  regressed = []
+  for k, v in m.items():
+    if bm is None:
+      print("%-20s %8u" % (k, v))
+      continue
+    bv = bm[k]
+    # Counts regress on any increase; times need to be 10% (and 1ms) worse.
+    if k.endswith("_us_p50") or k.endswith("_us_p99") or k.endswith("_max"):
+      bad = v > bv + max(bv // 10, 1000)
+    else:
+      bad = v > bv
+    if bad:
+      regressed.append(k)
+    print("%-20s %8u %8u%s" % (k, bv, v, "  REGRESSED" if bad else ""))
+  return 1 if regressed else 0
+
+def main(argv):
+  parser = argparse.ArgumentParser(
+    formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+  parser.add_argument("--filter", default=None,
+                      help="comma-separated event names to show")
+  parser.add_argument("--summary", action="store_true",
+                      help="print latency metrics instead of a timeline")
+  parser.add_argument("--baseline", default=None,
+                      help="baseline trace to compare against (implies "
+                      "--summary): exit status 1 on regression")
+  parser.add_argument("infile",
+                      help="input filename (FFTRACE.BIN, or a console log)")
+  args = parser.parse_args(argv[1:])
+
+  try:
+    mhz, lost, recs = load(args.infile)
+    base = None
+    if args.baseline:
+      bmhz, _, brecs = load(args.baseline)
+      base = (bmhz, brecs)
+  except ValueError as e:
+    print(e)
+    return 1
+  print("%u events at %u ticks/us (%u older events lost)"
+        % (len(recs), mhz, lost))
+
+  if args.summary or base:
+    return summary(mhz, recs, base)
+  show = set(args.filter.split(",")) if args.filter else None
+  timeline(mhz, recs, show)
+  return 0
+
+if __name__ == "__main__":
+  sys.exit(main(sys.argv))
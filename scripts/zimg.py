@@ -0,0 +1,144 @@
+# zimg.py
+#
+# Pack a disk image into FlashFloppy's block-compressed container, or unpack
+# one. An HFE image packs to a .HFZ file. See inc/zimg.h for the layout.
+#
+# Written & released by Keir Fraser <keir.xen@gmail.com>
+#
+# This is free and unencumbered software released into the public domain.
+# See the file COPYING for more details, or visit <http://unlicense.org>.
+
+import sys,struct,argparse
+
+hdr_fmt = "<4sB3xII"
+hdr_len = struct.calcsize(hdr_fmt)
+
+def lz4_length(n):
+  out = bytearray()
+  while n >= 255:
+    out.append(255)
+    n -= 255
+  out.append(n)
+  return out
+
+def lz4_sequence(lits, moff, mlen):
+  tok = min(len(lits), 15) << 4
+  if mlen:
+    tok |= min(mlen - 4, 15)
+  out = bytearray([tok])
+  if len(lits) >= 15:
+    out += lz4_length(len(lits) - 15)
+  out += lits
+  if mlen:
+    out += struct.pack("<H", moff)
+    if mlen - 4 >= 15:
+      out += lz4_length(mlen - 4 - 15)
+  return out
+
+# Greedy LZ4 block compressor. Follows the format's end-of-block rules (the
+# last match starts at least 12 bytes from the end; the last 5 bytes are
+# literals), so output is also decodable by the reference LZ4 library.
+def lz4_compress(dat):
+  n = len(dat)
+  out = bytearray()
+  table = dict()
+  anchor = i = 0
+  while i + 12 <= n:
+    key = dat[i:i+4]
+    cand = table.get(key)
+    table[key] = i
+    if cand is None or i - cand > 65535:
+      i += 1
+      continue
+    mlen = 4
+    while i + mlen < n - 5 and dat[cand+mlen] == dat[i+mlen]:
+      mlen += 1
+    out += lz4_sequence(dat[anchor:i], i - cand, mlen)
+    i += mlen
+    anchor = i
+  out += lz4_sequence(dat[anchor:], 0, 0)
+  return out
+
+def lz4_decompress(src, size):
+  out = bytearray()
+  s = 0
+  while s < len(src):
+    tok = src[s]; s += 1
+    n = tok >> 4
+    if n == 15:
+      while True:
+        x = src[s]; s += 1
+        n += x
+        if x != 255: break
+    out += src[s:s+n]; s += n
+    if s >= len(src): break
+    moff = src[s] | (src[s+1] << 8); s += 2
+    n = tok & 15
+    if n == 15:
+      while True:
+        x = src[s]; s += 1
+        n += x
+        if x != 255: break
+    for _ in range(n + 4):
+      out.append(out[-moff])
+  assert len(out) == size
+  return out
+
+def pack(dat, blk_shift):
+  blk_size = 1 << blk_shift
+  nr = (len(dat) + blk_size - 1) // blk_size
+  padded = dat + bytes(nr * blk_size - len(dat))
+  blocks = []
+  for b in range(nr):
+    raw = padded[b*blk_size:(b+1)*blk_size]
+    z = lz4_compress(raw)
+    # A block that does not compress is stored raw.
+    blocks.append(z if len(z) < blk_size else raw)
+  out = bytearray(struct.pack(hdr_fmt, b"FFZ1", blk_shift, len(dat), nr))
+  off = hdr_len + (nr + 1) * 4
+  for z in blocks:
+    out += struct.pack("<I", off)
+    off += len(z)
+  out += struct.pack("<I", off)
+  for z in blocks:
+    out += z
+  return out
+
+def unpack(dat):
+  sig, blk_shift, raw_size, nr = struct.unpack(hdr_fmt, dat[:hdr_len])
+  if sig != b"FFZ1":
+    raise ValueError("not a compressed container")
+  blk_size = 1 << blk_shift
+  idx = struct.unpack("<%dI" % (nr+1), dat[hdr_len:hdr_len+(nr+1)*4])
+  out = bytearray()
+  for b in range(nr):
+    z = dat[idx[b]:idx[b+1]]
+    out += z if len(z) == blk_size else lz4_decompress(z, blk_size)
+  return out[:raw_size]
+
+def main(argv):
+  parser = argparse.ArgumentParser(
+    formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+  parser.add_argument("--block-kb", type=int, default=4, choices=[4,8,16],
+                      help="block size, kB (the firmware needs twice this "
+                      "in RAM)")
+  parser.add_argument("--unpack", action="store_true",
+                      help="unpack a container instead")
+  parser.add_argument("infile", help="input filename")
+  parser.add_argument("outfile", help="output filename")
+  args = parser.parse_args(argv[1:])
+
+  with open(args.infile, "rb") as f:
+    dat = f.read()
+  if args.unpack:
+    out = unpack(dat)
+  else:
+    out = pack(dat, args.block_kb.bit_length() + 9)
+    assert unpack(out) == dat
+    print("%u -> %u bytes (%u%%)" % (len(dat), len(out),
+                                     len(out) * 100 // max(len(dat), 1)))
+  with open(args.outfile, "wb") as f:
+    f.write(out)
+
+if __name__ == "__main__":
+  main(sys.argv)
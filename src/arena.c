@@ -2,6 +2,10 @@
  * arena.c
  * 
  * Arena-based memory allocation. Only one arena, for now.
+ *
+ * Allocations are released wholesale by arena_init(), or back to a mark by
+ * arena_release(). A persistent tier at the top of RAM survives both: it is
+ * for small caches that should outlive an image mount.
  * 
  * Written & released by Keir Fraser <keir.xen@gmail.com>
  * 
@@ -12,6 +16,7 @@
 #define heap_bot (_ebss)
 static char *heap_p;
 static char *heap_top;
+static uint32_t persist_len;
 
 void *arena_alloc(uint32_t sz)
 {
@@ -21,6 +26,26 @@ void *arena_alloc(uint32_t sz)
     return p;
 }
 
+void *arena_mark(void)
+{
+    return heap_p;
+}
+
+void arena_release(void *mark)
+{
+    ASSERT(((char *)mark >= heap_bot) && ((char *)mark <= heap_p));
+    heap_p = mark;
+}
+
+void *arena_persist_alloc(uint32_t sz)
+{
+    sz = (sz + 3) & ~3;
+    ASSERT(heap_p + sz <= heap_top);
+    heap_top -= sz;
+    persist_len += sz;
+    return heap_top;
+}
+
 uint32_t arena_total(void)
 {
     return heap_top - heap_bot;
@@ -34,7 +59,7 @@ uint32_t arena_avail(void)
 void arena_init(void)
 {
     heap_p = heap_bot;
-    heap_top = (char *)0x20000000 + ram_kb*1024;
+    heap_top = (char *)0x20000000 + ram_kb*1024 - persist_len;
 }
 
 /*
@@ -0,0 +1,191 @@
+/*
+ * bench.c
+ *
+ * Storage qualification benchmark. Measures read and write latency and
+ * throughput of the volume backend on a scratch file, and grades the result
+ * against the demands of streaming an HD HFE image.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#define BENCH_FILE    "/FFBENCH.TMP"
+#define BENCH_REPORT  "/FFBENCH.TXT"
+#define BENCH_SECS    2048 /* Scratch file: 1MB */
+#define BENCH_RND_NR  128  /* Timed ops per random-access test */
+#define BENCH_MAX_NR  (BENCH_SECS/8)
+
+/* An HD HFE image streams both sides of a 500kbit/s track: 125kB/s. */
+#define HFE_HD_KBPS   125
+/* ring_io reads ahead in batches of up to 16 sectors: 64ms of HD HFE data.
+ * A read batch must complete well within that, and a write batch within it,
+ * for reads not to underrun. Streaming needs 2x margin on throughput. */
+#define PASS_KBPS     (2*HFE_HD_KBPS)
+#define PASS_RD_US    32000
+#define PASS_WR_US    64000
+
+enum { T_seq_rd, T_seq_wr, T_rnd_rd_512, T_rnd_rd_4k,
+       T_rnd_wr_512, T_rnd_wr_4k, T_NR };
+
+static const struct bench_test {
+    const char *name;
+    uint8_t secs;
+    bool_t write, random;
+} tests[T_NR] = {
+    [T_seq_rd]     = { "Seq Rd 4k",  8, FALSE, FALSE },
+    [T_seq_wr]     = { "Seq Wr 4k",  8, TRUE,  FALSE },
+    [T_rnd_rd_512] = { "Rnd Rd 512", 1, FALSE, TRUE },
+    [T_rnd_rd_4k]  = { "Rnd Rd 4k",  8, FALSE, TRUE },
+    [T_rnd_wr_512] = { "Rnd Wr 512", 1, TRUE,  TRUE },
+    [T_rnd_wr_4k]  = { "Rnd Wr 4k",  8, TRUE,  TRUE },
+};
+
+struct bench_stats {
+    uint32_t p50, p99, max; /* Latency, us */
+    uint32_t kbps;
+};
+
+static FIL *report_fp;
+
+static void report(const char *format, ...)
+{
+    char line[80];
+    va_list ap;
+    int len;
+
+    va_start(ap, format);
+    len = vsnprintf(line, sizeof(line), format, ap);
+    va_end(ap);
+    len = min_t(int, len, sizeof(line)-1);
+
+    printk("%s", line);
+    if (report_fp != NULL)
+        F_write(report_fp, line, len, NULL);
+}
+
+static void sort_u32(uint32_t *a, unsigned int nr)
+{
+    unsigned int i, j;
+    uint32_t x;
+
+    for (i = 1; i < nr; i++) {
+        x = a[i];
+        for (j = i; (j > 0) && (a[j-1] > x); j--)
+            a[j] = a[j-1];
+        a[j] = x;
+    }
+}
+
+static void run_test(const struct bench_test *t, LBA_t base, uint8_t *buf,
+                     uint32_t *lat, struct bench_stats *st)
+{
+    unsigned int i, nr = t->random ? BENCH_RND_NR : BENCH_SECS / t->secs;
+    uint32_t total_us = 0;
+    DRESULT res;
+    LBA_t lba;
+    time_t t0;
+
+    lcd_write(0, 1, -1, t->name);
+
+    for (i = 0; i < nr; i++) {
+        lba = base + (t->random ? rand() % (BENCH_SECS / t->secs) : i)
+            * t->secs;
+        t0 = time_now();
+        res = t->write ? disk_write(0, buf, lba, t->secs)
+            : disk_read(0, buf, lba, t->secs);
+        lat[i] = time_since(t0) / TIME_MHZ;
+        if (res != RES_OK)
+            F_die(FR_DISK_ERR);
+        total_us += lat[i];
+    }
+
+    sort_u32(lat, nr);
+    st->p50 = lat[nr/2];
+    st->p99 = lat[nr*99/100];
+    st->max = lat[nr-1];
+    st->kbps = nr * t->secs * 500000u / max_t(uint32_t, total_us, 1);
+
+    report("%10s: %4u kB/s, lat p50 %u us, p99 %u us, max %u us\n",
+           t->name, st->kbps, st->p50, st->p99, st->max);
+}
+
+bool_t volume_bench(char *msg, size_t len)
+{
+    struct bench_stats st[T_NR];
+    FIL *fp, *rfp;
+    FATFS *fs;
+    uint8_t *buf;
+    uint32_t *lat;
+    LBA_t base;
+    FRESULT fres;
+    bool_t pass;
+    unsigned int i;
+
+    if (volume_readonly()) {
+        snprintf(msg, len, "Volume is R/O");
+        return FALSE;
+    }
+
+    fp = arena_alloc(sizeof(*fp));
+    rfp = arena_alloc(sizeof(*rfp));
+    buf = arena_alloc(8*512);
+    lat = arena_alloc(BENCH_MAX_NR * sizeof(*lat));
+
+    /* A contiguous scratch file, so that the tests can address it directly
+     * through the volume layer. */
+    lcd_write(0, 1, -1, "Bench: Setup");
+    F_open(fp, BENCH_FILE, FA_CREATE_ALWAYS|FA_WRITE);
+    fres = f_expand(fp, BENCH_SECS*512, 1);
+    if (fres != FR_OK) {
+        F_close(fp);
+        f_unlink(BENCH_FILE);
+        snprintf(msg, len, "No 1MB free run");
+        return FALSE;
+    }
+    fs = fp->obj.fs;
+    base = fs->database + (LBA_t)(fp->obj.sclust - 2) * fs->csize;
+
+    F_open(rfp, BENCH_REPORT, FA_CREATE_ALWAYS|FA_WRITE);
+    report_fp = rfp;
+    report("FlashFloppy %s storage benchmark\n", fw_ver);
+
+    for (i = 0; i < 8*512; i++)
+        buf[i] = i;
+    for (i = 0; i < T_NR; i++)
+        run_test(&tests[i], base, buf, lat, &st[i]);
+
+    F_close(fp);
+    f_unlink(BENCH_FILE);
+
+    pass = ((st[T_seq_rd].kbps >= PASS_KBPS)
+            && (st[T_rnd_rd_4k].p99 <= PASS_RD_US)
+            && (st[T_rnd_wr_4k].p99 <= PASS_WR_US));
+    report("HD HFE streaming: %s\n", pass ? "PASS" : "FAIL");
+
+    /* Eager write drain stalls the host for the full writeback time: worth
+     * it only if that fits inside the head-settle time. Slower media should
+     * instead hold writes in RAM while the drive is busy. */
+    report("Recommended: write-drain = %s, write-back-ms = %u\n",
+           (st[T_rnd_wr_4k].p99 <= ff_cfg.head_settle_ms*1000)
+           ? "instant" : "adaptive",
+           (st[T_rnd_wr_4k].p99 <= PASS_WR_US) ? 0 : 2000);
+
+    report_fp = NULL;
+    F_close(rfp);
+
+    snprintf(msg, len, "%s %ukB/s", pass ? "PASS" : "FAIL",
+             st[T_seq_rd].kbps);
+    return pass;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
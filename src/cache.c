@@ -13,31 +13,50 @@ struct cache_ent {
     uint32_t id;
     struct list_head lru;
     struct list_head hash;
+    bool_t pinned, dirty;
     uint8_t dat[0];
 };
 
 struct cache {
-    uint32_t item_sz;
+    uint32_t item_sz, ent_sz;
+    uint32_t hash_mask;
+    uint16_t nr_items, nr_pinned, max_pinned, nr_dirty, max_dirty;
+    uint32_t hits, misses, evictions;
     struct list_head lru;
-    struct list_head hash[32];
-    struct cache_ent ents[0];
+    struct list_head pinned;
+    struct list_head dirty;
+    struct list_head *hash;
+    struct cache_ent *ents;
 };
 
 static struct cache *cache;
-#define CACHE_HASH(_id) ((_id)&31)
+#define CACHE_HASH(_c, _id) ((_id)&(_c)->hash_mask)
 
 struct cache *cache_init(void *start, void *end, unsigned int item_sz)
 {
     uint8_t *s, *e;
-    int i, nitm;
+    int i, nitm, nr_hash, ent_sz;
     struct cache *c;
     struct cache_ent *cent;
 
     /* Cache boundaries are four-byte aligned. */
     s = (uint8_t *)(((uint32_t)start + 3) & ~3);
     e = (uint8_t *)((uint32_t)end & ~3);
+    ent_sz = sizeof(*cent) + ((item_sz + 3) & ~3);
 
-    nitm = ((e - s) - (int)sizeof(*c)) / (int)(sizeof(*cent) + item_sz);
+    /* Size the hash table to the next power of two at or above the number of
+     * items that would fit without it, then refit the items around it. There
+     * is thus at most one item per bucket on average, and consecutive ids
+     * (sequential sectors) never collide. */
+    nitm = ((e - s) - (int)sizeof(*c)) / ent_sz;
+    if (nitm < 8) {
+        printk("No cache: too small (%d)\n", e - s);
+        return NULL;
+    }
+    for (nr_hash = 8; nr_hash < nitm; nr_hash <<= 1)
+        continue;
+    nitm = ((e - s) - (int)sizeof(*c) - nr_hash * (int)sizeof(*c->hash))
+        / ent_sz;
     if (nitm < 8) {
         printk("No cache: too small (%d)\n", e - s);
         return NULL;
@@ -46,9 +65,22 @@ struct cache *cache_init(void *start, void *end, unsigned int item_sz)
     /* Initialise the empty cache structure. */
     cache = c = (struct cache *)s;
     c->item_sz = item_sz;
+    c->ent_sz = ent_sz;
+    c->hash_mask = nr_hash - 1;
+    c->nr_items = nitm;
+    /* Pinned and dirty items are never evicted. Limit them so that at least
+     * a quarter of the cache always remains on the LRU. */
+    c->nr_pinned = c->nr_dirty = 0;
+    c->max_pinned = nitm / 4;
+    c->max_dirty = nitm / 2;
+    c->hits = c->misses = c->evictions = 0;
     list_init(&c->lru);
-    for (i = 0; i < ARRAY_SIZE(c->hash); i++)
+    list_init(&c->pinned);
+    list_init(&c->dirty);
+    c->hash = (struct list_head *)(c + 1);
+    for (i = 0; i < nr_hash; i++)
         list_init(&c->hash[i]);
+    c->ents = (struct cache_ent *)&c->hash[nr_hash];
 
     /* Insert all the cache entries into the LRU list. They are not present 
      * in any hash chain as none of the cache entries are yet in use. */
@@ -56,61 +88,92 @@ struct cache *cache_init(void *start, void *end, unsigned int item_sz)
     for (i = 0; i < nitm; i++) {
         list_insert_tail(&c->lru, &cent->lru);
         list_init(&cent->hash);
-        cent = (struct cache_ent *)((uint32_t)cent + sizeof(*cent) + item_sz);
+        cent->pinned = cent->dirty = FALSE;
+        cent = (struct cache_ent *)((uint32_t)cent + ent_sz);
     }
 
-    printk("Cache %u items\n", nitm);
+    printk("Cache %u items, %u buckets\n", nitm, nr_hash);
 
     return c;
 }
 
-const void *cache_lookup(struct cache *c, uint32_t id)
+static struct cache_ent *cache_find(struct cache *c, uint32_t id)
 {
     struct list_head *hash, *ent;
     struct cache_ent *cent;
 
-    /* Look up the item in the appropriate hash chain. */
-    hash = &c->hash[CACHE_HASH(id)];
+    hash = &c->hash[CACHE_HASH(c, id)];
     for (ent = hash->next; ent != hash; ent = ent->next) {
         cent = container_of(ent, struct cache_ent, hash);
         if (cent->id == id)
-            goto found;
+            return cent;
     }
     return NULL;
+}
 
-found:
-    /* Item is cached. Move it to head of LRU and return the data. */
+/* Put an entry on the list appropriate to its state. Only clean, unpinned
+ * entries go on the LRU, and hence may be evicted. */
+static void cache_relist(struct cache *c, struct cache_ent *cent)
+{
     list_remove(&cent->lru);
-    list_insert_head(&c->lru, &cent->lru);
+    list_insert_head(cent->pinned ? &c->pinned
+                     : cent->dirty ? &c->dirty
+                     : &c->lru, &cent->lru);
+}
+
+const void *cache_lookup(struct cache *c, uint32_t id)
+{
+    struct cache_ent *cent;
+
+    /* Look up the item in the appropriate hash chain. */
+    if ((cent = cache_find(c, id)) == NULL) {
+        c->misses++;
+        return NULL;
+    }
+
+    /* Item is cached. Move it to head of LRU and return the data. */
+    c->hits++;
+    cache_relist(c, cent);
     return cent->dat;
 }
 
-void cache_update(struct cache *c, uint32_t id, const void *dat)
+static struct cache_ent *__cache_update(
+    struct cache *c, uint32_t id, const void *dat)
 {
     struct cache_ent *cent;
-    void *p;
 
     /* Already in the cache? Just update the existing data. */
-    if ((p = (void *)cache_lookup(c, id)) != NULL)
+    if ((cent = cache_find(c, id)) != NULL) {
+        cache_relist(c, cent);
         goto found;
+    }
 
-    /* Steal the oldest cache entry from the LRU. */
+    /* Steal the oldest cache entry from the LRU. The pin and dirty limits
+     * guarantee that the LRU is never empty. */
+    ASSERT(!list_is_empty(&c->lru));
     cent = container_of(c->lru.prev, struct cache_ent, lru);
-    p = cent->dat;
 
     /* Remove the selected cache entry from the cache. */
     list_remove(&cent->lru);
-    if (!list_is_empty(&cent->hash))
+    if (!list_is_empty(&cent->hash)) {
         list_remove(&cent->hash);
+        c->evictions++;
+    }
 
     /* Reinsert the cache entry in the correct hash chain, and head of LRU. */
     cent->id = id;
     list_insert_head(&c->lru, &cent->lru);
-    list_insert_head(&c->hash[CACHE_HASH(id)], &cent->hash);
+    list_insert_head(&c->hash[CACHE_HASH(c, id)], &cent->hash);
 
 found:
     /* Finally, store away the actual item data. */
-    memcpy(p, dat, c->item_sz);
+    memcpy(cent->dat, dat, c->item_sz);
+    return cent;
+}
+
+void cache_update(struct cache *c, uint32_t id, const void *dat)
+{
+    (void)__cache_update(c, id, dat);
 }
 
 void cache_update_N(struct cache *c, uint32_t id,
@@ -124,6 +187,131 @@ void cache_update_N(struct cache *c, uint32_t id,
     }
 }
 
+void cache_fill_N(struct cache *c, uint32_t id, void *dat, unsigned int N)
+{
+    struct cache_ent *cent;
+    uint8_t *p = dat;
+
+    while (N--) {
+        /* A dirty cached item is newer than the caller's copy. */
+        if (((cent = cache_find(c, id)) != NULL) && cent->dirty) {
+            memcpy(p, cent->dat, c->item_sz);
+            cache_relist(c, cent);
+        } else {
+            cache_update(c, id, p);
+        }
+        id++;
+        p += c->item_sz;
+    }
+}
+
+bool_t cache_write(struct cache *c, uint32_t id, const void *dat)
+{
+    struct cache_ent *cent = cache_find(c, id);
+
+    if (((cent == NULL) || !cent->dirty) && (c->nr_dirty >= c->max_dirty))
+        return FALSE;
+
+    cent = __cache_update(c, id, dat);
+    if (!cent->dirty) {
+        cent->dirty = TRUE;
+        c->nr_dirty++;
+        cache_relist(c, cent);
+    }
+    return TRUE;
+}
+
+unsigned int cache_nr_dirty(struct cache *c)
+{
+    return c->nr_dirty;
+}
+
+bool_t cache_first_dirty(struct cache *c, uint32_t *id)
+{
+    struct cache_ent *cent = c->ents;
+    bool_t found = FALSE;
+    int i;
+
+    if (c->nr_dirty == 0)
+        return FALSE;
+
+    for (i = 0; i < c->nr_items; i++) {
+        if (cent->dirty && (!found || (cent->id < *id))) {
+            *id = cent->id;
+            found = TRUE;
+        }
+        cent = (struct cache_ent *)((uint32_t)cent + c->ent_sz);
+    }
+
+    return found;
+}
+
+const void *cache_clean(struct cache *c, uint32_t id)
+{
+    struct cache_ent *cent;
+
+    if (((cent = cache_find(c, id)) == NULL) || !cent->dirty)
+        return NULL;
+
+    cent->dirty = FALSE;
+    c->nr_dirty--;
+    cache_relist(c, cent);
+    return cent->dat;
+}
+
+bool_t cache_redirty(struct cache *c, uint32_t id, const void *dat)
+{
+    struct cache_ent *cent = cache_find(c, id);
+
+    /* Rewritten since it was cleaned? Then the cached data is newer. */
+    if ((cent != NULL) && cent->dirty)
+        return TRUE;
+    return cache_write(c, id, dat);
+}
+
+bool_t cache_pin(struct cache *c, uint32_t id)
+{
+    struct cache_ent *cent;
+
+    if ((cent = cache_find(c, id)) == NULL)
+        return FALSE;
+    if (cent->pinned)
+        return TRUE;
+    if (c->nr_pinned >= c->max_pinned)
+        return FALSE;
+
+    /* Move to the pinned list: it can no longer be evicted. */
+    cent->pinned = TRUE;
+    c->nr_pinned++;
+    cache_relist(c, cent);
+    return TRUE;
+}
+
+void cache_unpin(struct cache *c, uint32_t id)
+{
+    struct cache_ent *cent;
+
+    if (((cent = cache_find(c, id)) == NULL) || !cent->pinned)
+        return;
+
+    cent->pinned = FALSE;
+    c->nr_pinned--;
+    cache_relist(c, cent);
+}
+
+void cache_stats(struct cache *c)
+{
+    printk("Cache: %u hits, %u misses, %u evictions, %u/%u pinned, "
+           "%u dirty\n", c->hits, c->misses, c->evictions,
+           c->nr_pinned, c->nr_items, c->nr_dirty);
+}
+
+void cache_counts(struct cache *c, uint32_t *hits, uint32_t *misses)
+{
+    *hits = c->hits;
+    *misses = c->misses;
+}
+
 /*
  * Local variables:
  * mode: C
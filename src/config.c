@@ -23,67 +23,97 @@ static int isvalid(char c)
     return ((c/8) < sizeof(map)) ? (int8_t)(map[c/8] << (c&7)) < 0 : FALSE;
 }
 
+static char next_char(struct opts *opts)
+{
+    UINT nr;
+    char c;
+
+    if (opts->rbuf == NULL) {
+        F_read(opts->file, &c, 1, NULL);
+        return c;
+    }
+
+    if (opts->rbuf_pos == opts->rbuf_fill) {
+        F_read(opts->file, opts->rbuf, opts->rbuf_len, &nr);
+        opts->rbuf_pos = 0;
+        opts->rbuf_fill = nr;
+        if (nr == 0)
+            return '\0';
+    }
+
+    return opts->rbuf[opts->rbuf_pos++];
+}
+
 int get_next_opt(struct opts *opts)
 {
     char *p, c;
     const struct opt *opt;
     bool_t section;
+    int i;
 
-    F_read(opts->file, &c, 1, NULL);
+    c = next_char(opts);
 next_line:
     if (c == '\0')
         return OPT_eof;
     /* Skip leading whitespace. */
     while (isspace(c))
-        F_read(opts->file, &c, 1, NULL);
+        c = next_char(opts);
 
     /* Option name parsing. */
     section = (c == '['); /* "[section]" */
-    if (section)
-        F_read(opts->file, &c, 1, NULL);
+    if (section) {
+        opts->section_ofs = f_tell(opts->file)
+            - (opts->rbuf_fill - opts->rbuf_pos) - 1;
+        c = next_char(opts);
+    }
     p = opts->arg;
     while (isvalid(c) && ((p-opts->arg) < (opts->argmax-1))) {
         *p++ = c;
-        F_read(opts->file, &c, 1, NULL);
+        c = next_char(opts);
     }
     *p = '\0';
     if (section)
         return OPT_section;
     /* Look for a match in the accepted options list. */
-    for (opt = opts->opts; opt->name; opt++)
-        if (!strcmp(opt->name, opts->arg))
-            break;
-    if (!opt->name) {
+    if (opts->lookup) {
+        i = opts->lookup(opts->arg);
+    } else {
+        for (opt = opts->opts; opt->name; opt++)
+            if (!strcmp(opt->name, opts->arg))
+                break;
+        i = opt->name ? opt - opts->opts : -1;
+    }
+    if (i < 0) {
         /* No match? Then skip to next line and try again. */
         while ((c != '\r') && (c != '\n') && (c != '\0'))
-            F_read(opts->file, &c, 1, NULL);
+            c = next_char(opts);
         goto next_line;
     }
 
     /* Skip whitespace (and equals) between option name and value. */
     while ((c == ' ') || (c == '\t') || (c == '='))
-        F_read(opts->file, &c, 1, NULL);
+        c = next_char(opts);
 
     /* Option value parsing: */
     p = opts->arg;
     if (c == '"') {
         /* Arbitrary quoted string. Anything goes except NL/CR. */
-        F_read(opts->file, &c, 1, NULL);
+        c = next_char(opts);
         while ((c != '\r') && (c != '\n') && (c != '"') && (c != '\0')
                && ((p-opts->arg) < (opts->argmax-1))) {
             *p++ = c;
-            F_read(opts->file, &c, 1, NULL);
+            c = next_char(opts);
         }
     } else {
         /* Non-quoted value: restricted character set. */
         while (isvalid(c) && ((p-opts->arg) < (opts->argmax-1))) {
             *p++ = c;
-            F_read(opts->file, &c, 1, NULL);
+            c = next_char(opts);
         }
     }
     *p = '\0';
 
-    return opt - opts->opts;
+    return i;
 }
 
 
@@ -17,21 +17,32 @@
 void IRQ_44(void) __attribute__((alias("SOFTIRQ_console")));
 #define CONSOLE_SOFTIRQ 44
 
-/* We stage serial output in a ring buffer. */
+/* We stage serial output in a ring buffer. Producers reserve space by
+ * atomically advancing @prod, then fill it with IRQs enabled. The filled
+ * region [cons,commit) is published only by the outermost producer, once any
+ * producers which preempted it have also finished. */
 static char ring[2048];
 #define MASK(x) ((x)&(sizeof(ring)-1))
-static unsigned int cons, prod;
+static unsigned int cons, commit;
+static volatile unsigned int prod;
 
 /* The console can be set into synchronous mode in which case IRQ is disabled 
  * and the transmit-empty flag is polled manually for each byte. */
 static bool_t sync_console;
 
+/* Per-nesting-level scratch for formatting. Messages from deeper than
+ * MAX_NEST nested producers are dropped. */
+#define MAX_NEST 4
+static char scratch[MAX_NEST][128];
+static uint8_t printk_nest;
+
 static void flush_ring_to_serial(void)
 {
-    unsigned int c = cons, p = prod;
+    unsigned int c = cons, p = commit;
     barrier();
 
-    while (c != p) {
+    /* @commit may briefly step backwards while a producer publishes. */
+    while ((int)(p - c) > 0) {
         while (!(usart1->sr & USART_SR_TXE))
             cpu_relax();
         usart1->dr = ring[MASK(c++)];
@@ -50,39 +61,66 @@ static void kick_tx(void)
 {
     if (sync_console) {
         flush_ring_to_serial();
-    } else if (cons != prod) {
+    } else if (cons != commit) {
         IRQx_set_pending(CONSOLE_SOFTIRQ);
     }
 }
 
 int vprintk(const char *format, va_list ap)
 {
-    static char str[128];
-    char *p, c;
-    int n;
-
-    IRQ_global_disable();
-
-    n = vsnprintf(str, sizeof(str), format, ap);
-
-    p = str;
-    while (((c = *p++) != '\0') && ((prod-cons) != (sizeof(ring) - 1))) {
-        switch (c) {
+    unsigned int depth, len, nr, p;
+    char *str, *q, c;
+    int n = 0;
+
+    /* Each nesting level has its own scratch buffer. Preemption is strictly
+     * LIFO, so a preempting producer always restores @printk_nest before we
+     * resume, even mid-increment. */
+    depth = printk_nest++;
+    if (depth >= MAX_NEST)
+        goto out;
+    str = scratch[depth];
+
+    n = vsnprintf(str, sizeof(scratch[0]), format, ap);
+
+    /* Output length, with LF expanded to CR/LF and any CRs dropped. */
+    for (len = 0, q = str; (c = *q) != '\0'; q++)
+        len += (c == '\n') ? 2 : (c != '\r');
+
+    /* Reserve what we can fit. */
+    do {
+        p = prod;
+        nr = min_t(unsigned int, len, sizeof(ring) - 1 - (p - cons));
+    } while (cmpxchg(&prod, p, p + nr) != p);
+
+    for (q = str; nr != 0; q++) {
+        switch (c = *q) {
         case '\r': /* CR: ignore as we generate our own CR/LF */
             break;
         case '\n': /* LF: convert to CR/LF (usual terminal behaviour) */
-            ring[MASK(prod++)] = '\r';
+            ring[MASK(p++)] = '\r';
+            if (--nr == 0)
+                break;
             /* fall through */
         default:
-            ring[MASK(prod++)] = c;
+            ring[MASK(p++)] = c;
+            nr--;
             break;
         }
     }
 
-    kick_tx();
-
-    if (!sync_console)
-        IRQ_global_enable();
+out:
+    if ((--printk_nest == 0) || sync_console) {
+        /* Outermost producer (or crash dump): publish everything reserved so
+         * far. A producer preempting us here publishes for itself, but we may
+         * then overwrite it with an older value, so go round again. */
+        do {
+            p = prod;
+            barrier();
+            commit = p;
+            barrier();
+        } while (p != prod);
+        kick_tx();
+    }
 
     return n;
 }
@@ -141,10 +179,39 @@ void console_crash_on_input(void)
 
     (void)usart1->dr; /* clear UART_SR_RXNE */
     usart1->cr1 |= USART_CR1_RXNEIE;
+#if defined(PROFILE)
+    /* Serial input is instead a command to the profiler (see below). */
+    IRQx_set_prio(USART1_IRQ, CONSOLE_IRQ_PRI);
+#else
     IRQx_set_prio(USART1_IRQ, RESET_IRQ_PRI);
+#endif
     IRQx_enable(USART1_IRQ);
 }
 
+#if defined(PROFILE)
+/* Profiler commands: 'p' prints statistics, 'z' zeroes them. */
+void IRQ_37(void) __attribute__((alias("IRQ_console_rx")));
+static void IRQ_console_rx(void)
+{
+    unsigned int i;
+
+    switch (usart1->dr) {
+    case 'p':
+        /* Flush after each site so that the whole report fits the ring. We
+         * share the console soft IRQ's priority so cannot race with it. */
+        for (i = 0; i < PROF_NR; i++) {
+            prof_print(i);
+            flush_ring_to_serial();
+        }
+        break;
+    case 'z':
+        prof_reset();
+        printk("Profile reset\n");
+        break;
+    }
+}
+#endif
+
 /*
  * Local variables:
  * mode: C
@@ -105,18 +105,23 @@ uint8_t osd_buttons_rx;
 #define OSD_read  1
 #define OSD_write 2
 static uint8_t in_osd, osd_ver;
+/* Extra OSD-only row below the mirrored display, if enabled. */
+static char osd_overlay[40];
+static bool_t osd_overlay_on;
 #define OSD_I2C_ADDR 0x10
 
 static uint8_t _bl;
 static uint8_t i2c_addr;
 static uint8_t i2c_dead;
 static uint8_t i2c_row;
+static bool_t txn_open;
 static bool_t is_oled_display;
 static uint8_t oled_height;
 
 #define OLED_ADDR 0x3c
 enum { OLED_unknown, OLED_ssd1306, OLED_sh1106 };
 static uint8_t oled_model;
+static bool_t oled_data;
 static void oled_init(void);
 static unsigned int oled_prep_buffer(void);
 
@@ -149,6 +154,17 @@ static void timeout_fn(void *unused)
     IRQx_set_pending(I2C_ERROR_IRQ);
 }
 
+/* With nothing to send, the DMA pipeline goes idle and polls text[] for
+ * changes. The poll is kicked off in I2C event ISR context. */
+#define IDLE_POLL time_ms(20)
+static struct timer idle_timer;
+static bool_t idle_kick;
+static void idle_fn(void *unused)
+{
+    idle_kick = TRUE;
+    IRQx_set_pending(I2C_EVENT_IRQ);
+}
+
 /* I2C Error ISR: Reset the peripheral and reinit everything. */
 static void IRQ_i2c_error(void)
 {
@@ -165,6 +181,7 @@ static void IRQ_i2c_error(void)
     dma1->ifcr = DMA_TX_CGIF | DMA_RX_CGIF;
 
     timer_cancel(&timeout_timer);
+    timer_cancel(&idle_timer);
 
     lcd_init();
 }
@@ -173,6 +190,13 @@ static void IRQ_i2c_event(void)
 {
     uint16_t sr1 = i2c->sr1;
 
+    if (idle_kick) {
+        /* Idle poll: the bus is quiet, see if there is anything to send. */
+        idle_kick = FALSE;
+        dma_tx_tc_btf();
+        return;
+    }
+
     if (sr1 & I2C_SR1_SB) {
         /* Send address. Clears SR1_SB. */
         uint8_t a = in_osd ? OSD_I2C_ADDR : i2c_addr;
@@ -240,6 +264,75 @@ static void emit8(uint8_t **p, uint8_t val, uint8_t signals)
     emit4(p, (val << 4) | signals);
 }
 
+/* Begin a DMA-driven I2C transaction. */
+static void txn_start(void)
+{
+    txn_open = TRUE;
+    i2c->cr2 |= I2C_CR2_ITEVTEN;
+    i2c->cr1 |= I2C_CR1_START;
+}
+
+/* End the current DMA-driven I2C transaction, if there is one. */
+static void txn_stop(void)
+{
+    if (txn_open)
+        i2c_stop();
+    txn_open = FALSE;
+}
+
+/* Differential refresh: the text last sent to each display line (an LCD row,
+ * or a 16-pixel OLED band) and how it was laid out. Only changed cells are
+ * re-sent, with a periodic full refresh to recover from any lost bytes. */
+#define FULL_REFRESH time_ms(1000)
+static struct {
+    char text[4][40];
+    uint8_t key[4];
+    uint8_t bl;
+    bool_t full;
+    time_t full_time;
+    /* OLED: pixel columns [s,e) of the band currently being sent. */
+    uint8_t s, e;
+} shadow;
+
+/* Decide at the start of a frame whether it must be sent in full. */
+static void shadow_frame(void)
+{
+    shadow.full = ((shadow.bl != _bl)
+                   || (time_since(shadow.full_time) > FULL_REFRESH));
+    if (shadow.full)
+        shadow.full_time = time_now();
+    shadow.bl = _bl;
+}
+
+/* Compare display line @line with what was last sent to it, and record @p
+ * (NULL if blank) laid out per @key as now sent. Returns FALSE if there is
+ * no change, else the span of changed columns [*ps,*pe). */
+static bool_t shadow_update(unsigned int line, uint8_t key, const char *p,
+                            unsigned int *ps, unsigned int *pe)
+{
+    char *q = shadow.text[line];
+    unsigned int s = 0, e = lcd_columns;
+
+    if (!shadow.full && (shadow.key[line] == key)) {
+        if (p == NULL)
+            return FALSE;
+        while ((s < e) && (p[s] == q[s]))
+            s++;
+        if (s == e)
+            return FALSE;
+        while (p[e-1] == q[e-1])
+            e--;
+    }
+
+    shadow.key[line] = key;
+    if (p != NULL)
+        memcpy(q, p, lcd_columns);
+
+    *ps = s;
+    *pe = e;
+    return TRUE;
+}
+
 /* Snapshot text buffer into the command buffer. */
 static unsigned int osd_prep_buffer(void)
 {
@@ -249,14 +342,15 @@ static unsigned int osd_prep_buffer(void)
     unsigned int row;
 
     if (++in_osd == OSD_read) {
-        i2c->cr2 |= I2C_CR2_LAST | I2C_CR2_ITEVTEN;
-        i2c->cr1 |= I2C_CR1_ACK | I2C_CR1_START;
+        i2c->cr2 |= I2C_CR2_LAST;
+        i2c->cr1 |= I2C_CR1_ACK;
+        txn_start();
         return sizeof(struct i2c_osd_info);
     }
 
     *q++ = OSD_BACKLIGHT | !!_bl;
     *q++ = OSD_COLUMNS | lcd_columns;
-    *q++ = OSD_ROWS | 3;
+    *q++ = OSD_ROWS | (osd_overlay_on ? 4 : 3);
     *q++ = OSD_HEIGHTS | (menu_mode ? 4 : 2);
     *q++ = OSD_BUTTONS | osd_buttons_tx;
     *q++ = OSD_DATA;
@@ -265,13 +359,16 @@ static unsigned int osd_prep_buffer(void)
         memcpy(q, p, lcd_columns);
         q += lcd_columns;
     }
+    if (osd_overlay_on) {
+        memcpy(q, osd_overlay, lcd_columns);
+        q += lcd_columns;
+    }
 
     if (i2c_addr == 0)
         refresh_count++;
 
     in_osd = OSD_write;
-    i2c->cr2 |= I2C_CR2_ITEVTEN;
-    i2c->cr1 |= I2C_CR1_START;
+    txn_start();
 
     return q - buffer;
 }
@@ -283,34 +380,47 @@ static unsigned int lcd_prep_buffer(void)
     uint16_t order;
     char *p;
     uint8_t *q = buffer;
-    unsigned int i, row;
-
-    if (i2c_row == lcd_rows) {
-        i2c_row++;
-        if (has_osd) {
-            i2c_stop();
-            return osd_prep_buffer();
-        }
-    }
+    unsigned int i, s, e, row;
+    bool_t new_frame = FALSE;
 
     if (i2c_row > lcd_rows) {
+    frame:
         i2c_row = 0;
         refresh_count++;
-        i2c_stop();
-        i2c->cr2 |= I2C_CR2_ITEVTEN;
-        i2c->cr1 |= I2C_CR1_START;
+        txn_stop();
+        shadow_frame();
+        new_frame = TRUE;
     }
 
     order = (lcd_rows == 2) ? 0x7710 : 0x2103;
     if ((ff_cfg.display_order != DORD_default) && (display_mode == DM_normal))
         order = ff_cfg.display_order;
 
-    row = (order >> (i2c_row * DORD_shift)) & DORD_row;
-    p = (row < ARRAY_SIZE(text)) ? text[row] : NULL;
+    /* Skip to the next row with changed cells. */
+    for (; i2c_row < lcd_rows; i2c_row++) {
+        row = (order >> (i2c_row * DORD_shift)) & DORD_row;
+        p = (row < ARRAY_SIZE(text)) ? text[row] : NULL;
+        if (shadow_update(i2c_row, !p, p, &s, &e))
+            break;
+    }
+
+    if (i2c_row == lcd_rows) {
+        i2c_row++;
+        txn_stop();
+        if (has_osd)
+            return osd_prep_buffer();
+        /* A whole frame without changes: go idle. */
+        if (new_frame)
+            return 0;
+        goto frame;
+    }
 
-    emit8(&q, CMD_SETDDRADDR | row_offs[i2c_row], 0);
-    for (i = 0; i < lcd_columns; i++)
-        emit8(&q, p ? *p++ : ' ', _RS);
+    if (!txn_open)
+        txn_start();
+
+    emit8(&q, CMD_SETDDRADDR | (row_offs[i2c_row] + s), 0);
+    for (i = s; i < e; i++)
+        emit8(&q, p ? p[i] : ' ', _RS);
 
     i2c_row++;
 
@@ -341,11 +451,19 @@ static void dma_tx_tc_btf(void)
     /* Prepare the DMA buffer and start the next DMA sequence. */
     in_osd = OSD_no;
     if (i2c_addr == 0) {
-        i2c_stop();
+        txn_stop();
         dma_sz = osd_prep_buffer();
     } else {
         dma_sz = is_oled_display ? oled_prep_buffer() : lcd_prep_buffer();
     }
+
+    if (dma_sz == 0) {
+        /* Display is up to date. Poll again later. */
+        timer_cancel(&timeout_timer);
+        timer_set(&idle_timer, time_now() + IDLE_POLL);
+        return;
+    }
+
     dma_start(dma_sz);
 }
 
@@ -489,6 +607,26 @@ void lcd_write(int col, int row, int min, const char *str)
     IRQ_restore(oldpri);
 }
 
+void osd_overlay_write(const char *str)
+{
+    char row[sizeof(osd_overlay)];
+    uint32_t oldpri;
+
+    if (str == NULL) {
+        osd_overlay_on = FALSE;
+        return;
+    }
+
+    snprintf(row, sizeof(row), "%*s", lcd_columns, str); /* NB. %*s pads on the right */
+    if (osd_overlay_on && !memcmp(row, osd_overlay, lcd_columns))
+        return; /* unchanged */
+
+    oldpri = IRQ_save(I2C_IRQ_PRI);
+    memcpy(osd_overlay, row, sizeof(row));
+    osd_overlay_on = TRUE;
+    IRQ_restore(oldpri);
+}
+
 void lcd_backlight(bool_t on)
 {
     /* Will be picked up the next time text[] is rendered. */
@@ -509,9 +647,17 @@ bool_t lcd_init(void)
 
     i2c_dead = FALSE;
     i2c_row = 0;
+    txn_open = FALSE;
     in_osd = OSD_no;
+    oled_data = FALSE;
+    idle_kick = FALSE;
     osd_buttons_rx = 0;
 
+    /* Everything must be re-sent after (re)initialisation. */
+    shadow.full = TRUE;
+    shadow.full_time = time_now();
+    shadow.bl = _bl;
+
     if (is_32pin_mcu) {
         i2c = i2c1;
         i2c_cfg = &i2c1_cfg;
@@ -662,6 +808,7 @@ bool_t lcd_init(void)
     /* Timeout handler for if I2C transmission borks. */
     timer_init(&timeout_timer, timeout_fn, NULL);
     timer_set(&timeout_timer, time_now() + DMA_TIMEOUT);
+    timer_init(&idle_timer, idle_fn, NULL);
 
     if (is_oled_display) {
         oled_init();
@@ -675,6 +822,7 @@ bool_t lcd_init(void)
     i2c->cr1 |= I2C_CR1_START;
     if (!i2c_start(i2c_addr, I2C_WR))
         goto fail;
+    txn_open = TRUE;
 
     /* Initialise 4-bit interface, as in the datasheet. Do this synchronously
      * and with the required delays. */
@@ -716,48 +864,55 @@ fail:
     return FALSE;
 }
 
-extern const uint8_t oled_font_6x13[];
-static void oled_convert_text_row_6x13(char *pc)
+/* Render characters [s,e) of a text row into buffer[], at pixel column
+ * @x0 onwards. Glyphs outside the range are left unrendered. */
+static void oled_render_glyphs(const uint8_t *font, unsigned int w,
+                               char *pc, unsigned int x0,
+                               unsigned int s, unsigned int e)
 {
     unsigned int i, c;
     const uint8_t *p;
-    uint8_t *q = buffer;
-    const unsigned int w = 6;
-
-    q[0] = q[128] = 0;
-    q++;
+    uint8_t *q = &buffer[x0 + s * w];
 
-    for (i = 0; i < lcd_columns; i++) {
-        if ((c = *pc++ - 0x20) > 0x5e)
+    for (i = s; i < e; i++) {
+        if ((c = pc[i] - 0x20) > 0x5e)
             c = '.' - 0x20;
-        p = &oled_font_6x13[c * w * 2];
+        p = &font[c * w * 2];
         memcpy(q, p, w);
         memcpy(q+128, p+w, w);
         q += w;
     }
+}
+
+extern const uint8_t oled_font_6x13[];
+static void oled_convert_text_row_6x13(char *pc)
+{
+    const unsigned int w = 6;
+    unsigned int s, e;
+
+    /* Only the glyphs overlapping pixel columns [shadow.s,shadow.e) are
+     * sent. A scroll step moves every glyph on the row, so this helps only
+     * rows which change in part, such as the status fields. */
+    s = (shadow.s > 0) ? (shadow.s - 1) / w : 0;
+    e = min_t(unsigned int, lcd_columns, (shadow.e + w - 2) / w);
+
+    buffer[0] = buffer[128] = 0;
+    oled_render_glyphs(oled_font_6x13, w, pc, 1, s, e);
 
     /* Fill remainder of buffer[] with zeroes. */
-    memset(q, 0, 127-lcd_columns*w);
-    memset(q+128, 0, 127-lcd_columns*w);
+    memset(&buffer[1+lcd_columns*w], 0, 127-lcd_columns*w);
+    memset(&buffer[129+lcd_columns*w], 0, 127-lcd_columns*w);
 }
 
 #ifdef font_extra
 extern const uint8_t oled_font_8x16[];
 static void oled_convert_text_row_8x16(char *pc)
 {
-    unsigned int i, c;
-    const uint8_t *p;
-    uint8_t *q = buffer;
     const unsigned int w = 8;
 
-    for (i = 0; i < lcd_columns; i++) {
-        if ((c = *pc++ - 0x20) > 0x5e)
-            c = '.' - 0x20;
-        p = &oled_font_8x16[c * w * 2];
-        memcpy(q, p, w);
-        memcpy(q+128, p+w, w);
-        q += w;
-    }
+    oled_render_glyphs(oled_font_8x16, w, pc, 0, shadow.s / w,
+                       min_t(unsigned int, lcd_columns,
+                             (shadow.e + w - 1) / w));
 }
 #endif
 
@@ -784,70 +939,66 @@ static unsigned int oled_queue_cmds(
     return p - buf;
 }
 
+/* Expand pixel columns [shadow.s,shadow.e) of one page at @src to double
+ * height: @mask selects the lower (1) and/or upper (2) output page. Each
+ * column is read before it is written, so @src may overlap @dst. */
 static void oled_double_height(uint8_t *dst, uint8_t *src, uint8_t mask)
 {
     const uint8_t tbl[] = {
         0x00, 0x03, 0x0c, 0x0f, 0x30, 0x33, 0x3c, 0x3f,
         0xc0, 0xc3, 0xcc, 0xcf, 0xf0, 0xf3, 0xfc, 0xff
     };
-    uint8_t x, *p, *q;
+    uint8_t x, *q;
     unsigned int i;
-    if ((mask == 3) && (src == dst)) {
-        p = src + 128;
-        q = dst + 256;
-        for (i = 0; i < 128; i++) {
-            x = *--p;
-            *--q = tbl[x>>4];
-        }
-        p = src + 128;
-        for (i = 0; i < 128; i++) {
-            x = *--p;
-            *--q = tbl[x&15];
-        }
-    } else {
-        p = src;
-        q = dst;
+
+    for (i = shadow.s; i < shadow.e; i++) {
+        x = src[i];
+        q = &dst[i];
         if (mask & 1) {
-            for (i = 0; i < 128; i++) {
-                x = *p++;
-                *q++ = tbl[x&15];
-            }
-        }
-        if (mask & 2) {
-            p = src;
-            for (i = 0; i < 128; i++) {
-                x = *p++;
-                *q++ = tbl[x>>4];
-            }
+            *q = tbl[x&15];
+            q += 128;
         }
+        if (mask & 2)
+            *q = tbl[x>>4];
     }
 }
 
-static unsigned int oled_start_i2c(uint8_t *buf)
+/* Set up the display address for pixel columns [s,e) from @page onwards. */
+static unsigned int oled_start_i2c(
+    uint8_t *buf, unsigned int page, unsigned int s, unsigned int e)
 {
     static const uint8_t ssd1306_addr_cmds[] = {
         0x20, 0,      /* horizontal addressing mode */
-        0x21, 0, 127, /* column address range: 0-127 */
-        0x22, 0, 7,   /* page address range: 0-7 */
     }, ztech_addr_cmds[] = {
         0xda, 0x12,   /* alternate com pins config */
-        0x21, 4, 131, /* column address range: 4-131 */
-    }, sh1106_addr_cmds[] = {
-        0x10          /* column address high nibble is zero */
     };
 
-    uint8_t dynamic_cmds[4], *dc = dynamic_cmds;
+    uint8_t dynamic_cmds[8], *dc = dynamic_cmds;
     uint8_t *p = buf;
 
     /* Set up the display address range. */
     if (oled_model == OLED_sh1106) {
-        p += oled_queue_cmds(p, sh1106_addr_cmds, sizeof(sh1106_addr_cmds));
-        /* Column address: 0 or 2 (seems 128x64 displays are shifted by 2). */
-        *dc++ = (oled_height == 64) ? 0x02 : 0x00;
-        /* Page address: according to i2c_row. */
-        *dc++ = 0xb0 + i2c_row;
+        /* Column address: seems 128x64 displays are shifted by 2. */
+        s += (oled_height == 64) ? 2 : 0;
+        *dc++ = 0x00 | (s & 15);
+        *dc++ = 0x10 | (s >> 4);
+        /* Page address. */
+        *dc++ = 0xb0 + page;
     } else {
         p += oled_queue_cmds(p, ssd1306_addr_cmds, sizeof(ssd1306_addr_cmds));
+        /* ZHONGJY_TECH 2.23" 128x32 display based on SSD1305 controller.
+         * It has alternate COM pin mapping and is offset horizontally. */
+        if (ff_cfg.display_type & DISPLAY_ztech) {
+            p += oled_queue_cmds(p, ztech_addr_cmds, sizeof(ztech_addr_cmds));
+            s += 4;
+            e += 4;
+        }
+        *dc++ = 0x21; /* column address range */
+        *dc++ = s;
+        *dc++ = e - 1;
+        *dc++ = 0x22; /* page address range */
+        *dc++ = page;
+        *dc++ = 7;
     }
 
     /* Display on/off according to backlight setting. */
@@ -855,25 +1006,21 @@ static unsigned int oled_start_i2c(uint8_t *buf)
 
     p += oled_queue_cmds(p, dynamic_cmds, dc - dynamic_cmds);
 
-    /* ZHONGJY_TECH 2.23" 128x32 display based on SSD1305 controller. 
-     * It has alternate COM pin mapping and is offset horizontally. */
-    if (ff_cfg.display_type & DISPLAY_ztech)
-        p += oled_queue_cmds(p, ztech_addr_cmds, sizeof(ztech_addr_cmds));
-
     /* All subsequent bytes are data bytes. */
     *p++ = 0x40;
 
     /* Start the I2C transaction. */
-    i2c->cr2 |= I2C_CR2_ITEVTEN;
-    i2c->cr1 |= I2C_CR1_START;
+    txn_start();
 
     return p - buf;
 }
 
-static int oled_to_lcd_row(int in_row)
+/* Find the text row shown in OLED band @in_row. Returns 0 if normal height,
+ * else which half (1 or 2) of a double-height row the band shows. */
+static int oled_band_row(int in_row, int *prow)
 {
     uint16_t order;
-    int i = 0, row;
+    int i = 0;
     bool_t large = FALSE;
 
     order = (oled_height == 32) ? 0x7710 : menu_mode ? 0x7903 : 0x7183;
@@ -889,64 +1036,134 @@ static int oled_to_lcd_row(int in_row)
     }
 
     /* Remap the row */
-    row = order & DORD_row;
+    *prow = order & DORD_row;
+
+    return large ? i - in_row : 0;
+}
+
+static int oled_to_lcd_row(int in_row)
+{
+    int row, size = oled_band_row(in_row, &row);
+
     if (row < lcd_rows) {
         oled_convert_text_row(text[row]);
     } else {
         memset(buffer, 0, 256);
     }
 
-    return large ? i - in_row : 0;
+    return size;
+}
+
+/* Find the next OLED band, from @band, whose text has changed. The pixel
+ * columns to be re-sent are recorded in shadow.s and shadow.e. */
+static unsigned int oled_next_band(unsigned int band, unsigned int nr)
+{
+    unsigned int s, e, w = 6;
+    int row, size;
+
+    for (; band < nr; band++) {
+        size = oled_band_row(band, &row);
+        if (shadow_update(band, (size << 4) | row,
+                          (row < lcd_rows) ? text[row] : NULL, &s, &e))
+            break;
+    }
+
+    if (band == nr)
+        return band;
+
+#ifdef font_extra
+    if (ff_cfg.oled_font == FONT_8x16)
+        w = 8;
+#endif
+    if ((s == 0) && (e == lcd_columns)) {
+        /* Whole band, including any margins. */
+        shadow.s = 0;
+        shadow.e = 128;
+    } else {
+        /* The 6x13 font is rendered with a one-pixel left margin. */
+        shadow.s = s * w + (w == 6);
+        shadow.e = e * w + (w == 6);
+    }
+
+    return band;
 }
 
 static unsigned int ssd1306_prep_buffer(void)
 {
+    unsigned int nr = oled_height / 16, w;
     int size;
-
-    /* If we have completed a complete fill of the OLED display, start a new 
-     * I2C transaction. The OLED display seems to occasionally silently lose 
-     * a byte and then we lose sync with the display address. */
-    if (i2c_row == (oled_height / 16)) {
+    bool_t new_frame = FALSE;
+
+    if (oled_data) {
+        /* Band address is set up: now send its changed columns. */
+        oled_data = FALSE;
+        size = oled_to_lcd_row(i2c_row);
+        if (size != 0)
+            oled_double_height(buffer, &buffer[(size == 1) ? 128 : 0], 0x3);
+        w = shadow.e - shadow.s;
+        memmove(buffer, &buffer[shadow.s], w);
+        memmove(&buffer[w], &buffer[128 + shadow.s], w);
         i2c_row++;
-        if (has_osd) {
-            i2c_stop();
-            return osd_prep_buffer();
-        }
+        return 2 * w;
     }
 
-    if (i2c_row > (oled_height / 16)) {
+    if (i2c_row > nr) {
+    frame:
         i2c_row = 0;
         refresh_count++;
-        i2c_stop();
-        return oled_start_i2c(buffer);
+        shadow_frame();
+        new_frame = TRUE;
     }
 
-    /* Convert one row of text[] into buffer[] writes. */
-    size = oled_to_lcd_row(i2c_row);
-    if (size != 0)
-        oled_double_height(buffer, &buffer[(size == 1) ? 128 : 0], 0x3);
+    i2c_row = oled_next_band(i2c_row, nr);
 
-    i2c_row++;
+    if (i2c_row == nr) {
+        i2c_row++;
+        txn_stop();
+        if (has_osd)
+            return osd_prep_buffer();
+        /* A whole frame without changes: go idle. */
+        if (new_frame)
+            return 0;
+        goto frame;
+    }
 
-    return 256;
+    /* Each band is sent as its own I2C transaction. The OLED display seems
+     * to occasionally silently lose a byte and then we lose sync with the
+     * display address: this recovers sync at the next band. */
+    txn_stop();
+    oled_data = TRUE;
+    return oled_start_i2c(buffer, i2c_row * 2, shadow.s, shadow.e);
 }
 
 static unsigned int sh1106_prep_buffer(void)
 {
+    unsigned int nr = oled_height / 8, w;
     int size;
     uint8_t *p = buffer;
+    bool_t new_frame = FALSE;
 
-    if (i2c_row == (oled_height / 8)) {
-        i2c_row++;
-        if (has_osd) {
-            i2c_stop();
-            return osd_prep_buffer();
-        }
-    }
-
-    if (i2c_row > (oled_height / 8)) {
+    if (i2c_row > nr) {
+    frame:
         i2c_row = 0;
         refresh_count++;
+        shadow_frame();
+        new_frame = TRUE;
+    }
+
+    /* Pages are checked for changes in pairs, one text band at a time. */
+    if (!(i2c_row & 1))
+        i2c_row = oled_next_band(i2c_row / 2, nr / 2) * 2;
+
+    if (i2c_row == nr) {
+        i2c_row++;
+        txn_stop();
+        if (has_osd)
+            return osd_prep_buffer();
+        /* A whole frame without changes: go idle. */
+        if (new_frame)
+            return 0;
+        goto frame;
     }
 
     /* Convert one row of text[] into buffer[] writes. */
@@ -956,16 +1173,18 @@ static unsigned int sh1106_prep_buffer(void)
                            (i2c_row & 1) + 1);
     } else {
         if (!(i2c_row & 1))
-            memcpy(&buffer[128], &buffer[0], 128);
+            memcpy(&buffer[128 + shadow.s], &buffer[shadow.s],
+                   shadow.e - shadow.s);
     }
 
-    /* Every 8 rows needs a new page address and hence new I2C transaction. */
-    i2c_stop();
-    p += oled_start_i2c(p);
+    /* Every page needs a new page address and hence new I2C transaction. */
+    txn_stop();
+    p += oled_start_i2c(p, i2c_row, shadow.s, shadow.e);
 
-    /* Patch the data bytes onto the end of the address setup sequence. */
-    memcpy(p, &buffer[128], 128);
-    p += 128;
+    /* Patch the changed data bytes onto the end of the address setup. */
+    w = shadow.e - shadow.s;
+    memmove(p, &buffer[128 + shadow.s], w);
+    p += w;
 
     i2c_row++;
 
@@ -1081,7 +1300,7 @@ static void oled_init(void)
     p += oled_queue_cmds(p, cmds, sizeof(rot_cmds));
 
     /* Start off the I2C transaction. */
-    p += oled_start_i2c(p);
+    p += oled_start_i2c(p, 0, 0, 128);
 
     /* Send the initialisation command sequence by DMA. */
     i2c->cr2 |= I2C_CR2_DMAEN;
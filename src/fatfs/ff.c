@@ -1481,6 +1481,7 @@ static FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 			fs->free_clst++;
 			fs->fsi_flag |= 1;
 		}
+		fs->n_freed++;	/* FlashFloppy: see free_scan_idle() */
 #if FF_FS_EXFAT || FF_USE_TRIM
 		if (ecl + 1 == nxt) {	/* Is next cluster contiguous? */
 			ecl = nxt;
@@ -2210,6 +2211,8 @@ static FRESULT load_xdir (	/* FR_INT_ERR: invalid entry block */
 	if (res != FR_OK) return res;
 	if (dp->dir[XDIR_Type] != ET_STREAM) return FR_INT_ERR;	/* Invalid order */
 	mem_cpy(dirb + 1 * SZDIRE, dp->dir, SZDIRE);
+	dp->xsect = dp->sect;	/* FlashFloppy: see get_fileinfo() */
+	dp->xdir = dp->dir;
 	if (MAXDIRB(dirb[XDIR_NumName]) > sz_ent) return FR_INT_ERR;
 
 	/* Load file-name entries */
@@ -2681,9 +2684,112 @@ void flashfloppy_fill_fileinfo(FIL* fp)
 	if (move_window(fs, fp->dir_sect) != FR_OK)
 		F_die(FR_DISK_ERR);
 
+#if FF_FS_EXFAT
+	if (fs->fs_type == FS_EXFAT) {
+		/* A stream-extension entry (see get_fileinfo()). It has no
+		 * attributes: the caller's are kept. Nor is the containing
+		 * directory known, so the entry cannot be updated. */
+		fp->obj.sclust = ld_dword(dir + XDIR_FstClus - SZDIRE);
+		fp->obj.objsize = ld_qword(dir + XDIR_FileSize - SZDIRE);
+		fp->obj.stat = dir[XDIR_GenFlags - SZDIRE] & 2;
+		fp->obj.c_scl = 0;
+		return;
+	}
+#endif
+
 	fp->obj.attr = dir[DIR_Attr] & AM_MASK;
 	fp->obj.sclust = ld_clust(fs, dir);
 	fp->obj.objsize = ld_dword(dir + DIR_FileSize);
+#if FF_FS_EXFAT
+	fp->obj.stat = 0;
+	fp->obj.c_scl = fp->obj.c_size = fp->obj.c_ofs = 0;
+#endif
+}
+
+/* FlashFloppy: @cnt sectors at @buff were written directly to @sect, within
+ * the file's existing allocation. Keep the file's sector buffer coherent, and
+ * mark the file modified so that f_sync() flushes the volume. */
+void flashfloppy_wrote_sectors(FIL* fp, LBA_t sect, UINT cnt, const BYTE* buff)
+{
+#if !FF_FS_TINY
+	if (fp->sect - sect < cnt) {
+		mem_cpy(fp->buf, buff + (fp->sect - sect) * SS(fp->obj.fs), SS(fp->obj.fs));
+		fp->flag &= (BYTE)~FA_DIRTY;
+	}
+#endif
+	fp->flag |= FA_MODIFIED;
+}
+
+/* FlashFloppy: CRC-32 (IEEE), a nibble at a time to keep the table small. */
+static DWORD dir_crc32(const void* buf, UINT len, DWORD crc)
+{
+	static const DWORD tab[16] = {
+		0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+		0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+		0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+		0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+	};
+	const BYTE* p = buf;
+
+	while (len--) {
+		crc ^= *p++;
+		crc = (crc >> 4) ^ tab[crc & 15];
+		crc = (crc >> 4) ^ tab[crc & 15];
+	}
+	return crc;
+}
+
+/* FlashFloppy: Checksum the names, attributes and sizes held in the open
+ * directory's table, skipping the entry whose short name is @skip. The table
+ * is walked raw, which is much cheaper than listing it via f_readdir(). */
+DWORD flashfloppy_dir_crc(DIR* dp, const char *skip)
+{
+	FATFS* fs = dp->obj.fs;
+	LBA_t sect = 0;
+	DWORD crc = 0xffffffff;
+	BYTE* dir;
+	FRESULT res;
+
+	res = dir_sdi(dp, 0);
+	while (res == FR_OK) {
+		res = move_window(fs, dp->sect);
+		if (res != FR_OK) break;
+		dir = dp->dir;
+		if (dir[DIR_Name] == 0) break;	/* End of table */
+		if (dp->sect != sect) {	/* Entries are checksummed with their location */
+			sect = dp->sect;
+			crc = dir_crc32(&sect, sizeof(sect), crc);
+		}
+#if FF_FS_EXFAT
+		if (fs->fs_type == FS_EXFAT) {
+			/* Entry sets cannot cheaply be matched against @skip, so
+			 * allocations and sizes are excluded for all files, as well
+			 * as timestamps and the set checksum which covers them. The
+			 * index holds only names, attributes and locations. */
+			if (dir[XDIR_Type] == ET_FILEDIR) {
+				crc = dir_crc32(dir, XDIR_NumSec + 1, crc);
+				crc = dir_crc32(dir + XDIR_Attr, 2, crc);
+			} else if (dir[XDIR_Type] == ET_STREAM) {
+				crc = dir_crc32(dir, 1, crc);
+				crc = dir_crc32(dir + XDIR_NumName - SZDIRE, 3, crc);
+			} else {
+				crc = dir_crc32(dir, SZDIRE, crc);
+			}
+		} else
+#endif
+		if (dir[DIR_Attr] == AM_LFN) {
+			crc = dir_crc32(dir, SZDIRE, crc);
+		} else if (mem_cmp(dir, skip, 11)) {
+			/* Timestamps are excluded: they change on every write. */
+			crc = dir_crc32(dir, DIR_Attr + 1, crc);
+			crc = dir_crc32(dir + DIR_FileSize, 4, crc);
+		}
+		res = dir_next(dp, 0);
+	}
+	if (res != FR_OK && res != FR_NO_FILE)
+		F_die(res);
+
+	return crc;
 }
 #endif
 
@@ -2705,9 +2811,17 @@ static void get_fileinfo (
 	fno->fname[0] = 0;			/* Invaidate file info */
 	if (dp->sect == 0) return;	/* Exit if read pointer has reached end of directory */
 
-	/* FlashFloppy: We need to know the dirent for size/attr. */
+	/* FlashFloppy: We need to know the dirent for size/attr. On exFAT,
+	 * report the stream-extension entry, which holds the allocation. */
 	fno->dir_sect = fs->winsect;
 	fno->dir_ptr = dp->dir;
+#if FF_FS_EXFAT
+	if (fs->fs_type == FS_EXFAT) {
+		fno->dir_sect = dp->xsect;
+		fno->dir_ptr = dp->xdir;
+	}
+#endif
+	fno->dir_ofs = (dp->blk_ofs != 0xFFFFFFFF) ? dp->blk_ofs : dp->dptr;
 
 #if FF_USE_LFN		/* LFN configuration */
 #if FF_FS_EXFAT
@@ -3523,6 +3637,7 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 
 #if !FF_FS_READONLY
 		fs->last_clst = fs->free_clst = 0xFFFFFFFF;		/* Initialize cluster allocation information */
+		fs->n_freed = 0;
 #endif
 		fmt = FS_EXFAT;			/* FAT sub-type */
 	} else
@@ -3588,6 +3703,7 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 #if !FF_FS_READONLY
 		/* Get FSInfo if available */
 		fs->last_clst = fs->free_clst = 0xFFFFFFFF;		/* Initialize cluster allocation information */
+		fs->n_freed = 0;
 		fs->fsi_flag = 0x80;
 #if (FF_FS_NOFSINFO & 3) != 3
 		if (fmt == FS_FAT32				/* Allow to update FSInfo only if BPB_FSInfo32 == 1 */
@@ -3865,6 +3981,11 @@ FRESULT f_open (
 			{
 				fp->obj.sclust = ld_clust(fs, dj.dir);					/* Get object allocation info */
 				fp->obj.objsize = ld_dword(dj.dir + DIR_FileSize);
+#if FF_FS_EXFAT
+				/* FlashFloppy: FIL objects are copied into slots whole. */
+				fp->obj.stat = 0;
+				fp->obj.c_scl = fp->obj.c_size = fp->obj.c_ofs = 0;
+#endif
 			}
 #if FF_USE_FASTSEEK
 			fp->cltbl = 0;			/* Disable fast seek mode */
@@ -4165,7 +4286,11 @@ FRESULT f_sync (
 			/* Update the directory entry */
 			tm = GET_FATTIME();				/* Modified time */
 #if FF_FS_EXFAT
-			if (fs->fs_type == FS_EXFAT) {
+			if (fs->fs_type == FS_EXFAT && fp->obj.c_scl == 0) {
+				/* FlashFloppy: as below, no parent dir info. */
+				res = sync_fs(fs);
+				fp->flag &= (BYTE)~FA_MODIFIED;
+			} else if (fs->fs_type == FS_EXFAT) {
 				res = fill_first_frag(&fp->obj);	/* Fill first fragment on the FAT if needed */
 				if (res == FR_OK) {
 					res = fill_last_frag(&fp->obj, fp->clust, 0xFFFFFFFF);	/* Fill last fragment on the FAT if needed */
@@ -4734,6 +4859,32 @@ FRESULT f_readdir (
 
 
 
+/* FlashFloppy: Read the item at offset @ofs of the open directory's table,
+ * as previously reported in FILINFO.dir_ofs. As with f_readdir(), the
+ * directory is left positioned at the following item. */
+void flashfloppy_readdir_at(DIR* dp, FILINFO* fno, DWORD ofs)
+{
+	FRESULT res;
+	DEF_NAMBUF
+
+	INIT_NAMBUF(dp->obj.fs);
+	res = dir_sdi(dp, ofs);
+	if (res == FR_OK) res = DIR_READ_FILE(dp);
+	if (res == FR_OK) {
+		get_fileinfo(dp, fno);
+		res = dir_next(dp, 0);
+		if (res == FR_NO_FILE) res = FR_OK;
+	} else if (res == FR_NO_FILE) {
+		fno->fname[0] = 0;
+		res = FR_OK;
+	}
+	FREE_NAMBUF();
+	if (res != FR_OK)
+		F_die(res);
+}
+
+
+
 #if FF_USE_FIND
 /*-----------------------------------------------------------------------*/
 /* Find Next File                                                        */
@@ -5571,19 +5722,39 @@ FRESULT f_expand (
 {
 	FRESULT res;
 	FATFS *fs;
-	DWORD n, clst, stcl, scl, ncl, tcl, lclst;
+	DWORD n, clst, stcl, scl, ncl, tcl, lclst, ecl;
 
 
 	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
 	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);
-	if (fsz == 0 || fp->obj.objsize != 0 || !(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);
+	if (fsz == 0 || !(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);
+	/* FlashFloppy: A non-empty file may be extended to @fsz (FAT/FAT32, opt=1
+	 * only). The new clusters are allocated as one contiguous block, ideally
+	 * directly after the file's last cluster, and appended to its chain. */
+	if (fp->obj.objsize != 0 && (!opt || fsz <= fp->obj.objsize)) LEAVE_FF(fs, FR_DENIED);
 #if FF_FS_EXFAT
 	if (fs->fs_type != FS_EXFAT && fsz >= 0x100000000) LEAVE_FF(fs, FR_DENIED);	/* Check if in size limit */
+	if (fs->fs_type == FS_EXFAT && fp->obj.objsize != 0) LEAVE_FF(fs, FR_DENIED);
 #endif
 	n = (DWORD)fs->csize * SS(fs);	/* Cluster size */
 	tcl = (DWORD)(fsz / n) + ((fsz & (n - 1)) ? 1 : 0);	/* Number of clusters required */
-	stcl = fs->last_clst; lclst = 0;
+	stcl = fs->last_clst; lclst = 0; ecl = 0;
 	if (stcl < 2 || stcl >= fs->n_fatent) stcl = 2;
+	if (fp->obj.objsize != 0) {	/* FlashFloppy: Find the last cluster, and search from there */
+		tcl -= (DWORD)(fp->obj.objsize / n) + ((fp->obj.objsize & (n - 1)) ? 1 : 0);
+		for (ecl = fp->obj.sclust; ; ecl = clst) {
+			clst = get_fat(&fp->obj, ecl);
+			if (clst == 0xFFFFFFFF) LEAVE_FF(fs, FR_DISK_ERR);
+			if (clst < 2) LEAVE_FF(fs, FR_INT_ERR);
+			if (clst >= fs->n_fatent) break;	/* End of chain */
+		}
+		stcl = ecl;
+	}
+	if (tcl == 0) {		/* FlashFloppy: Fits in the last cluster */
+		fp->obj.objsize = fsz;
+		fp->flag |= FA_MODIFIED;
+		LEAVE_FF(fs, FR_OK);
+	}
 
 #if FF_FS_EXFAT
 	if (fs->fs_type == FS_EXFAT) {
@@ -5621,6 +5792,7 @@ FRESULT f_expand (
 					if (res != FR_OK) break;
 					lclst = clst;
 				}
+				if (res == FR_OK && ecl != 0) res = put_fat(fs, ecl, scl);	/* FlashFloppy: Link it to the file */
 			} else {		/* Set it as suggested point for next allocation */
 				lclst = scl - 1;
 			}
@@ -5630,7 +5802,7 @@ FRESULT f_expand (
 	if (res == FR_OK) {
 		fs->last_clst = lclst;		/* Set suggested start cluster to start next */
 		if (opt) {	/* Is it allocated now? */
-			fp->obj.sclust = scl;		/* Update object allocation information */
+			if (ecl == 0) fp->obj.sclust = scl;	/* Update object allocation information */
 			fp->obj.objsize = fsz;
 			if (FF_FS_EXFAT) fp->obj.stat = 2;	/* Set status 'contiguous chain' */
 			fp->flag |= FA_MODIFIED;
@@ -153,6 +153,7 @@ typedef struct {
 #if !FF_FS_READONLY
 	DWORD	last_clst;		/* Last allocated cluster */
 	DWORD	free_clst;		/* Number of free clusters */
+	DWORD	n_freed;		/* FlashFloppy: Clusters freed since mount, counted or not */
 #endif
 #if FF_FS_RPATH
 	DWORD	cdir;			/* Current directory start cluster (0:root) */
@@ -235,6 +236,10 @@ typedef struct {
 #if FF_USE_LFN
 	DWORD	blk_ofs;		/* Offset of current entry block being processed (0xFFFFFFFF:Invalid) */
 #endif
+#if FF_FS_EXFAT
+	LBA_t	xsect;			/* FlashFloppy: Sector and win[] pointer of the stream-extension */
+	BYTE*	xdir;			/* entry of the last entry block loaded */
+#endif
 #if FF_USE_FIND
 	const TCHAR* pat;		/* Pointer to the name matching pattern */
 #endif
@@ -250,6 +255,7 @@ typedef struct {
 	WORD	ftime;			/* Modified time */
 	LBA_t	dir_sect;		/* Sector number containing the directory entry (not used at exFAT) */
 	BYTE*	dir_ptr;		/* Pointer to the directory entry in the win[] (not used at exFAT) */
+	DWORD	dir_ofs;		/* Offset of the item's first entry (LFN or SFN) in its directory table */
 	BYTE	fattrib;		/* File attribute */
 #if FF_USE_LFN
 	TCHAR	altname[FF_SFN_BUF + 1];/* Altenative file name */
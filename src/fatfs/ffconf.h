@@ -58,7 +58,11 @@
 /* This option switches fast seek function. (0:Disable or 1:Enable) */
 
 
+#if defined(BOOTLOADER)
 #define FF_USE_EXPAND	0
+#else
+#define FF_USE_EXPAND	1
+#endif
 /* This option switches f_expand function. (0:Disable or 1:Enable) */
 
 
@@ -249,7 +253,11 @@
 /  buffer in the filesystem object (FATFS) is used for the file data transfer. */
 
 
+#if defined(EXFAT) && !defined(BOOTLOADER)
+#define FF_FS_EXFAT		1
+#else
 #define FF_FS_EXFAT		0
+#endif
 /* This option switches support for exFAT filesystem. (0:Disable or 1:Enable)
 /  To enable exFAT, also LFN needs to be enabled. (FF_USE_LFN >= 1)
 /  Note that enabling exFAT discards ANSI C (C89) compatibility. */
@@ -15461,6 +15461,24 @@ WCHAR ff_oem2uni (	/* Returns Unicode character in UTF-16, zero on error */
 /* Unicode up-case conversion                                             */
 /*------------------------------------------------------------------------*/
 
+#if FF_CODE_PAGE == 437
+/* FlashFloppy: Names are only ever given to FatFS in CP437, so only case
+ * pairs touching the CP437 repertoire can affect a name comparison. This
+ * matches the full tables below for every comparison against a CP437
+ * character (Basic Latin, Latin-1, U+0192, and Greek). */
+DWORD ff_wtoupper (	/* Returns up-converted code point */
+	DWORD uni		/* Unicode code point to be up-converted */
+)
+{
+	if (uni < 0x80) return (uni >= 'a' && uni <= 'z') ? uni - 0x20 : uni;
+	if (uni >= 0xE0 && uni <= 0xFE && uni != 0xF7) return uni - 0x20;
+	if (uni == 0xFF) return 0x178;
+	if (uni == 0x192) return 0x191;
+	if (uni == 0x3C2) return 0x3A3;
+	if (uni >= 0x3B1 && uni <= 0x3CB) return uni - 0x20;
+	return uni;
+}
+#else
 DWORD ff_wtoupper (	/* Returns up-converted code point */
 	DWORD uni		/* Unicode code point to be up-converted */
 )
@@ -15588,6 +15606,7 @@ DWORD ff_wtoupper (	/* Returns up-converted code point */
 
 	return uni;
 }
+#endif
 
 
 #endif /* #if FF_USE_LFN */
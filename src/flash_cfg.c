@@ -35,6 +35,17 @@ union cfg_slot {
 #define slot_is_blank(_slot) ((_slot)->words[0] == 0xffff)
 #define slot_is_valid(_slot) (((_slot) != NULL) && !slot_is_blank(_slot))
 
+/* Delta journal: entries recording changed ff_cfg bytes are appended to the
+ * words following the valid config slot, until the page fills. Each entry
+ * is a header word (JENT_MAGIC | payload words), a payload of runs, and a
+ * CRC word. Each run is a word (byte offset << 8 | byte count) followed by
+ * the bytes, padded to a whole word. An entry is applied only if its CRC is
+ * good, so an interrupted write leaves a consistent older configuration. */
+#define JENT_MAGIC 0xc000
+#define JENT_MASK  0xf000
+#define JENT_GAP   4 /* Merge runs separated by fewer equal bytes */
+#define JOURNAL_END ((uint16_t *)(SLOT_BASE + SLOT_NR))
+
 static void erase_slot(union cfg_slot *slot)
 {
     uint16_t zero = 0;
@@ -43,6 +54,111 @@ static void erase_slot(union cfg_slot *slot)
     printk("Config: Erased Slot %u\n", slot - SLOT_BASE);
 }
 
+static bool_t slot_is_erased(const union cfg_slot *slot)
+{
+    unsigned int i;
+    for (i = 0; i < SLOTW_NR; i++)
+        if (slot->words[i] != 0xffff)
+            return FALSE;
+    return TRUE;
+}
+
+/* First wholly erased slot beyond @slot's journal, or end of page. */
+static union cfg_slot *journal_limit(union cfg_slot *slot)
+{
+    while ((++slot < SLOT_BASE + SLOT_NR) && !slot_is_erased(slot))
+        continue;
+    return slot;
+}
+
+/* End of the erased words from journal word @p onward. A later slot that is
+ * not wholly erased, such as the target of an interrupted compaction, bounds
+ * the space an entry may be appended into. */
+static uint16_t *journal_room(uint16_t *p)
+{
+    union cfg_slot *s = SLOT_BASE
+        + (p - (uint16_t *)SLOT_BASE + SLOTW_NR - 1) / SLOTW_NR;
+    while ((s < SLOT_BASE + SLOT_NR) && slot_is_erased(s))
+        s++;
+    return (uint16_t *)s;
+}
+
+/* Retire @slot and its journal. Slot-sized spans of the journal are marked
+ * dead first, so that cfg_slot_find() never mistakes one for a slot. */
+static void journal_retire(union cfg_slot *slot, union cfg_slot *limit)
+{
+    union cfg_slot *s;
+    uint16_t zero = 0;
+
+    fpec_init();
+    for (s = slot + 1; s < limit; s++)
+        if (s->words[SLOTW_DEAD] == 0xffff)
+            fpec_write(&zero, 2, (uint32_t)&s->words[SLOTW_DEAD]);
+    erase_slot(slot);
+}
+
+/* Apply @slot's journal to @img. Returns the first unused journal word, or
+ * NULL if an entry is corrupt (in which case later entries are ignored). */
+static uint16_t *journal_replay(union cfg_slot *slot, union cfg_slot *img)
+{
+    uint16_t *p = (uint16_t *)(slot + 1), *q, *end;
+    unsigned int ofs, len;
+
+    while ((p < JOURNAL_END) && (*p != 0xffff)) {
+        end = p + 1 + (*p & ~JENT_MASK);
+        if (((*p & JENT_MASK) != JENT_MAGIC) || (end >= JOURNAL_END)
+            || crc16_ccitt(p, (end + 1 - p) * 2, 0xffff))
+            return NULL;
+        for (q = p + 1; q < end; q += 1 + (len + 1) / 2) {
+            ofs = *q >> 8;
+            len = *q & 0xff;
+            if ((q + 1 + (len + 1) / 2) > end)
+                return NULL;
+            /* Runs beyond this build's config are written by a newer
+             * build: keep only what fits. */
+            if (ofs < sizeof(*img) - 4)
+                memcpy((uint8_t *)img + ofs, q + 1,
+                       min_t(unsigned int, len, sizeof(*img) - 4 - ofs));
+        }
+        p = end + 1;
+    }
+
+    return p;
+}
+
+/* Build a journal entry at @ent for the bytes of ff_cfg that differ from
+ * @img. Returns its length in words. */
+static unsigned int journal_entry(const union cfg_slot *img, uint16_t *ent)
+{
+    const uint8_t *old = (const uint8_t *)&img->ff_cfg;
+    const uint8_t *new = (const uint8_t *)&ff_cfg;
+    unsigned int i, j, k, len;
+    uint16_t *q = ent + 1, crc;
+
+    for (i = 0; i < sizeof(ff_cfg); i = j) {
+        if (old[i] == new[i]) {
+            j = i + 1;
+            continue;
+        }
+        /* Extend the run over any short stretches of equal bytes. */
+        for (j = k = i + 1; (j < sizeof(ff_cfg)) && (j < k + JENT_GAP); j++)
+            if (old[j] != new[j])
+                k = j + 1;
+        j = k;
+        len = j - i;
+        *q = (i << 8) | len;
+        q[(len + 1) / 2] = 0xffff; /* padding */
+        memcpy(q + 1, &new[i], len);
+        q += 1 + (len + 1) / 2;
+    }
+
+    ent[0] = JENT_MAGIC | (q - ent - 1);
+    crc = htobe16(crc16_ccitt(ent, (q - ent) * 2, 0xffff));
+    *q++ = crc;
+
+    return q - ent;
+}
+
 /* Find first blank or valid config slot in Flash memory.
  * Returns NULL if none. */
 static union cfg_slot *cfg_slot_find(void)
@@ -68,22 +184,39 @@ static union cfg_slot *cfg_slot_find(void)
 
 void flash_ff_cfg_update(void *scratch)
 {
-    union cfg_slot *new_slot = scratch, *slot = cfg_slot_find();
-    uint16_t crc;
+    union cfg_slot *new_slot = scratch, *slot = cfg_slot_find(), *old = NULL;
+    uint16_t *p, *ent = (uint16_t *)(new_slot + 1), crc;
+    unsigned int nr;
 
-    /* Nothing to do if Flashed configuration is valid and up to date. */
-    if (slot_is_valid(slot) && !memcmp(&slot->ff_cfg, &ff_cfg, sizeof(ff_cfg)))
-        return;
+    if (slot_is_valid(slot)) {
+        *new_slot = *slot;
+        p = journal_replay(slot, new_slot);
+        /* Nothing to do if Flashed configuration is valid and up to date. */
+        if (!memcmp(&new_slot->ff_cfg, &ff_cfg, sizeof(ff_cfg)))
+            return;
+        /* Append the changes to the journal, if it is sound and has room.
+         * The CRC word is written last, to commit the entry. */
+        nr = journal_entry(new_slot, ent);
+        if ((p != NULL) && (p + nr <= journal_room(p))) {
+            fpec_init();
+            fpec_write(ent, (nr-1)*2, (uint32_t)p);
+            fpec_write(&ent[nr-1], 2, (uint32_t)&p[nr-1]);
+            printk("Config: Journalled %u words after Flash Slot %u\n",
+                   nr, slot - SLOT_BASE);
+            return;
+        }
+    }
 
     fpec_init();
 
     if ((slot != NULL) && slot_is_blank(slot)) {
         /* Slot is blank: no erase needed. */
     } else if ((slot != NULL)
-               && ((slot - SLOT_BASE) < (SLOT_NR - 1))) {
-        /* There's at least one blank slot available. Erase current slot. */
-        erase_slot(slot);
-        slot++;
+               && (journal_limit(slot) < (SLOT_BASE + SLOT_NR))) {
+        /* There's a blank slot beyond the journal. Compact into it, and
+         * retire the current slot once the new one is written. */
+        old = slot;
+        slot = journal_limit(slot);
     } else {
         /* No blank slots available. Erase whole page. */
         fpec_page_erase((uint32_t)SLOT_BASE);
@@ -102,18 +235,21 @@ void flash_ff_cfg_update(void *scratch)
     /* Write SLOTW_CRC. */
     fpec_write(&crc, 2, (uint32_t)&slot->words[SLOTW_CRC]);
     printk("Config: Written to Flash Slot %u\n", slot - SLOT_BASE);
+
+    if (old != NULL)
+        journal_retire(old, slot);
 }
 
 void flash_ff_cfg_erase(void)
 {
     union cfg_slot *slot = cfg_slot_find();
     if (slot_is_valid(slot))
-        erase_slot(slot);
+        journal_retire(slot, journal_limit(slot));
 }
 
 void flash_ff_cfg_read(void)
 {
-    union cfg_slot *slot = cfg_slot_find();
+    union cfg_slot img, *slot = cfg_slot_find();
     bool_t found = slot_is_valid(slot);
 
     BUILD_BUG_ON(sizeof(*slot) != sizeof(slot->words));
@@ -121,12 +257,16 @@ void flash_ff_cfg_read(void)
     ff_cfg = dfl_ff_cfg;
     printk("Config: ");
     if (found) {
-        unsigned int sz = min_t(unsigned int, slot->ff_cfg.size, ff_cfg.size);
+        unsigned int sz;
+        /* Flashed configuration is the slot plus its journal. */
+        img = *slot;
+        (void)journal_replay(slot, &img);
+        sz = min_t(unsigned int, img.ff_cfg.size, ff_cfg.size);
         printk("Flash Slot %u (ver %u, size %u)\n",
-               slot - SLOT_BASE, slot->ff_cfg.version, sz);
+               slot - SLOT_BASE, img.ff_cfg.version, sz);
         /* Copy over all options that are present in Flash. */
         if (sz > offsetof(struct ff_cfg, interface))
-            memcpy(&ff_cfg.interface, &slot->ff_cfg.interface,
+            memcpy(&ff_cfg.interface, &img.ff_cfg.interface,
                    sz - offsetof(struct ff_cfg, interface));
     } else {
         printk("Factory Defaults\n");
@@ -30,7 +30,14 @@ static void index_custom_assert(void *);   /* index.custom_timer */
 
 static time_t sync_time, sync_pos;
 
+/* One-shot timer which starts the read stream at sync_time. */
+static struct timer sync_timer;
+static bool_t sync_armed;
+static void sync_timer_fn(void *);
+
 static time_t prefetch_start_time;
+static bool_t prefetch_timed; /* Track load already recorded in perf? */
+static time_t seek_start_time; /* Step pulse, if any, that led to the load */
 static uint32_t max_prefetch_us;
 
 struct drive;
@@ -180,6 +187,8 @@ void floppy_cancel(void)
     timer_cancel(&drv->chgrst_timer);
     timer_cancel(&index.timer);
     timer_cancel(&index.custom_timer);
+    timer_cancel(&sync_timer);
+    sync_armed = FALSE;
     barrier(); /* cancel index.timer /then/ clear dma rings */
     dma_rd = dma_wr = NULL;
     barrier(); /* /then/ clear soft state */
@@ -198,12 +207,20 @@ void floppy_cancel(void)
 
     /* Clean up I/O. This must avoid potential cancel_call()s while still
      * getting volume communication into a consistent state. */
+    floppy_stall_report();
+    perf_snapshot();
+    F_async_stats();
+    ring_io_stats();
+    /* An in-flight raw volume read is abandoned; anything else runs on. */
     F_async_cancel_all();
     /* cancel_call() circumvents the threading subsystem and may leave it in an
-     * incoherent state. Volume operations never cancel so it is safe to
-     * thread_yield() if a volume operation is in progress. */
+     * incoherent state. Volume operations never cancel (an abandoned read
+     * fails cleanly) so it is safe to thread_yield() if a volume operation is
+     * in progress. */
     while (volume_interrupt())
         thread_yield();
+    /* Write back any cached image data before the image is closed. */
+    volume_cache_flush();
     thread_reset();
 }
 
@@ -311,6 +328,7 @@ void floppy_init(void)
     drive_change_output(drv, outp_trk0,   TRUE);
 
     floppy_init_irqs();
+    timer_dma_setup();
 
     IRQx_set_prio(FLOPPY_SOFTIRQ, FLOPPY_SOFTIRQ_PRI);
     IRQx_enable(FLOPPY_SOFTIRQ);
@@ -318,14 +336,27 @@ void floppy_init(void)
     timer_init(&index.timer, index_assert, NULL);
     timer_init(&index.timer_deassert, index_deassert, NULL);
     timer_init(&index.custom_timer, index_custom_assert, NULL);
+    timer_init(&sync_timer, sync_timer_fn, NULL);
 
     motor_chgrst_eject(drv);
 }
 
 static void io_thread_main(void *arg) {
     while (1) {
+        bool_t busy = FALSE;
         F_async_drain();
-        thread_yield();
+        logfile_poll();
+        if (image != NULL) {
+            busy = image_prefetch(image);
+            /* Write back cached writes once idle, or promptly at motor off. */
+            busy |= volume_cache_flush_idle(
+                drive.motor.on ? time_ms(ff_cfg.write_back_ms) : 0);
+        }
+        /* Sleep until new work arrives, unless there is more to do now. */
+        if (busy)
+            thread_yield();
+        else
+            F_async_sleep();
     }
 }
 
@@ -359,16 +390,24 @@ void floppy_insert(unsigned int unit, struct slot *slot)
 
 static void floppy_sync_flux(void)
 {
-    const uint16_t buf_mask = ARRAY_SIZE(dma_rd->buf) - 1;
+    const uint16_t buf_mask = dma_rd->len - 1;
     struct drive *drv = &drive;
     uint32_t prefetch_us;
     uint16_t nr_to_wrap, nr_to_cons, nr;
     int32_t ticks;
+    bool_t started;
 
-    /* No DMA should occur until the timer is enabled. */
-    ASSERT(dma_rd->cons == (ARRAY_SIZE(dma_rd->buf) - dma_rdata.cndtr));
+    /* Once armed, sync_timer_fn() may start the stream at any moment: sample
+     * its state with IRQs masked. No DMA should occur until then. Once armed
+     * or started, the DMA IRQ handler is the ring's only producer. */
+    IRQ_global_disable();
+    started = sync_armed || (dma_rd->state != DMA_starting);
+    ASSERT(started || (dma_rd->cons == (dma_rd->len - dma_rdata.cndtr)));
+    IRQ_global_enable();
+    if (started)
+        return;
 
-    nr_to_wrap = ARRAY_SIZE(dma_rd->buf) - dma_rd->prod;
+    nr_to_wrap = dma_rd->len - dma_rd->prod;
     nr_to_cons = (dma_rd->cons - dma_rd->prod - 1) & buf_mask;
     nr = min(nr_to_wrap, nr_to_cons);
     if (nr) {
@@ -378,7 +417,7 @@ static void floppy_sync_flux(void)
     }
 
     nr = (dma_rd->prod - dma_rd->cons) & buf_mask;
-    if (nr < buf_mask)
+    if (nr < min_t(uint16_t, buf_mask, DMA_START_SAMPLES))
         return;
 
     /* Log maximum prefetch times. */
@@ -386,6 +425,12 @@ static void floppy_sync_flux(void)
     if (prefetch_us > max_prefetch_us) {
         max_prefetch_us = prefetch_us;
         printk("[%uus]\n", max_prefetch_us);
+        stall_record(STALL_prefetch);
+    }
+    if (!prefetch_timed) {
+        prefetch_timed = TRUE;
+        perf_record_load(prefetch_us);
+        perf.seek_us = time_diff(seek_start_time, time_now()) / TIME_MHZ;
     }
 
     if (!drv->index_suppressed) {
@@ -393,19 +438,25 @@ static void floppy_sync_flux(void)
         if (ticks > time_ms(5)) {
             /* A while to wait. Go do other work. */
             return;
-        } else {
-            if (ticks > 0)
-                delay_ticks(ticks);
-            /* If we're out of sync then start over. */
-            ticks = time_diff(time_now(), sync_time);
-            if (ticks < -100) {
-                printk("Trk %u: late %uus\n",
-                       drv->image->cur_track, -ticks/time_us(1));
-
-                dma_rd->state = DMA_inactive;
-                dma_rd->prod = dma_rd->cons;
-                return;
-            }
+        }
+        if (ticks > 0) {
+            /* Start the stream from timer context, on time, and carry on
+             * with other work meanwhile. */
+            trace(flux_start, drv->image->cur_track, prefetch_us, 0);
+            sync_armed = TRUE;
+            timer_set(&sync_timer, sync_time - time_us(1));
+            return;
+        }
+        /* If we're out of sync then start over. */
+        ticks = time_diff(time_now(), sync_time);
+        if (ticks < -100) {
+            printk("Trk %u: late %uus\n",
+                   drv->image->cur_track, -ticks/time_us(1));
+            trace(late, drv->image->cur_track, -ticks/time_us(1), 1);
+
+            dma_rd->state = DMA_inactive;
+            dma_rd->prod = dma_rd->cons;
+            return;
         }
     } else if (drv->step.state) {
         /* IDX is suppressed: Wait for heads to settle.
@@ -434,7 +485,7 @@ static void floppy_sync_flux(void)
             < (sync_pos*(SYSCLK_MHZ/STK_MHZ))) {
 
             /* Sum all flux timings in the DMA buffer. */
-            const uint16_t buf_mask = ARRAY_SIZE(dma_rd->buf) - 1;
+            const uint16_t buf_mask = dma_rd->len - 1;
             uint32_t i, ticks = 0;
             for (i = dma_rd->cons; i != dma_rd->prod; i = (i+1) & buf_mask)
                 ticks += dma_rd->buf[i] + 1;
@@ -453,6 +504,7 @@ static void floppy_sync_flux(void)
             for (i = 0; i < index.custom_pulses_len; i++)
                 if (sync_pos < index.custom_pulses[i])
                     break;
+            index.custom_next = i;
             if (i < index.custom_pulses_len)
                 timer_set(&index.custom_timer,
                           time_now() - sync_pos + index.custom_pulses[i]);
@@ -464,6 +516,34 @@ static void floppy_sync_flux(void)
         drv->index_suppressed = FALSE;
     }
 
+    trace(flux_start, drv->image->cur_track, prefetch_us, 0);
+    rdata_start();
+}
+
+static void sync_timer_fn(void *unused)
+{
+    int32_t ticks;
+
+    sync_armed = FALSE;
+
+    /* Stopped since the timer was armed? We raced rdata_stop(). */
+    if (dma_rd->state != DMA_starting)
+        return;
+
+    /* Timers may fire a little early. */
+    ticks = time_diff(time_now(), sync_time);
+    if (ticks > 0)
+        delay_ticks(ticks);
+
+    /* If we're out of sync then start over: dma_rd_handle() cleans up. */
+    if (ticks < -100) {
+        printk("Trk %u: late %uus\n",
+               drive.image->cur_track, -ticks/time_us(1));
+        trace(late, drive.image->cur_track, -ticks/time_us(1), 1);
+        dma_rd->state = DMA_stopping;
+        return;
+    }
+
     rdata_start();
 }
 
@@ -476,6 +556,7 @@ static bool_t dma_rd_handle(struct drive *drv)
         time_t index_time, read_start_pos;
         unsigned int track;
         time_t start_time = time_now();
+        bool_t stepped = !!(drv->step.state & STEP_settling);
         /* Allow 10ms from current rotational position to load new track */
         int32_t delay = time_ms(10);
         /* Allow extra time if heads are settling. */
@@ -484,6 +565,13 @@ static bool_t dma_rd_handle(struct drive *drv)
                 + time_ms(ff_cfg.head_settle_ms);
             int32_t delta = time_diff(time_now(), step_settle);
             delay = max_t(int32_t, delta, delay);
+            /* Steps arriving faster than the heads settle are a multi-cylinder
+             * seek. Give the host time to step again before loading a track,
+             * so that the seek loads only the cylinder it stops at. */
+            if ((drv->step.interval < time_ms(ff_cfg.head_settle_ms))
+                && (time_since(drv->step.start)
+                    < drv->step.interval + drv->step.interval/2))
+                break;
         }
         /* No data fetch while stepping. */
         barrier(); /* check STEP_settling /then/ check STEP_active */
@@ -503,8 +591,12 @@ static bool_t dma_rd_handle(struct drive *drv)
             return TRUE;
         }
         read_start_pos *= SYSCLK_MHZ/STK_MHZ;
+        trace(setup_track, track, FALSE, 0);
         image_setup_track(im, track, &read_start_pos);
+        trace(setup_done, track, 0, 0);
         prefetch_start_time = time_now();
+        prefetch_timed = FALSE;
+        seek_start_time = stepped ? drv->step.start : start_time;
         read_start_pos /= SYSCLK_MHZ/STK_MHZ;
         sync_pos = read_start_pos;
         if (!drv->index_suppressed) {
@@ -518,6 +610,7 @@ static bool_t dma_rd_handle(struct drive *drv)
                 /* image_setup_track() consumed the entire delay. Try again. */
                 time_t ticks = time_since(start_time) - delay;
                 printk("Trk %u: trk late %uus\n", track, ticks/time_us(1));
+                trace(late, track, ticks/time_us(1), 0);
                 break;
             }
         }
@@ -540,10 +633,12 @@ static bool_t dma_rd_handle(struct drive *drv)
         break;
 
     case DMA_stopping:
+        timer_cancel(&sync_timer);
+        sync_armed = FALSE;
         dma_rd->state = DMA_inactive;
         /* Reinitialise the circular buffer to empty. */
         dma_rd->cons = dma_rd->prod =
-            ARRAY_SIZE(dma_rd->buf) - dma_rdata.cndtr;
+            dma_rd->len - dma_rdata.cndtr;
         /* Free-running index timer. */
         timer_cancel(&index.timer);
         timer_set(&index.timer, index.prev_time + drv->image->stk_per_rev);
@@ -573,6 +668,20 @@ void floppy_get_track(struct track_info *ti)
     ti->in_da_mode = active ? in_da_mode(drive.image, ti->cyl) : FALSE;
 }
 
+bool_t floppy_idle(void)
+{
+    struct drive *drv = &drive;
+
+    /* Streaming and prefetch are paced by the DMA, USB and timer IRQs, but
+     * head settling and track loads are polled. Stay awake while the host
+     * may be using the drive. */
+    return (dma_rd != NULL)
+        && (dma_rd->state == DMA_active) && !read_progress
+        && (dma_wr->state == DMA_inactive)
+        && (drv->step.state == 0)
+        && (!drv->sel || !drv->motor.on);
+}
+
 static bool_t index_is_suppressed(struct drive *drv)
 {
     /* Rotation is stalled? */
@@ -595,6 +704,8 @@ static void index_assert(void *dat)
 {
     struct drive *drv = &drive;
     index.prev_time = index.timer.deadline;
+    index.custom_next = 0;
+    trace(index, 0, 0, 0);
     if (index.custom_pulses_len)
         timer_set(&index.custom_timer, index.prev_time + index.custom_pulses[0]);
     else
@@ -622,10 +733,12 @@ static void index_custom_assert(void *dat)
         timer_set(&index.timer_deassert,
                   index.custom_timer.deadline + time_ms(2));
     }
+    /* Step on through the schedule, skipping any pulses we have overrun. */
     current_pulse_pos = time_since(index.prev_time);
-    for (i = 0; i < index.custom_pulses_len; i++)
+    for (i = index.custom_next + 1; i < index.custom_pulses_len; i++)
         if (current_pulse_pos < index.custom_pulses[i])
             break;
+    index.custom_next = i;
     if (i < index.custom_pulses_len)
         timer_set(&index.custom_timer, index.prev_time + index.custom_pulses[i]);
 }
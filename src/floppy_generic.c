@@ -35,10 +35,15 @@ struct dma_ring {
         uint16_t prod; /* dma_rd: our producer index for flux samples */
         uint16_t prev_sample; /* dma_wr: previous CCRx sample value */
     };
-    /* DMA ring buffer of timer values (ARR or CCRx). */
-    uint16_t buf[1024];
+    /* DMA ring buffer of timer values (ARR or CCRx). Sized at mount time. */
+    uint16_t len; /* power of two */
+    uint16_t buf[0];
 };
 
+/* Flux samples buffered before RDATA DMA starts. Larger rings fill the rest
+ * from IRQ_rdata_dma, so track-change latency is independent of ring size. */
+#define DMA_START_SAMPLES 1023
+
 /* DMA buffers are permanently allocated while a disk image is loaded, allowing 
  * independent and concurrent management of the RDATA/WDATA pins. */
 static struct dma_ring *dma_rd; /* RDATA DMA buffer */
@@ -67,6 +72,7 @@ static struct drive {
         uint8_t state;
         bool_t inward;
         time_t start;
+        int32_t interval; /* time between the last two steps */
         struct timer timer;
     } step;
     uint32_t restart_pos;
@@ -83,11 +89,46 @@ static struct {
     bool_t fake_fired;
     uint8_t custom_pulses_ver;
     uint8_t custom_pulses_len;
+    /* Next entry of custom_pulses[] for custom_timer to assert. */
+    uint8_t custom_next;
     /* Durations relative to track start. Must be in increasing order. */
     time_t custom_pulses[MAX_CUSTOM_PULSES];
 } index;
 
+/* Flux-stream stall telemetry, reset at mount. Each event is attributed to
+ * the mass-storage I/O in flight when it was detected: the fs_async classes
+ * with pending work, and the volume backend mid-request. */
+enum { STALL_underrun, STALL_overrun, STALL_kick, STALL_prefetch, STALL_NR };
+#define STALL_TRACKS 8 /* Per-track counts are kept for this many tracks */
+static struct {
+    uint16_t nr[STALL_NR];
+    uint16_t cause[STALL_NR][4][3]; /* [F_async_pending()][volume_busy()] */
+    struct {
+        uint16_t track, total;
+        uint16_t nr[STALL_NR];
+    } trk[STALL_TRACKS];
+    uint8_t nr_trk;
+    bool_t overrun; /* WDATA bitcell buffer currently overrun? */
+} stall;
+
+/* Per-image performance figures for FFPERF.TXT, reset at mount. Track-load
+ * latencies (setup to flux ready) are bucketed by powers of two: <1ms, <2ms,
+ * ... <64ms, >=64ms. The rest is snapshotted when the image is cancelled. */
+#define PERF_LOAD_BUCKETS 8
+static struct {
+    uint32_t mount_us, load_max_us;
+    uint32_t seek_us; /* Last step (or track load) to flux ready */
+    uint16_t nr_frags;
+    uint16_t load_hist[PERF_LOAD_BUCKETS];
+    uint16_t nr_stall[STALL_NR];
+    uint32_t cache_hits, cache_misses; /* Baseline at mount, then delta */
+    uint32_t wr_lat_us;
+    uint16_t nr_eager, nr_deferred;
+} perf;
+
 static unsigned int drive_calc_track(struct drive *drv);
+static void perf_record_load(uint32_t us);
+static void perf_snapshot(void);
 static void rdata_stop(void);
 static void wdata_start(void);
 static void wdata_stop(void);
@@ -131,60 +172,313 @@ static void floppy_init_irqs(void)
     }
 }
 
-/* Allocate and initialise a DMA ring. */
-static struct dma_ring *dma_ring_alloc(void)
+static void stall_record(unsigned int type)
+{
+    uint16_t track = image->cur_track;
+    unsigned int i, min;
+    uint32_t oldpri;
+
+    /* Events are recorded from both DMA IRQs and from thread context. */
+    oldpri = IRQ_save(WDATA_IRQ_PRI);
+
+    trace(stall, type, track, 0);
+    stall.nr[type]++;
+    stall.cause[type][F_async_pending()][volume_busy()]++;
+
+    for (i = 0; i < stall.nr_trk; i++)
+        if (stall.trk[i].track == track)
+            goto found;
+    if (stall.nr_trk < STALL_TRACKS) {
+        i = stall.nr_trk++;
+    } else {
+        /* Table is full: evict the quietest track. */
+        for (i = min = 0; i < STALL_TRACKS; i++)
+            if (stall.trk[i].total < stall.trk[min].total)
+                min = i;
+        i = min;
+    }
+    memset(&stall.trk[i], 0, sizeof(stall.trk[i]));
+    stall.trk[i].track = track;
+found:
+    stall.trk[i].total++;
+    stall.trk[i].nr[type]++;
+
+    IRQ_restore(oldpri);
+}
+
+void floppy_stall_report(void)
+{
+    static const char * const name[STALL_NR] = {
+        "underrun", "overrun", "kick", "prefetch" };
+    static const char * const fs_name[4] = { "-", "rd", "wb", "rd+wb" };
+    static const char * const vol_name[3] = { "-", "usb", "sd" };
+    unsigned int i, j, k;
+
+    for (i = 0; i < STALL_NR; i++) {
+        if (stall.nr[i] == 0)
+            continue;
+        printk("Stall %s: %u\n", name[i], stall.nr[i]);
+        for (j = 0; j < 4; j++)
+            for (k = 0; k < 3; k++)
+                if (stall.cause[i][j][k])
+                    printk(" fs:%s vol:%s: %u\n", fs_name[j], vol_name[k],
+                           stall.cause[i][j][k]);
+    }
+
+    for (i = 0; i < stall.nr_trk; i++)
+        printk(" T%u.%u: U%u O%u K%u P%u\n",
+               stall.trk[i].track >> 1, stall.trk[i].track & 1,
+               stall.trk[i].nr[STALL_underrun],
+               stall.trk[i].nr[STALL_overrun],
+               stall.trk[i].nr[STALL_kick],
+               stall.trk[i].nr[STALL_prefetch]);
+}
+
+void floppy_stall_summary(char *msg, size_t size)
+{
+    snprintf(msg, size, "U%u O%u K%u P%u",
+             stall.nr[STALL_underrun], stall.nr[STALL_overrun],
+             stall.nr[STALL_kick], stall.nr[STALL_prefetch]);
+}
+
+static void perf_record_load(uint32_t us)
+{
+    unsigned int b = 0, ms = us / 1000;
+
+    while (ms && (b < PERF_LOAD_BUCKETS-1)) {
+        ms >>= 1;
+        b++;
+    }
+    perf.load_hist[b]++;
+    perf.load_max_us = max_t(uint32_t, perf.load_max_us, us);
+}
+
+static void perf_snapshot(void)
 {
-    struct dma_ring *dma = arena_alloc(sizeof(*dma));
+    uint32_t hits, misses;
+
+    memcpy(perf.nr_stall, stall.nr, sizeof(perf.nr_stall));
+    volume_cache_counts(&hits, &misses);
+    perf.cache_hits = hits - perf.cache_hits;
+    perf.cache_misses = misses - perf.cache_misses;
+    ring_io_write_stats(&perf.wr_lat_us, &perf.nr_eager, &perf.nr_deferred);
+}
+
+void floppy_perf_overlay(char *msg, size_t size)
+{
+    snprintf(msg, size, "S%u K%u U%u Q%u",
+             min_t(uint32_t, floppy_slack_us() / 1000, 999),
+             min_t(uint32_t, perf.seek_us / 1000, 999),
+             stall.nr[STALL_underrun], F_async_depth());
+}
+
+/* Smallest bucket holding at least @pct percent of @nr track loads, or "-"
+ * if there were none. */
+static const char *perf_load_pct(unsigned int pct, unsigned int nr)
+{
+    static const char * const bound[PERF_LOAD_BUCKETS] = {
+        "<1", "<2", "<4", "<8", "<16", "<32", "<64", ">=64" };
+    unsigned int b, sum = 0;
+
+    if (nr == 0)
+        return "-";
+
+    for (b = 0; b < PERF_LOAD_BUCKETS-1; b++) {
+        sum += perf.load_hist[b];
+        if (sum * 100 >= pct * nr)
+            break;
+    }
+    return bound[b];
+}
+
+/* The report is best effort: a full or write-protected volume just loses
+ * it, rather than stopping the firmware as the F_ wrappers would. */
+static void perf_write(FIL *fp, const char *format, ...)
+{
+    char msg[80];
+    va_list ap;
+    UINT bw;
+    int n;
+
+    va_start(ap, format);
+    n = vsnprintf(msg, sizeof(msg), format, ap);
+    va_end(ap);
+    (void)f_write(fp, msg, min_t(int, n, sizeof(msg)-1), &bw);
+}
+
+void floppy_perf_report(FIL *fp, const char *name)
+{
+    unsigned int i, nr = 0;
+    uint32_t hits = perf.cache_hits, total = hits + perf.cache_misses;
+
+    if (!ff_cfg.perf_report)
+        return;
+
+    for (i = 0; i < PERF_LOAD_BUCKETS; i++)
+        nr += perf.load_hist[i];
+    /* Keep the percentage calculation within 32 bits. */
+    while (total > 0x1000000) {
+        hits >>= 1;
+        total >>= 1;
+    }
+
+    if (volume_readonly()
+        || (f_open(fp, "FFPERF.TXT", FA_OPEN_APPEND|FA_WRITE) != FR_OK))
+        return;
+    perf_write(fp, "%s\r\n", name);
+    perf_write(fp, " mount: %ums, %u fragments\r\n",
+               perf.mount_us / 1000, perf.nr_frags);
+    perf_write(fp, " track loads: %u, p50 %sms p90 %sms p99 %sms"
+               " max %uus\r\n", nr, perf_load_pct(50, nr),
+               perf_load_pct(90, nr), perf_load_pct(99, nr),
+               perf.load_max_us);
+    perf_write(fp, " stalls: underrun %u overrun %u kick %u prefetch %u\r\n",
+               perf.nr_stall[STALL_underrun], perf.nr_stall[STALL_overrun],
+               perf.nr_stall[STALL_kick], perf.nr_stall[STALL_prefetch]);
+    perf_write(fp, " cache: %u hits, %u misses (%u%%)\r\n",
+               perf.cache_hits, perf.cache_misses,
+               total ? hits * 100 / total : 0);
+    perf_write(fp, " writes: %uus/batch, drained %u eager %u deferred\r\n",
+               perf.wr_lat_us, perf.nr_eager, perf.nr_deferred);
+    (void)f_close(fp);
+}
+
+/* Allocate and initialise a DMA ring of @len samples. */
+static struct dma_ring *dma_ring_alloc(uint16_t len)
+{
+    struct dma_ring *dma = arena_alloc(sizeof(*dma) + len * sizeof(*dma->buf));
     memset(dma, 0, offsetof(struct dma_ring, buf));
+    dma->len = len;
     return dma;
 }
 
+/* Arena that floppy_mount() needs after the fast-seek table and extent map,
+ * at most: deep flux rings, the largest write bitcell buffer, and the
+ * minimum data buffer. */
+static uint32_t mount_reserve(void)
+{
+    bool_t deep = (ram_kb >= 64);
+    uint32_t ring = sizeof(struct dma_ring)
+        + (deep ? 2048 : 1024) * sizeof(uint16_t);
+    return 2*ring + (deep ? 32 : 8)*1024 + 10*1024;
+}
+
+/* Allocate the image, and build its fast-seek cluster table and extent map.
+ * Returns the cluster table, or NULL if there is none. */
+static DWORD *image_alloc(struct slot *slot, struct image **p_im,
+                          FSIZE_t *p_size)
+{
+#define MAX_FILE_FRAGS 511 /* 4kB cluster table, unless there is room */
+    struct image *im;
+    DWORD *cltbl, tlen, frags, need;
+    FRESULT fr;
+
+    *p_im = im = arena_alloc(sizeof(*im));
+    memset(im, 0, sizeof(*im));
+
+    /* Create a fast-seek cluster table for the image. It is built in place
+     * at the top of the arena, and claimed once its length is known. */
+    tlen = (MAX_FILE_FRAGS + 1) * 2;
+    cltbl = arena_alloc(0);
+    *cltbl = tlen;
+    fatfs_from_slot(&im->fp, slot, FA_READ);
+    *p_size = f_size(&im->fp);
+    if (*p_size == 0) {
+        /* Empty or dummy file. */
+        return NULL;
+    }
+
+    im->fp.cltbl = cltbl;
+    if (FF_FS_EXFAT && (im->fp.obj.fs->fs_type == FS_EXFAT)
+        && (im->fp.obj.stat == 2)) {
+        /* exFAT contiguous file: there is no FAT chain to walk. The table is
+         * a single fragment, the whole file. */
+        FATFS *fatfs = im->fp.obj.fs;
+        cltbl[0] = 4;
+        cltbl[1] = ((uint32_t)((*p_size + 511) / 512) + fatfs->csize - 1)
+            / fatfs->csize;
+        cltbl[2] = im->fp.obj.sclust;
+        cltbl[3] = 0;
+        fr = FR_OK;
+    } else {
+        fr = f_lseek(&im->fp, CREATE_LINKMAP);
+        if (fr == FR_NOT_ENOUGH_CORE) {
+            /* FatFS left the required length in cltbl[0]. Map the whole
+             * file if the table and extent map for that still leave room
+             * for the rest of the mount. */
+            need = cltbl[0];
+            if ((need * 4 + image_extents_size(cltbl) + mount_reserve())
+                <= arena_avail()) {
+                cltbl[0] = tlen = need;
+                fr = f_lseek(&im->fp, CREATE_LINKMAP);
+            }
+        }
+    }
+    if (fr == FR_OK) {
+        DWORD *_cltbl = arena_alloc(*cltbl * 4);
+        ASSERT(_cltbl == cltbl);
+        printk("Fast Seek: %u frags\n", (*cltbl / 2) - 1);
+        /* Extent map lets track reads bypass FatFS entirely. */
+        im->extents = arena_alloc(image_extents_size(cltbl));
+        image_extents_init(im->extents, &im->fp);
+    } else if (fr == FR_NOT_ENOUGH_CORE) {
+        /* Too fragmented to map whole. FatFS filled the table with the
+         * leading fragments: map those, and let FatFS walk the FAT chain for
+         * the remainder. */
+        frags = (tlen - 2) / 2;
+        printk("Fast Seek: %u of %u frags mapped, defragment the image!\n",
+               frags, (*cltbl / 2) - 1);
+        cltbl[0] = tlen;
+        cltbl[1 + frags*2] = 0;
+        (void)arena_alloc(tlen * 4);
+        im->extents = arena_alloc(image_extents_size(cltbl));
+        image_extents_init(im->extents, &im->fp);
+        cltbl = NULL;
+    } else {
+        F_die(fr);
+    }
+
+    return cltbl;
+}
+
 /* Allocate floppy resources and mount the given image. 
  * On return: dma_rd, dma_wr, image and index are all valid. */
 static void floppy_mount(struct slot *slot)
 {
-    struct image *im;
+    struct image *im = NULL;
     struct dma_ring *_dma_rd, *_dma_wr;
     struct drive *drv = &drive;
-    FSIZE_t fastseek_sz;
-    DWORD *cltbl;
-    FRESULT fr;
+    FSIZE_t fastseek_sz = 0;
+    DWORD *cltbl = NULL;
+    void *top, *mark = NULL;
     bool_t async = TRUE, retry;
+    time_t mount_start = time_now();
+    /* Deeper flux and bitcell buffering on larger-RAM parts, to ride out
+     * longer IRQ and I/O stalls. Not at high data rates, where a 64kB part
+     * needs the space to buffer whole tracks. */
+    bool_t deep = (ram_kb >= 64);
+
+    arena_init();
+#if !defined(QUICKDISK)
+    raw_cache_init();
+#endif
+    top = arena_mark();
 
     do {
         retry = FALSE;
 
-        arena_init();
-
-        _dma_rd = dma_ring_alloc();
-        _dma_wr = dma_ring_alloc();
-
-        im = arena_alloc(sizeof(*im));
-        memset(im, 0, sizeof(*im));
-
-        /* Create a fast-seek cluster table for the image. */
-#define MAX_FILE_FRAGS 511 /* up to a 4kB cluster table */
-        cltbl = arena_alloc(0);
-        *cltbl = (MAX_FILE_FRAGS + 1) * 2;
-        fatfs_from_slot(&im->fp, slot, FA_READ);
-        fastseek_sz = f_size(&im->fp);
-        if (fastseek_sz == 0) {
-            /* Empty or dummy file. */
-            cltbl = NULL;
-        } else {
-            im->fp.cltbl = cltbl;
-            fr = f_lseek(&im->fp, CREATE_LINKMAP);
-            printk("Fast Seek: %u frags\n", (*cltbl / 2) - 1);
-            if (fr == FR_OK) {
-                DWORD *_cltbl = arena_alloc(*cltbl * 4);
-                ASSERT(_cltbl == cltbl);
-            } else if (fr == FR_NOT_ENOUGH_CORE) {
-                printk("Fast Seek: FAILED\n");
-                cltbl = NULL;
-            } else {
-                F_die(fr);
-            }
+        /* A retry to re-lay the buffers (see below) keeps the image and its
+         * fast-seek table: only a change of file size forces a new FAT chain
+         * walk. */
+        if ((im == NULL) || (f_size(&im->fp) != fastseek_sz)) {
+            arena_release(top);
+            cltbl = image_alloc(slot, &im, &fastseek_sz);
+            mark = arena_mark();
         }
+        arena_release(mark);
+
+        _dma_rd = dma_ring_alloc(deep ? 2048 : 1024);
+        _dma_wr = dma_ring_alloc(deep ? 2048 : 1024);
 
         /* ~0 avoids sync match within fewer than 32 bits of scan start. */
         im->write_bc_window = ~0;
@@ -197,7 +491,7 @@ static void floppy_mount(struct slot *slot)
         } else {
             /* Size at least 4kb so a 512 byte sector (1k bc) can be fully
              * encoded into the 2kb read_bc, with space to spare. */
-            im->bufs.write_bc.len = 4*1024; /* Power of two. */
+            im->bufs.write_bc.len = (deep ? 8 : 4) * 1024; /* Power of two. */
             im->bufs.write_bc.p = arena_alloc(im->bufs.write_bc.len);
         }
 
@@ -218,10 +512,11 @@ static void floppy_mount(struct slot *slot)
 
         /* Any remaining space is used for staging I/O to mass storage, shared
          * between read and write paths (Change of use of this memory space is
-         * fully serialised). */
+         * fully serialised). Ring I/O's per-sector state is sized to match. */
+        ring_io_reserve(arena_avail());
         im->bufs.write_data.len = arena_avail();
         im->bufs.write_data.p = arena_alloc(im->bufs.write_data.len);
-        im->bufs.read_data = im->bufs.write_data;
+        im->bufs.read_data = im->bufs.staging = im->bufs.write_data;
 
         /* Minimum allowable buffer space. */
         ASSERT(im->bufs.read_data.len >= 10*1024);
@@ -248,6 +543,11 @@ static void floppy_mount(struct slot *slot)
             retry = TRUE;
             continue;
         }
+        if (deep && (im->write_bc_ticks < sysclk_us(2))) {
+            deep = FALSE;
+            retry = TRUE;
+            continue;
+        }
         if (!im->disk_handler->write_track || volume_readonly())
             slot->attributes |= AM_RDO;
         if (slot->attributes & AM_RDO) {
@@ -258,10 +558,19 @@ static void floppy_mount(struct slot *slot)
 
     } while (f_size(&im->fp) != fastseek_sz || retry);
 
+    memset(&stall, 0, sizeof(stall));
+    memset(&perf, 0, sizeof(perf));
+    perf.mount_us = time_diff(mount_start, time_now()) / TIME_MHZ;
+    perf.nr_frags = im->extents ? im->extents->nr : 0;
+    volume_cache_counts(&perf.cache_hits, &perf.cache_misses);
+
     /* After image is extended at mount time, we permit no further changes 
      * to the file metadata. Clear the dirent info to ensure this. */
     im->fp.dir_ptr = NULL;
     im->fp.dir_sect = 0;
+#if FF_FS_EXFAT
+    im->fp.obj.c_scl = 0;
+#endif
 
     _dma_rd->state = DMA_stopping;
 
@@ -277,15 +586,13 @@ static void floppy_mount(struct slot *slot)
     index.custom_pulses_ver = 0xFF;
 }
 
-/* Initialise timers and DMA for RDATA/WDATA. */
-static void timer_dma_init(void)
+/* One-time setup of the RDATA/WDATA timers and their DMA channels. None of
+ * this depends on the mounted image, and floppy_cancel() disturbs none of it,
+ * so an image swap need only re-point the DMA channels (timer_dma_init()). */
+static void timer_dma_setup(void)
 {
-    /* Enable DMA interrupts. */
-    dma1->ifcr = DMA_IFCR_CGIF(dma_rdata_ch) | DMA_IFCR_CGIF(dma_wdata_ch);
     IRQx_set_prio(dma_rdata_irq, RDATA_IRQ_PRI);
     IRQx_set_prio(dma_wdata_irq, WDATA_IRQ_PRI);
-    IRQx_enable(dma_rdata_irq);
-    IRQx_enable(dma_wdata_irq);
 
     /* RDATA Timer setup:
      * The counter is incremented at full SYSCLK rate. 
@@ -302,19 +609,8 @@ static void timer_dma_init(void)
     tim_rdata->dier = TIM_DIER_UDE;
     tim_rdata->cr2 = 0;
 
-    /* DMA setup: From a circular buffer into the RDATA Timer's ARR. */
+    /* RDATA DMA: From a circular buffer into the RDATA Timer's ARR. */
     dma_rdata.cpar = (uint32_t)(unsigned long)&tim_rdata->arr;
-    dma_rdata.cmar = (uint32_t)(unsigned long)dma_rd->buf;
-    dma_rdata.cndtr = ARRAY_SIZE(dma_rd->buf);
-    dma_rdata.ccr = (DMA_CCR_PL_HIGH |
-                     DMA_CCR_MSIZE_16BIT |
-                     DMA_CCR_PSIZE_16BIT |
-                     DMA_CCR_MINC |
-                     DMA_CCR_CIRC |
-                     DMA_CCR_DIR_M2P |
-                     DMA_CCR_HTIE |
-                     DMA_CCR_TCIE |
-                     DMA_CCR_EN);
 
     /* WDATA Timer setup: 
      * The counter runs from 0x0000-0xFFFF inclusive at full SYSCLK rate.
@@ -329,10 +625,32 @@ static void timer_dma_init(void)
     tim_wdata->dier = TIM_DIER_CC1DE;
     tim_wdata->cr2 = 0;
 
-    /* DMA setup: From the WDATA Timer's CCRx into a circular buffer. */
+    /* WDATA DMA: From the WDATA Timer's CCRx into a circular buffer. */
     dma_wdata.cpar = (uint32_t)(unsigned long)&tim_wdata->ccr1;
+}
+
+/* Start DMA for RDATA/WDATA on the newly-mounted image's rings. */
+static void timer_dma_init(void)
+{
+    /* Enable DMA interrupts. */
+    dma1->ifcr = DMA_IFCR_CGIF(dma_rdata_ch) | DMA_IFCR_CGIF(dma_wdata_ch);
+    IRQx_enable(dma_rdata_irq);
+    IRQx_enable(dma_wdata_irq);
+
+    dma_rdata.cmar = (uint32_t)(unsigned long)dma_rd->buf;
+    dma_rdata.cndtr = dma_rd->len;
+    dma_rdata.ccr = (DMA_CCR_PL_HIGH |
+                     DMA_CCR_MSIZE_16BIT |
+                     DMA_CCR_PSIZE_16BIT |
+                     DMA_CCR_MINC |
+                     DMA_CCR_CIRC |
+                     DMA_CCR_DIR_M2P |
+                     DMA_CCR_HTIE |
+                     DMA_CCR_TCIE |
+                     DMA_CCR_EN);
+
     dma_wdata.cmar = (uint32_t)(unsigned long)dma_wr->buf;
-    dma_wdata.cndtr = ARRAY_SIZE(dma_wr->buf);
+    dma_wdata.cndtr = dma_wr->len;
     dma_wdata.ccr = (DMA_CCR_PL_HIGH |
                      DMA_CCR_MSIZE_16BIT |
                      DMA_CCR_PSIZE_16BIT |
@@ -371,6 +689,7 @@ static void wdata_stop(void)
 
     /* Ok we're now stopping DMA activity. */
     dma_wr->state = DMA_stopping;
+    trace(wgate, 0, 0, 0);
 
     /* Turn off timer. */
     tim_wdata->ccer = 0;
@@ -381,6 +700,7 @@ static void wdata_stop(void)
 
     switch (ff_cfg.write_drain) {
     case WDRAIN_instant:
+    case WDRAIN_adaptive:
         /* Restart read exactly where write ended. No more IDX pulses until
          * write-out is complete. */
         drive_set_restart_pos(drv);
@@ -397,7 +717,7 @@ static void wdata_stop(void)
 
     /* Remember where this write's DMA stream ended. */
     write = get_write(image, image->wr_prod);
-    write->dma_end = ARRAY_SIZE(dma_wr->buf) - dma_wdata.cndtr;
+    write->dma_end = dma_wr->len - dma_wdata.cndtr;
     image->wr_prod++;
 
 #if !defined(QUICKDISK)
@@ -451,6 +771,7 @@ static void wdata_start(void)
     write = get_write(image, image->wr_prod);
     write->start = start_pos;
     write->track = drive_calc_track(&drive);
+    trace(wgate, 1, write->track, 0);
 
     /* Allow IDX pulses while handling a write. */
     drive.index_suppressed = FALSE;
@@ -488,7 +809,7 @@ static void rdata_stop(void)
         drive_set_restart_pos(&drive);
 }
 
-/* Called from user context to start the read stream. */
+/* Called from user context, or sync_timer, to start the read stream. */
 static void rdata_start(void)
 {
     IRQ_global_disable();
@@ -515,10 +836,14 @@ out:
     IRQ_global_enable();
 }
 
+/* Did the last floppy_read_data() buffer anything? It may have more to do. */
+static bool_t read_progress;
+
 static void floppy_read_data(struct drive *drv)
 {
     /* Read some track data if there is buffer space. */
-    if (image_read_track(drv->image) && dma_rd->kick_dma_irq) {
+    read_progress = image_read_track(drv->image);
+    if (read_progress && dma_rd->kick_dma_irq) {
         /* We buffered some more data and the DMA handler requested a kick. */
         dma_rd->kick_dma_irq = FALSE;
         IRQx_set_pending(dma_rdata_irq);
@@ -547,13 +872,22 @@ static bool_t dma_wr_handle(struct drive *drv)
         }
     
         /* Set up the track for writing. */
+        trace(setup_track, write->track, TRUE, 0);
         image_setup_track(im, write->track, NULL);
+        trace(setup_done, write->track, 0, 0);
 
         drv->writing = TRUE;
 
     }
 
-    /* Continue a write. */
+    /* Continue a write. If the write is still being captured, pull in flux
+     * received since the last half-ring DMA interrupt: each sector can then
+     * be decoded, and its writeback started, as soon as it is complete. */
+    if ((dma_wr->state == DMA_starting) && (im->wr_cons == im->wr_prod)) {
+        uint16_t prod = dma_wr->len - dma_wdata.cndtr;
+        if (((prod - dma_wr->cons) & (dma_wr->len - 1)) >= dma_wr->len / 16)
+            IRQx_set_pending(dma_wdata_irq);
+    }
     completed = image_write_track(im);
 
     /* Is this write now completely processed? */
@@ -596,9 +930,36 @@ bool_t floppy_handle(void)
             ? dma_rd_handle : dma_wr_handle)(drv);
 }
 
-static void IRQ_rdata_dma(void)
+uint32_t floppy_slack_us(void)
+{
+    struct image *im = image;
+    struct image_buf *bc;
+    uint32_t cells, slack = ~0u;
+    int32_t space;
+
+    if (dma_rd->state == DMA_active) {
+        /* Flux queued for the RDATA timer, then bitcells in read_bc. Every
+         * flux sample is at least one bitcell. */
+        bc = &im->bufs.read_bc;
+        cells = ((dma_rd->prod - (dma_rd->len - dma_rdata.cndtr))
+                 & (dma_rd->len - 1)) + (bc->prod - bc->cons);
+        slack = cells * (im->ticks_per_cell / 16) / SYSCLK_MHZ;
+    }
+
+    if (dma_wr->state != DMA_inactive) {
+        /* Space left in write_bc before the WDATA decoder overruns. */
+        bc = &im->bufs.write_bc;
+        space = bc->len*8 - (bc->prod - bc->cons);
+        cells = max_t(int32_t, space, 0);
+        slack = min_t(uint32_t, slack, cells * im->write_bc_ticks / SYSCLK_MHZ);
+    }
+
+    return slack;
+}
+
+static ramfunc void __IRQ_rdata_dma(void)
 {
-    const uint16_t buf_mask = ARRAY_SIZE(dma_rd->buf) - 1;
+    const uint16_t buf_mask = dma_rd->len - 1;
     uint32_t prev_ticks_since_index, ticks, i;
     uint16_t nr_to_wrap, nr_to_cons, nr, dmacons, done;
     time_t now;
@@ -612,20 +973,22 @@ static void IRQ_rdata_dma(void)
         return;
 
     /* Find out where the DMA engine's consumer index has got to. */
-    dmacons = ARRAY_SIZE(dma_rd->buf) - dma_rdata.cndtr;
+    dmacons = dma_rd->len - dma_rdata.cndtr;
 
     /* Check for DMA catching up with the producer index (underrun). */
     if (((dmacons < dma_rd->cons)
          ? (dma_rd->prod >= dma_rd->cons) || (dma_rd->prod < dmacons)
          : (dma_rd->prod >= dma_rd->cons) && (dma_rd->prod < dmacons))
-        && (dmacons != dma_rd->cons))
+        && (dmacons != dma_rd->cons)) {
         printk("RDATA underrun! %x-%x-%x\n",
                dma_rd->cons, dma_rd->prod, dmacons);
+        stall_record(STALL_underrun);
+    }
 
     dma_rd->cons = dmacons;
 
     /* Find largest contiguous stretch of ring buffer we can fill. */
-    nr_to_wrap = ARRAY_SIZE(dma_rd->buf) - dma_rd->prod;
+    nr_to_wrap = dma_rd->len - dma_rd->prod;
     nr_to_cons = (dmacons - dma_rd->prod - 1) & buf_mask;
     nr = min(nr_to_wrap, nr_to_cons);
     if (nr == 0) /* Buffer already full? Then bail. */
@@ -639,6 +1002,8 @@ static void IRQ_rdata_dma(void)
     dma_rd->prod &= buf_mask;
     if (done != nr) {
         /* Read buffer ran dry: kick us when more data is available. */
+        if (!dma_rd->kick_dma_irq)
+            stall_record(STALL_kick);
         dma_rd->kick_dma_irq = TRUE;
     } else if (nr != nr_to_cons) {
         /* We didn't fill the ring: re-enter this ISR to do more work. */
@@ -661,6 +1026,7 @@ static void IRQ_rdata_dma(void)
         for (i = 0; i < index.custom_pulses_len; i++)
             if (current_pulse_pos <= index.custom_pulses[i])
                 break;
+        index.custom_next = i;
         if (i < index.custom_pulses_len)
             timer_set(&index.custom_timer, index.prev_time + index.custom_pulses[i]);
         else
@@ -681,7 +1047,7 @@ static void IRQ_rdata_dma(void)
         /* Ticks left in current sample. */
         ticks = tim_rdata->arr - tim_rdata->cnt;
         /* Index of next sample. */
-        dmacons = ARRAY_SIZE(dma_rd->buf) - dma_rdata.cndtr;
+        dmacons = dma_rd->len - dma_rdata.cndtr;
         /* If another sample was loaded meanwhile, try again for a consistent
          * snapshot. */
         if (dmacons == dma_rd->cons)
@@ -698,53 +1064,45 @@ static void IRQ_rdata_dma(void)
     timer_set(&index.timer, now + ticks);
 }
 
-static void IRQ_wdata_dma(void)
+static ramfunc void IRQ_rdata_dma(void)
+{
+    PROF(rdata_dma, __IRQ_rdata_dma());
+}
+
+/* Decoder core of __IRQ_wdata_dma(): converts captured flux samples
+ * [dma_wr->cons, @prod) into bitcells at the head of image->bufs.write_bc.
+ * @sync is a constant at each call site, so that each sync mode gets its own
+ * loop, free of per-sample dispatch. */
+static always_inline void flux_to_bc(unsigned int sync, uint16_t prod)
 {
-    const uint16_t buf_mask = ARRAY_SIZE(dma_rd->buf) - 1;
-    uint16_t cons, prod, prev, curr, next;
+    const uint16_t buf_mask = dma_wr->len - 1;
+    const uint16_t *buf = dma_wr->buf;
+    uint16_t cons, prev, curr, next;
     uint16_t cell = image->write_bc_ticks, window;
-    uint32_t bc_dat = 0, bc_prod;
+    uint32_t bc_dat, bc_prod, n, r;
     uint32_t *bc_buf = image->bufs.write_bc.p;
-    unsigned int sync = image->sync;
     unsigned int bc_bufmask = (image->bufs.write_bc.len / 4) - 1;
-    struct write *write = NULL;
 
     window = cell + (cell >> 1);
 
-    /* Clear DMA peripheral interrupts. */
-    dma1->ifcr = DMA_IFCR_CGIF(dma_wdata_ch);
-
-    /* If we happen to be called in the wrong state, just bail. */
-    if (dma_wr->state == DMA_inactive)
-        return;
-
-    /* Find out where the DMA engine's producer index has got to. */
-    prod = ARRAY_SIZE(dma_wr->buf) - dma_wdata.cndtr;
-
-    /* Check if we are processing the tail end of a write. */
-    barrier(); /* interrogate peripheral /then/ check for write-end. */
-    if (image->wr_bc != image->wr_prod) {
-        write = get_write(image, image->wr_bc);
-        prod = write->dma_end;
-    }
-
-    /* Process the flux timings into the raw bitcell buffer. */
     prev = dma_wr->prev_sample;
     bc_prod = image->bufs.write_bc.prod;
     bc_dat = image->write_bc_window;
     for (cons = dma_wr->cons; cons != prod; cons = (cons+1) & buf_mask) {
-        next = dma_wr->buf[cons];
+        next = buf[cons];
         curr = next - prev;
         prev = next;
-        while (curr > window) {
+        for (n = 0; curr > window; n++)
             curr -= cell;
-            bc_dat <<= 1;
-            bc_prod++;
-            if (!(bc_prod&31))
-                bc_buf[((bc_prod-1) / 32) & bc_bufmask] = htobe32(bc_dat);
+        /* Shift in the zeroes, a word at a time across word boundaries. */
+        while (n >= (r = 32 - (bc_prod & 31))) {
+            bc_dat = (r == 32) ? 0 : bc_dat << r;
+            bc_prod += r;
+            n -= r;
+            bc_buf[((bc_prod-1) / 32) & bc_bufmask] = htobe32(bc_dat);
         }
-        bc_dat = (bc_dat << 1) | 1;
-        bc_prod++;
+        bc_dat = (bc_dat << n << 1) | 1;
+        bc_prod += n + 1;
         switch (sync) {
         case SYNC_fm:
             /* FM clock sync clock byte is 0xc7. Check for:
@@ -764,6 +1122,59 @@ static void IRQ_wdata_dma(void)
     if (bc_prod & 31)
         bc_buf[(bc_prod / 32) & bc_bufmask] = htobe32(bc_dat << (-bc_prod&31));
 
+    image->write_bc_window = bc_dat;
+    image->bufs.write_bc.prod = bc_prod;
+    dma_wr->cons = cons;
+    dma_wr->prev_sample = prev;
+}
+
+static ramfunc void __IRQ_wdata_dma(void)
+{
+    uint16_t prod;
+    uint32_t bc_prod;
+    struct write *write = NULL;
+
+    /* Clear DMA peripheral interrupts. */
+    dma1->ifcr = DMA_IFCR_CGIF(dma_wdata_ch);
+
+    /* If we happen to be called in the wrong state, just bail. */
+    if (dma_wr->state == DMA_inactive)
+        return;
+
+    /* Find out where the DMA engine's producer index has got to. */
+    prod = dma_wr->len - dma_wdata.cndtr;
+
+    /* Check if we are processing the tail end of a write. */
+    barrier(); /* interrogate peripheral /then/ check for write-end. */
+    if (image->wr_bc != image->wr_prod) {
+        write = get_write(image, image->wr_bc);
+        prod = write->dma_end;
+    }
+
+    /* Process the flux timings into the raw bitcell buffer. */
+    switch (image->sync) {
+    case SYNC_fm:
+        flux_to_bc(SYNC_fm, prod);
+        break;
+    case SYNC_mfm:
+        flux_to_bc(SYNC_mfm, prod);
+        break;
+    default:
+        flux_to_bc(SYNC_none, prod);
+        break;
+    }
+    bc_prod = image->bufs.write_bc.prod;
+
+    /* Has writeback fallen a whole buffer behind the incoming bitcells? */
+    if ((bc_prod - image->bufs.write_bc.cons)
+        > image->bufs.write_bc.len * 8) {
+        if (!stall.overrun)
+            stall_record(STALL_overrun);
+        stall.overrun = TRUE;
+    } else {
+        stall.overrun = FALSE;
+    }
+
     /* Processing the tail end of a write? */
     if (write != NULL) {
         /* Remember where this write's bitcell data ends. */
@@ -771,16 +1182,15 @@ static void IRQ_wdata_dma(void)
         if (++image->wr_bc != image->wr_prod)
             IRQx_set_pending(dma_wdata_irq);
         /* Initialise decoder state for the start of the next write. */
-        bc_prod = (bc_prod + 31) & ~31;
-        bc_dat = ~0;
-        prev = 0;
+        image->bufs.write_bc.prod = (bc_prod + 31) & ~31;
+        image->write_bc_window = ~0;
+        dma_wr->prev_sample = 0;
     }
+}
 
-    /* Save our progress for next time. */
-    image->write_bc_window = bc_dat;
-    image->bufs.write_bc.prod = bc_prod;
-    dma_wr->cons = cons;
-    dma_wr->prev_sample = prev;
+static ramfunc void IRQ_wdata_dma(void)
+{
+    PROF(wdata_dma, __IRQ_wdata_dma());
 }
 
 void floppy_sync(void)
@@ -49,19 +49,82 @@ struct op {
     f_op_func func;
     FIL *fp;
     union op_args args;
+    FSIZE_t ofs; /* File position for read/write, if seek is set. */
+    time_t queued;
+    bool_t seek;
     bool_t cancelled;
 };
 
-#define OPS_LEN 4 /* Power of 2. */
-#define OPS_MASK(x) ((x)&(OPS_LEN-1))
-static struct {
-    struct op ops[OPS_LEN];
+/* Two service classes. Latency-critical reads are always serviced before
+ * deferrable writeback and sync work, so a long writeback batch cannot
+ * starve the read path. Within a class, ops complete in FIFO order. */
+enum { Q_READ, Q_WRITEBACK, Q_NR };
+
+/* Queue depths per class. Power of 2. */
+#ifndef FS_ASYNC_READ_LEN
+#define FS_ASYNC_READ_LEN 4
+#endif
+#ifndef FS_ASYNC_WRITEBACK_LEN
+#define FS_ASYNC_WRITEBACK_LEN 8
+#endif
+
+/* A FOP encodes the class in its bottom bit and a per-class sequence number
+ * in the remaining bits. */
+#define FOP_MK(q, seq) ((FOP)(((unsigned int)(seq) << 1) | (q)))
+#define FOP_CLASS(f) ((f) & 1)
+#define FOP_SEQ(f) ((f) >> 1)
+/* Is @f's sequence number before @seq? Only 31 bits of sequence survive in a
+ * FOP, so compare against a FOP of the same class, modulo 2^31. */
+#define FOP_BEFORE(f, seq) \
+    ((int)((unsigned int)(f) - FOP_MK(FOP_CLASS(f), seq)) < 0)
+
+struct op_stats {
+    uint32_t nr_ops, nr_merged, total_wait;
+    time_t max_wait;
+    uint8_t max_depth;
+};
+
+struct op_queue {
+    struct op *ops;
     int prod, cons;
-} f_async_queue;
+    uint8_t len;
+    struct op_stats stats;
+};
+
+static struct op read_ops[FS_ASYNC_READ_LEN];
+static struct op writeback_ops[FS_ASYNC_WRITEBACK_LEN];
+
+static struct {
+    struct op_queue q[Q_NR];
+    struct op *last; /* Most recently enqueued op. */
+    /* Batch of ops being executed by F_async_drain(), from run_q->cons. */
+    struct op_queue *run_q;
+    int run_nr;
+} f_async_queue = {
+    .q = {
+        [Q_READ] = { .ops = read_ops, .len = FS_ASYNC_READ_LEN },
+        [Q_WRITEBACK] = { .ops = writeback_ops,
+                          .len = FS_ASYNC_WRITEBACK_LEN }
+    }
+};
+
+#define OPS_MASK(q, x) ((x)&((q)->len-1))
+
+/* Wakes the I/O thread from F_async_sleep(). */
+static struct thread_event f_async_event;
+
+void F_async_sleep(void) {
+    thread_wait(&f_async_event);
+}
+
+void F_async_notify(void) {
+    thread_notify(&f_async_event);
+}
 
 bool_t F_async_isdone(FOP oper) {
-    ASSERT(oper - f_async_queue.prod < 0);
-    return oper - f_async_queue.cons < 0;
+    struct op_queue *q = &f_async_queue.q[FOP_CLASS(oper)];
+    ASSERT(FOP_BEFORE(oper, q->prod));
+    return FOP_BEFORE(oper, q->cons);
 }
 
 void F_async_wait(FOP oper) {
@@ -69,68 +132,319 @@ void F_async_wait(FOP oper) {
         thread_yield();
 }
 
+static void do_disk_read(struct op *op);
+
+/* Is every op of the batch being executed cancelled? */
+static bool_t run_cancelled(void) {
+    struct op_queue *q = f_async_queue.run_q;
+    for (int i = 0; i < f_async_queue.run_nr; i++)
+        if (!q->ops[OPS_MASK(q, q->cons + i)].cancelled)
+            return FALSE;
+    return TRUE;
+}
+
+/* A volume read already in flight for a wholly cancelled batch is abandoned
+ * mid-transfer. Only raw volume reads qualify: failing a FatFS op part way
+ * through would leave the file object in an error state. */
+static void abort_cancelled_batch(void) {
+    struct op_queue *q = f_async_queue.run_q;
+    if ((q != NULL) && (q->ops[OPS_MASK(q, q->cons)].func == do_disk_read)
+            && run_cancelled())
+        (void)volume_abort();
+}
+
 void F_async_cancel(FOP oper) {
+    struct op_queue *q = &f_async_queue.q[FOP_CLASS(oper)];
     if (F_async_isdone(oper))
         return;
-    f_async_queue.ops[OPS_MASK(oper)].cancelled = TRUE;
+    q->ops[OPS_MASK(q, FOP_SEQ(oper))].cancelled = TRUE;
+    if (q == f_async_queue.run_q)
+        abort_cancelled_batch();
 }
 
 void F_async_cancel_all(void) {
-    for (int i = 0; i < OPS_LEN; i++)
-        f_async_queue.ops[i].cancelled = TRUE;
+    for (int i = 0; i < Q_NR; i++) {
+        struct op_queue *q = &f_async_queue.q[i];
+        for (int j = 0; j < q->len; j++)
+            q->ops[j].cancelled = TRUE;
+    }
+    abort_cancelled_batch();
 }
 
 FOP F_async_get_completed_op(void) {
-    return f_async_queue.cons - 4; /* "Random" op. Chosen by fair dice roll. */
+    struct op_queue *q = &f_async_queue.q[Q_WRITEBACK];
+    return FOP_MK(Q_WRITEBACK, q->cons - q->len);
+}
+
+bool_t F_async_idle(void) {
+    for (int i = 0; i < Q_NR; i++) {
+        struct op_queue *q = &f_async_queue.q[i];
+        if (q->prod != q->cons)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+unsigned int F_async_pending(void) {
+    unsigned int pending = 0;
+    for (int i = 0; i < Q_NR; i++) {
+        struct op_queue *q = &f_async_queue.q[i];
+        if (q->prod != q->cons)
+            pending |= 1u << i; /* F_PENDING_read, F_PENDING_writeback */
+    }
+    return pending;
+}
+
+unsigned int F_async_depth(void) {
+    unsigned int depth = 0;
+    for (int i = 0; i < Q_NR; i++)
+        depth += f_async_queue.q[i].prod - f_async_queue.q[i].cons;
+    return depth;
+}
+
+void F_async_stats(void) {
+    static const char * const name[] = { "read", "writeback" };
+    for (int i = 0; i < Q_NR; i++) {
+        struct op_stats *st = &f_async_queue.q[i].stats;
+        if (st->nr_ops == 0)
+            continue;
+        printk("async %s: %u ops (%u merged), max depth %u, "
+               "wait avg %u us, max %u us\n",
+               name[i], st->nr_ops, st->nr_merged, st->max_depth,
+               st->total_wait / st->nr_ops / TIME_MHZ,
+               st->max_wait / TIME_MHZ);
+        memset(st, 0, sizeof(*st));
+    }
+}
+
+static void do_nop(struct op *op) {
+}
+
+static void do_lseek(struct op *op);
+static void do_read(struct op *op);
+static void do_write(struct op *op);
+static void do_sync(struct op *op);
+static void do_disk_write(struct op *op);
+
+/* Do two byte (or sector) extents overlap? */
+static bool_t extents_overlap(FSIZE_t a, UINT a_len, FSIZE_t b, UINT b_len) {
+    return (a < b + b_len) && (b < a + a_len);
+}
+
+/* May read op @rd be serviced ahead of the queued writeback work? Not if it
+ * could observe data, or a file position, that queued work will change. Nor
+ * if it would overwrite memory that a queued write is yet to take its data
+ * from (see ring_io_detach()). */
+static bool_t read_may_overtake(const struct op *rd) {
+    struct op_queue *q = &f_async_queue.q[Q_WRITEBACK];
+    bool_t file = (rd->func == do_read);
+    uintptr_t buff = (uintptr_t)(file ? rd->args.read.buff
+                                 : rd->args.disk_read.buff);
+    UINT len = file ? rd->args.read.btr : rd->args.disk_read.count * 512;
+
+    if (file && !rd->seek)
+        return FALSE;
+
+    for (int i = q->cons; i != q->prod; i++) {
+        const struct op *op = &q->ops[OPS_MASK(q, i)];
+        if (op->cancelled)
+            continue;
+        if (op->func == do_write) {
+            if (!file || ((op->fp == rd->fp) && (!op->seek
+                    || extents_overlap(op->ofs, op->args.write.btw,
+                                       rd->ofs, rd->args.read.btr)))
+                    || extents_overlap((uintptr_t)op->args.write.buff,
+                                       op->args.write.btw, buff, len))
+                return FALSE;
+        } else if ((op->func == do_sync) && !file) {
+            /* FatFS metadata writeback may hit any sector. */
+            return FALSE;
+        } else if (op->func == do_disk_write) {
+            if (file || ((op->fp == rd->fp)
+                    && extents_overlap(op->args.disk_write.sector,
+                                       op->args.disk_write.count,
+                                       rd->args.disk_read.sector,
+                                       rd->args.disk_read.count))
+                    || extents_overlap((uintptr_t)op->args.disk_write.buff,
+                                       op->args.disk_write.count*512,
+                                       buff, len))
+                return FALSE;
+        } else if ((op->fp == rd->fp) && ((op->func == do_lseek)
+                || ((op->func == do_read) && !op->seek))) {
+            /* A stray seek, or an unpositioned read, depends on the current
+             * file position: it must not be disturbed. */
+            return FALSE;
+        }
+    }
+
+    return TRUE;
 }
 
-static FOP enqueue(f_op_func func, FIL *fp, union op_args *args) {
-    struct op *op;
+static FOP enqueue(f_op_func func, FIL *fp, union op_args *args,
+                   FSIZE_t ofs, bool_t seek) {
+    struct op_queue *q;
+    struct op *op, tmpl = {
+        .func = func, .fp = fp, .args = *args, .ofs = ofs, .seek = seek };
     bool_t printed = FALSE;
-    while (f_async_queue.prod - f_async_queue.cons >= OPS_LEN) {
+    uint8_t depth;
+    int cls;
+
+    if ((func == do_read) || (func == do_disk_read))
+        cls = read_may_overtake(&tmpl) ? Q_READ : Q_WRITEBACK;
+    else
+        cls = Q_WRITEBACK;
+    q = &f_async_queue.q[cls];
+
+    while (q->prod - q->cons >= q->len) {
         if (!printed) {
-            printk("async queue full; blocking on I/O\n");
+            printk("async queue %u full; blocking on I/O\n", cls);
             printk("0: %x 1: %x\n",
-                    f_async_queue.ops[OPS_MASK(f_async_queue.prod-1)].func,
-                    f_async_queue.ops[OPS_MASK(f_async_queue.prod-2)].func);
+                    q->ops[OPS_MASK(q, q->prod-1)].func,
+                    q->ops[OPS_MASK(q, q->prod-2)].func);
             printed = TRUE;
         }
         thread_yield();
     }
-    op = &f_async_queue.ops[OPS_MASK(f_async_queue.prod)];
-    op->func = func;
-    op->fp = fp;
-    op->args = *args;
+    op = &q->ops[OPS_MASK(q, q->prod)];
+    *op = tmpl;
+    op->queued = time_now();
     op->cancelled = FALSE;
-    return f_async_queue.prod++;
+    f_async_queue.last = op;
+    depth = q->prod - q->cons + 1;
+    q->stats.max_depth = max_t(uint8_t, q->stats.max_depth, depth);
+    F_async_notify();
+    return FOP_MK(cls, q->prod++);
+}
+
+/* Fold an immediately-preceding F_lseek_async() on the same file into the
+ * following read or write. This makes the pair atomic with respect to the
+ * scheduler, which is what permits reads to overtake queued writes. */
+static bool_t absorb_seek(FIL *fp, FSIZE_t *ofs) {
+    struct op *last = f_async_queue.last;
+    if ((last == NULL) || (last->fp != fp) || (last->func != do_lseek)
+            || !last->seek)
+        return FALSE;
+    *ofs = last->ofs;
+    /* Harmless if the seek is already in progress or complete. */
+    last->func = do_nop;
+    return TRUE;
+}
+
+static void op_seek(struct op *op) {
+    /* Short-circuit if already appropriately positioned. The caller of
+     * F_lseek_async can't check fptr themselves like they could using the
+     * blocking API. */
+    if (op->seek && (op->ofs != op->fp->fptr))
+        F_lseek(op->fp, op->ofs);
+}
+
+/* Largest single transfer built by merging queued disk reads. The USB BOT
+ * layer transfers directly into the caller's buffer, so the only limits are
+ * the 16-bit READ(10) block count and keeping the I/O thread responsive. */
+#define MAX_MERGE_SECS 64
+
+/* Merge disk reads queued directly behind @op into it, where both the sector
+ * range and the destination buffer are contiguous. Returns the number of
+ * queued ops which the merged op now covers. */
+static int merge_disk_reads(struct op_queue *q, struct op *op) {
+    int i, nr = 1;
+    for (i = q->cons + 1; i != q->prod; i++) {
+        struct op *next = &q->ops[OPS_MASK(q, i)];
+        UINT count = op->args.disk_read.count;
+        if ((next->func != do_disk_read) || next->cancelled
+                || (next->fp != op->fp)
+                || (next->args.disk_read.sector
+                    != op->args.disk_read.sector + count)
+                || (next->args.disk_read.buff
+                    != op->args.disk_read.buff + count * 512)
+                || (count + next->args.disk_read.count > MAX_MERGE_SECS))
+            break;
+        op->args.disk_read.count += next->args.disk_read.count;
+        nr++;
+    }
+    q->stats.nr_merged += nr - 1;
+    return nr;
+}
+
+/* Hint the disk transfer which follows ops @idx-1 and earlier of @q, so that
+ * the driver can issue it back to back with theirs. Only direct disk ops are
+ * hinted: they make exactly one volume call. */
+static void chain_next(struct op_queue *q, int idx) {
+    struct op_queue *rq = &f_async_queue.q[Q_READ];
+    struct op_queue *wq = &f_async_queue.q[Q_WRITEBACK];
+    struct op *next;
+    int i;
+
+    /* Reads are serviced first. */
+    i = (q == rq) ? idx : rq->cons;
+    if (i != rq->prod) {
+        next = &rq->ops[OPS_MASK(rq, i)];
+    } else {
+        i = (q == wq) ? idx : wq->cons;
+        if (i == wq->prod)
+            return;
+        next = &wq->ops[OPS_MASK(wq, i)];
+    }
+
+    if (next->cancelled)
+        return;
+    if (next->func == do_disk_read)
+        volume_chain((uintptr_t)next->fp, FALSE, next->args.disk_read.buff,
+                     next->args.disk_read.sector, next->args.disk_read.count);
+    else if (next->func == do_disk_write)
+        volume_chain((uintptr_t)next->fp, TRUE, next->args.disk_write.buff,
+                     next->args.disk_write.sector,
+                     next->args.disk_write.count);
 }
 
 void F_async_drain(void) {
-    while (f_async_queue.prod != f_async_queue.cons) {
-        struct op *op = &f_async_queue.ops[OPS_MASK(f_async_queue.cons)];
+    for (;;) {
+        struct op_queue *q = &f_async_queue.q[Q_READ];
+        struct op *op;
+        time_t wait;
+        int nr = 1;
+        if (q->prod == q->cons) {
+            q = &f_async_queue.q[Q_WRITEBACK];
+            if (q->prod == q->cons)
+                break;
+        }
+        op = &q->ops[OPS_MASK(q, q->cons)];
+        wait = time_since(op->queued);
+        q->stats.nr_ops++;
+        q->stats.total_wait += wait;
+        q->stats.max_wait = max_t(time_t, q->stats.max_wait, wait);
         if (!op->cancelled) {
+            trace(fop_start, q - f_async_queue.q, wait, 0);
+            if (op->func == do_disk_read)
+                nr = merge_disk_reads(q, op);
+            if ((op->func == do_disk_read) || (op->func == do_disk_write))
+                chain_next(q, q->cons + nr);
+            f_async_queue.run_q = q;
+            f_async_queue.run_nr = nr;
             op->func(op);
+            f_async_queue.run_q = NULL;
+            trace(fop_done, q - f_async_queue.q, nr, 0);
+        } else {
+            /* This op's transfer may have been hinted, and even issued. It
+             * must complete before the op's buffer is released. */
+            volume_chain(0, FALSE, NULL, 0, 0);
         }
-        f_async_queue.cons++;
+        q->cons += nr;
     }
 }
 
 static void do_lseek(struct op *op) {
-    /* Short-circuit if already appropriately positioned. The caller of
-     * F_lseek_async can't check fptr themselves like they could using the
-     * blocking API. */
-    if (op->args.lseek.ofs == op->fp->fptr)
-        return;
-    F_lseek(op->fp, op->args.lseek.ofs);
+    op_seek(op);
 }
 
 FOP F_lseek_async(FIL *fp, FSIZE_t ofs) {
-    union op_args args = { .lseek = {ofs} };
-    return enqueue(do_lseek, fp, &args);
+    union op_args args = { 0 };
+    return enqueue(do_lseek, fp, &args, ofs, TRUE);
 }
 
 static void do_read(struct op *op) {
     time_t start = time_now(), duration;
+    op_seek(op);
     F_read(op->fp, op->args.read.buff, op->args.read.btr, op->args.read.br);
     duration = time_since(start);
     if (duration > time_us(9000))
@@ -140,11 +454,14 @@ static void do_read(struct op *op) {
 
 FOP F_read_async(FIL *fp, void *buff, UINT btr, UINT *br) {
     union op_args args = { .read = {buff, btr, br} };
-    return enqueue(do_read, fp, &args);
+    FSIZE_t ofs = 0;
+    bool_t seek = absorb_seek(fp, &ofs);
+    return enqueue(do_read, fp, &args, ofs, seek);
 }
 
 static void do_write(struct op *op) {
     time_t start = time_now(), duration;
+    op_seek(op);
     F_write(op->fp, op->args.write.buff, op->args.write.btw, op->args.write.bw);
     duration = time_since(start);
     if (duration > time_us(9000))
@@ -154,7 +471,9 @@ static void do_write(struct op *op) {
 
 FOP F_write_async(FIL *fp, const void *buff, UINT btw, UINT *bw) {
     union op_args args = { .write = {buff, btw, bw} };
-    return enqueue(do_write, fp, &args);
+    FSIZE_t ofs = 0;
+    bool_t seek = absorb_seek(fp, &ofs);
+    return enqueue(do_write, fp, &args, ofs, seek);
 }
 
 static void do_sync(struct op *op) {
@@ -163,18 +482,19 @@ static void do_sync(struct op *op) {
 
 FOP F_sync_async(FIL *fp) {
     union op_args args = { 0 };
-    return enqueue(do_sync, fp, &args);
+    return enqueue(do_sync, fp, &args, 0, FALSE);
 }
 
 static void do_disk_read(struct op *op) {
-    if (disk_read((uintptr_t) op->fp, op->args.disk_read.buff,
+    if ((disk_read((uintptr_t) op->fp, op->args.disk_read.buff,
             op->args.disk_read.sector, op->args.disk_read.count) != RES_OK)
+            && !run_cancelled()) /* abandoned by abort_cancelled_batch()? */
         F_die(FR_DISK_ERR);
 }
 
 FOP disk_read_async(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count) {
     union op_args args = { .disk_read = {buff, sector, count} };
-    return enqueue(do_disk_read, (void*)(uintptr_t) pdrv, &args);
+    return enqueue(do_disk_read, (void*)(uintptr_t) pdrv, &args, 0, FALSE);
 }
 
 static void do_disk_write(struct op *op) {
@@ -190,7 +510,7 @@ static void do_disk_write(struct op *op) {
 
 FOP disk_write_async(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count) {
     union op_args args = { .disk_write = {buff, sector, count} };
-    return enqueue(do_disk_write, (void*)(uintptr_t) pdrv, &args);
+    return enqueue(do_disk_write, (void*)(uintptr_t) pdrv, &args, 0, FALSE);
 }
 
 static void do_disk_ioctl(struct op *op) {
@@ -204,5 +524,5 @@ static void do_disk_ioctl(struct op *op) {
 
 FOP disk_ioctl_async(BYTE pdrv, BYTE cmd, void* buff, DRESULT *res) {
     union op_args args = { .disk_ioctl = {cmd, buff, res} };
-    return enqueue(do_disk_ioctl, (void*)(uintptr_t) pdrv, &args);
+    return enqueue(do_disk_ioctl, (void*)(uintptr_t) pdrv, &args, 0, FALSE);
 }
@@ -13,8 +13,7 @@
  *  uSb -> Waiting for USB stack
  *   rd -> Reading the update file
  *  CrC -> CRC-checking the file
- *  CLr -> Erasing flash
- *  Prg -> Programming flash
+ *  Prg -> Erasing and programming flash
  * 
  * Error messages:
  *  E01 -> No update file found
@@ -108,6 +107,58 @@ static void erase_old_firmware(void)
         fpec_page_erase(p);
 }
 
+/* Flash programming runs in its own thread, one buffer behind the file
+ * reads. An erase or program stalls every access to Flash, so the CPU
+ * does nothing else meanwhile. What does overlap is the SD/USB transfer
+ * of the next buffer into RAM (prg.buf), which the hardware continues
+ * while the CPU waits on Flash. Each page is erased just before it is
+ * programmed. */
+#define PRG_STEP 256 /* bytes programmed between yields */
+static struct {
+    struct thread thread;
+    uint8_t buf[2][2048];
+    uint16_t nr[2]; /* bytes awaiting programming, 0 if buffer is free */
+    uint32_t p; /* next flash address to program */
+    bool_t eof, bad;
+} prg;
+
+static void program_thread(void *unused)
+{
+    unsigned int i = 0, off, n;
+    uint8_t *buf;
+
+    for (;;) {
+        while (!prg.nr[i] && !prg.eof)
+            thread_yield();
+        if (!prg.nr[i])
+            break;
+        buf = prg.buf[i];
+        for (off = 0; off < prg.nr[i]; off += n) {
+            if (!(prg.p & (flash_page_size-1)))
+                fpec_page_erase(prg.p);
+            n = min_t(unsigned int, PRG_STEP, prg.nr[i] - off);
+            fpec_write(&buf[off], n, prg.p);
+            if (memcmp((void *)prg.p, &buf[off], n) != 0) {
+                /* Byte-by-byte verify failed. */
+                prg.bad = TRUE;
+            }
+            prg.p += n;
+            /* Let the USB transfer for the next buffer make progress. */
+            thread_yield();
+        }
+        barrier();
+        prg.nr[i] = 0;
+        i ^= 1;
+    }
+
+    /* Erase the remainder of the old firmware. */
+    prg.p = (prg.p + flash_page_size - 1) & ~(flash_page_size - 1);
+    for (; prg.p < FIRMWARE_END; prg.p += flash_page_size) {
+        fpec_page_erase(prg.p);
+        thread_yield();
+    }
+}
+
 static void msg_display(const char *p)
 {
     printk("[%s]\n", p);
@@ -130,13 +181,11 @@ int update(void *unused)
     static FILINFO fno;
     static char update_fname[FF_MAX_LFN+1];
 
-    /* Our file buffer. Again, off stack. */
-    static uint8_t buf[2048];
-
     uint32_t p;
     uint16_t footer[2], crc;
     UINT i, nr;
     FIL *fp = &file;
+    uint8_t *buf;
 
     /* Find the update file, confirming that it exists and there is no 
      * ambiguity (ie. we don't allow multiple update files). */
@@ -163,7 +212,8 @@ int update(void *unused)
                  || (f_size(fp) > (FIRMWARE_END-FIRMWARE_START))
                  || (f_size(fp) & 3))
         ? FC_bad_file : 0;
-    printk("%u bytes: %s\n", f_size(fp), fail_code ? "BAD" : "OK");
+    printk("%u bytes: %s\n", (unsigned int)f_size(fp),
+           fail_code ? "BAD" : "OK");
     if (fail_code)
         goto fail;
     /* Check signature in footer. */
@@ -178,8 +228,9 @@ int update(void *unused)
     msg_display("CRC");
     crc = 0xffff;
     F_lseek(fp, 0);
+    buf = prg.buf[0];
     for (i = 0; !f_eof(fp); i++) {
-        nr = min_t(UINT, sizeof(buf), f_size(fp) - f_tell(fp));
+        nr = min_t(UINT, sizeof(prg.buf[0]), f_size(fp) - f_tell(fp));
         F_read(&file, buf, nr, NULL);
         crc = crc16_ccitt(buf, nr, crc);
     }
@@ -188,27 +239,30 @@ int update(void *unused)
         goto fail;
     }
 
-    /* Erase the old firmware. */
-    msg_display("CLR");
+    /* Erase and program the new firmware. The next buffer is read into RAM
+     * while the programmer waits on Flash. The file is CRC-checked again as
+     * it streams, in case it reads back differently from the check above. */
+    msg_display("PRG");
     fpec_init();
-    erase_old_firmware();
     old_firmware_erased = TRUE;
-
-    /* Program the new firmware. */
-    msg_display("PRG");
+    prg.p = FIRMWARE_START;
+    thread_start(&prg.thread, _thread1_stacktop, program_thread, NULL);
     crc = 0xffff;
     F_lseek(fp, 0);
-    p = FIRMWARE_START;
-    for (i = 0; !f_eof(fp); i++) {
-        nr = min_t(UINT, sizeof(buf), f_size(fp) - f_tell(fp));
-        F_read(&file, buf, nr, NULL);
-        fpec_write(buf, nr, p);
-        if (memcmp((void *)p, buf, nr) != 0) {
-            /* Byte-by-byte verify failed. */
-            fail_code = FC_bad_prg;
-            goto fail;
-        }
-        p += nr;
+    for (i = 0; !f_eof(fp) && !prg.bad; i ^= 1) {
+        while (prg.nr[i])
+            thread_yield();
+        nr = min_t(UINT, sizeof(prg.buf[i]), f_size(fp) - f_tell(fp));
+        F_read(&file, prg.buf[i], nr, NULL);
+        crc = crc16_ccitt(prg.buf[i], nr, crc);
+        barrier();
+        prg.nr[i] = nr;
+    }
+    prg.eof = TRUE;
+    thread_join(&prg.thread);
+    if (prg.bad || crc) {
+        fail_code = FC_bad_prg;
+        goto fail;
     }
 
     /* Verify the new firmware (CRC-CCITT). */
@@ -311,6 +365,10 @@ int main(void)
     printk("** Keir Fraser <keir.xen@gmail.com>\n");
     printk("** https://github.com/keirf/FlashFloppy\n\n");
 
+    /* Fast path: USB is not started unless the main firmware requested an
+     * update (see fw_update_requested()) or the buttons are held. The reset
+     * returns the peripherals to their power-on state for the main firmware,
+     * which is then entered directly from the top of main(). */
     if (!update_requested && !buttons_pressed())
         reset_to_main_fw();
 
@@ -356,6 +414,9 @@ int main(void)
     /* Do the update. */
     fres = F_call_cancellable(update, NULL);
 
+    /* A FatFS error may have left the programmer thread mid-update. */
+    thread_reset();
+
     if (fres || fail_code) {
 
         /* An error occurred. Report it on the display. */
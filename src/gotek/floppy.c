@@ -278,8 +278,10 @@ static void IRQ_STEP_changed(void)
         return;
 
     /* Valid step request for this drive: start the step operation. */
+    drv->step.interval = time_since(drv->step.start);
     drv->step.start = time_now();
     drv->step.state = STEP_started;
+    trace(step, drv->cyl, drv->step.inward, 0);
     if (drv->outp & m(outp_trk0))
         drive_change_output(drv, outp_trk0, FALSE);
     if (dma_rd != NULL) {
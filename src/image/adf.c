@@ -14,49 +14,10 @@
 #define DD_TRACKLEN_BC 101376 /* multiple of 32 */
 #define POST_IDX_GAP_BC 1024
 
-#define SYNCED      0
-#define SYNC_NEEDED 1
-#define SYNCING     2
-
 /* Shift even/odd bits into MFM data-bit positions */
 #define even(x) ((x)>>1)
 #define odd(x) (x)
 
-static void progress_write(struct image *im)
-{
-    struct image_buf *wb = &im->adf.write_buffer;
-    uint16_t idx, off, cnt;
-
-    ASSERT(im->adf.write_offsets != NULL);
-
-    thread_yield();
-    if (!F_async_isdone(im->adf.write_op))
-        return;
-    if (im->adf.write_cnt) {
-        wb->cons += im->adf.write_cnt;
-        im->adf.write_cnt = 0;
-    }
-    if (wb->prod == wb->cons) {
-        if (im->adf.sync_state == SYNCING)
-            im->adf.sync_state = SYNCED;
-        else if (im->adf.sync_state == SYNC_NEEDED) {
-            im->adf.write_op = disk_ioctl_async(0, CTRL_SYNC, NULL, NULL);
-            im->adf.sync_state = SYNCING;
-        }
-        return;
-    }
-
-    idx = wb->cons % wb->len;
-    off = im->adf.write_offsets[idx];
-    for (cnt = 1; wb->cons + cnt < wb->prod && idx + cnt < wb->len; cnt++)
-        if (im->adf.write_offsets[idx+cnt] != off + cnt)
-            break;
-    F_lseek_async(&im->fp, off*512);
-    im->adf.write_op = F_write_async(&im->fp, wb->p + idx*512, cnt*512, NULL);
-    im->adf.write_cnt = cnt;
-    im->adf.sync_state = SYNC_NEEDED;
-}
-
 static uint32_t amigados_checksum(void *dat, unsigned int bytes)
 {
     uint32_t *p = dat, csum = 0;
@@ -68,49 +29,82 @@ static uint32_t amigados_checksum(void *dat, unsigned int bytes)
     return csum;
 }
 
+/* MFM-encode the even bits of @x. The clock bit preceding the first data
+ * bit depends on the previous long, and is left for emit_raw() to fix up. */
+static always_inline uint32_t mfm_long(uint32_t x)
+{
+    x &= 0x55555555u; /* data bits */
+    return x | ((~((x>>2)|x) & 0x55555555u) << 1); /* clock bits */
+}
+
 static bool_t adf_open(struct image *im)
 {
-    if ((f_size(&im->fp) % (2*11*512)) || (f_size(&im->fp) == 0))
+    struct image_buf *rd = &im->bufs.read_data;
+    uint32_t sz = f_size(&im->fp);
+
+    if ((sz % (2*11*512)) || (sz == 0))
         return FALSE;
 
     im->nr_sides = 2;
-    im->adf.nr_secs = 11;
+    im->adf->nr_secs = 11;
     im->tracklen_bc = DD_TRACKLEN_BC;
     im->ticks_per_cell = (sysclk_stk(im->stk_per_rev) * 16u) / im->tracklen_bc;
 
-    im->nr_cyls = f_size(&im->fp) / (2 * 11 * 512);
+    im->nr_cyls = sz / (2 * 11 * 512);
 
     if (im->nr_cyls > 90) {
         /* HD image: twice as many sectors per track, same data rate. */
         im->nr_cyls /= 2;
         im->stk_per_rev *= 2;
-        im->adf.nr_secs *= 2;
+        im->adf->nr_secs *= 2;
         im->tracklen_bc *= 2;
     }
 
-    im->adf.pre_idx_gap_bc = (im->tracklen_bc
-                              - im->adf.nr_secs * 544 * 16
+    im->adf->pre_idx_gap_bc = (im->tracklen_bc
+                              - im->adf->nr_secs * 544 * 16
                               - POST_IDX_GAP_BC);
 
+    /* Sector header cache, carved from the tail of read_data. */
+    rd->len = (rd->len - 2 * im->adf->nr_secs * sizeof(struct adf_sec_hdr))
+        & ~511;
+    im->adf->sec_hdr = (struct adf_sec_hdr *)((uint8_t *)rd->p + rd->len);
+
     return TRUE;
 }
 
+/* The ring holds the whole current cylinder: side 0 in the primary ring and
+ * side 1 in the shadow. Sector writes are patched straight into it. */
+static void adf_ring_io_init(struct image *im)
+{
+    if (im->adf->ring_io_inited)
+        return;
+    ring_io_init(&im->adf->ring_io, &im->fp, &im->bufs.read_data,
+            (im->cur_track & ~1) * im->adf->nr_secs * 512,
+            ((im->cur_track & ~1) + 1) * im->adf->nr_secs * 512,
+            im->adf->nr_secs);
+    ring_io_tune(&im->adf->ring_io, 2, 8, 0, 0);
+    im->adf->ring_io.map = im->extents;
+    im->adf->ring_io_inited = TRUE;
+}
+
 static void adf_setup_track(
     struct image *im, uint16_t track, uint32_t *start_pos)
 {
     const UINT sec_sz = 512;
-    struct image_buf *rd = &im->bufs.read_data;
     struct image_buf *bc = &im->bufs.read_bc;
     uint32_t decode_off, sector, sys_ticks = start_pos ? *start_pos : 0;
 
     if ((im->cur_track ^ track) & ~1) {
         /* New cylinder: Refresh the sector maps (ordered by sector #). */
         unsigned int sect;
-        for (sect = 0; sect < im->adf.nr_secs; sect++)
-            im->adf.sec_map[0][sect] = im->adf.sec_map[1][sect] = sect;
-        if (im->adf.ring_io_inited)
-            ring_io_shutdown(&im->adf.ring_io);
-        im->adf.ring_io_inited = FALSE;
+        for (sect = 0; sect < im->adf->nr_secs; sect++)
+            im->adf->sec_map[0][sect] = im->adf->sec_map[1][sect] = sect;
+        if (im->adf->ring_io_inited) {
+            ring_io_sync(&im->adf->ring_io);
+            ring_io_shutdown(&im->adf->ring_io);
+        }
+        im->adf->ring_io_inited = FALSE;
+        im->adf->sec_hdr_valid[0] = im->adf->sec_hdr_valid[1] = 0;
     }
 
     im->cur_track = track;
@@ -123,43 +117,30 @@ static void adf_setup_track(
 
     decode_off = im->cur_bc;
     if (decode_off < POST_IDX_GAP_BC) {
-        im->adf.decode_pos = 0;
-        im->adf.sec_idx = 0;
+        im->adf->decode_pos = 0;
+        im->adf->sec_idx = 0;
     } else {
         decode_off -= POST_IDX_GAP_BC;
         sector = decode_off / (544*16);
         decode_off %= 544*16;
-        im->adf.decode_pos = sector + 1;
-        im->adf.sec_idx = sector;
-        if (im->adf.sec_idx >= im->adf.nr_secs)
-            im->adf.sec_idx = 0;
+        im->adf->decode_pos = sector + 1;
+        im->adf->sec_idx = sector;
+        if (im->adf->sec_idx >= im->adf->nr_secs)
+            im->adf->sec_idx = 0;
     }
 
     bc->prod = bc->cons = 0;
 
     if (start_pos) {
-        if (im->adf.ring_io_inited)
-            ring_io_seek(&im->adf.ring_io,
-                    im->adf.sec_map[im->cur_track&1][im->adf.sec_idx] * sec_sz,
+        if (im->adf->ring_io_inited)
+            ring_io_seek(&im->adf->ring_io,
+                    im->adf->sec_map[im->cur_track&1][im->adf->sec_idx] * sec_sz,
                     FALSE, im->cur_track&1);
-        im->adf.trash_bc = decode_off;
+        im->adf->trash_bc = decode_off;
     } else {
-        if (im->adf.write_offsets == NULL) {
-            ring_io_shutdown(&im->adf.ring_io);
-            im->adf.ring_io_inited = FALSE;
-
-            im->adf.write_offsets = rd->p;
-            im->adf.write_buffer.prod = 0;
-            im->adf.write_buffer.cons = 0;
-            im->adf.write_buffer.p = rd->p + 512;
-            im->adf.write_buffer.len = rd->len / 512 - 1;
-            ASSERT(im->adf.write_buffer.len * sizeof(*im->adf.write_offsets)
-                    <= 512);
-            im->adf.write_op = F_async_get_completed_op();
-        }
-
-        im->adf.sec_idx = 0;
-        im->adf.written_secs = 0;
+        adf_ring_io_init(im);
+        im->adf->sec_idx = 0;
+        im->adf->written_secs = 0;
     }
 }
 
@@ -185,34 +166,17 @@ static bool_t adf_read_track(struct image *im)
     uint32_t _r = (r);                                   \
     bc_b[bc_p++ & bc_mask] = htobe32(_r & ~(pr << 31));  \
     pr = _r; })
-#define emit_long(l) ({                                         \
-    uint32_t _l = (l);                                          \
-    _l &= 0x55555555u; /* data bits */                          \
-    _l |= (~((l>>2)|l) & 0x55555555u) << 1; /* clock bits */    \
-    emit_raw(_l); })
-
-    if (im->adf.write_offsets != NULL) {
-        progress_write(im);
-        if (im->adf.sync_state)
-            return FALSE;
-        im->adf.write_offsets = NULL;
-        im->adf.write_buffer.p = NULL;
-    }
-    if (!im->adf.ring_io_inited) {
-        ring_io_init(&im->adf.ring_io, &im->fp, &im->bufs.read_data,
-                (im->cur_track & ~1) * im->adf.nr_secs * 512,
-                ((im->cur_track & ~1) + 1) * im->adf.nr_secs * 512,
-                im->adf.nr_secs);
-        im->adf.ring_io.batch_secs = 2;
-        im->adf.ring_io_inited = TRUE;
-
-        ring_io_seek(&im->adf.ring_io,
-                im->adf.sec_map[im->cur_track&1][im->adf.sec_idx] * sec_sz,
+#define emit_long(l) emit_raw(mfm_long(l))
+
+    if (!im->adf->ring_io_inited) {
+        adf_ring_io_init(im);
+        ring_io_seek(&im->adf->ring_io,
+                im->adf->sec_map[im->cur_track&1][im->adf->sec_idx] * sec_sz,
                 FALSE, im->cur_track&1);
     }
-    ring_io_progress(&im->adf.ring_io);
+    ring_io_progress(&im->adf->ring_io);
 
-    if (im->adf.decode_pos == 0) {
+    if (im->adf->decode_pos == 0) {
 
         /* Post-index track gap */
         if (bc_space < POST_IDX_GAP_BC/32)
@@ -220,21 +184,22 @@ static bool_t adf_read_track(struct image *im)
         for (i = 0; i < POST_IDX_GAP_BC/32; i++)
             emit_long(0);
 
-    } else if (im->adf.decode_pos == im->adf.nr_secs+1) {
+    } else if (im->adf->decode_pos == im->adf->nr_secs+1) {
 
         /* Pre-index track gap */
-        if (bc_space < im->adf.pre_idx_gap_bc/32)
+        if (bc_space < im->adf->pre_idx_gap_bc/32)
             return FALSE;
-        for (i = 0; i < im->adf.pre_idx_gap_bc/32-1; i++)
+        for (i = 0; i < im->adf->pre_idx_gap_bc/32-1; i++)
             emit_long(0);
         emit_raw(0xaaaaaaa0); /* write splice */
-        im->adf.decode_pos = -1;
+        im->adf->decode_pos = -1;
 
     } else {
 
-        uint32_t info, csum, sec_idx = im->adf.decode_pos - 1;
-        uint32_t sector = im->adf.sec_map[hd][sec_idx];
-        uint32_t *buf = rd->p + ring_io_idx(&im->adf.ring_io, rd->cons);
+        uint32_t info, csum, sec_idx = im->adf->decode_pos - 1;
+        uint32_t sector = im->adf->sec_map[hd][sec_idx];
+        uint32_t *buf = rd->p + ring_io_idx(&im->adf->ring_io, rd->cons);
+        struct adf_sec_hdr *h = &im->adf->sec_hdr[hd*im->adf->nr_secs + sec_idx];
 
         if (bc_space < (544*16)/32)
             return FALSE;
@@ -242,6 +207,22 @@ static bool_t adf_read_track(struct image *im)
         if (rd->prod < rd->cons + sec_sz)
             return FALSE;
 
+        /* The header and data checksum change only when the cylinder is
+         * written: encode them once, not every revolution. */
+        if (!(im->adf->sec_hdr_valid[hd] & (1u << sec_idx))) {
+            info = ((0xff << 24)
+                    | (im->cur_track << 16)
+                    | (sector << 8)
+                    | (im->adf->nr_secs - sec_idx));
+            h->info_e = mfm_long(even(info));
+            h->info_o = mfm_long(odd(info));
+            csum = info ^ (info >> 1);
+            h->hdr_csum = mfm_long(odd(csum));
+            csum = amigados_checksum(buf, 512);
+            h->dat_csum = mfm_long(odd(csum));
+            im->adf->sec_hdr_valid[hd] |= 1u << sec_idx;
+        }
+
         /* Sector header */
 
         /* sector gap */
@@ -249,23 +230,17 @@ static bool_t adf_read_track(struct image *im)
         /* sync */
         emit_raw(0x44894489);
         /* info word */
-        info = ((0xff << 24)
-                | (im->cur_track << 16)
-                | (sector << 8)
-                | (im->adf.nr_secs - sec_idx));
-        emit_long(even(info));
-        emit_long(odd(info));
+        emit_raw(h->info_e);
+        emit_raw(h->info_o);
         /* label */
         for (i = 0; i < 8; i++)
             emit_long(0);
         /* header checksum */
-        csum = info ^ (info >> 1);
         emit_long(0);
-        emit_long(odd(csum));
+        emit_raw(h->hdr_csum);
         /* data checksum */
-        csum = amigados_checksum(buf, 512);
         emit_long(0);
-        emit_long(odd(csum));
+        emit_raw(h->dat_csum);
 
         /* Sector data */
 
@@ -273,21 +248,21 @@ static bool_t adf_read_track(struct image *im)
             emit_long(even(be32toh(buf[i])));
         for (i = 0; i < 512/4; i++)
             emit_long(odd(be32toh(buf[i])));
-        im->adf.sec_idx++;
-        if (im->adf.sec_idx >= im->adf.nr_secs)
-            im->adf.sec_idx = 0;
-        ring_io_seek(&im->adf.ring_io,
-                im->adf.sec_map[hd][im->adf.sec_idx] * sec_sz,
+        im->adf->sec_idx++;
+        if (im->adf->sec_idx >= im->adf->nr_secs)
+            im->adf->sec_idx = 0;
+        ring_io_seek(&im->adf->ring_io,
+                im->adf->sec_map[hd][im->adf->sec_idx] * sec_sz,
                 FALSE, im->cur_track&1);
     }
 
-    if (im->adf.trash_bc) {
+    if (im->adf->trash_bc) {
         int16_t to_consume =
-            min_t(uint16_t, (bc_p - bc_c)*16, im->adf.trash_bc);
-        im->adf.trash_bc -= to_consume;
+            min_t(uint16_t, (bc_p - bc_c)*16, im->adf->trash_bc);
+        im->adf->trash_bc -= to_consume;
         bc->cons += to_consume;
     }
-    im->adf.decode_pos++;
+    im->adf->decode_pos++;
     bc->prod = bc_p * 32;
 
     return TRUE;
@@ -301,7 +276,8 @@ static bool_t adf_write_track(struct image *im)
     uint32_t *buf = wr->p;
     unsigned int bufmask = (wr->len / 4) - 1;
     uint32_t *w;
-    struct image_buf *wb = &im->adf.write_buffer;
+    struct image_buf *rd = &im->bufs.read_data;
+    struct ring_io *rio = &im->adf->ring_io;
     uint32_t c = wr->cons / 32, p = wr->prod / 32;
     uint32_t info, dsum, csum;
     unsigned int i, sect;
@@ -339,7 +315,7 @@ static bool_t adf_write_track(struct image *im)
 
         /* Check the info word and header checksum.  */
         if (((info>>16) != ((0xff<<8) | im->cur_track))
-            || (sect >= im->adf.nr_secs) || (csum != 0)) {
+            || (sect >= im->adf->nr_secs) || (csum != 0)) {
             printk("Bad header: info=%08x csum=%08x\n", info, csum);
             continue;
         }
@@ -349,52 +325,62 @@ static bool_t adf_write_track(struct image *im)
             break;
         }
 
-        if (wb->prod - wb->cons >= wb->len) {
+        /* Data checksum. */
+        csum = (buf[c++ & bufmask] & 0x55555555) << 1;
+        csum |= buf[c++ & bufmask] & 0x55555555;
+
+        /* Validate the data checksum before touching the buffered track:
+         * a bad sector leaves the old data in place. */
+        for (i = dsum = 0; i < 256; i++)
+            dsum ^= buf[(c + i) & bufmask];
+        csum = be32toh(csum ^ (dsum & 0x55555555));
+        if (csum != 0) {
+            printk("Bad data: csum=%08x\n", csum);
+            c += 256;
+            continue;
+        }
+
+        /* Claim the sector in the ring. It is wholly overwritten so need not
+         * be read first, unless a read into it is already in flight. */
+        ring_io_seek(rio, sect * 512, TRUE, hd);
+        if (ring_io_writable(rio, 512) != 512) {
+            ring_io_flush(rio);
             c = c_sav;
             flush = FALSE;
             break;
         }
 
-        /* Data checksum. */
-        csum = (buf[c++ & bufmask] & 0x55555555) << 1;
-        csum |= buf[c++ & bufmask] & 0x55555555;
-
-        /* Data area. Decode to a write buffer and key a running checksum.*/
-        im->adf.write_offsets[wb->prod % wb->len]
-            = im->cur_track * im->adf.nr_secs + sect;
-        w = wb->p + (wb->prod % wb->len) * 512;
-        for (i = dsum = 0; i < 128; i++) {
+        /* Data area. Decode straight into the buffered track, from which
+         * reads are served and the sector is written back to the image. */
+        w = rd->p + ring_io_idx(rio, rd->cons);
+        for (i = 0; i < 128; i++) {
             uint32_t o = buf[(c + 128) & bufmask] & 0x55555555;
             uint32_t e = buf[c++ & bufmask] & 0x55555555;
-            dsum ^= o ^ e;
             *w++ = (e << 1) | o;
         }
         c += 128;
-
-        /* Validate the data checksum. */
-        csum = be32toh(csum ^ dsum);
-        if (csum != 0) {
-            printk("Bad data: csum=%08x\n", csum);
-            continue;
-        }
+        rd->cons += 512;
+        ring_io_flush(rio);
+        /* The sector's data and (below) position in the map have changed. */
+        im->adf->sec_hdr_valid[hd] = 0;
 
         printk("Write %u/%u...\n", im->cur_track, sect);
-        wb->prod += 1;
 
         /* All good: add to the write-out batch. */
-        if (!(im->adf.written_secs & (1u<<sect))) {
-            im->adf.written_secs |= 1u<<sect;
-            im->adf.sec_map[hd][im->adf.sec_idx++] = sect;
+        if (!(im->adf->written_secs & (1u<<sect))) {
+            im->adf->written_secs |= 1u<<sect;
+            im->adf->sec_map[hd][im->adf->sec_idx++] = sect;
         }
     }
 
-    progress_write(im);
+    ring_io_progress(rio);
 
-    if (flush && (im->adf.sec_idx != im->adf.nr_secs)) {
+    if (flush && (im->adf->sec_idx != im->adf->nr_secs)) {
         /* End of write: If not all sectors were correctly written,
          * force the default in-order sector map. */
-        for (sect = 0; sect < im->adf.nr_secs; sect++)
-            im->adf.sec_map[hd][sect] = sect;
+        for (sect = 0; sect < im->adf->nr_secs; sect++)
+            im->adf->sec_map[hd][sect] = sect;
+        im->adf->sec_hdr_valid[hd] = 0;
     }
 
     wr->cons = c * 32;
@@ -404,14 +390,10 @@ static bool_t adf_write_track(struct image *im)
 
 static void adf_sync(struct image *im)
 {
-    if (im->adf.write_offsets == NULL) {
-        ring_io_shutdown(&im->adf.ring_io);
-    } else {
-        while (im->adf.sync_state) {
-            progress_write(im);
-            F_async_wait(im->adf.write_op);
-        }
-    }
+    if (!im->adf->ring_io_inited)
+        return;
+    ring_io_sync(&im->adf->ring_io);
+    ring_io_shutdown(&im->adf->ring_io);
 }
 
 const struct image_handler adf_image_handler = {
@@ -423,6 +405,7 @@ const struct image_handler adf_image_handler = {
     .sync = adf_sync,
 
     .async = TRUE,
+    .state_sz = sizeof(struct adf_image),
 };
 
 /*
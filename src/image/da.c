@@ -46,72 +46,172 @@ static void process_wdata(
 
 static unsigned int enc_sec_sz(struct image *im)
 {
-    return im->da.idam_sz + im->da.dam_sz;
+    return im->da->idam_sz + im->da->dam_sz;
 }
 
-static void progress_write(struct image *im)
+/* A burst of writes is synced to the volume once it has been idle this long. */
+#define SYNC_DELAY time_ms(200)
+
+static void swap_sectors(uint32_t *a, uint32_t *b)
+{
+    unsigned int i;
+    uint32_t x;
+    for (i = 0; i < SEC_SZ/4; i++) {
+        x = a[i];
+        a[i] = b[i];
+        b[i] = x;
+    }
+}
+
+/* Stable insertion sort of pending buffer segments [@idx,@idx+@nr) by disk
+ * offset, so that scattered writes coalesce into few volume writes. Repeat
+ * writes to the same sector keep their order. Host writes arrive mostly in
+ * sector order, so this is usually close to linear. */
+static void sort_writes(struct image *im, uint16_t idx, uint16_t nr)
 {
-    struct image_buf *wb = &im->da.write_buffer;
-    uint16_t idx, cnt;
+    struct image_buf *wb = &im->da->write_buffer;
+    LBA_t *offs = im->da->write_offsets, x;
+    uint8_t *p = wb->p;
+    uint16_t i, j;
+
+    for (i = idx + 1; i < idx + nr; i++) {
+        for (j = i; (j > idx) && (offs[j-1] > offs[j]); j--) {
+            x = offs[j-1];
+            offs[j-1] = offs[j];
+            offs[j] = x;
+            swap_sectors((uint32_t *)(p + (j-1)*SEC_SZ),
+                         (uint32_t *)(p + j*SEC_SZ));
+        }
+    }
+}
+
+static void progress_write(struct image *im, bool_t force_sync)
+{
+    struct image_buf *wb = &im->da->write_buffer;
+    LBA_t *offs = im->da->write_offsets;
+    uint16_t idx, cnt, nr;
     LBA_t off;
 
-    ASSERT(im->da.write_offsets != NULL);
+    ASSERT(im->da->write_offsets != NULL);
 
     thread_yield();
-    if (!F_async_isdone(im->da.write_op))
+    if (!F_async_isdone(im->da->write_op))
         return;
-    if (im->da.write_cnt) {
-        wb->cons += im->da.write_cnt;
-        im->da.write_cnt = 0;
+    if (im->da->write_cnt) {
+        wb->cons += im->da->write_cnt;
+        im->da->write_cnt = 0;
     }
     if (wb->prod == wb->cons) {
-        if (im->da.sync_state == SYNCING)
-            im->da.sync_state = SYNCED;
-        else if (im->da.sync_state == SYNC_NEEDED) {
-            im->da.write_op = disk_ioctl_async(0, CTRL_SYNC, NULL, NULL);
-            im->da.sync_state = SYNCING;
+        if (im->da->sync_state == SYNCING)
+            im->da->sync_state = SYNCED;
+        else if ((im->da->sync_state == SYNC_NEEDED)
+                 && (force_sync
+                     || (time_since(im->da->last_write) >= SYNC_DELAY))) {
+            im->da->write_op = disk_ioctl_async(0, CTRL_SYNC, NULL, NULL);
+            im->da->sync_state = SYNCING;
         }
         return;
     }
 
+    /* Sort everything pending up to the end of the ring. */
     idx = wb->cons % wb->len;
-    off = im->da.write_offsets[idx];
-    for (cnt = 1; wb->cons + cnt < wb->prod && idx + cnt < wb->len; cnt++)
-        if (im->da.write_offsets[idx+cnt] != off + cnt)
+    nr = min_t(uint16_t, wb->prod - wb->cons, wb->len - idx);
+    sort_writes(im, idx, nr);
+
+    /* Skip writes superseded by a later write to the same sector. */
+    while ((nr > 1) && (offs[idx] == offs[idx+1])) {
+        wb->cons++;
+        idx++;
+        nr--;
+    }
+
+    off = offs[idx];
+    for (cnt = 1; cnt < nr; cnt++)
+        if (offs[idx+cnt] != off + cnt)
             break;
     ASSERT(off);
-    im->da.write_op = disk_write_async(0, wb->p + idx*512, off, cnt);
-    im->da.write_cnt = cnt;
-    im->da.sync_state = SYNC_NEEDED;
+    im->da->write_op = disk_write_async(0, wb->p + idx*512, off, cnt);
+    im->da->write_cnt = cnt;
+    im->da->sync_state = SYNC_NEEDED;
+}
+
+/* Sectors fetched per read-ahead. */
+#define RA_SECS 8
+/* Volume cache footprint per sector, including overheads. */
+#define CACHE_ENT_SZ (SEC_SZ + 96)
+/* Minimum write buffer, in sectors. */
+#define MIN_WB_SECS 8
+
+/* Fetch sectors around @lba into the volume cache ahead of need, via
+ * multi-sector reads. The emulated disk re-reads the current track window
+ * every revolution, and hosts typically step through LBAs in order, so
+ * nearly all single-sector reads which follow are then cache hits. */
+static void readahead(struct image *im, LBA_t lba)
+{
+    struct directaccess *da = im->da;
+    LBA_t base = da->dass.lba_base;
+
+    if (da->ra_secs == 0)
+        return;
+
+    if ((lba - da->ra_lba) >= (da->ra_end - da->ra_lba)) {
+        /* Miss: fetch from the start of the track window, if that reaches
+         * @lba. The single-sector read queued behind then hits the cache. */
+        da->ra_lba = ((lba - base) < da->ra_secs) ? base : lba;
+        da->ra_end = da->ra_lba + da->ra_secs;
+        disk_read_async(0, da->ra_buf, da->ra_lba, da->ra_secs);
+    }
+
+    /* Sequential host: fetch the next track window too. The cache holds two
+     * read-ahead windows, so only the two most recent are tracked. */
+    if (da->ra_seq
+        && ((int32_t)(da->ra_end - base) >= 0)
+        && ((int32_t)(base + 2*da->dass.nr_sec - da->ra_end) > 0)) {
+        disk_read_async(0, da->ra_buf, da->ra_end, da->ra_secs);
+        da->ra_end += da->ra_secs;
+        if ((da->ra_end - da->ra_lba) > 2*da->ra_secs)
+            da->ra_lba = da->ra_end - 2*da->ra_secs;
+    }
 }
 
 static bool_t da_open(struct image *im)
 {
-    struct da_status_sector *dass = &im->da.dass;
+    struct da_status_sector *dass = &im->da->dass;
     struct image_buf *rd = &im->bufs.read_data;
-    int p_used = 0;
+    int p_used = 0, cache_sz;
     bool_t version_override = (ff_cfg.da_report_version[0] != '\0');
 
     printk("D-A Mode Entered\n");
     im->nr_sides = 1;
 
-    im->da.rd_buf = rd->p + p_used;
+    im->da->rd_buf = rd->p + p_used;
     p_used += SEC_SZ;
-    /* 768 bytes for cache overhead. */
-    volume_cache_init(rd->p + p_used, rd->p + p_used + 8*SEC_SZ + 768);
-    p_used += 8*SEC_SZ + 768;
-    im->da.write_buffer.p = rd->p + p_used;
-    im->da.write_buffer.len =
-        (rd->len - p_used - 3) / (512 + sizeof(*im->da.write_offsets));
-    im->da.write_offsets = rd->p + p_used;
-    p_used += (im->da.write_buffer.len*sizeof(*im->da.write_offsets) + 3) & ~3;
-    p_used += im->da.write_buffer.len * 512;
+    /* Read-ahead needs a staging buffer, and the cache must hold both the
+     * current and the next window. Fall back to single-sector reads into a
+     * minimal cache if space is tight. */
+    im->da->ra_secs = RA_SECS;
+    if ((rd->len - p_used) < (2*RA_SECS*CACHE_ENT_SZ + RA_SECS*SEC_SZ
+                              + MIN_WB_SECS*(512 + sizeof(LBA_t)) + 3))
+        im->da->ra_secs = 0;
+    cache_sz = (im->da->ra_secs ? 2*im->da->ra_secs : 8) * CACHE_ENT_SZ;
+    volume_cache_init(rd->p + p_used, rd->p + p_used + cache_sz);
+    p_used += cache_sz;
+    im->da->ra_buf = rd->p + p_used;
+    p_used += im->da->ra_secs * SEC_SZ;
+    im->da->ra_lba = im->da->ra_end = 0;
+    im->da->ra_seq = FALSE;
+    im->da->write_buffer.p = rd->p + p_used;
+    im->da->write_buffer.len =
+        (rd->len - p_used - 3) / (512 + sizeof(*im->da->write_offsets));
+    im->da->write_offsets = rd->p + p_used;
+    p_used += (im->da->write_buffer.len*sizeof(*im->da->write_offsets) + 3) & ~3;
+    p_used += im->da->write_buffer.len * 512;
     ASSERT(p_used <= rd->len);
-    ASSERT(im->da.write_buffer.len >= 8);
+    ASSERT(im->da->write_buffer.len >= MIN_WB_SECS);
 
-    im->da.write_buffer.prod = 0;
-    im->da.write_buffer.cons = 0;
-    im->da.write_op = F_async_get_completed_op();
+    im->da->write_buffer.prod = 0;
+    im->da->write_buffer.cons = 0;
+    im->da->write_op = F_async_get_completed_op();
 
     switch (display_type) {
     case DT_LED_7SEG:
@@ -132,7 +232,7 @@ static bool_t da_open(struct image *im)
 
 static void da_seek_track(struct image *im, uint16_t track)
 {
-    struct da_status_sector *dass = &im->da.dass;
+    struct da_status_sector *dass = &im->da->dass;
 
     track &= ~1; /* force side 0 */
     if (im->cur_track == track)
@@ -165,29 +265,29 @@ static void da_setup_track(
 
     da_seek_track(im, track);
 
-    nsec = im->da.dass.nr_sec + 1;
+    nsec = im->da->dass.nr_sec + 1;
     switch (im->sync) {
     case SYNC_fm:
-        im->da.idx_sz = FM_GAP_4A;
-        im->da.idam_sz = FM_GAP_SYNC + 5 + 2 + FM_GAP_2;
-        im->da.dam_sz = FM_GAP_SYNC + 1 + SEC_SZ + 2 + FM_GAP_3;
+        im->da->idx_sz = FM_GAP_4A;
+        im->da->idam_sz = FM_GAP_SYNC + 5 + 2 + FM_GAP_2;
+        im->da->dam_sz = FM_GAP_SYNC + 1 + SEC_SZ + 2 + FM_GAP_3;
         im->tracklen_bc = FM_GAP_4;
         break;
     default:
-        im->da.idx_sz = MFM_GAP_4A + MFM_GAP_SYNC + 4 + MFM_GAP_1;
-        im->da.idam_sz = MFM_GAP_SYNC + 8 + 2 + MFM_GAP_2;
-        im->da.dam_sz = MFM_GAP_SYNC + 4 + SEC_SZ + 2 + MFM_GAP_3;
+        im->da->idx_sz = MFM_GAP_4A + MFM_GAP_SYNC + 4 + MFM_GAP_1;
+        im->da->idam_sz = MFM_GAP_SYNC + 8 + 2 + MFM_GAP_2;
+        im->da->dam_sz = MFM_GAP_SYNC + 4 + SEC_SZ + 2 + MFM_GAP_3;
         im->tracklen_bc = MFM_GAP_4;
         break;
     }
 
     im->tracklen_bc += enc_sec_sz(im) * nsec;
-    im->tracklen_bc += im->da.idx_sz;
+    im->tracklen_bc += im->da->idx_sz;
     im->tracklen_bc *= 16;
 
     im->stk_per_rev = stk_sysclk(im->tracklen_bc * im->write_bc_ticks);
 
-    im->da.trk_sec = 0;
+    im->da->trk_sec = 0;
 
     im->cur_bc = (sys_ticks * 16) / im->ticks_per_cell;
     im->cur_bc &= ~15;
@@ -197,44 +297,44 @@ static void da_setup_track(
     im->ticks_since_flux = 0;
 
     decode_off = im->cur_bc / 16;
-    if (decode_off < im->da.idx_sz) {
-        im->da.decode_pos = 0;
+    if (decode_off < im->da->idx_sz) {
+        im->da->decode_pos = 0;
     } else {
-        decode_off -= im->da.idx_sz;
-        im->da.decode_pos = decode_off / enc_sec_sz(im);
-        if (im->da.decode_pos < nsec) {
-            im->da.trk_sec = im->da.decode_pos;
-            im->da.decode_pos = im->da.decode_pos * 2 + 1;
+        decode_off -= im->da->idx_sz;
+        im->da->decode_pos = decode_off / enc_sec_sz(im);
+        if (im->da->decode_pos < nsec) {
+            im->da->trk_sec = im->da->decode_pos;
+            im->da->decode_pos = im->da->decode_pos * 2 + 1;
             decode_off %= enc_sec_sz(im);
-            if (decode_off >= im->da.idam_sz) {
-                decode_off -= im->da.idam_sz;
-                im->da.decode_pos++;
+            if (decode_off >= im->da->idam_sz) {
+                decode_off -= im->da->idam_sz;
+                im->da->decode_pos++;
             }
         } else {
-            im->da.decode_pos = nsec * 2 + 1;
+            im->da->decode_pos = nsec * 2 + 1;
             decode_off -= nsec * enc_sec_sz(im);
        }
     }
 
     rd->prod = rd->cons = 0;
     bc->prod = bc->cons = 0;
-    im->da.read_op_started = FALSE;
+    im->da->read_op_started = FALSE;
 
     if (start_pos) {
-        im->da.trash_bc = decode_off * 16;
+        im->da->trash_bc = decode_off * 16;
         *start_pos = sys_ticks;
     }
 }
 
 static bool_t da_read_track(struct image *im)
 {
-    struct da_status_sector *dass = &im->da.dass;
+    struct da_status_sector *dass = &im->da->dass;
     struct image_buf *rd = &im->bufs.read_data;
-    uint8_t *buf = im->da.rd_buf;
+    uint8_t *buf = im->da->rd_buf;
 
-    progress_write(im);
+    progress_write(im, FALSE);
     if (rd->prod == rd->cons) {
-        uint8_t sec = im->da.trk_sec;
+        uint8_t sec = im->da->trk_sec;
         if (sec == 0) {
             struct da_status_sector *da = (struct da_status_sector *)buf;
             memset(da, 0, SEC_SZ);
@@ -245,21 +345,24 @@ static bool_t da_read_track(struct image *im)
             if (sec == 1)
                 strcpy((char *)buf, im->slot->name);
         } else {
-            if (!im->da.read_op_started) {
-                if (im->da.sync_state)
+            if (!im->da->read_op_started) {
+                LBA_t lba = dass->lba_base+sec-1;
+                /* Reads must observe all buffered writes. A pending sync
+                 * does not matter: the data is already on the volume. */
+                if (im->da->write_buffer.prod != im->da->write_buffer.cons)
                     return FALSE;
-                im->da.read_op =
-                    disk_read_async(0, buf, dass->lba_base+sec-1, 1);
-                im->da.read_op_started = TRUE;
+                readahead(im, lba);
+                im->da->read_op = disk_read_async(0, buf, lba, 1);
+                im->da->read_op_started = TRUE;
             }
             thread_yield();
-            if (!F_async_isdone(im->da.read_op))
+            if (!F_async_isdone(im->da->read_op))
                 return FALSE;
-            im->da.read_op_started = FALSE;
+            im->da->read_op_started = FALSE;
         }
         rd->prod++;
-        if (++im->da.trk_sec >= (dass->nr_sec + 1))
-            im->da.trk_sec = 0;
+        if (++im->da->trk_sec >= (dass->nr_sec + 1))
+            im->da->trk_sec = 0;
     }
 
     return (im->sync == SYNC_fm) ? fm_read_track(im) : mfm_read_track(im);
@@ -267,10 +370,10 @@ static bool_t da_read_track(struct image *im)
 
 static bool_t fm_read_track(struct image *im)
 {
-    struct da_status_sector *dass = &im->da.dass;
+    struct da_status_sector *dass = &im->da->dass;
     struct image_buf *bc = &im->bufs.read_bc;
     struct image_buf *rd = &im->bufs.read_data;
-    uint8_t *buf = im->da.rd_buf;
+    uint8_t *buf = im->da->rd_buf;
     uint16_t *bc_b = bc->p;
     uint32_t bc_len, bc_mask, bc_space, bc_p, bc_c;
     uint16_t crc;
@@ -282,25 +385,25 @@ static bool_t fm_read_track(struct image *im)
     bc_len = bc->len / 2; /* FM words */
     bc_mask = bc_len - 1;
     bc_space = bc_len - (uint16_t)(bc_p - bc_c);
-    if (bc_space < im->da.dam_sz)
+    if (bc_space < im->da->dam_sz)
         return FALSE;
 
 #define emit_raw(r) ({                          \
     uint16_t _r = (r);                          \
     bc_b[bc_p++ & bc_mask] = htobe16(_r); })
-#define emit_byte(b) emit_raw(bintomfm(b) | 0xaaaa)
-    if (im->da.decode_pos == 0) {
+#define emit_byte(b) emit_raw(bintofm(b))
+    if (im->da->decode_pos == 0) {
         /* Post-index track gap */
         for (i = 0; i < FM_GAP_4A; i++)
             emit_byte(0xff);
-    } else if (im->da.decode_pos == (1 + (dass->nr_sec + 1) * 2)) {
+    } else if (im->da->decode_pos == (1 + (dass->nr_sec + 1) * 2)) {
         /* Pre-index track gap */
         for (i = 0; i < FM_GAP_4; i++)
             emit_byte(0xff);
-        im->da.decode_pos = -1;
-    } else if (im->da.decode_pos & 1) {
+        im->da->decode_pos = -1;
+    } else if (im->da->decode_pos & 1) {
         /* IDAM */
-        uint8_t cyl = 254, hd = 0, sec = (im->da.decode_pos-1) >> 1, no = 2;
+        uint8_t cyl = 254, hd = 0, sec = (im->da->decode_pos-1) >> 1, no = 2;
         uint8_t idam[5] = { 0xfe, cyl, hd, sec, no };
         for (i = 0; i < FM_GAP_SYNC; i++)
             emit_byte(0x00);
@@ -318,8 +421,8 @@ static bool_t fm_read_track(struct image *im)
         for (i = 0; i < FM_GAP_SYNC; i++)
             emit_byte(0x00);
         emit_raw(fm_sync(dam[0], FM_SYNC_CLK));
-        for (i = 0; i < SEC_SZ; i++)
-            emit_byte(buf[i]);
+        bin_to_fm_ring(bc_b, bc_mask, bc_p, buf, SEC_SZ);
+        bc_p += SEC_SZ;
         crc = crc16_ccitt(buf, SEC_SZ, FM_DAM_CRC);
         emit_byte(crc >> 8);
         emit_byte(crc);
@@ -330,13 +433,13 @@ static bool_t fm_read_track(struct image *im)
 #undef emit_raw
 #undef emit_byte
 
-    if (im->da.trash_bc) {
+    if (im->da->trash_bc) {
         int16_t to_consume =
-            min_t(uint16_t, (bc_p - bc_c)*16, im->da.trash_bc);
-        im->da.trash_bc -= to_consume;
+            min_t(uint16_t, (bc_p - bc_c)*16, im->da->trash_bc);
+        im->da->trash_bc -= to_consume;
         bc->cons += to_consume;
     }
-    im->da.decode_pos++;
+    im->da->decode_pos++;
     bc->prod = bc_p * 16;
 
     return TRUE;
@@ -344,10 +447,10 @@ static bool_t fm_read_track(struct image *im)
 
 static bool_t mfm_read_track(struct image *im)
 {
-    struct da_status_sector *dass = &im->da.dass;
+    struct da_status_sector *dass = &im->da->dass;
     struct image_buf *bc = &im->bufs.read_bc;
     struct image_buf *rd = &im->bufs.read_data;
-    uint8_t *buf = im->da.rd_buf;
+    uint8_t *buf = im->da->rd_buf;
     uint16_t *bc_b = bc->p;
     uint32_t bc_len, bc_mask, bc_space, bc_p, bc_c;
     uint16_t pr, crc;
@@ -359,7 +462,7 @@ static bool_t mfm_read_track(struct image *im)
     bc_len = bc->len / 2; /* MFM words */
     bc_mask = bc_len - 1;
     bc_space = bc_len - (uint16_t)(bc_p - bc_c);
-    if (bc_space < im->da.dam_sz)
+    if (bc_space < im->da->dam_sz)
         return FALSE;
 
     pr = be16toh(bc_b[(bc_p-1) & bc_mask]);
@@ -368,7 +471,7 @@ static bool_t mfm_read_track(struct image *im)
     bc_b[bc_p++ & bc_mask] = htobe16(_r & ~(pr << 15));  \
     pr = _r; })
 #define emit_byte(b) emit_raw(bintomfm(b))
-    if (im->da.decode_pos == 0) {
+    if (im->da->decode_pos == 0) {
         /* IAM */
         for (i = 0; i < MFM_GAP_4A; i++)
             emit_byte(0x4e);
@@ -379,14 +482,14 @@ static bool_t mfm_read_track(struct image *im)
         emit_byte(0xfc);
         for (i = 0; i < MFM_GAP_1; i++)
             emit_byte(0x4e);
-    } else if (im->da.decode_pos == (1 + (dass->nr_sec + 1) * 2)) {
+    } else if (im->da->decode_pos == (1 + (dass->nr_sec + 1) * 2)) {
         /* Track gap. */
         for (i = 0; i < MFM_GAP_4; i++)
             emit_byte(0x4e);
-        im->da.decode_pos = -1;
-    } else if (im->da.decode_pos & 1) {
+        im->da->decode_pos = -1;
+    } else if (im->da->decode_pos & 1) {
         /* IDAM */
-        uint8_t cyl = 255, hd = 0, sec = (im->da.decode_pos-1) >> 1, no = 2;
+        uint8_t cyl = 255, hd = 0, sec = (im->da->decode_pos-1) >> 1, no = 2;
         uint8_t idam[8] = { 0xa1, 0xa1, 0xa1, 0xfe, cyl, hd, sec, no };
         for (i = 0; i < MFM_GAP_SYNC; i++)
             emit_byte(0x00);
@@ -407,8 +510,8 @@ static bool_t mfm_read_track(struct image *im)
         for (i = 0; i < 3; i++)
             emit_raw(0x4489);
         emit_byte(dam[3]);
-        for (i = 0; i < SEC_SZ; i++)
-            emit_byte(buf[i]);
+        pr = bin_to_mfm_ring(bc_b, bc_mask, bc_p, buf, SEC_SZ, pr);
+        bc_p += SEC_SZ;
         crc = crc16_ccitt(buf, SEC_SZ, MFM_DAM_CRC);
         emit_byte(crc >> 8);
         emit_byte(crc);
@@ -419,13 +522,13 @@ static bool_t mfm_read_track(struct image *im)
 #undef emit_raw
 #undef emit_byte
 
-    if (im->da.trash_bc) {
+    if (im->da->trash_bc) {
         int16_t to_consume =
-            min_t(uint16_t, (bc_p - bc_c)*16, im->da.trash_bc);
-        im->da.trash_bc -= to_consume;
+            min_t(uint16_t, (bc_p - bc_c)*16, im->da->trash_bc);
+        im->da->trash_bc -= to_consume;
         bc->cons += to_consume;
     }
-    im->da.decode_pos++;
+    im->da->decode_pos++;
     bc->prod = bc_p * 16;
 
     return TRUE;
@@ -443,7 +546,7 @@ static bool_t fm_write_track(struct image *im)
     struct image_buf *wr = &im->bufs.write_bc;
     uint16_t *buf = wr->p;
     unsigned int bufmask = (wr->len / 2) - 1;
-    struct image_buf *wb = &im->da.write_buffer;
+    struct image_buf *wb = &im->da->write_buffer;
     uint8_t *wrbuf;
     uint32_t c = wr->cons / 16, p = wr->prod / 16;
     uint32_t base = write->start / im->ticks_per_cell; /* in data bytes */
@@ -477,7 +580,7 @@ static bool_t fm_write_track(struct image *im)
             break;
         }
 
-        sect = (base - im->da.idx_sz - im->da.idam_sz + enc_sec_sz(im)/2)
+        sect = (base - im->da->idx_sz - im->da->idam_sz + enc_sec_sz(im)/2)
             / enc_sec_sz(im);
 
         wrbuf = wb->p + (wb->prod % wb->len) * 512;
@@ -489,7 +592,7 @@ static bool_t fm_write_track(struct image *im)
         process_wdata(im, sect, FM_DAM_CRC, crc_data);
     }
 
-    progress_write(im);
+    progress_write(im, FALSE);
     wr->cons = c * 16;
 
     return flush;
@@ -502,7 +605,7 @@ static bool_t mfm_write_track(struct image *im)
     struct image_buf *wr = &im->bufs.write_bc;
     uint16_t *buf = wr->p;
     unsigned int bufmask = (wr->len / 2) - 1;
-    struct image_buf *wb = &im->da.write_buffer;
+    struct image_buf *wb = &im->da->write_buffer;
     uint8_t *wrbuf;
     uint32_t c = wr->cons / 16, p = wr->prod / 16;
     uint32_t base = write->start / im->ticks_per_cell; /* in data bytes */
@@ -536,7 +639,7 @@ static bool_t mfm_write_track(struct image *im)
         }
 
         case 0xfb: /* Ordinary Sector */ {
-            sect = (base - im->da.idx_sz - im->da.idam_sz + enc_sec_sz(im)/2)
+            sect = (base - im->da->idx_sz - im->da->idam_sz + enc_sec_sz(im)/2)
                 / enc_sec_sz(im);
             crc = MFM_DAM_CRC;
             break;
@@ -568,7 +671,7 @@ static bool_t mfm_write_track(struct image *im)
     }
 
 out:
-    progress_write(im);
+    progress_write(im, FALSE);
     wr->cons = c * 16;
     return flush;
 }
@@ -576,8 +679,8 @@ out:
 static void process_wdata(
         struct image *im, unsigned int sect, uint16_t crc, uint16_t crc_data)
 {
-    struct da_status_sector *dass = &im->da.dass;
-    struct image_buf *wb = &im->da.write_buffer;
+    struct da_status_sector *dass = &im->da->dass;
+    struct image_buf *wb = &im->da->write_buffer;
     uint8_t *wrbuf = wb->p + (wb->prod % wb->len) * 512;
     unsigned int i;
 
@@ -601,15 +704,18 @@ static void process_wdata(
         case CMD_NOP:
             dass->last_cmd_status = 0; /* ok */
             break;
-        case CMD_SET_LBA:
+        case CMD_SET_LBA: {
+            LBA_t next = dass->lba_base + dass->nr_sec;
             for (i = 0; i < 4; i++) {
                 dass->lba_base <<= 8;
                 dass->lba_base |= dac->param[3-i];
             }
             dass->nr_sec = dac->param[5] ?: (im->sync == SYNC_fm) ? 4 : 8;
+            im->da->ra_seq = (dass->lba_base == next);
             printk("D-A LBA %08x, nr=%u\n", dass->lba_base, dass->nr_sec);
             dass->last_cmd_status = 0; /* ok */
             break;
+        }
         case CMD_SET_CYL:
             printk("D-A Cyl A=%u B=%u\n", dac->param[0], dac->param[1]);
             for (i = 0; i < 2; i++)
@@ -642,19 +748,20 @@ static void process_wdata(
     } else if (dass->lba_base != ~0u) {
         /* All good: write out to mass storage. */
         dass->write_cnt++;
-        im->da.write_offsets[wb->prod % wb->len] = dass->lba_base+sect-1;
+        im->da->write_offsets[wb->prod % wb->len] = dass->lba_base+sect-1;
+        im->da->last_write = time_now();
         wb->prod++;
     }
 }
 
 static void da_sync(struct image *im)
 {
-    if (im->da.read_op_started) {
-        F_async_wait(im->da.read_op);
+    if (im->da->read_op_started) {
+        F_async_wait(im->da->read_op);
     }
-    while (im->da.sync_state) {
-        progress_write(im);
-        F_async_wait(im->da.write_op);
+    while (im->da->sync_state) {
+        progress_write(im, TRUE);
+        F_async_wait(im->da->write_op);
     }
     printk("D-A Mode Exited\n");
 }
@@ -668,6 +775,7 @@ const struct image_handler da_image_handler = {
     .sync = da_sync,
 
     .async = TRUE,
+    .state_sz = sizeof(struct directaccess),
 };
 
 /*
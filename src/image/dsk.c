@@ -67,9 +67,63 @@ static struct tib *tib_p(struct image *im)
     return (struct tib *)((char *)rd->p + 256);
 }
 
+/* Stepping back and forth between neighbouring cylinders is common, so keep
+ * the last few TIBs (as fixed up by dsk_read_tib()) and skip the re-read. */
+#define TIB_CACHE_NR ARRAY_SIZE(((struct dsk_image *)0)->tib_tag)
+#define TIB_CACHE_SZ (TIB_CACHE_NR * 256)
+
+static bool_t tib_cache_get(struct image *im, unsigned int nr)
+{
+    unsigned int i;
+    for (i = 0; i < TIB_CACHE_NR; i++) {
+        if (im->dsk->tib_tag[i] == nr + 1) {
+            memcpy(tib_p(im), im->dsk->tib_cache + i * 256, 256);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static void tib_cache_put(struct image *im, unsigned int nr)
+{
+    unsigned int i = im->dsk->tib_next;
+    im->dsk->tib_next = (i + 1) % TIB_CACHE_NR;
+    im->dsk->tib_tag[i] = nr + 1;
+    memcpy(im->dsk->tib_cache + i * 256, tib_p(im), 256);
+}
+
+/* Read and fix up the TIB of track @nr. Returns FALSE if unformatted. */
+static bool_t dsk_read_tib(struct image *im, unsigned int nr)
+{
+    struct tib *tib = tib_p(im);
+    unsigned int i;
+
+    if (tib_cache_get(im, nr))
+        return TRUE;
+
+    F_lseek_async(&im->fp, im->dsk->trk_off);
+    F_async_wait(F_read_async(&im->fp, tib, 256, NULL));
+    if (strncmp(tib->sig, "Track-Info", 10) || !tib->nr_secs)
+        return FALSE;
+
+    /* Clamp number of sectors. */
+    if (tib->nr_secs > ARRAY_SIZE(im->dsk->secs))
+        tib->nr_secs = ARRAY_SIZE(im->dsk->secs);
+
+    /* Compute per-sector actual length. */
+    for (i = 0; i < tib->nr_secs; i++)
+        tib->sib[i].actual_length = im->dsk->extended
+            ? le16toh(tib->sib[i].actual_length)
+            : 128 << min_t(unsigned, tib->sec_sz, 8);
+
+    tib_cache_put(im, nr);
+    return TRUE;
+}
+
 static bool_t dsk_open(struct image *im)
 {
     struct dib *dib = dib_p(im);
+    unsigned int i, nr, off;
 
     /* HACK! We stash TIB in the read-data area. Assert that it is also
      * available at the same offset in the write-data area too. */
@@ -83,7 +137,7 @@ static bool_t dsk_open(struct image *im)
         /* regular DSK */
     } else if (!strncmp(dib->sig, "EXTENDED CPC DSK", 16)) {
         /* extended DSK */
-        im->dsk.extended = 1;
+        im->dsk->extended = 1;
     } else {
         return FALSE;
     }
@@ -105,8 +159,32 @@ static bool_t dsk_open(struct image *im)
 
     im->cur_track = ~0;
 
-    im->dsk.track_data.p = im->bufs.write_data.p + 512 + BATCH_SIZE;
-    im->dsk.track_data.len = im->bufs.write_data.len - 512 - BATCH_SIZE;
+    im->dsk->track_data.p = im->bufs.write_data.p + 512 + BATCH_SIZE;
+    im->dsk->track_data.len = im->bufs.write_data.len - 512 - BATCH_SIZE;
+
+    /* Carve the TIB cache from the bottom of track_data. */
+    im->dsk->tib_cache = im->dsk->track_data.p;
+    im->dsk->track_data.p += TIB_CACHE_SZ;
+    im->dsk->track_data.len -= TIB_CACHE_SZ;
+
+    /* EDSK tracks vary in size: build the track offset table now, rather
+     * than summing the size table on every seek. */
+    if (im->dsk->extended) {
+        nr = im->nr_cyls * im->nr_sides;
+        im->dsk->trk_map = im->dsk->track_data.p;
+        for (i = off = 0; i < nr; i++) {
+            im->dsk->trk_map[i] = off;
+            off += dib->track_szs[i];
+        }
+        off = (nr * sizeof(uint16_t) + 31) & ~31;
+        im->dsk->track_data.p += off;
+        im->dsk->track_data.len -= off;
+    }
+
+    /* Fixed parts of the track layout. */
+    im->dsk->idx_sz = GAP_4A + GAP_SYNC + 4 + GAP_1;
+    im->dsk->idam_sz = GAP_SYNC + 8 + 2 + GAP_2;
+    im->dsk->dam_sz_pre = GAP_SYNC + 4;
 
     return TRUE;
 }
@@ -117,11 +195,13 @@ static void dsk_seek_track(
     struct dib *dib = dib_p(im);
     struct tib *tib = tib_p(im);
     unsigned int i, nr;
+    uint16_t off;
     uint32_t tracklen;
-    uint32_t trk_off, trk_len;
+    uint32_t trk_off, trk_len, ring_bytes;
+    bool_t weak;
 
-    ring_io_sync(&im->dsk.ring_io);
-    ring_io_shutdown(&im->dsk.ring_io);
+    ring_io_sync(&im->dsk->ring_io);
+    ring_io_shutdown(&im->dsk->ring_io);
     im->cur_track = track;
 
     if (cyl >= im->nr_cyls) {
@@ -132,65 +212,59 @@ static void dsk_seek_track(
         goto out;
     }
 
-    im->dsk.trk_off = 0x100;
+    im->dsk->trk_off = 0x100;
     nr = (unsigned int)cyl * im->nr_sides + side;
-    if (im->dsk.extended) {
+    if (im->dsk->extended) {
         if (dib->track_szs[nr] == 0)
             goto unformatted;
-        for (i = 0; i < nr; i++)
-            im->dsk.trk_off += dib->track_szs[i] * 256;
+        im->dsk->trk_off += im->dsk->trk_map[nr] * 256;
         trk_len = dib->track_szs[nr] * 256;
     } else {
         trk_len = le16toh(dib->track_sz);
-        im->dsk.trk_off += nr * trk_len;
+        im->dsk->trk_off += nr * trk_len;
     }
 
     /* Read the Track Info Block and Sector Info Blocks. */
-    F_lseek_async(&im->fp, im->dsk.trk_off);
-    F_async_wait(F_read_async(&im->fp, tib, 256, NULL));
-    im->dsk.trk_off += 256;
-    if (strncmp(tib->sig, "Track-Info", 10) || !tib->nr_secs)
+    if (!dsk_read_tib(im, nr))
         goto unformatted;
+    im->dsk->trk_off += 256;
 
     if (verbose_image_log)
         printk("T%u.%u -> %u.%u: %u sectors\n", cyl, side, tib->track,
                tib->side, tib->nr_secs);
 
-    /* Clamp number of sectors. */
-    if (tib->nr_secs > 29)
-        tib->nr_secs = 29;
-
-    /* Compute per-sector actual length. */
-    for (i = 0; i < tib->nr_secs; i++)
-        tib->sib[i].actual_length = im->dsk.extended
-            ? le16toh(tib->sib[i].actual_length)
-            : 128 << min_t(unsigned, tib->sec_sz, 8);
-
     /* Align to 512-byte boundary for ring_io. */
-    trk_off = im->dsk.trk_off;
+    trk_off = im->dsk->trk_off;
     trk_len += trk_off % 512;
     trk_off -= trk_off % 512;
     trk_len = (trk_len + 511) & ~511;
 
-    ring_io_init(&im->dsk.ring_io, &im->fp, &im->dsk.track_data, trk_off, ~0,
+    ring_io_init(&im->dsk->ring_io, &im->fp, &im->dsk->track_data, trk_off, ~0,
             trk_len / 512);
-    im->dsk.ring_io.batch_secs = 2;
+    ring_io_tune(&im->dsk->ring_io, 2, 8, 0, 0);
+    im->dsk->ring_io.map = im->extents;
 
 out:
-    im->dsk.idx_sz = GAP_4A;
-    im->dsk.idx_sz += GAP_SYNC + 4 + GAP_1;
-    im->dsk.idam_sz = GAP_SYNC + 8 + 2 + GAP_2;
-    im->dsk.dam_sz_pre = GAP_SYNC + 4;
-    im->dsk.dam_sz_post = 2 + tib->gap3;
-
-    /* Work out minimum track length (with no pre-index track gap). */
-    tracklen = (im->dsk.idam_sz + im->dsk.dam_sz_pre + im->dsk.dam_sz_post)
-        * tib->nr_secs;
-    tracklen += im->dsk.idx_sz;
-    for (i = 0; i < tib->nr_secs; i++) {
-        tracklen += data_sz(&tib->sib[i]);
-        if (is_gaps_sector(&tib->sib[i]))
-            tracklen -= im->dsk.dam_sz_post;
+    im->dsk->dam_sz_post = 2 + tib->gap3;
+
+    /* Lay out the sectors once, so that the encoder and the write path
+     * need not walk the SIBs. Also work out minimum track length (with no
+     * pre-index track gap) and whether there are any weak sectors. */
+    tracklen = im->dsk->idx_sz;
+    weak = FALSE;
+    for (i = off = 0; i < tib->nr_secs; i++) {
+        struct sib *sib = &tib->sib[i];
+        struct dsk_sec *sec = &im->dsk->secs[i];
+        sec->off = off;
+        sec->data_sz = data_sz(sib);
+        sec->gaps = is_gaps_sector(sib);
+        sec->copies = sec->data_sz ? sib->actual_length / sec->data_sz : 1;
+        sec->enc_sz = im->dsk->idam_sz + im->dsk->dam_sz_pre + sec->data_sz;
+        if (!sec->gaps)
+            sec->enc_sz += im->dsk->dam_sz_post;
+        off += sib->actual_length;
+        tracklen += sec->enc_sz;
+        weak |= (sec->copies > 1);
     }
     tracklen *= 16;
 
@@ -199,10 +273,19 @@ out:
     im->tracklen_bc = (im->tracklen_bc + 31) & ~31;
 
     /* Now calculate the pre-index track gap. */
-    im->dsk.gap4 = (im->tracklen_bc - tracklen) / 16;
+    im->dsk->gap4 = (im->tracklen_bc - tracklen) / 16;
 
     /* Calculate ticks per revolution */
     im->stk_per_rev = stk_sysclk(im->tracklen_bc * im->write_bc_ticks);
+
+    /* Cache the encoded track in spare track_data above the ring, unless
+     * weak sectors make each revolution different. */
+    ring_bytes = !tib->nr_secs ? 0
+        : weak ? im->dsk->track_data.len : im->dsk->ring_io.ring_len;
+    bc_cache_init(im, &im->dsk->bc_cache,
+                  (uint8_t *)im->dsk->track_data.p + ring_bytes,
+                  (uint8_t *)im->dsk->track_data.p + im->dsk->track_data.len,
+                  im->tracklen_bc);
 }
 
 static uint32_t calc_start_pos(struct image *im)
@@ -212,52 +295,48 @@ static uint32_t calc_start_pos(struct image *im)
     unsigned int i;
 
     /* Calculate start position within the track. */
-    im->dsk.crc = 0xffff;
-    im->dsk.trk_pos = im->dsk.rd_sec_pos = im->dsk.decode_data_pos = 0;
+    im->dsk->crc = 0xffff;
+    im->dsk->trk_pos = im->dsk->rd_sec_pos = im->dsk->decode_data_pos = 0;
     decode_off = im->cur_bc / 16;
-    if (decode_off < im->dsk.idx_sz) {
+    if (decode_off < im->dsk->idx_sz) {
         /* Post-index track gap */
-        im->dsk.decode_pos = 0;
+        im->dsk->decode_pos = 0;
     } else {
-        decode_off -= im->dsk.idx_sz;
+        decode_off -= im->dsk->idx_sz;
         for (i = 0; i < tib->nr_secs; i++) {
-            uint16_t sec_sz = im->dsk.idam_sz + im->dsk.dam_sz_pre
-                + data_sz(&tib->sib[i]) + im->dsk.dam_sz_post;
-            if (is_gaps_sector(&tib->sib[i]))
-                sec_sz -= im->dsk.dam_sz_post;
-            if (decode_off < sec_sz)
+            if (decode_off < im->dsk->secs[i].enc_sz)
                 break;
-            decode_off -= sec_sz;
+            decode_off -= im->dsk->secs[i].enc_sz;
         }
         if (i < tib->nr_secs) {
             /* IDAM */
-            im->dsk.trk_pos = i;
-            im->dsk.decode_pos = i * 4 + 1;
-            if (decode_off >= im->dsk.idam_sz) {
+            im->dsk->trk_pos = i;
+            im->dsk->decode_pos = i * 4 + 1;
+            if (decode_off >= im->dsk->idam_sz) {
                 /* DAM */
-                decode_off -= im->dsk.idam_sz;
-                im->dsk.decode_pos++;
-                if (decode_off >= im->dsk.dam_sz_pre) {
+                decode_off -= im->dsk->idam_sz;
+                im->dsk->decode_pos++;
+                if (decode_off >= im->dsk->dam_sz_pre) {
                     /* Data or Post Data */
-                    decode_off -= im->dsk.dam_sz_pre;
-                    im->dsk.decode_pos++;
-                    if (decode_off < data_sz(&tib->sib[i])) {
+                    decode_off -= im->dsk->dam_sz_pre;
+                    im->dsk->decode_pos++;
+                    if (decode_off < im->dsk->secs[i].data_sz) {
                         /* Data */
-                        im->dsk.rd_sec_pos = decode_off / BATCH_SIZE;
-                        im->dsk.decode_data_pos = im->dsk.rd_sec_pos;
+                        im->dsk->rd_sec_pos = decode_off / BATCH_SIZE;
+                        im->dsk->decode_data_pos = im->dsk->rd_sec_pos;
                         decode_off %= BATCH_SIZE;
                     } else {
                         /* Post Data */
-                        decode_off -= data_sz(&tib->sib[i]);
-                        im->dsk.decode_pos++;
-                        im->dsk.trk_pos = (i + 1) % tib->nr_secs;
+                        decode_off -= im->dsk->secs[i].data_sz;
+                        im->dsk->decode_pos++;
+                        im->dsk->trk_pos = (i + 1) % tib->nr_secs;
                     }
                 }
             }
         } else {
             /* Pre-index track gap */
-            im->dsk.decode_pos = tib->nr_secs * 4 + 1;
-            im->dsk.decode_data_pos = decode_off / BATCH_SIZE;
+            im->dsk->decode_pos = tib->nr_secs * 4 + 1;
+            im->dsk->decode_data_pos = decode_off / BATCH_SIZE;
             decode_off %= BATCH_SIZE;
         }
     }
@@ -277,7 +356,7 @@ static void dsk_setup_track(
     if (track != im->cur_track)
         dsk_seek_track(im, track, cyl, side);
 
-    im->dsk.write_sector = -1;
+    im->dsk->write_sector = -1;
 
     im->cur_bc = (sys_ticks * 16) / im->ticks_per_cell;
     im->cur_bc &= ~15;
@@ -292,62 +371,68 @@ static void dsk_setup_track(
     if (start_pos) {
         decode_off = calc_start_pos(im);
 
-        im->dsk.trash_bc = decode_off * 16;
+        im->dsk->trash_bc = decode_off * 16;
         *start_pos = sys_ticks;
+
+        /* A cached track is replayed from the exact start word. */
+        bc_cache_seek(&im->dsk->bc_cache, im->cur_bc);
+        if (bc_cache_valid(&im->dsk->bc_cache))
+            im->dsk->trash_bc = 0;
     } else {
-        im->dsk.decode_pos = 0;
+        im->dsk->decode_pos = 0;
+        bc_cache_seek(&im->dsk->bc_cache, 0);
     }
 }
 
-static bool_t dsk_read_track(struct image *im)
+static bool_t dsk_encode_track(struct image *im)
 {
     struct tib *tib = tib_p(im);
     struct image_buf *rd = &im->bufs.read_data;
     struct image_buf *bc = &im->bufs.read_bc;
-    uint8_t *buf = (uint8_t *)rd->p + 512; /* skip DIB/TIB */
+    uint8_t *buf = im->dsk->sec_data;
     uint16_t *bc_b = bc->p;
     uint32_t bc_len, bc_mask, bc_space, bc_p, bc_c;
     uint16_t pr, crc;
     unsigned int i;
 
     if (tib->nr_secs && (rd->prod == rd->cons)) {
-        uint16_t off = 0, len;
+        struct dsk_sec *sec = &im->dsk->secs[im->dsk->trk_pos];
+        uint16_t off = sec->off, len = sec->data_sz;
         uint32_t idx;
         bool_t partial = FALSE;
-        for (i = 0; i < im->dsk.trk_pos; i++)
-            off += tib->sib[i].actual_length;
-        len = data_sz(&tib->sib[i]);
-        if (len != tib->sib[i].actual_length) {
+        if (sec->copies > 1) {
             /* Weak sector -- pick different data each revolution. */
-            off += len * (im->dsk.rev % (tib->sib[i].actual_length / len));
+            off += len * (im->dsk->rev % sec->copies);
         }
-        off += im->dsk.rd_sec_pos * BATCH_SIZE;
-        len -= im->dsk.rd_sec_pos * BATCH_SIZE;
+        off += im->dsk->rd_sec_pos * BATCH_SIZE;
+        len -= im->dsk->rd_sec_pos * BATCH_SIZE;
         if (len > BATCH_SIZE) {
             len = BATCH_SIZE;
             partial = TRUE;
         }
-        off += im->dsk.trk_off % 512;
-        ring_io_seek(&im->dsk.ring_io, off, FALSE, FALSE);
-        ring_io_progress(&im->dsk.ring_io);
-        if (im->dsk.track_data.cons + len > im->dsk.track_data.prod)
+        off += im->dsk->trk_off % 512;
+        ring_io_seek(&im->dsk->ring_io, off, FALSE, FALSE);
+        ring_io_progress(&im->dsk->ring_io);
+        if (im->dsk->track_data.cons + len > im->dsk->track_data.prod)
             return FALSE;
 
         if (partial) {
-            im->dsk.rd_sec_pos++;
+            im->dsk->rd_sec_pos++;
         } else {
-            im->dsk.rd_sec_pos = 0;
-            if (++im->dsk.trk_pos >= tib->nr_secs) {
-                im->dsk.trk_pos = 0;
-                im->dsk.rev++;
+            im->dsk->rd_sec_pos = 0;
+            if (++im->dsk->trk_pos >= tib->nr_secs) {
+                im->dsk->trk_pos = 0;
+                im->dsk->rev++;
             }
         }
-        idx = ring_io_idx(&im->dsk.ring_io, im->dsk.track_data.cons);
-        memcpy_fast(buf, im->dsk.track_data.p + idx, len);
+        /* Encode straight from the ring. The ring cursor stays on this data
+         * until the next fetch, so ring_io will not recycle it. */
+        idx = ring_io_idx(&im->dsk->ring_io, im->dsk->track_data.cons);
+        buf = im->dsk->sec_data = (uint8_t *)im->dsk->track_data.p + idx;
         rd->prod++;
     }
     if (tib->nr_secs)
-        ring_io_progress(&im->dsk.ring_io);
+        ring_io_progress(&im->dsk->ring_io);
 
     /* Generate some MFM if there is space in the raw-bitcell ring buffer. */
     bc_p = bc->prod / 16; /* MFM words */
@@ -363,9 +448,9 @@ static bool_t dsk_read_track(struct image *im)
     pr = _r; })
 #define emit_byte(b) emit_raw(mfmtab[(uint8_t)(b)])
 
-    if (im->dsk.decode_pos == 0) {
+    if (im->dsk->decode_pos == 0) {
         /* Post-index track gap */
-        if (bc_space < im->dsk.idx_sz)
+        if (bc_space < im->dsk->idx_sz)
             return FALSE;
         for (i = 0; i < GAP_4A; i++)
             emit_byte(0x4e);
@@ -377,24 +462,24 @@ static bool_t dsk_read_track(struct image *im)
         emit_byte(0xfc);
         for (i = 0; i < GAP_1; i++)
             emit_byte(0x4e);
-    } else if (im->dsk.decode_pos == (tib->nr_secs * 4 + 1)) {
+    } else if (im->dsk->decode_pos == (tib->nr_secs * 4 + 1)) {
         /* Pre-index track gap */
-        uint16_t sz = im->dsk.gap4 - im->dsk.decode_data_pos * BATCH_SIZE;
+        uint16_t sz = im->dsk->gap4 - im->dsk->decode_data_pos * BATCH_SIZE;
         if (bc_space < min_t(unsigned int, sz, BATCH_SIZE))
             return FALSE;
         if (sz > BATCH_SIZE) {
             sz = BATCH_SIZE;
-            im->dsk.decode_data_pos++;
-            im->dsk.decode_pos--;
+            im->dsk->decode_data_pos++;
+            im->dsk->decode_pos--;
         } else {
-            im->dsk.decode_data_pos = 0;
-            im->dsk.decode_pos = -1;
+            im->dsk->decode_data_pos = 0;
+            im->dsk->decode_pos = -1;
         }
         for (i = 0; i < sz; i++)
             emit_byte(0x4e);
     } else {
-        uint8_t sec = (im->dsk.decode_pos-1) >> 2;
-        switch ((im->dsk.decode_pos - 1) & 3) {
+        uint8_t sec = (im->dsk->decode_pos-1) >> 2;
+        switch ((im->dsk->decode_pos - 1) & 3) {
         case 0: /* IDAM */ {
             uint8_t idam[8] = { 0xa1, 0xa1, 0xa1, 0xfe };
             if (bc_space < (GAP_SYNC + 8 + 2 + GAP_2))
@@ -419,7 +504,7 @@ static bool_t dsk_read_track(struct image *im)
         }
         case 1: /* DAM */ {
             uint8_t dam[4] = { 0xa1, 0xa1, 0xa1, 0xfb };
-            if (bc_space < im->dsk.dam_sz_pre)
+            if (bc_space < im->dsk->dam_sz_pre)
                 return FALSE;
             if (tib->sib[sec].stat2 & 0x01)
                 dam[3] = 0x00; /* Missing Address Mark (Data) */
@@ -430,33 +515,33 @@ static bool_t dsk_read_track(struct image *im)
             for (i = 0; i < 3; i++)
                 emit_raw(0x4489);
             emit_byte(dam[3]);
-            im->dsk.crc = crc16_ccitt(dam, sizeof(dam), 0xffff);
+            im->dsk->crc = crc16_ccitt(dam, sizeof(dam), 0xffff);
             break;
         }
         case 2: /* Data */ {
-            uint16_t sec_sz = data_sz(&tib->sib[sec]);
-            sec_sz -= im->dsk.decode_data_pos * BATCH_SIZE;
+            uint16_t sec_sz = im->dsk->secs[sec].data_sz;
+            sec_sz -= im->dsk->decode_data_pos * BATCH_SIZE;
             if (bc_space < min_t(unsigned int, sec_sz, BATCH_SIZE))
                 return FALSE;
             if (sec_sz > BATCH_SIZE) {
                 sec_sz = BATCH_SIZE;
-                im->dsk.decode_data_pos++;
-                im->dsk.decode_pos--;
+                im->dsk->decode_data_pos++;
+                im->dsk->decode_pos--;
             } else {
-                im->dsk.decode_data_pos = 0;
+                im->dsk->decode_data_pos = 0;
             }
-            for (i = 0; i < sec_sz; i++)
-                emit_byte(buf[i]);
-            im->dsk.crc = crc16_ccitt(buf, sec_sz, im->dsk.crc);
+            pr = bin_to_mfm_ring(bc_b, bc_mask, bc_p, buf, sec_sz, pr);
+            bc_p += sec_sz;
+            im->dsk->crc = crc16_ccitt(buf, sec_sz, im->dsk->crc);
             rd->cons++;
             break;
         }
         case 3: /* Post Data */ {
-            if (is_gaps_sector(&tib->sib[sec]))
+            if (im->dsk->secs[sec].gaps)
                 break;
-            if (bc_space < im->dsk.dam_sz_post)
+            if (bc_space < im->dsk->dam_sz_post)
                 return FALSE;
-            crc = im->dsk.crc;
+            crc = im->dsk->crc;
             if ((tib->sib[sec].stat1 & 0x20) && (tib->sib[sec].stat2 & 0x20))
                 crc = ~crc; /* CRC Error in Data */
             emit_byte(crc >> 8);
@@ -468,17 +553,38 @@ static bool_t dsk_read_track(struct image *im)
         }
     }
 
-    if (im->dsk.trash_bc) {
-        int16_t to_consume = min_t(uint16_t, (bc_p - bc_c)*16, im->dsk.trash_bc);
-        im->dsk.trash_bc -= to_consume;
+    if (im->dsk->trash_bc) {
+        int16_t to_consume = min_t(uint16_t, (bc_p - bc_c)*16, im->dsk->trash_bc);
+        im->dsk->trash_bc -= to_consume;
         bc->cons += to_consume;
     }
-    im->dsk.decode_pos++;
+    im->dsk->decode_pos++;
     bc->prod = bc_p * 16;
 
     return TRUE;
 }
 
+static bool_t dsk_read_track(struct image *im)
+{
+    struct bc_cache *c = &im->dsk->bc_cache;
+    uint32_t prod = im->bufs.read_bc.prod;
+    int32_t pre_gap = tib_p(im)->nr_secs * 4 + 1;
+    bool_t in_pre_gap = (im->dsk->decode_pos == pre_gap), ret;
+
+    if (bc_cache_valid(c)) {
+        if (tib_p(im)->nr_secs)
+            ring_io_progress(&im->dsk->ring_io);
+        return bc_cache_replay(im, c);
+    }
+
+    ret = dsk_encode_track(im);
+    /* The revolution ends when we emit the last of the pre-index gap. */
+    if (ret)
+        bc_cache_record(im, c, prod,
+                        in_pre_gap && (im->dsk->decode_pos != pre_gap));
+    return ret;
+}
+
 static int dsk_find_first_write_sector(
     struct image *im, struct write *write, struct tib *tib)
 {
@@ -486,15 +592,12 @@ static int dsk_find_first_write_sector(
     int32_t base = write->start / im->ticks_per_cell; /* in data bytes */
 
     /* Convert write offset to sector number (in rotational order). */
-    base -= im->dsk.idx_sz + im->dsk.idam_sz;
+    base -= im->dsk->idx_sz + im->dsk->idam_sz;
     for (i = 0; i < tib->nr_secs; i++) {
         /* Within small range of expected data start? */
         if ((base >= -64) && (base <= 64))
             break;
-        base -= im->dsk.idam_sz + im->dsk.dam_sz_pre
-            + data_sz(&tib->sib[i]) + im->dsk.dam_sz_post;
-        if (is_gaps_sector(&tib->sib[i]))
-            base += im->dsk.dam_sz_post;
+        base -= im->dsk->secs[i].enc_sz;
     }
 
     if (i >= tib->nr_secs) {
@@ -515,9 +618,12 @@ static bool_t dsk_write_track(struct image *im)
     unsigned int bufmask = (wr->len / 2) - 1;
     uint8_t *wrbuf = (uint8_t *)im->bufs.write_data.p + 512; /* skip DIB/TIB */
     uint32_t c = wr->cons / 16, p = wr->prod / 16;
-    struct image_buf *td = &im->dsk.track_data;
+    struct image_buf *td = &im->dsk->track_data;
     unsigned int i;
 
+    /* Any write may change the track's encoding. */
+    bc_cache_invalidate(&im->dsk->bc_cache);
+
     /* If we are processing final data then use the end index, rounded up. */
     barrier();
     flush = (im->wr_cons != im->wr_bc);
@@ -525,7 +631,7 @@ static bool_t dsk_write_track(struct image *im)
         p = (write->bc_end + 15) / 16;
 
     while ((int16_t)(p - c) > 0) {
-        if (im->dsk.decode_pos == 0) {
+        if (im->dsk->decode_pos == 0) {
             uint8_t x;
             /* When IRQ_write_dma finds the sync it will rewrite 32 bits that
              * may have already been observed by the consumer to align the
@@ -539,10 +645,10 @@ static bool_t dsk_write_track(struct image *im)
                 continue;
             c++;
             if (x == 0xfe) /* IDAM */
-                im->dsk.decode_pos = 1;
+                im->dsk->decode_pos = 1;
             else if (x == 0xfb) /* DAM */
-                im->dsk.decode_pos = 2;
-        } else if (im->dsk.decode_pos == 1) {
+                im->dsk->decode_pos = 2;
+        } else if (im->dsk->decode_pos == 1) {
             /* ID record, shy address mark */
             uint16_t crc;
             if (p - c < 4 + 2)
@@ -555,107 +661,122 @@ static bool_t dsk_write_track(struct image *im)
             crc = crc16_ccitt(wrbuf, i, 0xffff);
             if (crc != 0) {
                 printk("DSK IDAM Bad CRC: %04x, %02x\n", crc, wrbuf[6]);
-                im->dsk.decode_pos = 0;
+                im->dsk->decode_pos = 0;
                 continue;
             }
             /* Convert logical sector number -> rotational number. */
             for (i = 0; i < tib->nr_secs; i++)
                 if (wrbuf[6] == tib->sib[i].r)
                     break;
-            im->dsk.write_sector = i;
-            if (im->dsk.write_sector >= tib->nr_secs) {
+            im->dsk->write_sector = i;
+            im->dsk->formatting = TRUE;
+            if (im->dsk->write_sector >= tib->nr_secs) {
                 printk("DSK IDAM Bad Sector: %02x\n", wrbuf[6]);
-                im->dsk.write_sector = -2;
+                im->dsk->write_sector = -2;
             }
-            im->dsk.decode_data_pos = 0;
-            im->dsk.decode_pos = 0;
-        } else if (im->dsk.decode_pos == 2) {
+            im->dsk->decode_data_pos = 0;
+            im->dsk->decode_pos = 0;
+        } else if (im->dsk->decode_pos == 2) {
             /* Data record, shy address mark */
             unsigned int sec_sz;
-            int sec_nr = im->dsk.write_sector;
+            int sec_nr = im->dsk->write_sector;
 
             if (sec_nr < 0) {
                 if (sec_nr == -1) {
                     sec_nr = dsk_find_first_write_sector(im, write, tib);
-                    im->dsk.write_sector = sec_nr;
-                    im->dsk.decode_data_pos = 0;
+                    im->dsk->write_sector = sec_nr;
+                    im->dsk->formatting = FALSE;
+                    im->dsk->decode_data_pos = 0;
                 }
                 if (sec_nr < 0) {
                     printk("DSK DAM Unknown\n");
-                    im->dsk.write_sector = -2;
-                    im->dsk.decode_pos = 0;
+                    im->dsk->write_sector = -2;
+                    im->dsk->decode_pos = 0;
                     continue;
                 }
             }
 
-            sec_sz = data_sz(&tib->sib[sec_nr]);
+            sec_sz = im->dsk->secs[sec_nr].data_sz;
 
-            if (!im->dsk.decode_data_pos) {
-                unsigned int off;
+            if (!im->dsk->decode_data_pos) {
                 if (p - c < 4) /* Will we able to increment decode_data_pos? */
                     break;
-                im->dsk.crc = MFM_DAM_CRC;
+                im->dsk->crc = MFM_DAM_CRC;
 
                 printk("Write %d[%02x]/%u\n",
                        sec_nr, tib->sib[sec_nr].r, tib->nr_secs);
 
-                for (i = off = 0; i < sec_nr; i++)
-                    off += tib->sib[i].actual_length;
-                off += im->dsk.trk_off % 512;
-                ring_io_seek(&im->dsk.ring_io, off, TRUE, FALSE);
+                ring_io_seek(&im->dsk->ring_io,
+                             im->dsk->secs[sec_nr].off + im->dsk->trk_off % 512,
+                             TRUE, FALSE);
             }
 
-            if (im->dsk.decode_data_pos < sec_sz) {
+            if (im->dsk->decode_data_pos < sec_sz) {
                 unsigned int nr;
-                uint32_t idx = ring_io_idx(&im->dsk.ring_io, td->cons);
-                nr = sec_sz - im->dsk.decode_data_pos;
+                uint32_t idx = ring_io_idx(&im->dsk->ring_io, td->cons);
+                nr = sec_sz - im->dsk->decode_data_pos;
                 nr = min_t(unsigned int, nr,
-                        ring_io_idxend(&im->dsk.ring_io) - idx);
+                        ring_io_idxend(&im->dsk->ring_io) - idx);
                 nr = min_t(unsigned int, nr, p - c);
 
-                /* It should be quite rare to wait on the read, as that'd be
-                 * like a buffer underrun during normal reading. */
-                if (td->cons + nr > td->prod) {
-                    flush = FALSE;
-                    break;
+                if (im->dsk->formatting)
+                    nr = min_t(unsigned int, nr, BATCH_SIZE);
+
+                if (nr && im->dsk->formatting
+                        && ring_io_buffered(&im->dsk->ring_io, nr)) {
+                    /* A format mostly rewrites the data already there. Decode
+                     * aside, so that only changed sectors are written back. */
+                    mfm_ring_to_bin(buf, bufmask, c, wrbuf, nr);
+                    im->dsk->crc = crc16_ccitt(wrbuf, nr, im->dsk->crc);
+                    ring_io_rewrite(&im->dsk->ring_io, wrbuf, nr);
+                } else {
+                    /* Sectors overwritten from their start need not be read
+                     * first. Waiting on the read otherwise should be quite
+                     * rare, as that'd be like a buffer underrun during normal
+                     * reading. */
+                    if (nr && !(nr = ring_io_writable(&im->dsk->ring_io,
+                                                      nr))) {
+                        flush = FALSE;
+                        break;
+                    }
+                    mfm_ring_to_bin(buf, bufmask, c, td->p + idx, nr);
+                    im->dsk->crc = crc16_ccitt(td->p + idx, nr,
+                                               im->dsk->crc);
+                    td->cons += nr;
                 }
-
-                mfm_ring_to_bin(buf, bufmask, c, td->p + idx, nr);
                 c += nr;
-                im->dsk.crc = crc16_ccitt(td->p + idx, nr, im->dsk.crc);
-                td->cons += nr;
-                im->dsk.decode_data_pos += nr;
-                if (im->dsk.decode_data_pos == sec_sz)
-                    ring_io_flush(&im->dsk.ring_io);
+                im->dsk->decode_data_pos += nr;
+                if (im->dsk->decode_data_pos == sec_sz)
+                    ring_io_flush(&im->dsk->ring_io);
             }
 
-            if (im->dsk.decode_data_pos < sec_sz)
+            if (im->dsk->decode_data_pos < sec_sz)
                 continue;
 
             if (p - c < 2)
                 break;
             mfm_ring_to_bin(buf, bufmask, c, wrbuf, 2);
             c += 2;
-            im->dsk.crc = crc16_ccitt(wrbuf, 2, im->dsk.crc);
-            if (im->dsk.crc != 0) {
+            im->dsk->crc = crc16_ccitt(wrbuf, 2, im->dsk->crc);
+            if (im->dsk->crc != 0) {
                 printk("DSK Bad CRC: %04x, %d[%02x]\n",
-                       im->dsk.crc, sec_nr, tib->sib[sec_nr].r);
+                       im->dsk->crc, sec_nr, tib->sib[sec_nr].r);
             }
-            im->dsk.write_sector = -2;
-            im->dsk.decode_pos = 0;
+            im->dsk->write_sector = -2;
+            im->dsk->decode_pos = 0;
         }
     }
 
     if (tib->nr_secs)
-        ring_io_progress(&im->dsk.ring_io);
+        ring_io_progress(&im->dsk->ring_io);
     wr->cons = c * 16;
     return flush;
 }
 
 static void dsk_sync(struct image *im)
 {
-    ring_io_sync(&im->dsk.ring_io);
-    ring_io_shutdown(&im->dsk.ring_io);
+    ring_io_sync(&im->dsk->ring_io);
+    ring_io_shutdown(&im->dsk->ring_io);
 }
 
 const struct image_handler dsk_image_handler = {
@@ -666,6 +787,7 @@ const struct image_handler dsk_image_handler = {
     .write_track = dsk_write_track,
     .sync = dsk_sync,
     .async = TRUE,
+    .state_sz = sizeof(struct dsk_image),
 };
 
 /*
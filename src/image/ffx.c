@@ -0,0 +1,237 @@
+/*
+ * ffx.c
+ *
+ * FlashFloppy native flux (FFX) image files: per-track flux intervals,
+ * pre-quantised to RDATA timer reload values. Build with scripts/mk_ffx.py.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* NB. Fields are little endian. */
+struct ffx_header {
+    char sig[8]; /* "FFXFLUX0" */
+    uint8_t nr_cyls, nr_sides;
+    uint8_t sample_mhz; /* Sample clock: must equal SYSCLK_MHZ */
+    uint8_t rsvd;
+    uint16_t bc_ns; /* Nominal bitcell time: selects DD/HD outputs */
+    uint16_t rsvd2;
+};
+
+/* Track list follows the header, one entry per (cyl, side), side fastest. */
+struct ffx_track {
+    uint32_t off;       /* File offset of track checkpoints, sector aligned */
+    uint32_t nr;        /* Number of samples */
+    uint32_t rev_ticks; /* Sum of sample intervals: SYSCLK ticks per rev */
+};
+
+/* Each track is a sector of checkpoints, followed by its samples. Sample i
+ * is one less than the SYSCLK ticks from flux i-1 (or from the index) to flux
+ * i: exactly as loaded into the RDATA timer. Checkpoint k is the last sample
+ * that starts at or before k * ceil(rev_ticks / FFX_NR_CP) ticks. */
+#define FFX_NR_CP 64
+
+/* Samples buffered in read_bc, feeding the DMA ring. */
+#define MAX_BC_SECS 4
+
+static bool_t ffx_open(struct image *im)
+{
+    struct ffx_header fhdr;
+    struct image_buf *rd = &im->bufs.read_data;
+    uint32_t cp_len = FFX_NR_CP * sizeof(struct ffx_cp);
+
+    F_read(&im->fp, &fhdr, sizeof(fhdr), NULL);
+    if (strncmp(fhdr.sig, "FFXFLUX0", sizeof(fhdr.sig))
+            || (fhdr.nr_cyls == 0)
+            || (fhdr.nr_sides < 1) || (fhdr.nr_sides > 2)
+            || (fhdr.bc_ns == 0))
+        return FALSE;
+
+    /* Samples are timer reload values: they cannot be rescaled on the fly. */
+    if (fhdr.sample_mhz != SYSCLK_MHZ) {
+        printk("FFX: %u MHz samples, need %u MHz\n",
+               fhdr.sample_mhz, SYSCLK_MHZ);
+        return FALSE;
+    }
+
+    im->nr_cyls = fhdr.nr_cyls;
+    im->nr_sides = fhdr.nr_sides;
+    im->write_bc_ticks = sysclk_ns(le16toh(fhdr.bc_ns));
+    im->ticks_per_cell = im->write_bc_ticks * 16;
+    im->sync = SYNC_none;
+
+    /* Current track's checkpoints, carved from the tail of read_data. */
+    rd->len = (rd->len - cp_len) & ~511;
+    im->ffx->cp = (struct ffx_cp *)((uint8_t *)rd->p + rd->len);
+
+    return TRUE;
+}
+
+static void ffx_seek_track(struct image *im, uint16_t track)
+{
+    struct image_buf *rd = &im->bufs.read_data;
+    struct ffx_image *ffx = im->ffx;
+    struct ffx_track trk;
+    unsigned int i = (track/2) * im->nr_sides + (track&1);
+
+    F_lseek_async(&im->fp, sizeof(struct ffx_header) + i*sizeof(trk));
+    F_async_wait(F_read_async(&im->fp, &trk, sizeof(trk), NULL));
+    trk.off = le32toh(trk.off);
+    ffx->nr = le32toh(trk.nr);
+    trk.rev_ticks = le32toh(trk.rev_ticks);
+    if ((trk.off % 512) || (ffx->nr == 0) || (ffx->nr > 0x7fffff)
+            || (trk.rev_ticks == 0))
+        F_die(FR_BAD_IMAGE);
+
+    F_lseek_async(&im->fp, trk.off);
+    F_async_wait(F_read_async(&im->fp, ffx->cp,
+                              FFX_NR_CP * sizeof(struct ffx_cp), NULL));
+
+    im->tracklen_ticks = trk.rev_ticks * 16;
+    im->stk_per_rev = stk_sysclk(trk.rev_ticks);
+
+    image_prefetch_reserve(im, rd->p, (uint8_t *)rd->p
+            + min_t(uint32_t, rd->len, (ffx->nr*2 + 511) & ~511));
+    ring_io_init(&ffx->ring_io, &im->fp, rd,
+            trk.off + 512, ~0, (ffx->nr*2 + 511) / 512);
+    /* Flux samples stream at several times the rate of HFE bitcells. */
+    ring_io_tune(&ffx->ring_io, 8, 32, MAX_BC_SECS, 2*MAX_BC_SECS);
+    ffx->ring_io.map = im->extents;
+}
+
+static void ffx_setup_track(
+    struct image *im, uint16_t track, uint32_t *start_pos)
+{
+    struct image_buf *bc = &im->bufs.read_bc;
+    struct ffx_image *ffx = im->ffx;
+    uint8_t cyl = min_t(uint8_t, track >> 1, im->nr_cyls - 1);
+    uint8_t side = track & (im->nr_sides - 1);
+    uint32_t sys_ticks, rev_ticks;
+    struct ffx_cp *cp;
+
+    track = cyl*2 + side;
+    if (track != im->cur_track) {
+        ring_io_shutdown(&ffx->ring_io);
+        ffx_seek_track(im, track);
+        im->cur_track = track;
+    }
+
+    /* Start at the latest checkpoint at or before the requested position. */
+    rev_ticks = im->tracklen_ticks / 16;
+    sys_ticks = (start_pos ? *start_pos : 0) % rev_ticks;
+    cp = &ffx->cp[sys_ticks / ((rev_ticks + FFX_NR_CP - 1) / FFX_NR_CP)];
+    ffx->pos = le32toh(cp->sample);
+    if (ffx->pos >= ffx->nr)
+        F_die(FR_BAD_IMAGE);
+    sys_ticks = le32toh(cp->ticks);
+    im->cur_ticks = sys_ticks * 16;
+    im->ticks_since_flux = 0;
+
+    bc->prod = bc->cons = 0;
+    ring_io_seek(&ffx->ring_io, ffx->pos * 2, FALSE, FALSE);
+    if (start_pos)
+        *start_pos = sys_ticks;
+}
+
+static bool_t ffx_read_track(struct image *im)
+{
+    struct image_buf *rd = &im->bufs.read_data;
+    struct image_buf *bc = &im->bufs.read_bc;
+    struct ffx_image *ffx = im->ffx;
+    struct ring_io *rio = &ffx->ring_io;
+    uint8_t *buf = rd->p, *bc_b = bc->p;
+    uint32_t bc_p, bc_c, bc_mask, bc_space, pos, nr, trk_len = ffx->nr*2;
+    bool_t progress = FALSE;
+
+    ring_io_progress(rio);
+
+    /* Copy samples from the ring into the sample ring (read_bc). Sectors are
+     * contiguous in the ring; the sample ring is a power of two. */
+    bc_p = bc->prod;
+    bc_c = bc->cons;
+    bc_mask = bc->len - 1;
+    for (;;) {
+        bc_space = min_t(uint32_t, bc->len, MAX_BC_SECS*512)
+            - (bc_p - bc_c);
+        if ((rd->cons >= rd->prod) || (bc_space == 0))
+            break;
+        pos = ring_io_pos(rio, rd->cons);
+        if (pos >= trk_len) {
+            /* Skip padding to the end of the track. Samples resume at the
+             * index, at the head of the ring. */
+            rd->cons += rio->f_len - pos;
+            continue;
+        }
+        nr = min_t(uint32_t, rd->prod - rd->cons, bc_space);
+        nr = min_t(uint32_t, nr, 512 - (rd->cons & 511));
+        nr = min_t(uint32_t, nr, trk_len - pos);
+        nr = min_t(uint32_t, nr, bc->len - (bc_p & bc_mask));
+        memcpy(&bc_b[bc_p & bc_mask], &buf[ring_io_idx(rio, rd->cons)], nr);
+        rd->cons += nr;
+        bc_p += nr;
+        progress = TRUE;
+    }
+
+    barrier();
+    bc->prod = bc_p;
+
+    return progress;
+}
+
+static ramfunc uint16_t ffx_rdata_flux(
+    struct image *im, uint16_t *tbuf, uint16_t nr)
+{
+    struct image_buf *bc = &im->bufs.read_bc;
+    struct ffx_image *ffx = im->ffx;
+    uint16_t *bc_b = bc->p;
+    uint32_t bc_c = bc->cons / 2, bc_mask = bc->len / 2 - 1;
+    uint32_t ticks = im->cur_ticks, pos = ffx->pos, x, todo, done;
+
+    done = todo = min_t(uint32_t, nr, (bc->prod / 2) - bc_c);
+
+    /* Samples are the DMA ring's own format. Only the rotational position
+     * needs tracking, for index timing. */
+    for (; todo != 0; todo--) {
+        *tbuf++ = x = le16toh(bc_b[bc_c++ & bc_mask]);
+        ticks += (x + 1) << 4;
+        if (++pos == ffx->nr) {
+            pos = 0;
+            im->tracklen_ticks = ticks;
+            ticks = 0;
+        }
+    }
+
+    bc->cons = bc_c * 2;
+    im->cur_ticks = ticks;
+    ffx->pos = pos;
+    return done;
+}
+
+static void ffx_sync(struct image *im)
+{
+    ring_io_shutdown(&im->ffx->ring_io);
+}
+
+/* Read only: there is no bitcell stream to write back into. */
+const struct image_handler ffx_image_handler = {
+    .open = ffx_open,
+    .setup_track = ffx_setup_track,
+    .read_track = ffx_read_track,
+    .rdata_flux = ffx_rdata_flux,
+    .sync = ffx_sync,
+
+    .async = TRUE,
+    .state_sz = sizeof(struct ffx_image),
+};
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
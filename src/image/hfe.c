@@ -55,10 +55,8 @@ enum {
     IFM_Disable = 0xfe
 };
 
-struct track_header {
-    uint16_t offset;
-    uint16_t len;
-};
+/* The track LUT is an array of struct hfe_trk, one per cylinder, in units
+ * of 512-byte blocks and bytes respectively. Little endian on file. */
 
 /* HFEv3 opcodes. The 4-bit codes have their bit ordering reversed. */
 enum {
@@ -74,24 +72,38 @@ enum {
 #define absdiff_t(type,x,y) \
     ({ type __x = (x); type __y = (y); __x < __y ? __y-__x: __x-__y; })
 
-static void hfe_seek_track(struct image *im, uint16_t track, bool_t async);
+static void hfe_seek_track(struct image *im, uint16_t track);
+
+/* Read file data outside the ring: header and track LUT. */
+static void hfe_file_read(struct image *im, FSIZE_t off, void *buf, UINT len)
+{
+    if (im->hfe->z) {
+        zimg_read(im->hfe->z, off, buf, len);
+    } else {
+        F_lseek(&im->fp, off);
+        F_read(&im->fp, buf, len, NULL);
+    }
+}
 
 static bool_t hfe_open(struct image *im)
 {
     struct disk_header dhdr;
+    struct image_buf *rd = &im->bufs.read_data;
     uint16_t bitrate;
+    unsigned int i;
     /* File data is less compact since it contains data for both heads. */
     uint32_t norm_buf_size = im->bufs.write_bc.len + im->bufs.read_data.len/2;
 
-    F_read(&im->fp, &dhdr, sizeof(dhdr), NULL);
+    hfe_file_read(im, 0, &dhdr, sizeof(dhdr));
     if (!strncmp(dhdr.sig, "HXCHFEV3", sizeof(dhdr.sig))) {
         if (dhdr.formatrevision > 0)
             return FALSE;
-        im->hfe.is_v3 = TRUE;
+        im->hfe->is_v3 = TRUE;
+        im->hfe->rnd = rand();
     } else if (!strncmp(dhdr.sig, "HXCPICFE", sizeof(dhdr.sig))) {
         if (dhdr.formatrevision > 1)
             return FALSE;
-        im->hfe.is_v3 = FALSE;
+        im->hfe->is_v3 = FALSE;
     } else {
         return FALSE;
     }
@@ -104,98 +116,162 @@ static bool_t hfe_open(struct image *im)
         return FALSE;
     }
 
-    im->hfe.double_step = !dhdr.single_step;
-    im->hfe.tlut_base = le16toh(dhdr.track_list_offset);
+    im->hfe->double_step = !dhdr.single_step;
+    im->hfe->nr_tracks = dhdr.nr_tracks;
     im->nr_cyls = dhdr.nr_tracks;
-    if (im->hfe.double_step)
+    if (im->hfe->double_step)
         im->nr_cyls = min_t(unsigned int, im->nr_cyls*2, 255);
     im->nr_sides = dhdr.nr_sides;
     im->write_bc_ticks = sysclk_us(500) / bitrate;
     im->ticks_per_cell = im->write_bc_ticks * 16;
     im->sync = SYNC_none;
 
+    /* The track LUT is small: hold it whole, carved from the tail of
+     * read_data, so that seeks need not wait on the media to find a track. */
+    rd->len = (rd->len - dhdr.nr_tracks * sizeof(struct hfe_trk)) & ~3;
+    im->hfe->tlut = (struct hfe_trk *)((uint8_t *)rd->p + rd->len);
+    hfe_file_read(im, le16toh(dhdr.track_list_offset) * 512, im->hfe->tlut,
+                  dhdr.nr_tracks * sizeof(struct hfe_trk));
+    for (i = 0; i < dhdr.nr_tracks; i++) {
+        im->hfe->tlut[i].off = le16toh(im->hfe->tlut[i].off);
+        im->hfe->tlut[i].len = le16toh(im->hfe->tlut[i].len);
+    }
+
     /* Get an initial value for ticks per revolution. */
-    hfe_seek_track(im, 0, FALSE);
+    hfe_seek_track(im, 0);
     im->cur_track = -1;
 
     /* Not essential, but we want to know if we are unable to fully buffer
      * writes for an HD track when we'd expect there to be enough RAM to make
      * it possible. */
-    ASSERT(ram_kb < 64 || ((200000/8 + 255) & ~255) < norm_buf_size);
+    ASSERT(ram_kb < 64 || im->hfe->z
+           || ((200000/8 + 255) & ~255) < norm_buf_size);
 
     return TRUE;
 }
 
-static void hfe_seek_track(struct image *im, uint16_t track, bool_t async)
+/* HFZ: an HFE image in a compressed container (see scripts/zimg.py). The
+ * decoder's buffers are carved from read_data before it is put to use. */
+static bool_t hfz_open(struct image *im)
 {
-    struct track_header thdr;
-    uint16_t trk_off, old_len;
+    uint32_t rd_len = im->bufs.read_data.len;
 
-    if (async) {
-        F_lseek_async(&im->fp, im->hfe.tlut_base*512 + (track/2)*4);
-        F_async_wait(F_read_async(&im->fp, &thdr, sizeof(thdr), NULL));
-    } else {
-        F_lseek(&im->fp, im->hfe.tlut_base*512 + (track/2)*4);
-        F_read(&im->fp, &thdr, sizeof(thdr), NULL);
-    }
+    if ((im->hfe->z = zimg_open(&im->fp, &im->bufs.read_data)) == NULL)
+        return FALSE;
+    if (hfe_open(im))
+        return TRUE;
+    im->bufs.read_data.len = rd_len;
+    return FALSE;
+}
 
-    trk_off = le16toh(thdr.offset);
-    old_len = im->hfe.trk_len;
-    im->hfe.trk_len = le16toh(thdr.len) / 2;
-    im->tracklen_bc = im->hfe.trk_len * 8;
+static void hfe_seek_track(struct image *im, uint16_t track)
+{
+    struct image_buf *rd = &im->bufs.read_data;
+    const struct hfe_trk *t = &im->hfe->tlut[track/2];
+    uint16_t old_len;
+
+    old_len = im->hfe->trk_len;
+    im->hfe->trk_len = t->len / 2;
+    im->tracklen_bc = im->hfe->trk_len * 8;
+    for (im->hfe->cp_shift = 11;
+         (im->tracklen_bc >> im->hfe->cp_shift) >= HFE_MAX_CP;
+         im->hfe->cp_shift++)
+        continue;
     /* Opcodes in v3 make it difficult to predict the track's length. Keep the
      * previous track's value if the track byte lengths are close. */
-    if (!(im->hfe.is_v3 && im->stk_per_rev
-            && absdiff_t(uint16_t, old_len, im->hfe.trk_len) < 256))
+    if (!(im->hfe->is_v3 && im->stk_per_rev
+            && absdiff_t(uint16_t, old_len, im->hfe->trk_len) < 256))
         im->stk_per_rev = stk_sysclk(im->tracklen_bc * im->write_bc_ticks);
 
-    ring_io_init(&im->hfe.ring_io, &im->fp, &im->bufs.read_data,
-            (LBA_t)trk_off * 512, ~0, (im->hfe.trk_len*2 + 511) / 512);
+    image_prefetch_reserve(im, rd->p, (uint8_t *)rd->p
+            + min_t(uint32_t, rd->len, (im->hfe->trk_len*2 + 511) & ~511));
+    ring_io_init(&im->hfe->ring_io, &im->fp, rd,
+            (LBA_t)t->off * 512, ~0, (im->hfe->trk_len*2 + 511) / 512);
     /* Aggressively batch our reads at HD data rate, as that can be faster
-     * than some USB drives will serve up a single block.*/
-    im->hfe.ring_io.batch_secs =
-        (im->write_bc_ticks > sysclk_ns(1500)) ? 4 : 8;
-    im->hfe.ring_io.trailing_secs = MAX_BC_SECS;
+     * than some USB drives will serve up a single block. Slow drives may
+     * need larger batches still, which ring_io will discover. */
+    ring_io_tune(&im->hfe->ring_io,
+                 (im->write_bc_ticks > sysclk_ns(1500)) ? 4 : 8, 16,
+                 MAX_BC_SECS, 2*MAX_BC_SECS);
+    im->hfe->ring_io.map = im->extents;
+    im->hfe->ring_io.z = im->hfe->z;
 }
 
-static void hfe_setup_track(
-    struct image *im, uint16_t track, uint32_t *start_pos)
+/* Record checkpoints from here only if cur_bc and cur_ticks agree exactly. */
+static void hfe_cp_arm(struct image *im, bool_t exact)
 {
-    struct image_buf *bc = &im->bufs.read_bc;
-    uint32_t sys_ticks, opcode_adj_bc = 0;
-    uint8_t cyl = track >> (im->hfe.double_step ? 2 : 1);
-    uint8_t side = track & (im->nr_sides - 1);
-    int i;
+    struct hfe_image *hfe = im->hfe;
 
-    track = cyl*2 + side;
-    if (track/2 != im->cur_track/2) {
-        ring_io_sync(&im->hfe.ring_io);
-        ring_io_shutdown(&im->hfe.ring_io);
+    hfe->cp_exact = exact;
+    hfe->cp_next = (exact && (hfe->cp_nr < HFE_MAX_CP))
+        ? (uint32_t)hfe->cp_nr << hfe->cp_shift : ~0u;
+}
 
-        im->cur_track = track;
-        hfe_seek_track(im, track, TRUE);
-    } else if (track != im->cur_track) {
-        im->cur_track = track;
+static void hfe_cp_record(struct image *im)
+{
+    struct hfe_image *hfe = im->hfe;
+    struct hfe_cp *cp = &hfe->cp[hfe->cp_nr];
+
+    cp->ticks = im->cur_ticks;
+    cp->bc_off = im->cur_bc - hfe->cp_next;
+    cp->ticks_per_cell = im->ticks_per_cell;
+    hfe->cp_nr++;
+    hfe_cp_arm(im, TRUE);
+}
+
+/* Find the bitcell at rotational position @ticks from the checkpoints. Within
+ * the enclosing checkpoint interval, assume its opcodes to be evenly spread. */
+static bool_t hfe_cp_seek(struct image *im, uint32_t ticks)
+{
+    struct hfe_image *hfe = im->hfe;
+    struct hfe_cp *cp;
+    uint32_t bc, end_bc, end_ticks, cells, nr, tpc;
+    unsigned int i;
+
+    if (!hfe->is_v3 || !hfe->cp_nr)
+        return FALSE;
+
+    for (i = 1; i < hfe->cp_nr; i++)
+        if (ticks < hfe->cp[i].ticks)
+            break;
+    cp = &hfe->cp[i-1];
+    bc = ((uint32_t)(i-1) << hfe->cp_shift) + cp->bc_off;
+    if (i < hfe->cp_nr) {
+        end_bc = ((uint32_t)i << hfe->cp_shift) + cp[1].bc_off;
+        end_ticks = cp[1].ticks;
+    } else if (hfe->cp_full && (ticks < im->tracklen_ticks)) {
+        end_bc = im->tracklen_bc;
+        end_ticks = im->tracklen_ticks;
+    } else {
+        return FALSE;
     }
 
-    /* If track does not fit in memory, now is a good time to flush writes to
-     * reduce chances of future buffer underrun caused by a very slow write.
-     * However if write-drain=realtime, then any delays cut into reads so we
-     * just accept the buffer underrun risk. */
-    if ((im->hfe.trk_len*2 + 511) / 512 > im->bufs.read_data.len
-            && ff_cfg.write_drain != WDRAIN_realtime)
-        ring_io_sync(&im->hfe.ring_io);
+    tpc = cp->ticks_per_cell;
+    nr = (ticks - cp->ticks) / tpc;
+    cells = (end_ticks - cp->ticks) / tpc;
+    im->cur_ticks = cp->ticks + nr * tpc;
+    if (cells != 0)
+        nr = min_t(uint32_t, nr, cells) * (end_bc - bc) / cells;
+    im->cur_bc = bc + nr;
+    im->ticks_per_cell = tpc;
+    im->write_bc_ticks = tpc / 16;
+    return TRUE;
+}
 
-    sys_ticks = start_pos ? *start_pos : get_write(im, im->wr_cons)->start;
-    im->cur_bc = (sys_ticks * 16) / im->ticks_per_cell;
-    if (im->hfe.is_v3 && im->tracklen_ticks > 0
+static void hfe_estimate_pos(struct image *im, uint32_t ticks)
+{
+    uint32_t opcode_adj_bc = 0;
+
+    im->cur_bc = ticks / im->ticks_per_cell;
+    if (im->hfe->is_v3 && im->tracklen_ticks > 0
         && im->tracklen_ticks < im->tracklen_bc * im->ticks_per_cell) {
 
         /* If there are opcodes (other than random) in the track, seeking will
          * not be precise as opcodes contribute zero bitcells and thus zero
          * ticks. The HFE track data will _appear_ misaligned to the previous
-         * until the track is read from the beginning. Misalignment greater
-         * than 3 ms is possible and can shift writes backward in time.
+         * until the track has been read from the beginning, and checkpoints
+         * recorded. Misalignment greater than 3 ms is possible and can shift
+         * writes backward in time.
          *
          * Severe misalignment is most likely caused by regular occurrences of
          * OP_bitrate evenly distributed through the track. Assume opcodes
@@ -212,10 +288,68 @@ static void hfe_setup_track(
         opcode_adj_bc  = 0;
     }
     im->cur_ticks = im->cur_bc * im->ticks_per_cell;
-    im->ticks_since_flux = 0;
 
     /* Must be careful to exclude opcode_adj_bc from tick calculations. */
     im->cur_bc += opcode_adj_bc;
+}
+
+/* Does the current cylinder's track data not fit in the read buffer? */
+static bool_t track_exceeds_buffer(struct image *im)
+{
+    return (im->hfe->trk_len*2 + 511) / 512 > im->bufs.read_data.len;
+}
+
+static void hfe_setup_track(
+    struct image *im, uint16_t track, uint32_t *start_pos)
+{
+    struct image_buf *bc = &im->bufs.read_bc;
+    uint32_t sys_ticks;
+    uint8_t cyl = track >> (im->hfe->double_step ? 2 : 1);
+    uint8_t side = track & (im->nr_sides - 1);
+    bool_t adaptive = (ff_cfg.write_drain == WDRAIN_adaptive);
+    bool_t eager, cyl_change;
+    int i;
+
+    track = cyl*2 + side;
+    cyl_change = (track/2 != im->cur_track/2);
+
+    /* write-drain=adaptive: Drain now if the media can complete the writeback
+     * within the host's head-settle time, else let it drain behind reads.
+     * Asked only where a drain is at stake, so that the logged decisions
+     * count real ones. */
+    eager = adaptive && (cyl_change || track_exceeds_buffer(im))
+        && ring_io_drain_eager(&im->hfe->ring_io,
+                               ff_cfg.head_settle_ms * 1000);
+
+    if (track != im->cur_track) {
+        if (cyl_change) {
+            if (eager) {
+                ring_io_sync(&im->hfe->ring_io);
+                ring_io_shutdown(&im->hfe->ring_io);
+            } else {
+                ring_io_detach(&im->hfe->ring_io);
+            }
+            hfe_seek_track(im, track);
+        }
+        im->cur_track = track;
+        im->hfe->cp_nr = 0;
+        im->hfe->cp_full = FALSE;
+    }
+
+    /* If track does not fit in memory, now is a good time to flush writes to
+     * reduce chances of future buffer underrun caused by a very slow write.
+     * However if write-drain=realtime, then any delays cut into reads so we
+     * just accept the buffer underrun risk. */
+    if (track_exceeds_buffer(im)
+            && (adaptive ? eager : ff_cfg.write_drain != WDRAIN_realtime))
+        ring_io_sync(&im->hfe->ring_io);
+
+    sys_ticks = start_pos ? *start_pos : get_write(im, im->wr_cons)->start;
+    if (!hfe_cp_seek(im, sys_ticks * 16)
+        || (im->cur_bc >= im->tracklen_bc))
+        hfe_estimate_pos(im, sys_ticks * 16);
+    im->ticks_since_flux = 0;
+    hfe_cp_arm(im, im->cur_bc == 0);
 
     sys_ticks = im->cur_ticks / 16;
 
@@ -224,11 +358,11 @@ static void hfe_setup_track(
     for (i = 0; i < im->index_pulses_len; i++)
         if (im->cur_ticks < im->index_pulses[i])
             break;
-    im->hfe.next_index_pulses_pos = i;
+    im->hfe->next_index_pulses_pos = i;
 
     if (start_pos) {
         /* Read mode. */
-        ring_io_seek(&im->hfe.ring_io, im->cur_bc/8 / 256 * 512, FALSE, FALSE);
+        ring_io_seek(&im->hfe->ring_io, im->cur_bc/8 / 256 * 512, FALSE, FALSE);
         /* Consumer may be ahead of producer, but only until the first read
          * completes. */
         bc->cons = im->cur_bc % (256*8);
@@ -238,8 +372,8 @@ static void hfe_setup_track(
                      + im->cur_bc / 8 % 256
                      + (im->cur_track & 1) * 256;
         /* Write mode. */
-        ring_io_seek(&im->hfe.ring_io, pos, TRUE, FALSE);
-        im->hfe.fresh_seek = TRUE;
+        ring_io_seek(&im->hfe->ring_io, pos, TRUE, FALSE);
+        im->hfe->fresh_seek = TRUE;
     }
 }
 
@@ -252,7 +386,7 @@ static bool_t hfe_read_track(struct image *im)
     uint32_t bc_len, bc_mask, bc_space, bc_p, bc_c;
     unsigned int nr_sec;
 
-    ring_io_progress(&im->hfe.ring_io);
+    ring_io_progress(&im->hfe->ring_io);
     if (rd->cons >= rd->prod)
         return FALSE;
 
@@ -271,7 +405,7 @@ static bool_t hfe_read_track(struct image *im)
     while (nr_sec--) {
         uint32_t cons = rd->cons + (im->cur_track&1)*256;
         memcpy(&bc_b[bc_p & bc_mask],
-               &buf[ring_io_idx(&im->hfe.ring_io, cons)],
+               &buf[ring_io_idx(&im->hfe->ring_io, cons)],
                256);
         rd->cons += 512;
         bc_p += 256;
@@ -283,7 +417,10 @@ static bool_t hfe_read_track(struct image *im)
     return TRUE;
 }
 
-static uint16_t hfe_rdata_flux(struct image *im, uint16_t *tbuf, uint16_t nr)
+/* @is_v3 is a constant at each call site, so that HFEv1/v2 tracks get a
+ * copy of the generator free of per-byte opcode checks. */
+static always_inline uint16_t _hfe_rdata_flux(
+    struct image *im, uint16_t *tbuf, uint16_t nr, bool_t is_v3)
 {
     struct image_buf *bc = &im->bufs.read_bc;
     uint8_t *bc_b = bc->p;
@@ -291,8 +428,9 @@ static uint16_t hfe_rdata_flux(struct image *im, uint16_t *tbuf, uint16_t nr)
     uint32_t ticks = im->ticks_since_flux;
     uint32_t ticks_per_cell = im->ticks_per_cell;
     uint32_t y = 8, todo = nr;
+    uint32_t rnd_mask = im->hfe->rnd_mask;
+    unsigned int rnd_left = im->hfe->rnd_left;
     uint8_t x;
-    bool_t is_v3 = im->hfe.is_v3;
 
     while ((int32_t)(bc_p - bc_c) >= 3*8) {
         ASSERT(y == 8);
@@ -301,31 +439,36 @@ static uint16_t hfe_rdata_flux(struct image *im, uint16_t *tbuf, uint16_t nr)
             im->tracklen_ticks = im->cur_ticks;
             im->cur_bc = im->cur_ticks = 0;
             im->stk_per_rev = stk_sysclk(im->tracklen_ticks / 16);
+            if (im->hfe->cp_exact)
+                im->hfe->cp_full = TRUE;
+            hfe_cp_arm(im, TRUE);
             /* Skip tail of current 256-byte block. */
             bc_c = (bc_c + 256*8-1) & ~(256*8-1);
-            if (im->index_pulses_len != im->hfe.next_index_pulses_pos) {
-                im->index_pulses_len = im->hfe.next_index_pulses_pos;
+            if (im->index_pulses_len != im->hfe->next_index_pulses_pos) {
+                im->index_pulses_len = im->hfe->next_index_pulses_pos;
                 im->index_pulses_ver++;
             }
-            im->hfe.next_index_pulses_pos = 0;
+            im->hfe->next_index_pulses_pos = 0;
             continue;
         }
+        if (im->cur_bc >= im->hfe->cp_next)
+            hfe_cp_record(im);
         y = bc_c % 8;
         x = bc_b[(bc_c/8) & bc_mask] >> y;
         if (is_v3 && (y == 0) && ((x & 0xf) == 0xf)) {
             /* V3 byte-aligned opcode processing. */
             switch (x >> 4) {
             case OP_index:
-                if (im->hfe.next_index_pulses_pos < MAX_CUSTOM_PULSES
-                    && im->index_pulses[im->hfe.next_index_pulses_pos] != im->cur_ticks) {
+                if (im->hfe->next_index_pulses_pos < MAX_CUSTOM_PULSES
+                    && im->index_pulses[im->hfe->next_index_pulses_pos] != im->cur_ticks) {
 
-                    im->index_pulses[im->hfe.next_index_pulses_pos]
+                    im->index_pulses[im->hfe->next_index_pulses_pos]
                         = im->cur_ticks;
-                    if (im->index_pulses_len < im->hfe.next_index_pulses_pos+1)
-                        im->index_pulses_len = im->hfe.next_index_pulses_pos+1;
+                    if (im->index_pulses_len < im->hfe->next_index_pulses_pos+1)
+                        im->index_pulses_len = im->hfe->next_index_pulses_pos+1;
                     im->index_pulses_ver++;
                 }
-                im->hfe.next_index_pulses_pos++;
+                im->hfe->next_index_pulses_pos++;
                 /* fallthrough */
             case OP_nop:
             default:
@@ -350,24 +493,26 @@ static uint16_t hfe_rdata_flux(struct image *im, uint16_t *tbuf, uint16_t nr)
                 x = bc_b[(bc_c/8) & bc_mask] >> y;
                 break;
             case OP_rand:
-                x = rand();
+                /* Weak areas are typically long runs of OP_rand: spread
+                 * each 32-bit PRNG output across four bytes. */
+                if (rnd_left == 0) {
+                    rnd_mask = im->hfe->rnd = xorshift32(im->hfe->rnd);
+                    rnd_left = 4;
+                }
+                x = rnd_mask;
+                rnd_mask >>= 8;
+                rnd_left--;
                 break;
             }
         }
         bc_c += 8 - y;
         im->cur_bc += 8 - y;
         im->cur_ticks += (8 - y) * ticks_per_cell;
-        while (y < 8) {
-            y++;
-            ticks += ticks_per_cell;
-            if (x & 1) {
-                *tbuf++ = (ticks >> 4) - 1;
-                ticks &= 15;
-                if (!--todo)
-                    goto out;
-            }
-            x >>= 1;
-        }
+        /* HFE bitcells are LSB first: reverse them for bc_to_flux(). */
+        y = bc_to_flux(_rbit32(x), y, 8, ticks_per_cell,
+                       &ticks, &tbuf, &todo);
+        if (!todo)
+            goto out;
     }
 
 out:
@@ -375,9 +520,28 @@ out:
     im->cur_bc -= 8 - y;
     im->cur_ticks -= (8 - y) * ticks_per_cell;
     im->ticks_since_flux = ticks;
+    if (is_v3) {
+        im->hfe->rnd_mask = rnd_mask;
+        im->hfe->rnd_left = rnd_left;
+    }
     return nr - todo;
 }
 
+static ramfunc uint16_t hfe_rdata_flux(
+    struct image *im, uint16_t *tbuf, uint16_t nr)
+{
+    return im->hfe->is_v3
+        ? _hfe_rdata_flux(im, tbuf, nr, TRUE)
+        : _hfe_rdata_flux(im, tbuf, nr, FALSE);
+}
+
+/* Flag (with 0x80) each byte of @x with low nibble 0xf: an HFEv3 opcode. */
+static inline uint32_t opcode_bytes(uint32_t x)
+{
+    uint32_t t = ~x & 0x0f0f0f0f;
+    return ~((t + 0x7f7f7f7f) | t) & 0x80808080;
+}
+
 static bool_t hfe_write_track(struct image *im)
 {
     bool_t flush;
@@ -389,7 +553,7 @@ static bool_t hfe_write_track(struct image *im)
     uint8_t *w;
     struct image_buf *rd = &im->bufs.read_data;
     uint32_t i, space, c = wr->cons / 8, p = wr->prod / 8;
-    bool_t is_v3 = im->hfe.is_v3;
+    bool_t is_v3 = im->hfe->is_v3;
 
     /* If we are processing final data then use the end index, rounded to
      * nearest. */
@@ -400,12 +564,12 @@ static bool_t hfe_write_track(struct image *im)
 
     for (;;) {
 
-        uint32_t pos = ring_io_pos(&im->hfe.ring_io, rd->cons);
+        uint32_t pos = ring_io_pos(&im->hfe->ring_io, rd->cons);
         UINT nr;
 
-        if (pos / 512 * 256 + pos % 256 >= im->hfe.trk_len) {
-            ASSERT(pos / 512 * 256 + pos % 256 == im->hfe.trk_len);
-            ring_io_flush(&im->hfe.ring_io);
+        if (pos / 512 * 256 + pos % 256 >= im->hfe->trk_len) {
+            ASSERT(pos / 512 * 256 + pos % 256 == im->hfe->trk_len);
+            ring_io_flush(&im->hfe->ring_io);
             rd->cons += 512 - pos%256;
             continue;
         }
@@ -415,7 +579,7 @@ static bool_t hfe_write_track(struct image *im)
         /* Limit to end of current 256-byte HFE block. */
         nr = min_t(UINT, nr, 256 - (pos & 255));
         /* Limit to end of HFE track. */
-        nr = min_t(UINT, nr, im->hfe.trk_len - pos / 512 * 256 - pos % 256);
+        nr = min_t(UINT, nr, im->hfe->trk_len - pos / 512 * 256 - pos % 256);
 
         /* Bail if no bytes to write. */
         if (nr == 0)
@@ -429,10 +593,10 @@ static bool_t hfe_write_track(struct image *im)
         }
 
         /* Encode into the sector buffer for later write-out. */
-        w = rd->p + ring_io_idx(&im->hfe.ring_io, rd->cons);
+        w = rd->p + ring_io_idx(&im->hfe->ring_io, rd->cons);
         i = 0;
 
-        if (im->hfe.fresh_seek && is_v3 && (pos & 255) >= 1) {
+        if (im->hfe->fresh_seek && is_v3 && (pos & 255) >= 1) {
             /* Avoid writing in the middle of an opcode. */
             char b = *(w-1);
             if ((pos & 255) >= 2)
@@ -455,9 +619,22 @@ static bool_t hfe_write_track(struct image *im)
                 }
             }
         }
-        im->hfe.fresh_seek = FALSE;
+        im->hfe->fresh_seek = FALSE;
 
         for (; i < nr; i++) {
+            if (!(((uintptr_t)w | c) & 3) && (i + 4 <= nr)
+                && !(is_v3 && opcode_bytes(*(uint32_t *)w))) {
+                /* Fast path: a word of bitcells at a time, when both buffers
+                 * are aligned and no opcode is to be preserved. */
+                uint32_t x = _rev32(_rbit32(*(uint32_t *)&buf[c & bufmask]));
+                c += 4;
+                if (is_v3)
+                    x ^= opcode_bytes(x) >> 6; /* b ^= 2, as below */
+                *(uint32_t *)w = x;
+                w += 4;
+                i += 3;
+                continue;
+            }
             if (is_v3 && (*w & 0xf) == 0xf) {
                 switch (*w >> 4) {
                 case OP_skip:
@@ -501,9 +678,9 @@ static bool_t hfe_write_track(struct image *im)
     }
 
     if (flush)
-        ring_io_flush(&im->hfe.ring_io);
+        ring_io_flush(&im->hfe->ring_io);
     else
-        ring_io_progress(&im->hfe.ring_io);
+        ring_io_progress(&im->hfe->ring_io);
 
     wr->cons = c * 8;
 
@@ -512,8 +689,33 @@ static bool_t hfe_write_track(struct image *im)
 
 static void hfe_sync(struct image *im)
 {
-    ring_io_sync(&im->hfe.ring_io);
-    ring_io_shutdown(&im->hfe.ring_io);
+    ring_io_sync(&im->hfe->ring_io);
+    ring_io_shutdown(&im->hfe->ring_io);
+}
+
+static bool_t hfe_prefetch(
+    struct image *im, int dir, struct image_prefetch *pf)
+{
+    struct ring_io *rio = &im->hfe->ring_io;
+    struct image_buf *rd = &im->bufs.read_data;
+    unsigned int nbr = im->cur_track/2 + ((dir > 0) ? 1 : -1);
+    uint32_t len, need;
+
+    if (!ring_io_idle(rio))
+        return FALSE;
+
+    pf->len = 0;
+    if ((nbr >= im->hfe->nr_tracks) || ((len = im->hfe->tlut[nbr].len) == 0))
+        return TRUE;
+
+    /* Keep clear of both the current ring and the neighbour's ring. */
+    len = (len + 511) & ~511;
+    need = max_t(uint32_t, rio->ring_len, min_t(uint32_t, len, rd->len));
+    pf->off = (FSIZE_t)im->hfe->tlut[nbr].off * 512;
+    pf->len = len;
+    pf->start = (uint8_t *)rd->p + need;
+    pf->end = (uint8_t *)rd->p + rd->len;
+    return TRUE;
 }
 
 const struct image_handler hfe_image_handler = {
@@ -523,8 +725,23 @@ const struct image_handler hfe_image_handler = {
     .rdata_flux = hfe_rdata_flux,
     .write_track = hfe_write_track,
     .sync = hfe_sync,
+    .prefetch = hfe_prefetch,
+
+    .async = TRUE,
+    .state_sz = sizeof(struct hfe_image),
+};
+
+/* Read only, and no prefetch: the volume cache would hold compressed data at
+ * uncompressed offsets. */
+const struct image_handler hfz_image_handler = {
+    .open = hfz_open,
+    .setup_track = hfe_setup_track,
+    .read_track = hfe_read_track,
+    .rdata_flux = hfe_rdata_flux,
+    .sync = hfe_sync,
 
     .async = TRUE,
+    .state_sz = sizeof(struct hfe_image),
 };
 
 /*
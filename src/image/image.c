@@ -13,7 +13,9 @@
 
 extern const struct image_handler adf_image_handler;
 extern const struct image_handler atr_image_handler;
+extern const struct image_handler ffx_image_handler;
 extern const struct image_handler hfe_image_handler;
+extern const struct image_handler hfz_image_handler;
 extern const struct image_handler img_image_handler;
 extern const struct image_handler st_image_handler;
 extern const struct image_handler d81_image_handler;
@@ -35,13 +37,19 @@ extern const struct image_handler ti99_image_handler;
 extern const struct image_handler xdf_image_handler;
 extern const struct image_handler dummy_image_handler;
 
+/* img.c: re-open the most recently probed raw image from cached geometry. */
+const struct image_handler *raw_cache_handler(unsigned int i);
+bool_t raw_cache_open(struct image *im);
+
 const struct image_type image_type[] = {
     { "adf", &adf_image_handler },
     { "atr", &atr_image_handler },
     { "d81", &d81_image_handler },
     { "dsk", &dsk_image_handler },
+    { "ffx", &ffx_image_handler },
     { "hdm", &pc98hdm_image_handler },
     { "hfe", &hfe_image_handler },
+    { "hfz", &hfz_image_handler },
     { "img", &img_image_handler },
     { "ima", &img_image_handler },
     { "out", &img_image_handler },
@@ -83,14 +91,15 @@ bool_t image_valid(FILINFO *fp)
     if (fp->fattrib & AM_DIR)
         return FALSE;
 
-    /* Skip empty images. */
-    if (fp->fsize == 0)
+    /* Skip empty images, and those too large for a slot (exFAT). */
+    if ((fp->fsize == 0) || (fp->fsize > 0xffffffffu))
         return FALSE;
 
     /* Check valid extension. */
     filename_extension(fp->fname, ext, sizeof(ext));
     if (!strcmp(ext, "adf") && !is_quickdisk) {
-        return (ff_cfg.host == HOST_acorn) || !(fp->fsize % (2*11*512));
+        return ((ff_cfg.host == HOST_acorn)
+                || !((uint32_t)fp->fsize % (2*11*512)));
     } else {
         const struct image_type *type;
         for (type = &image_type[0]; type->handler != NULL; type++)
@@ -101,16 +110,28 @@ bool_t image_valid(FILINFO *fp)
     return FALSE;
 }
 
-static bool_t try_handler(struct image *im, struct slot *slot,
-                          DWORD *cltbl,
-                          const struct image_handler *handler)
+static void init_image(struct image *im, struct slot *slot,
+                       DWORD *cltbl,
+                       const struct image_handler *handler)
 {
     struct image_bufs bufs = im->bufs;
+    struct image_extents *extents = im->extents;
+    struct image_buf *data = &bufs.staging;
     BYTE mode;
 
     /* Reinitialise image structure, except for static buffers. */
     memset(im, 0, sizeof(*im));
     im->bufs = bufs;
+    im->extents = extents;
+
+    /* The handler's state comes from the tail of the staging area. Previous
+     * handlers' carvings are discarded. */
+    im->state = (void *)(((uintptr_t)data->p + data->len
+                          - handler->state_sz) & ~7);
+    memset(im->state, 0, handler->state_sz);
+    im->bufs.read_data.p = data->p;
+    im->bufs.read_data.len = (uint8_t *)im->state - (uint8_t *)data->p;
+    im->bufs.write_data = im->bufs.read_data;
     im->cur_track = ~0;
     im->slot = slot;
 
@@ -126,7 +147,13 @@ static bool_t try_handler(struct image *im, struct slot *slot,
         mode |= FA_WRITE;
     fatfs_from_slot(&im->fp, slot, mode);
     im->fp.cltbl = cltbl;
+}
 
+static bool_t try_handler(struct image *im, struct slot *slot,
+                          DWORD *cltbl,
+                          const struct image_handler *handler)
+{
+    init_image(im, slot, cltbl, handler);
     return handler->open(im);
 }
 
@@ -154,6 +181,13 @@ void image_open(struct image *im, struct slot *slot, DWORD *cltbl,
         F_die(FR_BAD_IMAGE);
     }
 
+    /* Re-inserting a recently opened raw image? Skip the probe. */
+    for (i = 0; (hint = raw_cache_handler(i)) != NULL; i++) {
+        init_image(im, slot, cltbl, hint);
+        if (raw_cache_open(im))
+            return;
+    }
+
     /* Extract filename extension (if available). */
     memcpy(ext, slot->type, sizeof(slot->type));
     ext[sizeof(slot->type)] = '\0';
@@ -228,17 +262,32 @@ bool_t image_in_da_mode(struct image *im)
 void image_extend(struct image *im)
 {
     FSIZE_t new_sz;
+    FRESULT fr;
 
     if (!(im->disk_handler->extend && im->fp.dir_ptr && ff_cfg.extend_image))
         return;
 
+#if FF_FS_EXFAT
+    /* An exFAT entry set is rewritten via its containing directory. */
+    if ((im->fp.obj.fs->fs_type == FS_EXFAT) && !im->fp.obj.c_scl)
+        return;
+#endif
+
     new_sz = im->disk_handler->extend(im);
     if (f_size(&im->fp) >= new_sz)
         return;
 
-    /* Disable fast-seek mode, as it disallows extending the file. */
+    /* Disable fast-seek mode, as it disallows extending the file. The caller
+     * rebuilds the cluster table once the file size has changed. */
     im->fp.cltbl = NULL;
 
+    /* Extend the file as a single contiguous fragment if possible. Else fall
+     * back to growing it a cluster at a time, wherever free space is found. */
+    fr = f_expand(&im->fp, new_sz, 1);
+    if ((fr != FR_OK) && (fr != FR_DENIED))
+        F_die(fr);
+    printk("Extend: %s\n", (fr == FR_OK) ? "contiguous" : "fragmented");
+
     /* Attempt to extend the file. */
     F_lseek(&im->fp, new_sz);
     F_sync(&im->fp);
@@ -249,6 +298,10 @@ void image_extend(struct image *im)
     im->slot->size = new_sz;
 }
 
+enum { PF_idle = 0, PF_pending, PF_fetching };
+/* Write-back staging: coalesce up to four sectors per flushed write. */
+#define PF_BOUNCE_WB 2048
+
 static void print_image_info(struct image *im)
 {
     char msg[25];
@@ -283,14 +336,295 @@ void image_setup_track(
     if (h != im->track_handler)
         image_sync(im);
     im->track_handler = h;
+
+#if !defined(QUICKDISK)
+    /* Note direction of head travel and restart any prefetch. */
+    if ((track>>1) != im->prefetch.cyl) {
+        struct image_prefetch *pf = &im->prefetch;
+        pf->dir = ((track>>1) < pf->cyl) ? -1 : 1;
+        pf->cyl = track>>1;
+        pf->state = PF_pending;
+        F_async_notify();
+    }
+#endif
+
     h->setup_track(im, track, start_pos);
 
     print_image_info(im);
 }
 
+unsigned int image_extents_size(const DWORD *cltbl)
+{
+    /* One extent per fragment, plus the sentinel. */
+    return sizeof(struct image_extents)
+        + (cltbl[0] / 2) * sizeof(struct image_extent);
+}
+
+void image_extents_init(struct image_extents *map, FIL *fp)
+{
+    FATFS *fs = fp->obj.fs;
+    struct image_extent *ext = map->ext;
+    DWORD ncl, *tbl = fp->cltbl + 1;
+    uint32_t fsec = 0;
+
+    /* Walk the cluster table: [size, (nr_clusters, first_cluster)*, 0]. */
+    while ((ncl = *tbl++) != 0) {
+        ext->fsec = fsec;
+        ext->lba = fs->database + (LBA_t)(*tbl++ - 2) * fs->csize;
+        fsec += ncl * fs->csize;
+        ext++;
+    }
+    map->nr = ext - map->ext;
+
+    /* Sentinel: nothing is mapped beyond the final (partial) file sector. */
+    ext->fsec = min_t(uint32_t, fsec, (f_size(fp) + 511) / 512);
+    ext->lba = 0;
+}
+
+LBA_t image_extents_lba(const struct image_extents *map, FSIZE_t ofs,
+                        uint32_t *nsec)
+{
+    const struct image_extent *ext = map->ext;
+    uint32_t sec = ofs / 512;
+    unsigned int lo = 0, hi = map->nr, mid;
+
+    if (sec >= ext[hi].fsec)
+        return 0;
+
+    /* Binary search: ext[lo].fsec <= sec < ext[hi].fsec. */
+    while ((hi - lo) > 1) {
+        mid = (lo + hi) / 2;
+        if (ext[mid].fsec <= sec)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    if (nsec != NULL)
+        *nsec = ext[lo+1].fsec - sec;
+    return ext[lo].lba + (sec - ext[lo].fsec);
+}
+
+#if !defined(QUICKDISK)
+
+enum { BCC_off = 0, BCC_armed, BCC_recording, BCC_valid };
+/* Words replayed per call: keep the thread responsive. */
+#define BCC_BATCH 512
+
+void bc_cache_init(struct image *im, struct bc_cache *c,
+                   void *start, void *end, uint32_t tracklen_bc)
+{
+    uint32_t bytes = tracklen_bc / 8;
+    uint8_t *p;
+
+    c->p = NULL;
+    c->state = BCC_off;
+    c->nr = tracklen_bc / 16;
+    if ((tracklen_bc % 16) || (c->nr != tracklen_bc / 16)
+            || ((uint8_t *)end - (uint8_t *)start) < (int)(bytes + 4))
+        return;
+
+    p = (uint8_t *)(((uintptr_t)end - bytes) & ~3);
+    image_prefetch_reserve(im, p, p + bytes);
+    c->p = (uint16_t *)p;
+    c->pos = 0;
+    c->state = BCC_armed;
+}
+
+void bc_cache_invalidate(struct bc_cache *c)
+{
+    if (c->state != BCC_off)
+        c->state = BCC_armed;
+}
+
+bool_t bc_cache_valid(struct bc_cache *c)
+{
+    return c->state == BCC_valid;
+}
+
+void bc_cache_seek(struct bc_cache *c, uint32_t bc)
+{
+    if (c->state == BCC_valid)
+        c->pos = (bc / 16) % c->nr;
+    else
+        bc_cache_invalidate(c);
+}
+
+void bc_cache_record(struct image *im, struct bc_cache *c,
+                     uint32_t prod, bool_t rev_end)
+{
+    struct image_buf *bc = &im->bufs.read_bc;
+    const uint16_t *bc_b = bc->p;
+    uint32_t bc_mask = bc->len / 2 - 1;
+    uint32_t p = prod / 16, n = bc->prod / 16 - p;
+
+    if (c->state == BCC_recording) {
+        if ((c->pos + n) > c->nr) {
+            /* Encoder disagrees with the expected track length. */
+            c->state = BCC_off;
+            return;
+        }
+        while (n--)
+            c->p[c->pos++] = bc_b[p++ & bc_mask];
+    }
+
+    if (!rev_end)
+        return;
+
+    if ((c->state == BCC_recording) && (c->pos == c->nr)) {
+        c->state = BCC_valid;
+    } else if (c->state != BCC_off) {
+        /* The next word generated starts a revolution: record it. */
+        c->state = BCC_recording;
+    }
+    c->pos = 0;
+}
+
+bool_t bc_cache_replay(struct image *im, struct bc_cache *c)
+{
+    struct image_buf *bc = &im->bufs.read_bc;
+    uint16_t *bc_b = bc->p;
+    uint32_t bc_len, bc_mask, bc_space, bc_p, bc_c, n, m;
+
+    bc_p = bc->prod / 16;
+    bc_c = bc->cons / 16;
+    bc_len = bc->len / 2;
+    bc_mask = bc_len - 1;
+    bc_space = bc_len - (uint16_t)(bc_p - bc_c);
+
+    n = min_t(uint32_t, bc_space, c->nr - c->pos);
+    n = min_t(uint32_t, n, BCC_BATCH);
+    if (n == 0)
+        return FALSE;
+
+    /* Copy in up to two chunks, as the bitcell ring may wrap. */
+    m = min_t(uint32_t, n, bc_len - (bc_p & bc_mask));
+    memcpy(&bc_b[bc_p & bc_mask], &c->p[c->pos], m * 2);
+    memcpy(bc_b, &c->p[c->pos + m], (n - m) * 2);
+
+    c->pos += n;
+    if (c->pos >= c->nr)
+        c->pos = 0;
+    bc->prod = (bc_p + n) * 16;
+
+    return TRUE;
+}
+
+#endif
+
+#if !defined(QUICKDISK)
+
+bool_t image_prefetch(struct image *im)
+{
+    struct image_prefetch *pf = &im->prefetch;
+    const struct image_handler *h = im->track_handler;
+    uint8_t *start, *end;
+    uint32_t max_len, bounce, pin_len;
+    LBA_t lba;
+    bool_t ok, pin;
+
+    if ((pf->state == PF_idle) || (h->prefetch == NULL)
+            || (im->extents == NULL))
+        return FALSE;
+
+    /* Demand I/O first: retry when the queue is drained. */
+    if (!F_async_idle())
+        return TRUE;
+
+    /* The head of the image holds cylinder 0, which hosts read on every
+     * reboot: keep it pinned in the cache, ahead of any neighbour. */
+    pin_len = min_t(uint32_t, ff_cfg.pin_boot_kb * 1024,
+                    (f_size(&im->fp) + 511) & ~511);
+
+    if (pf->state == PF_pending) {
+        if (!h->prefetch(im, pf->dir, pf))
+            return TRUE;
+        pf->state = PF_idle;
+        /* Bounce buffer, followed by at least a few cache entries. The bounce
+         * buffer doubles as the write-back staging buffer, if enabled. */
+        bounce = ff_cfg.write_back_ms ? PF_BOUNCE_WB : 512;
+        start = (uint8_t *)(((uintptr_t)pf->start + 3) & ~3);
+        end = pf->end;
+        if ((end - start) < (bounce + 6*1024))
+            return FALSE;
+        if ((start != pf->cache_start) || (end != pf->cache_end)) {
+            volume_cache_init(start + bounce, end);
+            /* Keep FAT and directory sectors over streamed image data. They
+             * matter when a fragmented image has no fast-seek table. */
+            volume_cache_pin_metadata(im->fp.obj.fs);
+            if (ff_cfg.write_back_ms)
+                volume_cache_writeback(start, bounce);
+            pf->cache_start = start;
+            pf->cache_end = end;
+            pf->pin_off = 0;
+            pf->pin_done = FALSE;
+        }
+        if ((pf->len == 0) && (pf->pin_done || (pf->pin_off >= pin_len)))
+            return FALSE;
+        /* Don't evict our own prefetched data (allows for cache overheads). */
+        max_len = ((end - start - bounce) / (512 + 32) - 1) * 512;
+        max_len -= min_t(uint32_t, max_len, pin_len);
+        pf->len += pf->off & 511;
+        pf->off &= ~511;
+        pf->len = min_t(uint32_t, pf->len, max_len);
+        pf->state = PF_fetching;
+    }
+
+    pin = !pf->pin_done && (pf->pin_off < pin_len);
+    if (!pin && (pf->len == 0)) {
+        pf->state = PF_idle;
+        return FALSE;
+    }
+
+    /* One sector at a time, so that demand I/O is delayed only briefly. */
+    lba = image_extents_lba(im->extents, pin ? pf->pin_off : pf->off, NULL);
+    pf->busy = TRUE;
+    ok = lba && volume_prefetch(lba, pf->cache_start);
+    /* Once the pin limit is reached, leave the rest of the head unpinned. */
+    if (pin && !(ok && volume_cache_pin(lba)))
+        pf->pin_done = TRUE;
+    pf->busy = FALSE;
+    if (pf->state != PF_fetching)
+        return pf->state != PF_idle;
+    if (pin) {
+        pf->pin_off += 512;
+        return TRUE;
+    }
+    pf->off += 512;
+    pf->len -= min_t(uint32_t, pf->len, 512);
+    if (!ok || (pf->len == 0))
+        pf->state = PF_idle;
+    return pf->state != PF_idle;
+}
+
+void image_prefetch_reserve(struct image *im, void *start, void *end)
+{
+    struct image_prefetch *pf = &im->prefetch;
+
+    if ((pf->cache_start == NULL)
+            || ((uint8_t *)start >= (uint8_t *)pf->cache_end)
+            || ((uint8_t *)end <= (uint8_t *)pf->cache_start))
+        return;
+
+    /* The I/O thread may be filling the cache right now. Destroying the cache
+     * may also flush write-back data, so the volume must be quiescent. */
+    while (pf->busy || volume_interrupt())
+        thread_yield();
+    volume_cache_destroy();
+    pf->cache_start = pf->cache_end = NULL;
+    if (pf->state == PF_fetching) {
+        pf->state = PF_pending;
+        F_async_notify();
+    }
+}
+
+#endif
+
 bool_t image_read_track(struct image *im)
 {
-    return im->track_handler->read_track(im);
+    bool_t ret;
+    PROF(read_track, ret = im->track_handler->read_track(im));
+    return ret;
 }
 
 uint16_t image_rdata_flux(struct image *im, uint16_t *tbuf, uint16_t nr)
@@ -300,7 +634,9 @@ uint16_t image_rdata_flux(struct image *im, uint16_t *tbuf, uint16_t nr)
 
 bool_t image_write_track(struct image *im)
 {
-    return im->track_handler->write_track(im);
+    bool_t ret;
+    PROF(write_track, ret = im->track_handler->write_track(im));
+    return ret;
 }
 
 void image_sync(struct image *im)
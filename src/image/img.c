@@ -15,6 +15,8 @@ static void raw_setup_track(
 static bool_t raw_read_track(struct image *im);
 static bool_t raw_write_track(struct image *im);
 static void raw_sync(struct image *im);
+static bool_t raw_prefetch(
+    struct image *im, int dir, struct image_prefetch *pf);
 static bool_t raw_open(struct image *im);
 static void mfm_prep_track(struct image *im);
 static bool_t mfm_read_track(struct image *im);
@@ -170,21 +172,67 @@ const static struct raw_type {
     { 0 }
 };
 
-static FSIZE_t im_size(struct image *im)
+/* Aligned container, built by scripts/mk_aligned.py: a raw image with each
+ * track padded to a fixed stride, so that tracks start on sector (or
+ * cluster) boundaries. The image's own type is still known by extension.
+ * NB. Fields are little endian. */
+struct aln_header {
+    char sig[8]; /* "FFALIGN0" */
+    uint32_t data_off;   /* File offset of the first track */
+    uint32_t raw_size;   /* Size of the raw image */
+    uint32_t trk_stride; /* File bytes per track: a multiple of 512 */
+};
+
+/* Probe for an aligned container, once per open, before the file is
+ * parsed. Formats with their own header have set base_off already. */
+static void aln_probe(struct image *im)
+{
+    struct aln_header ahdr;
+    uint32_t data_off, raw_size, stride;
+
+    if (im->img->aln_probed || im->img->base_off
+            || (f_size(&im->fp) < sizeof(ahdr)))
+        return;
+    im->img->aln_probed = TRUE;
+
+    F_lseek(&im->fp, 0);
+    F_read(&im->fp, &ahdr, sizeof(ahdr), NULL);
+    if (strncmp(ahdr.sig, "FFALIGN0", sizeof(ahdr.sig)))
+        return;
+
+    data_off = le32toh(ahdr.data_off);
+    raw_size = le32toh(ahdr.raw_size);
+    stride = le32toh(ahdr.trk_stride);
+    if ((data_off % 512) || (data_off == 0) || (raw_size == 0)
+            || (stride % 512) || (stride == 0)
+            || (data_off > f_size(&im->fp))) {
+        printk("IMG: Bad aligned container\n");
+        return;
+    }
+
+    im->img->base_off = data_off;
+    im->img->trk_stride = stride;
+    im->img->aln_size = raw_size;
+}
+
+static uint32_t im_size(struct image *im)
 {
-    return (f_size(&im->fp) < im->img.base_off) ? 0
-        : (f_size(&im->fp) - im->img.base_off);
+    aln_probe(im);
+    if (im->img->trk_stride)
+        return im->img->aln_size;
+    return (f_size(&im->fp) < im->img->base_off) ? 0
+        : (f_size(&im->fp) - im->img->base_off);
 }
 
 static unsigned int enc_sec_sz(struct image *im, struct raw_sec *sec)
 {
-    return im->img.idam_sz + im->img.dam_sz_pre
-        + sec_sz(sec->n) + im->img.dam_sz_post;
+    return im->img->idam_sz + im->img->dam_sz_pre
+        + sec_sz(sec->n) + im->img->dam_sz_post;
 }
 
 static void reset_all_params(struct image *im)
 {
-    memset(&im->img, 0, sizeof(im->img));
+    memset(im->img, 0, sizeof(*im->img));
     im->nr_cyls = im->nr_sides = 0;
 }
 
@@ -258,7 +306,7 @@ static void tag_add_layout(
     trk->hskew = layout->hskew;
     trk->head = layout->head;
 
-    sec = &im->img.sec_info_base[trk->sec_off];
+    sec = &im->img->sec_info_base[trk->sec_off];
     for (i = 0; i < layout->nr_sectors; i++) {
         sec->r = i + layout->base[0];
         sec->n = layout->no;
@@ -266,6 +314,152 @@ static void tag_add_layout(
     }
 }
 
+/* Index of IMG.CFG section headers, built by the first tag_open() after each
+ * mount so that later insertions need not rescan every section. Tag names
+ * and sizes are held as 16-bit hashes: the section chosen via the index is
+ * re-scored from its header text before it is used. */
+#define IMGCFG_IDX_MAX 128
+static struct imgcfg_idx {
+    uint32_t sclust, size;
+    uint16_t fs_id;
+    uint16_t nr;
+    bool_t valid, overflow;
+    struct imgcfg_sec {
+        uint32_t ofs:31, has_size:1; /* ofs: file offset of '[' */
+        uint16_t tag, size;          /* tag == 0: default section */
+    } sec[IMGCFG_IDX_MAX];
+} imgcfg_idx;
+
+static uint16_t tag_hash(const char *p)
+{
+    uint16_t h = 5381;
+    if (*p == '\0')
+        return 0;
+    while (*p != '\0')
+        h = (h * 33) ^ tolower(*p++);
+    return h ?: 1;
+}
+
+static uint16_t size_hash(int size)
+{
+    return size ^ (size >> 16);
+}
+
+/* Split a section header "<tag>[::<size>]" in place. */
+static bool_t tag_split(char *p, int *size)
+{
+    char *q = p;
+    while ((q = strchr(q, ':')) != NULL) {
+        if (*++q == ':') {
+            *size = strtol(q+1, NULL, 10);
+            q[-1] = '\0'; /* terminate tagname string */
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Score a section header against the image: the first best-scoring section
+ * is the one that is processed. */
+static int tag_score(struct image *im, char *p, const char *tag)
+{
+    int size, score = 0;
+    if (tag_split(p, &size)) {
+        /* Match on size is worth less than a match on tagname.
+         * Mismatch on size clobbers the section. */
+        score += (im_size(im) == size) ? 2 : -100;
+    }
+    if (tag && !strcmp_ci(p, tag)) {
+        /* Tagname match is worth the most. */
+        score += 4;
+    } else if (*p == '\0') {
+        /* Empty (default) section is worth the least. */
+        score += 1;
+    } else {
+        /* Non-match on a non-empty tagname clobbers the section. */
+        score -= 100;
+    }
+    return score;
+}
+
+/* As tag_score(), from hashes. Never less than the true score. */
+static int tag_idx_score(struct image *im, const struct imgcfg_sec *s,
+                         const char *tag, uint16_t tag_h)
+{
+    int score = 0;
+    if (s->has_size)
+        score += (size_hash(im_size(im)) == s->size) ? 2 : -100;
+    if (tag && (s->tag == tag_h))
+        score += 4;
+    else if (s->tag == 0)
+        score += 1;
+    else
+        score -= 100;
+    return score;
+}
+
+static void imgcfg_idx_build(struct opts *opts)
+{
+    const static struct opt no_opts[] = { { NULL } };
+    struct imgcfg_idx *idx = &imgcfg_idx;
+    struct opts o = *opts;
+    struct imgcfg_sec *s;
+    FIL *fp = opts->file;
+    int size;
+
+    idx->sclust = fp->obj.sclust;
+    idx->size = f_size(fp);
+    idx->fs_id = fp->obj.id;
+    idx->nr = 0;
+    idx->overflow = FALSE;
+    idx->valid = TRUE;
+
+    /* With no options to match, only section headers are returned. */
+    o.opts = no_opts;
+    while (get_next_opt(&o) != OPT_eof) {
+        if (idx->nr == IMGCFG_IDX_MAX) {
+            idx->overflow = TRUE;
+            break;
+        }
+        s = &idx->sec[idx->nr++];
+        s->ofs = o.section_ofs;
+        s->has_size = tag_split(o.arg, &size);
+        s->size = s->has_size ? size_hash(size) : 0;
+        s->tag = tag_hash(o.arg);
+    }
+
+    F_lseek(fp, 0);
+}
+
+/* Pick the best-scoring section via the index. Returns FALSE if the index
+ * is incomplete, in which case the whole file must be scanned. */
+static bool_t imgcfg_idx_lookup(struct image *im, struct opts *opts,
+                                const char *tag, int *best, uint32_t *ofs)
+{
+    struct imgcfg_idx *idx = &imgcfg_idx;
+    FIL *fp = opts->file;
+    uint16_t tag_h = tag ? tag_hash(tag) : 0;
+    int i, score;
+
+    if (!idx->valid || (idx->sclust != fp->obj.sclust)
+        || (idx->size != f_size(fp)) || (idx->fs_id != fp->obj.id))
+        imgcfg_idx_build(opts);
+
+    if (idx->overflow)
+        return FALSE;
+
+    *best = 0;
+    for (i = 0; i < idx->nr; i++) {
+        score = tag_idx_score(im, &idx->sec[i], tag, tag_h);
+        if (score > *best) {
+            *best = score;
+            *ofs = idx->sec[i].ofs;
+        }
+    }
+
+    return TRUE;
+}
+
 static bool_t tag_open(struct image *im, char *tag)
 {
     enum {
@@ -311,7 +505,8 @@ static bool_t tag_open(struct image *im, char *tag)
         [IMGCFG_file_layout] = { "file-layout" },
     };
 
-    int match, active, option, nr_t = 0;
+    int match, active, option, nr_t = 0, idx_score = 0;
+    uint32_t ofs;
     struct simple_layout t_layout, d_layout;
     struct {
         FIL file;
@@ -332,38 +527,31 @@ static bool_t tag_open(struct image *im, char *tag)
 
     match = active = 0;
 
+    /* Seek straight to the section chosen by the index, if possible. */
+    if (imgcfg_idx_lookup(im, &opts, tag, &idx_score, &ofs)) {
+        if (idx_score <= 0)
+            goto out;
+        F_lseek(&heap->file, ofs);
+    }
+
     while ((option = get_next_opt(&opts)) != OPT_eof) {
 
         if (option == OPT_section) {
-            char *p, *q;
             /* New section: Finalise any currently-active section. */
             if (active) {
                 tag_add_layout(im, &t_layout, nr_t);
                 finalise_track_map(im);
                 active = 0;
             }
-            /* Parse the tag name and optional size following "::". */
-            p = q = opts.arg;
-            while ((q = strchr(q, ':')) != NULL) {
-                if (*++q == ':') {
-                    /* Found "::<size>" */
-                    int size = strtol(q+1, NULL, 10);
-                    /* Match on size is worth less than a match on tagname.
-                     * Mismatch on size clobbers the section. */
-                    active += (im_size(im) == size) ? 2 : -100;
-                    q[-1] = '\0'; /* terminate tagname string */
-                    break;
-                }
-            }
-            if (tag && !strcmp_ci(p, tag)) {
-                /* Tagname match is worth the most. */
-                active += 4;
-            } else if (*p == '\0') {
-                /* Empty (default) section is worth the least. */
-                active += 1;
-            } else {
-                /* Non-match on a non-empty tagname clobbers the section. */
-                active -= 100;
+            /* Only the section chosen by the index need be processed. */
+            if (idx_score && match)
+                break;
+            active = tag_score(im, opts.arg, tag);
+            if (idx_score && (active != idx_score)) {
+                /* Hash collision: fall back to scanning every section. */
+                idx_score = active = 0;
+                F_lseek(&heap->file, 0);
+                continue;
             }
             if (active > match) {
                 /* Best score so far: Process the section. */
@@ -404,7 +592,7 @@ static bool_t tag_open(struct image *im, char *tag)
                 }
                 for (c = c_s; c <= c_e; c++)
                     for (h = h_s; h <= h_e; h++)
-                        im->img.trk_map[c*im->nr_sides+h] = nr_t;
+                        im->img->trk_map[c*im->nr_sides+h] = nr_t;
             } while (*p++ == ',');
             break;
         }
@@ -475,11 +663,11 @@ static bool_t tag_open(struct image *im, char *tag)
                     *q++ = '\0';
                 if (!strncmp(p, "reverse-side", 12)) {
                     uint8_t side = !!strtol(p+12, NULL, 10);
-                    im->img.layout |= LAYOUT_reverse_side(side);
+                    im->img->layout |= LAYOUT_reverse_side(side);
                 } else if (!strcmp(p, "sequential")) {
-                    im->img.layout |= LAYOUT_sequential;
+                    im->img->layout |= LAYOUT_sequential;
                 } else if (!strcmp(p, "sides-swapped")) {
-                    im->img.layout |= LAYOUT_sides_swapped;
+                    im->img->layout |= LAYOUT_sides_swapped;
                 }
             }
             break;
@@ -493,6 +681,7 @@ static bool_t tag_open(struct image *im, char *tag)
         finalise_track_map(im);
     }
 
+out:
     F_close(&heap->file);
 
     return match ? raw_open(im) : FALSE;
@@ -619,7 +808,7 @@ static bool_t atr_open(struct image *im)
         /* 40-2-18, 256b/s, MFM */
         im->nr_sides = 2;
     }
-    im->img.base_off = 16;
+    im->img->base_off = 16;
 
     trk_map = init_track_map(im);
 
@@ -631,7 +820,7 @@ static bool_t atr_open(struct image *im)
         trk->invert_data = TRUE;
         trk->data_rate = rate;
         trk->interleave = ATR_INTERLEAVE(nr_sectors);
-        sec = &im->img.sec_info_base[trk->sec_off];
+        sec = &im->img->sec_info_base[trk->sec_off];
         for (j = 0; j < nr_sectors; j++) {
             sec->r = j + 1;
             sec->n = no;
@@ -640,7 +829,7 @@ static bool_t atr_open(struct image *im)
     }
 
     /* Track 0 layout: First three sectors are always 128 bytes. */
-    sec = &im->img.sec_info_base[im->img.trk_info[0].sec_off];
+    sec = &im->img->sec_info_base[im->img->trk_info[0].sec_off];
     for (i = 0; i < 3; i++) {
         sec->n = 0;
         sec++;
@@ -694,7 +883,7 @@ static bool_t ibm_3174_open(struct image *im)
         trk->has_iam = TRUE;
         trk->gap_3 = 104;
         trk->rpm = (i == 0) ? 360 : 180;
-        sec = &im->img.sec_info_base[trk->sec_off];
+        sec = &im->img->sec_info_base[trk->sec_off];
         for (j = 0; j < nr_sectors; j++) {
             sec->r = j + 1;
             sec->n = 2;
@@ -717,7 +906,7 @@ static bool_t ibm_3174_open(struct image *im)
 
 static bool_t d81_open(struct image *im)
 {
-    im->img.layout = LAYOUT_sides_swapped;
+    im->img->layout = LAYOUT_sides_swapped;
     return raw_type_open(im, d81_type);
 }
 
@@ -786,7 +975,7 @@ static bool_t pc98fdi_open(struct image *im)
     im->nr_cyls = le32toh(header.cyls);
     im->nr_sides = le32toh(header.nr_sides);
     /* Skip 4096-byte header. */
-    im->img.base_off = le32toh(header.header_size);
+    im->img->base_off = le32toh(header.header_size);
     simple_layout(im, &layout);
     return raw_open(im);
 }
@@ -813,8 +1002,9 @@ static void bpb_read(struct image *im, struct bpb *bpb)
     const static uint16_t offs[] = {
         510, 11, 24, 26, 19, 17, 22 };
 
+    aln_probe(im);
     for (i = 0; i < ARRAY_SIZE(offs); i++) {
-        F_lseek(&im->fp, offs[i]);
+        F_lseek(&im->fp, im->img->base_off + offs[i]);
         F_read(&im->fp, x, 2, NULL);
         *x = le16toh(*x);
         x++;
@@ -963,7 +1153,7 @@ static bool_t trd_open(struct image *im)
     /* Some images do not fill the last cylinder (see attached images on 
      * issue #260). We deal with that by marking the very last track empty. */
     if (tot_trks & (im->nr_sides-1))
-        im->img.trk_map[tot_trks] = SIMPLE_EMPTY_TRK;
+        im->img->trk_map[tot_trks] = SIMPLE_EMPTY_TRK;
 
     return raw_open(im);
 }
@@ -1062,7 +1252,7 @@ static bool_t sdu_open(struct image *im)
     layout.gap3 = 84; /* standard gap3 */
 
     /* Skip 46-byte SABDU header. */
-    im->img.base_off = 46;
+    im->img->base_off = 46;
 
     simple_layout(im, &layout);
     return raw_open(im);
@@ -1105,7 +1295,7 @@ static bool_t ti99_open(struct image *im)
     layout.cskew = 3;
     layout.no = 1;
     layout.base[0] = layout.base[1] = 0;
-    im->img.layout = LAYOUT_sequential | LAYOUT_reverse_side(1);
+    im->img->layout = LAYOUT_sequential | LAYOUT_reverse_side(1);
 
     if ((fsize % (40*9)) == 0) {
 
@@ -1195,12 +1385,12 @@ static bool_t uknc_open(struct image *im)
     bool_t ok;
 
     /* All tracks have special extra sync marks. */
-    im->img.post_crc_syncs = 1;
+    im->img->post_crc_syncs = 1;
 
     ok = raw_type_open(im, uknc_type);
 
     if (ok) {
-        trk = im->img.trk_info;
+        trk = im->img->trk_info;
         for (i = 0; i < im->nr_sides; i++) {
             /* All tracks have custom GAP2 and GAP4A. */
             trk->gap_2 = 24;
@@ -1222,11 +1412,11 @@ static bool_t jvc_open(struct image *im)
     unsigned int bps, bpc;
     struct simple_layout layout = dfl_simple_layout;
 
-    im->img.base_off = f_size(&im->fp) & 255;
+    im->img->base_off = f_size(&im->fp) & 255;
 
     /* Check the image header. */
     F_read(&im->fp, &jvc,
-           min_t(unsigned, im->img.base_off, sizeof(jvc)), NULL);
+           min_t(unsigned, im->img->base_off, sizeof(jvc)), NULL);
     if (jvc.attr || ((jvc.sides != 1) && (jvc.sides != 2)) || (jvc.spt == 0))
         return FALSE;
 
@@ -1289,7 +1479,7 @@ static bool_t vdk_open(struct image *im)
     if ((im->nr_sides != 1) && (im->nr_sides != 2))
         return FALSE;
 
-    im->img.base_off = le16toh(vdk.hlen);
+    im->img->base_off = le16toh(vdk.hlen);
 
     simple_layout(im, &layout);
     return raw_open(im);
@@ -1309,8 +1499,10 @@ struct xdf_format {
     } cylN_sec[2][4]; /* per-head, per-sector */
 };
 
+/* Per-layout track descriptors, indexed by trk_map[] entry. */
 struct xdf_info {
     uint32_t *file_sec_offsets[4]; /* C0H0 C0H1 CnH0 CnH1 */
+    uint32_t track_delay_bc[4];
     const struct xdf_format *fmt;
     uint32_t cyl_bytes;
 };
@@ -1391,7 +1583,7 @@ found:
         unsigned int aux_id = 1, main_id = 129;
         trk = add_track_layout(im, fmt->sec_per_track0, i);
         trk->interleave = 2;
-        sec = &im->img.sec_info_base[trk->sec_off];
+        sec = &im->img->sec_info_base[trk->sec_off];
         for (j = 0; j < fmt->sec_per_track0; j++) {
             sec->r = (i == 0) && (j < 8) ? aux_id++ : main_id++;
             sec->n = 2;
@@ -1401,7 +1593,7 @@ found:
     for (; i < 4; i++) {
         trk = add_track_layout(im, fmt->sec_per_trackN, i);
         trk->interleave = 1;
-        sec = &im->img.sec_info_base[trk->sec_off];
+        sec = &im->img->sec_info_base[trk->sec_off];
         for (j = 0; j < fmt->sec_per_trackN; j++) {
             uint8_t n = fmt->cylN_sec[i-2][j].no;
             sec->r = n + 128;
@@ -1418,9 +1610,9 @@ found:
     finalise_track_map(im);
 
     /* File sector offsets: Dummy non-NULL until xdf_setup_track(). */
-    im->img.file_sec_offsets = (uint32_t *)0xdeadbeef;
+    im->img->file_sec_offsets = (uint32_t *)0xdeadbeef;
 
-    offs = off = (uint32_t *)align_p(im->img.heap_bottom)
+    offs = off = (uint32_t *)align_p(im->img->heap_bottom)
         - 2*fmt->sec_per_track0 - 2*fmt->sec_per_trackN;
     xdf_info = (struct xdf_info *)offs - 1;
     check_p(xdf_info, im);
@@ -1467,30 +1659,32 @@ found:
         for (j = 0; j < fmt->sec_per_trackN; j++)
             *off++ = (uint32_t)fmt->cylN_sec[i][j].offs << 8;
 
-    return raw_open(im);
+    for (i = 0; i < 4; i++)
+        xdf_info->track_delay_bc[i] = (i == 3) ? fmt->head1_shift_bc : 0;
+
+    if (!raw_open(im))
+        return FALSE;
+
+    /* Both sides of a cylinder share one region of the image file. Set up
+     * the track offset table to match, for setup_track and prefetch. */
+    for (i = 0; i < im->nr_cyls * im->nr_sides; i++)
+        im->img->trk_offs[i] = (i / im->nr_sides) * xdf_info->cyl_bytes;
+
+    return TRUE;
 }
 
 /* Sets up track delay and file sector-offsets table before calling 
- * generic routine. */
+ * generic routine. All are precomputed by xdf_open(). */
 static void xdf_setup_track(
     struct image *im, uint16_t track, uint32_t *start_pos)
 {
-    struct xdf_info *xdf_info = (struct xdf_info *)im->img.heap_bottom;
-    unsigned int offs_sel;
-
-    im->img.track_delay_bc = 0;
-    offs_sel = track & 1;
+    struct xdf_info *xdf_info = (struct xdf_info *)im->img->heap_bottom;
+    unsigned int layout = im->img->trk_map[track];
 
-    if ((track>>1) != 0) {
-        /* Cyl N. */
-        offs_sel += 2;
-        if (track & 1)
-            im->img.track_delay_bc = xdf_info->fmt->head1_shift_bc;
-    }
-
-    im->img.trk_off = (track>>1) * xdf_info->cyl_bytes;
-    im->img.trk_len = xdf_info->cyl_bytes;
-    im->img.file_sec_offsets = xdf_info->file_sec_offsets[offs_sel];
+    im->img->track_delay_bc = xdf_info->track_delay_bc[layout];
+    im->img->trk_off = im->img->trk_offs[track];
+    im->img->trk_len = xdf_info->cyl_bytes;
+    im->img->file_sec_offsets = xdf_info->file_sec_offsets[layout];
 
     raw_setup_track(im, track, start_pos);
 }
@@ -1502,7 +1696,9 @@ const struct image_handler img_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
+    .state_sz = sizeof(struct img_image),
 };
 
 const struct image_handler d81_image_handler = {
@@ -1512,7 +1708,9 @@ const struct image_handler d81_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
+    .state_sz = sizeof(struct img_image),
 };
 
 const struct image_handler st_image_handler = {
@@ -1522,7 +1720,9 @@ const struct image_handler st_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
+    .state_sz = sizeof(struct img_image),
 };
 
 const struct image_handler adfs_image_handler = {
@@ -1532,7 +1732,9 @@ const struct image_handler adfs_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
+    .state_sz = sizeof(struct img_image),
 };
 
 const struct image_handler atr_image_handler = {
@@ -1542,7 +1744,9 @@ const struct image_handler atr_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
+    .state_sz = sizeof(struct img_image),
 };
 
 const struct image_handler mbd_image_handler = {
@@ -1552,7 +1756,9 @@ const struct image_handler mbd_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
+    .state_sz = sizeof(struct img_image),
 };
 
 const struct image_handler mgt_image_handler = {
@@ -1562,7 +1768,9 @@ const struct image_handler mgt_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
+    .state_sz = sizeof(struct img_image),
 };
 
 const struct image_handler pc98fdi_image_handler = {
@@ -1572,7 +1780,9 @@ const struct image_handler pc98fdi_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
+    .state_sz = sizeof(struct img_image),
 };
 
 const struct image_handler pc98hdm_image_handler = {
@@ -1582,7 +1792,9 @@ const struct image_handler pc98hdm_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
+    .state_sz = sizeof(struct img_image),
 };
 
 const struct image_handler trd_image_handler = {
@@ -1593,7 +1805,9 @@ const struct image_handler trd_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
+    .state_sz = sizeof(struct img_image),
 };
 
 const struct image_handler opd_image_handler = {
@@ -1603,7 +1817,9 @@ const struct image_handler opd_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
+    .state_sz = sizeof(struct img_image),
 };
 
 const struct image_handler ssd_image_handler = {
@@ -1614,7 +1830,9 @@ const struct image_handler ssd_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
+    .state_sz = sizeof(struct img_image),
 };
 
 const struct image_handler dsd_image_handler = {
@@ -1625,7 +1843,9 @@ const struct image_handler dsd_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
+    .state_sz = sizeof(struct img_image),
 };
 
 const struct image_handler sdu_image_handler = {
@@ -1635,7 +1855,9 @@ const struct image_handler sdu_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
+    .state_sz = sizeof(struct img_image),
 };
 
 const struct image_handler jvc_image_handler = {
@@ -1645,7 +1867,9 @@ const struct image_handler jvc_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
+    .state_sz = sizeof(struct img_image),
 };
 
 const struct image_handler vdk_image_handler = {
@@ -1655,7 +1879,9 @@ const struct image_handler vdk_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
+    .state_sz = sizeof(struct img_image),
 };
 
 const struct image_handler ti99_image_handler = {
@@ -1665,7 +1891,9 @@ const struct image_handler ti99_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
+    .state_sz = sizeof(struct img_image),
 };
 
 const struct image_handler xdf_image_handler = {
@@ -1675,7 +1903,9 @@ const struct image_handler xdf_image_handler = {
     .rdata_flux = bc_rdata_flux,
     .write_track = raw_write_track,
     .sync = raw_sync,
+    .prefetch = raw_prefetch,
     .async = TRUE,
+    .state_sz = sizeof(struct img_image),
 };
 
 
@@ -1685,13 +1915,16 @@ const struct image_handler xdf_image_handler = {
 
 static FSIZE_t raw_extend(struct image *im)
 {
-    unsigned int i, j, sz = im->img.base_off;
+    unsigned int i, j, sz = im->img->base_off;
     struct raw_trk *trk;
     struct raw_sec *sec;
 
+    if (im->img->trk_stride)
+        return sz + im->nr_cyls * im->nr_sides * im->img->trk_stride;
+
     for (i = 0; i < im->nr_cyls * im->nr_sides; i++) {
-        trk = &im->img.trk_info[im->img.trk_map[i]];
-        sec = &im->img.sec_info_base[trk->sec_off];
+        trk = &im->img->trk_info[im->img->trk_map[i]];
+        sec = &im->img->sec_info_base[trk->sec_off];
         for (j = 0; j < trk->nr_sectors; j++) {
             sz += sec_sz(sec->n);
             sec++;
@@ -1705,13 +1938,13 @@ static unsigned int file_idx(
     struct image *im, unsigned int cyl, unsigned int side)
 {
     unsigned int _c, _s;
-    _c = (im->img.layout & LAYOUT_reverse_side(side))
+    _c = (im->img->layout & LAYOUT_reverse_side(side))
         ? im->nr_cyls - cyl - 1
         : cyl;
-    _s = (im->img.layout & LAYOUT_sides_swapped)
+    _s = (im->img->layout & LAYOUT_sides_swapped)
         ? side ^ (im->nr_sides - 1)
         : side;
-    return (im->img.layout & LAYOUT_sequential)
+    return (im->img->layout & LAYOUT_sequential)
         ? (_s * im->nr_cyls) + _c
         : (_c * im->nr_sides) + _s;
 }
@@ -1720,8 +1953,8 @@ static inline unsigned int calc_track_len(
     struct image *im, unsigned int cyl, unsigned int side)
 {
     struct raw_trk *trk =
-        &im->img.trk_info[im->img.trk_map[cyl*im->nr_sides + side]];
-    struct raw_sec *sec = &im->img.sec_info_base[trk->sec_off];
+        &im->img->trk_info[im->img->trk_map[cyl*im->nr_sides + side]];
+    struct raw_sec *sec = &im->img->sec_info_base[trk->sec_off];
     unsigned int off = 0;
     for (unsigned int k = 0; k < trk->nr_sectors; k++) {
         off += sec_sz(sec->n);
@@ -1733,46 +1966,47 @@ static inline unsigned int calc_track_len(
 static unsigned int calc_track_off(
     struct image *im, unsigned int cyl, unsigned int side)
 {
-    unsigned int off = im->img.base_off;
-    unsigned int i, j;
-    unsigned int idx = file_idx(im, cyl, side);
-    for (i = 0; i < im->nr_cyls; i++) {
-        for (j = 0; j < im->nr_sides; j++) {
-            if (file_idx(im, i, j) >= idx)
-                continue;
-            off += calc_track_len(im, i, j);
-        }
-    }
-    return off;
+    return im->img->trk_offs[file_idx(im, cyl, side)];
+}
+
+static uint32_t sec_data_off(struct image *im, unsigned int sec_i)
+{
+    return (im->img->file_sec_offsets ?: im->img->sec_offs)[sec_i];
+}
+
+/* Ring position of byte @off of the current track. */
+static uint32_t ring_pos(struct image *im, uint32_t off)
+{
+    return off + (im->img->resident ? im->img->trk_off : im->img->trk_off % 512);
 }
 
 static void raw_seek_track(
     struct image *im, uint16_t track, unsigned int cyl, unsigned int side)
 {
-    unsigned int i, pos;
+    unsigned int i, pos, off;
     struct raw_trk *trk;
     uint16_t old_track = im->cur_track;
-    uint32_t trk_off, trk_len;
+    uint32_t trk_off, trk_len, ring_bytes;
     uint32_t shadow_trk_off = 0, shadow_trk_len = 0;
 
     im->cur_track = track;
 
     /* Update image structure with info for this track. */
-    trk = &im->img.trk_info[im->img.trk_map[cyl*im->nr_sides + side]];
-    im->img.trk = trk;
-    im->img.sec_info = &im->img.sec_info_base[trk->sec_off];
+    trk = &im->img->trk_info[im->img->trk_map[cyl*im->nr_sides + side]];
+    im->img->trk = trk;
+    im->img->sec_info = &im->img->sec_info_base[trk->sec_off];
 
     trk->rpm = trk->rpm ?: 300;
     im->stk_per_rev = (stk_ms(200) * 300) / trk->rpm;
 
     if (trk->nr_sectors != 0) {
         /* Create logical sector map in rotational order. */
-        memset(im->img.sec_map, 0xff, trk->nr_sectors);
+        memset(im->img->sec_map, 0xff, trk->nr_sectors);
         pos = ((cyl*trk->cskew) + (side*trk->hskew)) % trk->nr_sectors;
         for (i = 0; i < trk->nr_sectors; i++) {
-            while (im->img.sec_map[pos] != 0xff)
+            while (im->img->sec_map[pos] != 0xff)
                 pos = (pos + 1) % trk->nr_sectors;
-            im->img.sec_map[pos] = i;
+            im->img->sec_map[pos] = i;
             pos = (pos + trk->interleave) % trk->nr_sectors;
         }
     }
@@ -1784,10 +2018,28 @@ static void raw_seek_track(
         mfm_prep_track(im);
     }
 
-    if (im->img.file_sec_offsets != NULL) {
+    /* Sector offsets, so that the per-sector paths need not sum sizes. */
+    for (i = off = 0; i < trk->nr_sectors; i++) {
+        im->img->sec_offs[i] = off;
+        off += sec_sz(im->img->sec_info[i].n);
+    }
+    for (i = off = 0; i < trk->nr_sectors; i++) {
+        im->img->enc_offs[i] = off;
+        off += enc_sec_sz(im, &im->img->sec_info[im->img->sec_map[i]]);
+    }
+    im->img->enc_offs[i] = off;
+
+    if (im->img->resident) {
+        /* The ring already spans the whole image. */
+        im->img->trk_off = calc_track_off(im, cyl, side);
+        im->img->trk_len = calc_track_len(im, cyl, side);
+        goto out;
+    }
+
+    if (im->img->file_sec_offsets != NULL) {
         /* Assume xdf, where track offset is the same for both side. */
-        trk_off = im->img.trk_off;
-        trk_len = im->img.trk_len;
+        trk_off = im->img->trk_off;
+        trk_len = im->img->trk_len;
     } else {
         trk_off = calc_track_off(im, cyl, 0);
         trk_len = calc_track_len(im, cyl, 0);
@@ -1796,17 +2048,17 @@ static void raw_seek_track(
             shadow_trk_len = calc_track_len(im, cyl, 1);
         }
 
-        im->img.shadow = side > 0;
-        if (im->img.shadow) {
-            im->img.trk_off = shadow_trk_off;
-            im->img.trk_len = shadow_trk_len;
+        im->img->shadow = side > 0;
+        if (im->img->shadow) {
+            im->img->trk_off = shadow_trk_off;
+            im->img->trk_len = shadow_trk_len;
         } else {
-            im->img.trk_off = trk_off;
-            im->img.trk_len = trk_len;
+            im->img->trk_off = trk_off;
+            im->img->trk_len = trk_len;
         }
     }
 
-    /* Align to 512-byte block boundaries for ring_io, so im->img.trk_off/len
+    /* Align to 512-byte block boundaries for ring_io, so im->img->trk_off/len
      * is unchanged. This will generally have no effect because normally
      * sec_sz*nr_sec is a multiple of 512. */
     trk_len += trk_off % 512;
@@ -1822,7 +2074,7 @@ static void raw_seek_track(
 
         /* Check if both sides fit in memory. We want to fully-buffer at least
          * the current side. */
-        disable_shadow |= im->img.track_data.len < trk_len*2;
+        disable_shadow |= im->img->track_data.len < trk_len*2;
         /* Check if the two sides overlap, which would confuse the ring. This
          * implies tracks are not 512-byte aligned which we choose not to
          * bother optimizing. */
@@ -1838,19 +2090,32 @@ static void raw_seek_track(
                 trk_len = shadow_trk_len;
             }
             shadow_trk_off = shadow_trk_len = 0;
-            im->img.shadow = FALSE;
+            im->img->shadow = FALSE;
             old_track = ~track; /* Force re-init. */
         }
     }
 
     if (old_track >> 1 != track >> 1) {
         FSIZE_t shadow_off = shadow_trk_len > 0 ? shadow_trk_off : ~0;
-        ring_io_sync(&im->img.ring_io);
-        ring_io_shutdown(&im->img.ring_io);
-        ring_io_init(&im->img.ring_io, &im->fp, &im->img.track_data,
+        struct image_buf *td = &im->img->track_data;
+        ring_io_sync(&im->img->ring_io);
+        ring_io_shutdown(&im->img->ring_io);
+        image_prefetch_reserve(im, td->p, (uint8_t *)td->p
+                + min_t(uint32_t, td->len, trk_len + shadow_trk_len));
+        ring_io_init(&im->img->ring_io, &im->fp, &im->img->track_data,
                 trk_off, shadow_off, trk_len / 512);
-        im->img.ring_io.batch_secs = 2;
+        ring_io_tune(&im->img->ring_io, 2, 8, 0, 0);
+        im->img->ring_io.map = im->extents;
     }
+
+out:
+    /* Cache the encoded track in spare track_data above the ring. */
+    ring_bytes = im->img->ring_io.ring_len
+        * ((im->img->ring_io.f_shadow_off != ~0) ? 2 : 1);
+    bc_cache_init(im, &im->img->bc_cache,
+                  (uint8_t *)im->img->track_data.p + ring_bytes,
+                  (uint8_t *)im->img->track_data.p + im->img->track_data.len,
+                  im->tracklen_bc);
 }
 
 static uint32_t calc_start_pos(struct image *im)
@@ -1858,59 +2123,57 @@ static uint32_t calc_start_pos(struct image *im)
     uint32_t decode_off;
     int32_t bc;
 
-    bc = im->cur_bc - im->img.track_delay_bc;
+    bc = im->cur_bc - im->img->track_delay_bc;
     if (bc < 0)
         bc += im->tracklen_bc;
 
-    im->img.crc = 0xffff;
-    im->img.trk_sec = im->img.rd_sec_pos = im->img.decode_data_pos = 0;
+    im->img->crc = 0xffff;
+    im->img->trk_sec = im->img->rd_sec_pos = im->img->decode_data_pos = 0;
     decode_off = bc / 16;
-    if (decode_off < im->img.idx_sz) {
+    if (decode_off < im->img->idx_sz) {
         /* Post-index track gap */
-        im->img.decode_pos = 0;
+        im->img->decode_pos = 0;
     } else {
-        struct raw_trk *trk = im->img.trk;
-        uint8_t *sec_map = im->img.sec_map;
-        unsigned int i, ess;
+        struct raw_trk *trk = im->img->trk;
+        uint32_t *enc_offs = im->img->enc_offs;
+        unsigned int i;
         struct raw_sec *sec;
-        decode_off -= im->img.idx_sz;
-        for (i = 0; i < trk->nr_sectors; i++) {
-            sec = &im->img.sec_info[*sec_map++];
-            ess = enc_sec_sz(im, sec);
-            if (decode_off < ess)
+        decode_off -= im->img->idx_sz;
+        for (i = 0; i < trk->nr_sectors; i++)
+            if (decode_off < enc_offs[i+1])
                 break;
-            decode_off -= ess;
-        }
         if (i < trk->nr_sectors) {
+            sec = &im->img->sec_info[im->img->sec_map[i]];
+            decode_off -= enc_offs[i];
             /* IDAM */
-            im->img.trk_sec = i;
-            im->img.decode_pos = i * 4 + 1;
-            if (decode_off >= im->img.idam_sz) {
+            im->img->trk_sec = i;
+            im->img->decode_pos = i * 4 + 1;
+            if (decode_off >= im->img->idam_sz) {
                 /* DAM */
-                decode_off -= im->img.idam_sz;
-                im->img.decode_pos++;
-                if (decode_off >= im->img.dam_sz_pre) {
+                decode_off -= im->img->idam_sz;
+                im->img->decode_pos++;
+                if (decode_off >= im->img->dam_sz_pre) {
                     /* Data or Post Data */
-                    decode_off -= im->img.dam_sz_pre;
-                    im->img.decode_pos++;
+                    decode_off -= im->img->dam_sz_pre;
+                    im->img->decode_pos++;
                     if (decode_off < sec_sz(sec->n)) {
                         /* Data */
-                        im->img.rd_sec_pos = decode_off / BATCH_SIZE;
-                        im->img.decode_data_pos = im->img.rd_sec_pos;
+                        im->img->rd_sec_pos = decode_off / BATCH_SIZE;
+                        im->img->decode_data_pos = im->img->rd_sec_pos;
                         decode_off %= BATCH_SIZE;
                     } else {
                         /* Post Data */
                         decode_off -= sec_sz(sec->n);
-                        im->img.decode_pos++;
+                        im->img->decode_pos++;
                         /* Start fetch at next sector. */
-                        im->img.trk_sec = (i + 1) % trk->nr_sectors;
+                        im->img->trk_sec = (i + 1) % trk->nr_sectors;
                     }
                 }
             }
         } else {
             /* Pre-index track gap */
-            im->img.decode_pos = trk->nr_sectors * 4 + 1;
-            im->img.decode_data_pos = decode_off / BATCH_SIZE;
+            im->img->decode_pos = trk->nr_sectors * 4 + 1;
+            im->img->decode_data_pos = decode_off / BATCH_SIZE;
             decode_off %= BATCH_SIZE;
         }
     }
@@ -1930,7 +2193,7 @@ static void raw_setup_track(
     if (track != im->cur_track)
         raw_seek_track(im, track, cyl, side);
 
-    im->img.write_sector = -1;
+    im->img->write_sector = -1;
 
     im->cur_bc = (sys_ticks * 16) / im->ticks_per_cell;
     im->cur_bc &= ~15;
@@ -1943,19 +2206,310 @@ static void raw_setup_track(
     bc->prod = bc->cons = 0;
 
     if (start_pos) {
+        int32_t bc_pos = im->cur_bc - im->img->track_delay_bc;
+        if (bc_pos < 0)
+            bc_pos += im->tracklen_bc;
+
         decode_off = calc_start_pos(im);
 
-        im->img.trash_bc = decode_off * 16;
+        im->img->trash_bc = decode_off * 16;
         *start_pos = sys_ticks;
+
+        /* A cached track is replayed from the exact start word. */
+        bc_cache_seek(&im->img->bc_cache, bc_pos);
+        if (bc_cache_valid(&im->img->bc_cache))
+            im->img->trash_bc = 0;
     } else {
-        im->img.decode_pos = 0;
+        im->img->decode_pos = 0;
+        bc_cache_seek(&im->img->bc_cache, 0);
     }
 }
 
+static bool_t raw_prefetch(
+    struct image *im, int dir, struct image_prefetch *pf)
+{
+    struct ring_io *rio = &im->img->ring_io;
+    struct image_buf *td = &im->img->track_data;
+    int cyl = (im->cur_track >> 1) + dir;
+    unsigned int side = im->cur_track & 1, s;
+    uint32_t off, len, need;
+
+    if (!ring_io_idle(rio))
+        return FALSE;
+
+    pf->len = 0;
+    if (im->img->resident || (cyl < 0) || (cyl >= im->nr_cyls))
+        return TRUE;
+
+    if (im->img->file_sec_offsets != NULL) {
+        /* XDF: one ring spans the whole cylinder. */
+        off = calc_track_off(im, cyl, 0);
+        len = need = im->img->trk_len;
+    } else {
+        /* The neighbour's ring may cover both sides of the cylinder. */
+        for (s = need = 0; s < im->nr_sides; s++)
+            need += (calc_track_len(im, cyl, s) + 1023) & ~511;
+        off = calc_track_off(im, cyl, side);
+        len = calc_track_len(im, cyl, side);
+    }
+    need = min_t(uint32_t, need, td->len);
+    need = max_t(uint32_t, need, rio->ring_len
+                 * ((rio->f_shadow_off != ~0) ? 2 : 1));
+
+    pf->off = off;
+    pf->len = len;
+    pf->start = (uint8_t *)td->p + need;
+    pf->end = (uint8_t *)td->p + td->len;
+    if (im->img->bc_cache.p != NULL)
+        pf->end = (uint8_t *)im->img->bc_cache.p;
+    return TRUE;
+}
+
+/* Most recently opened raw images, keyed by first cluster, size and volume
+ * mount (not by directory entry, which floppy_mount() clears after open).
+ * Re-inserting one (eject menu, drive reset, swapping between the disks of
+ * a set) restores the parsed geometry rather than re-probing the file and
+ * re-parsing IMG.CFG. The geometry heap holds no pointers, so it is copied
+ * wholesale and rebased to its new top. Entries share one packed heap pool,
+ * and keep only the img_image fields set up by the probe (those before
+ * track_data). The cache lives in the arena's persistent tier, claimed at
+ * first mount. */
+#define RAW_CACHE_NR   2
+#define RAW_CACHE_POOL 1280
+#define RAW_CACHE_IMG  offsetof(struct img_image, track_data)
+static struct raw_cache {
+    const struct image_handler *handler;
+    uint32_t stamp; /* raw_cache_clock at last use */
+    uint32_t sclust, size;
+    uint16_t fs_id; /* FATFS mount id: a remount invalidates the entry */
+    uint8_t host, nr_cyls, nr_sides;
+    uint16_t heap_off, heap_len; /* Geometry heap, in raw_cache_pool */
+    uint8_t *heap_top;
+    uint32_t img[(RAW_CACHE_IMG + 3) / 4];
+} *raw_cache;
+static uint8_t *raw_cache_pool;
+static uint32_t raw_cache_clock;
+
+void raw_cache_init(void)
+{
+    unsigned int i;
+
+    if (raw_cache != NULL)
+        return;
+    raw_cache = arena_persist_alloc(RAW_CACHE_NR * sizeof(*raw_cache));
+    raw_cache_pool = arena_persist_alloc(RAW_CACHE_POOL);
+    for (i = 0; i < RAW_CACHE_NR; i++)
+        raw_cache[i].handler = NULL;
+}
+
+static uint8_t *raw_heap_top(struct image *im)
+{
+    return (uint8_t *)im->bufs.read_data.p + im->bufs.read_data.len;
+}
+
+static bool_t raw_cache_match(const struct raw_cache *c, struct image *im)
+{
+    return (c->handler == im->disk_handler)
+        && (c->sclust == im->fp.obj.sclust)
+        && (c->size == f_size(&im->fp))
+        && (c->fs_id == im->fp.obj.id)
+        && (c->host == ff_cfg.host);
+}
+
+static struct raw_cache *raw_cache_find(struct image *im)
+{
+    unsigned int i;
+
+    if (raw_cache == NULL)
+        return NULL;
+    for (i = 0; i < RAW_CACHE_NR; i++)
+        if (raw_cache_match(&raw_cache[i], im))
+            return &raw_cache[i];
+    return NULL;
+}
+
+/* Least recently used valid entry, or NULL if there is none. */
+static struct raw_cache *raw_cache_lru(void)
+{
+    struct raw_cache *c, *lru = NULL;
+    unsigned int i;
+
+    for (i = 0; i < RAW_CACHE_NR; i++) {
+        c = &raw_cache[i];
+        if ((c->handler != NULL) && ((lru == NULL) || (c->stamp < lru->stamp)))
+            lru = c;
+    }
+    return lru;
+}
+
+/* Slide the heaps of valid entries down over any freed space, lowest first.
+ * Returns the number of pool bytes in use. */
+static unsigned int raw_cache_pack(void)
+{
+    struct raw_cache *c, *next;
+    unsigned int i, used = 0;
+
+    for (;;) {
+        for (i = 0, next = NULL; i < RAW_CACHE_NR; i++) {
+            c = &raw_cache[i];
+            if ((c->handler != NULL) && (c->heap_off >= used)
+                && ((next == NULL) || (c->heap_off < next->heap_off)))
+                next = c;
+        }
+        if (next == NULL)
+            return used;
+        memmove(&raw_cache_pool[used], &raw_cache_pool[next->heap_off],
+                next->heap_len);
+        next->heap_off = used;
+        used += next->heap_len;
+    }
+}
+
+static void raw_cache_record(struct image *im)
+{
+    struct raw_cache *c;
+    uint8_t *top = raw_heap_top(im);
+    uint32_t len = top - (uint8_t *)im->img->heap_bottom;
+    unsigned int i, used;
+
+    if (raw_cache == NULL)
+        return;
+
+    /* Replace an empty entry, else the least recently used. */
+    for (i = 0; (i < RAW_CACHE_NR) && (raw_cache[i].handler != NULL); i++)
+        continue;
+    c = (i < RAW_CACHE_NR) ? &raw_cache[i] : raw_cache_lru();
+    c->handler = NULL;
+
+    /* Empty files have no first cluster, and so no unique key. XDF keeps
+     * pointers in its heap, so cannot be rebased. */
+    if ((im->fp.obj.sclust == 0) || (im->img->file_sec_offsets != NULL)
+        || (len == 0) || (len > RAW_CACHE_POOL))
+        return;
+
+    /* Make room in the pool, evicting further entries as needed. */
+    while ((used = raw_cache_pack()) + len > RAW_CACHE_POOL)
+        raw_cache_lru()->handler = NULL;
+
+    c->sclust = im->fp.obj.sclust;
+    c->size = f_size(&im->fp);
+    c->fs_id = im->fp.obj.id;
+    c->host = ff_cfg.host;
+    c->nr_cyls = im->nr_cyls;
+    c->nr_sides = im->nr_sides;
+    c->heap_top = top;
+    memcpy(c->img, im->img, RAW_CACHE_IMG);
+    c->heap_off = used;
+    c->heap_len = len;
+    memcpy(&raw_cache_pool[used], im->img->heap_bottom, len);
+    c->stamp = ++raw_cache_clock;
+    c->handler = im->disk_handler;
+}
+
+/* Handler of the @i'th valid cache entry, or NULL if there are no more. */
+const struct image_handler *raw_cache_handler(unsigned int i)
+{
+    unsigned int j;
+
+    if (raw_cache == NULL)
+        return NULL;
+    for (j = 0; j < RAW_CACHE_NR; j++)
+        if ((raw_cache[j].handler != NULL) && (i-- == 0))
+            return raw_cache[j].handler;
+    return NULL;
+}
+
+bool_t raw_cache_open(struct image *im)
+{
+    struct raw_cache *c = raw_cache_find(im);
+    uint8_t *top = raw_heap_top(im);
+    int32_t delta;
+
+    if ((c == NULL)
+        || ((uint32_t)(top - (uint8_t *)im->bufs.read_data.p)
+            < c->heap_len + BATCH_SIZE))
+        return FALSE;
+
+    c->stamp = ++raw_cache_clock;
+    delta = top - c->heap_top;
+    im->nr_cyls = c->nr_cyls;
+    im->nr_sides = c->nr_sides;
+    memcpy(im->img, c->img, RAW_CACHE_IMG);
+#define rebase(p) ((p) = (void *)((uint8_t *)(p) + delta))
+    rebase(im->img->heap_bottom);
+    rebase(im->img->trk_map);
+    rebase(im->img->sec_map);
+    rebase(im->img->trk_info);
+    rebase(im->img->sec_info_base);
+#undef rebase
+    memcpy(im->img->heap_bottom, &raw_cache_pool[c->heap_off], c->heap_len);
+
+    return raw_open(im);
+}
+
+/* Spare track_data required above a resident image. */
+#define RESIDENT_SLACK (8*1024)
+
 static bool_t raw_open(struct image *im)
 {
-    im->img.track_data.p = im->bufs.write_data.p + BATCH_SIZE;
-    im->img.track_data.len = im->img.heap_bottom - im->img.track_data.p;
+    struct raw_trk *trk;
+    unsigned int i, j, nr_trks, nr_secs, sz;
+    uint32_t off;
+
+    if (!raw_cache_find(im))
+        raw_cache_record(im);
+
+    im->img->track_data.p = im->bufs.write_data.p + BATCH_SIZE;
+    im->img->track_data.len = im->img->heap_bottom - im->img->track_data.p;
+
+    /* Carve the track and sector offset tables from the bottom of
+     * track_data, sized for the largest track layout. */
+    nr_trks = im->nr_cyls * im->nr_sides;
+    for (i = nr_secs = 0; i < nr_trks; i++) {
+        trk = &im->img->trk_info[im->img->trk_map[i]];
+        nr_secs = max_t(unsigned int, nr_secs, trk->nr_sectors);
+    }
+    sz = ((nr_trks + 2*nr_secs + 1) * sizeof(uint32_t) + 31) & ~31;
+    if (sz >= im->img->track_data.len)
+        F_die(FR_BAD_IMAGE);
+    im->img->trk_offs = im->img->track_data.p;
+    im->img->sec_offs = im->img->trk_offs + nr_trks;
+    im->img->enc_offs = im->img->sec_offs + nr_secs;
+    im->img->track_data.p += sz;
+    im->img->track_data.len -= sz;
+
+    /* Track offsets, in file order. In an aligned container every track
+     * occupies the same stride, so each starts on a sector boundary and is
+     * fetched by a single contiguous read. */
+    aln_probe(im);
+    for (i = 0; i < im->nr_cyls; i++)
+        for (j = 0; j < im->nr_sides; j++)
+            im->img->trk_offs[file_idx(im, i, j)] = calc_track_len(im, i, j);
+    for (i = 0, off = im->img->base_off; i < nr_trks; i++) {
+        uint32_t len = im->img->trk_offs[i];
+        if (im->img->trk_stride) {
+            if (len > im->img->trk_stride)
+                F_die(FR_BAD_IMAGE);
+            len = im->img->trk_stride;
+        }
+        im->img->trk_offs[i] = off;
+        off += len;
+    }
+
+    /* Hold small images wholly in RAM, leaving room to cache the encoded
+     * track. The ring streams the whole image in on first use, and each
+     * seek thereafter is served from memory. Writes go back via the ring's
+     * usual sync path. */
+    sz = (f_size(&im->fp) + 511) & ~511;
+    if ((im->img->file_sec_offsets == NULL) && (sz != 0)
+            && (sz + RESIDENT_SLACK <= im->img->track_data.len)) {
+        im->img->resident = TRUE;
+        ring_io_init(&im->img->ring_io, &im->fp, &im->img->track_data,
+                0, ~0, sz / 512);
+        ring_io_tune(&im->img->ring_io, 2, 8, 0, 0);
+        im->img->ring_io.map = im->extents;
+        printk("IMG: %uKB resident\n", sz / 1024);
+    }
 
     /* Initialise write_bc_ticks (used by floppy_insert to set outp_hden). */
     im->cur_track = ~0;
@@ -1967,9 +2521,9 @@ static bool_t raw_open(struct image *im)
 void process_data(struct image *im, void *p, unsigned int len)
 {
     /* Pointer and size should be 4-byte aligned. */
-    ASSERT(!((len|(uint32_t)p)&3));
+    ASSERT(!((len|(uintptr_t)p)&3));
 
-    if (im->img.trk->invert_data) {
+    if (im->img->trk->invert_data) {
         uint32_t *_p = p, *_q = _p + len/4;
         while (_p != _q) {
             *_p = ~*_p;
@@ -1980,52 +2534,75 @@ void process_data(struct image *im, void *p, unsigned int len)
 
 static bool_t raw_read_track(struct image *im)
 {
-    return (im->sync == SYNC_fm) ? fm_read_track(im) : mfm_read_track(im);
+    struct bc_cache *c = &im->img->bc_cache;
+    uint32_t prod = im->bufs.read_bc.prod;
+    int32_t pre_gap = im->img->trk->nr_sectors * 4 + 1;
+    bool_t in_pre_gap = (im->img->decode_pos == pre_gap), ret;
+
+    if (bc_cache_valid(c)) {
+        ring_io_progress(&im->img->ring_io);
+        return bc_cache_replay(im, c);
+    }
+
+    ret = (im->sync == SYNC_fm) ? fm_read_track(im) : mfm_read_track(im);
+    /* The revolution ends when we emit the last of the pre-index gap. */
+    if (ret)
+        bc_cache_record(im, c, prod,
+                        in_pre_gap && (im->img->decode_pos != pre_gap));
+    return ret;
 }
 
 static int raw_find_first_write_sector(
     struct image *im, struct write *write, struct raw_trk *trk)
 {
-    uint8_t *sec_map = im->img.sec_map;
     unsigned int i;
     int32_t base;
 
     base = write->start / im->ticks_per_cell; /* in data bytes */
-    base -= im->img.track_delay_bc;
+    base -= im->img->track_delay_bc;
     if (base < 0)
         base += im->tracklen_bc;
 
     /* Convert write offset to sector number (in rotational order). */
-    base -= im->img.idx_sz + im->img.idam_sz;
+    base -= im->img->idx_sz + im->img->idam_sz;
     for (i = 0; i < trk->nr_sectors; i++) {
         /* Within small range of expected data start? */
-        if ((base >= -64) && (base <= 64))
+        int32_t delta = base - (int32_t)im->img->enc_offs[i];
+        if ((delta >= -64) && (delta <= 64))
             break;
-        base -= enc_sec_sz(im, &im->img.sec_info[*sec_map++]);
     }
 
     /* Convert rotational order to logical order. */
     if (i >= trk->nr_sectors) {
-        printk("IMG Bad Wr.Off: %d\n", base);
+        printk("IMG Bad Wr.Off: %d\n", base - (int32_t)im->img->enc_offs[i]);
         return -2;
     }
-    return *sec_map;
+    return im->img->sec_map[i];
 }
 
 static bool_t raw_write_track(struct image *im)
 {
     bool_t flush;
-    struct raw_trk *trk = im->img.trk;
+    struct raw_trk *trk = im->img->trk;
     struct write *write = get_write(im, im->wr_cons);
     struct image_buf *wr = &im->bufs.write_bc;
     uint16_t *buf = wr->p;
     unsigned int bufmask = (wr->len / 2) - 1;
     uint8_t *wrbuf = im->bufs.write_data.p;
     uint32_t c = wr->cons / 16, p = wr->prod / 16;
-    struct image_buf *td = &im->img.track_data;
+    struct image_buf *td = &im->img->track_data;
     struct raw_sec *sec;
+    struct raw_cache *rc;
     unsigned int i;
 
+    /* A write may change what the probe found (eg. a reformatted boot
+     * sector): forget the cached geometry. */
+    if ((rc = raw_cache_find(im)) != NULL)
+        rc->handler = NULL;
+
+    /* Any write may change the track's encoding. */
+    bc_cache_invalidate(&im->img->bc_cache);
+
     /* If we are processing final data then use the end index, rounded up. */
     barrier();
     flush = (im->wr_cons != im->wr_bc);
@@ -2033,7 +2610,7 @@ static bool_t raw_write_track(struct image *im)
         p = (write->bc_end + 15) / 16;
 
     while ((int16_t)(p - c) > 0) {
-        if (im->img.decode_pos == 0) {
+        if (im->img->decode_pos == 0) {
             uint8_t x;
             /* When IRQ_write_dma finds the sync it will rewrite 32 bits that
              * may have already been observed by the consumer to align the
@@ -2063,11 +2640,11 @@ static bool_t raw_write_track(struct image *im)
             }
 
             if (x == 0xfe) /* IDAM */
-                im->img.decode_pos = 1;
+                im->img->decode_pos = 1;
             else if (x == 0xfb) /* DAM */
-                im->img.decode_pos = 2;
+                im->img->decode_pos = 2;
 
-        } else if (im->img.decode_pos == 1) {
+        } else if (im->img->decode_pos == 1) {
             /* ID record, shy address mark */
             uint8_t idam_r;
             uint16_t crc;
@@ -2089,119 +2666,129 @@ static bool_t raw_write_track(struct image *im)
             crc = crc16_ccitt(wrbuf, i, 0xffff);
             if (crc != 0) {
                 printk("IMG IDAM Bad CRC: %04x, %u\n", crc, idam_r);
-                im->img.decode_pos = 0;
+                im->img->decode_pos = 0;
                 continue;
             }
             /* Search by sector id for this sector's logical order. */
-            for (i = 0, sec = im->img.sec_info;
+            for (i = 0, sec = im->img->sec_info;
                  (i < trk->nr_sectors) && (sec->r != idam_r);
                  i++, sec++)
                 continue;
-            im->img.write_sector = i;
+            im->img->write_sector = i;
+            im->img->formatting = TRUE;
             if (i >= trk->nr_sectors) {
                 printk("IMG IDAM Bad Sector: %02x\n", idam_r);
-                im->img.write_sector = -2;
+                im->img->write_sector = -2;
             }
-            im->img.decode_data_pos = 0;
-            im->img.decode_pos = 0;
-        } else if (im->img.decode_pos == 2) {
+            im->img->decode_data_pos = 0;
+            im->img->decode_pos = 0;
+        } else if (im->img->decode_pos == 2) {
             /* Data record, shy address mark */
             unsigned int sec_sz;
-            int sec_nr = im->img.write_sector;
+            int sec_nr = im->img->write_sector;
 
             if (sec_nr < 0) {
                 if (sec_nr == -1) {
                     sec_nr = raw_find_first_write_sector(im, write, trk);
-                    im->img.write_sector = sec_nr;
-                    im->img.decode_data_pos = 0;
+                    im->img->write_sector = sec_nr;
+                    im->img->formatting = FALSE;
+                    im->img->decode_data_pos = 0;
                 }
                 if (sec_nr < 0) {
                     printk("IMG DAM Unknown\n");
-                    im->img.write_sector = -2;
-                    im->img.decode_pos = 0;
+                    im->img->write_sector = -2;
+                    im->img->decode_pos = 0;
                     continue;
                 }
             }
 
-            sec_sz = sec_sz(im->img.sec_info[sec_nr].n);
+            sec_sz = sec_sz(im->img->sec_info[sec_nr].n);
 
-            if (!im->img.decode_data_pos) {
+            if (!im->img->decode_data_pos) {
                 unsigned int off;
                 if (p - c < 4) /* Will we able to increment decode_data_pos? */
                     break;
-                im->img.crc = (im->sync == SYNC_fm) ? FM_DAM_CRC : MFM_DAM_CRC;
-
-                sec = &im->img.sec_info[sec_nr];
+                im->img->crc = (im->sync == SYNC_fm) ? FM_DAM_CRC : MFM_DAM_CRC;
 
-                if (im->img.file_sec_offsets) {
-                    off = im->img.file_sec_offsets[sec_nr];
-                } else {
-                    sec = im->img.sec_info;
-                    for (i = off = 0; i < sec_nr; i++)
-                        off += sec_sz(sec++->n);
-                }
-                off += im->img.trk_off % 512;
-                ring_io_seek(&im->img.ring_io, off, TRUE, im->img.shadow);
+                sec = &im->img->sec_info[sec_nr];
+                off = ring_pos(im, sec_data_off(im, sec_nr));
+                ring_io_seek(&im->img->ring_io, off, TRUE, im->img->shadow);
                 printk("Write %u[%02x]/%u\n", sec_nr, sec->r, trk->nr_sectors);
             }
 
-            if (im->img.decode_data_pos < sec_sz) {
+            if (im->img->decode_data_pos < sec_sz) {
                 unsigned int nr;
-                uint32_t idx = ring_io_idx(&im->img.ring_io, td->cons);
-                nr = sec_sz - im->img.decode_data_pos;
+                uint32_t idx = ring_io_idx(&im->img->ring_io, td->cons);
+                nr = sec_sz - im->img->decode_data_pos;
                 nr = min_t(unsigned int, nr,
-                        ring_io_idxend(&im->img.ring_io) - idx);
+                        ring_io_idxend(&im->img->ring_io) - idx);
                 /* Keep alignment for process_data(). */
                 if (nr && p - c < 4)
                     break;
                 nr = min_t(unsigned int, nr, (p - c) & ~3);
 
-                /* It should be quite rare to wait on the read, as that'd be
-                 * like a buffer underrun during normal reading. */
-                if (td->cons + nr > td->prod) {
-                    flush = FALSE;
-                    break;
+                if (im->img->formatting)
+                    nr = min_t(unsigned int, nr, BATCH_SIZE);
+
+                if (nr && im->img->formatting
+                        && ring_io_buffered(&im->img->ring_io, nr)) {
+                    /* A format mostly rewrites the data already there. Decode
+                     * aside, so that only changed sectors are written back. */
+                    mfm_ring_to_bin(buf, bufmask, c, wrbuf, nr);
+                    im->img->crc = crc16_ccitt(wrbuf, nr, im->img->crc);
+                    process_data(im, wrbuf, nr);
+                    ring_io_rewrite(&im->img->ring_io, wrbuf, nr);
+                } else {
+                    /* Sectors overwritten from their start need not be read
+                     * first. Waiting on the read otherwise should be quite
+                     * rare, as that'd be like a buffer underrun during normal
+                     * reading. */
+                    if (nr && !(nr = ring_io_writable(&im->img->ring_io,
+                                                      nr))) {
+                        flush = FALSE;
+                        break;
+                    }
+                    mfm_ring_to_bin(buf, bufmask, c, td->p + idx, nr);
+                    im->img->crc = crc16_ccitt(td->p + idx, nr,
+                                               im->img->crc);
+                    process_data(im, td->p + idx, nr);
+                    td->cons += nr;
                 }
-
-                mfm_ring_to_bin(buf, bufmask, c, td->p + idx, nr);
                 c += nr;
-                im->img.crc = crc16_ccitt(td->p + idx, nr, im->img.crc);
-                process_data(im, td->p + idx, nr);
-                td->cons += nr;
-                im->img.decode_data_pos += nr;
-                if (im->img.decode_data_pos == sec_sz)
-                    ring_io_flush(&im->img.ring_io);
+                im->img->decode_data_pos += nr;
+                if (im->img->decode_data_pos == sec_sz)
+                    ring_io_flush(&im->img->ring_io);
             }
 
-            if (im->img.decode_data_pos < sec_sz)
+            if (im->img->decode_data_pos < sec_sz)
                 continue;
 
             if (p - c < 2)
                 break;
             mfm_ring_to_bin(buf, bufmask, c, wrbuf, 2);
             c += 2;
-            im->img.crc = crc16_ccitt(wrbuf, 2, im->img.crc);
-            if (im->img.crc != 0)
-                printk("IMG Bad CRC: %04x\n", im->img.crc);
-            im->img.write_sector = -2;
-            im->img.decode_pos = 0;
+            im->img->crc = crc16_ccitt(wrbuf, 2, im->img->crc);
+            if (im->img->crc != 0)
+                printk("IMG Bad CRC: %04x\n", im->img->crc);
+            im->img->write_sector = -2;
+            im->img->decode_pos = 0;
         }
     }
 
-    ring_io_progress(&im->img.ring_io);
+    ring_io_progress(&im->img->ring_io);
     wr->cons = c * 16;
     return flush;
 }
 
 static void raw_sync(struct image *im)
 {
-    ring_io_sync(&im->img.ring_io);
-    ring_io_shutdown(&im->img.ring_io);
+    ring_io_sync(&im->img->ring_io);
+    ring_io_shutdown(&im->img->ring_io);
 }
 
 static void raw_dump_info(struct image *im)
 {
-    struct raw_trk *trk = im->img.trk;
+    struct raw_trk *trk = im->img->trk;
     unsigned int i;
 
     if (!verbose_image_log)
@@ -2214,14 +2801,14 @@ static void raw_dump_info(struct image *im)
     printk(" rpm: %u, tracklen: %u, datarate: %u\n",
            trk->rpm, im->tracklen_bc, trk->data_rate);
     printk(" gap2: %u, gap3: %u, gap4a: %u, gap4: %u\n",
-           trk->gap_2, trk->gap_3, trk->gap_4a, im->img.gap_4);
+           trk->gap_2, trk->gap_3, trk->gap_4a, im->img->gap_4);
     printk(" ticks_per_cell: %u, write_bc_ticks: %u, has_iam: %u\n",
            im->ticks_per_cell, im->write_bc_ticks, trk->has_iam);
     printk(" interleave: %u, cskew %u, hskew %u\n ",
            trk->interleave, trk->cskew, trk->hskew);
-    printk(" file-layout: %x\n", im->img.layout);
+    printk(" file-layout: %x\n", im->img->layout);
     for (i = 0; i < trk->nr_sectors; i++) {
-        struct raw_sec *sec = &im->img.sec_info[im->img.sec_map[i]];
+        struct raw_sec *sec = &im->img->sec_info[im->img->sec_map[i]];
         int hd = trk->head ? trk->head-1 : im->cur_track&1;
         printk("{%u,%u,%u,%u} ", im->cur_track/2, hd, sec->r, sec->n);
     }
@@ -2232,67 +2819,76 @@ static void raw_dump_info(struct image *im)
 static void img_fetch_data(struct image *im)
 {
     struct image_buf *rd = &im->bufs.read_data;
+    struct image_buf *td = &im->img->track_data;
     uint8_t *buf = rd->p;
-    struct raw_sec *sec, *s;
+    struct raw_sec *sec;
     uint8_t sec_i;
     uint16_t off, len;
+    uint32_t idx, idxend;
 
-    if (im->img.trk->nr_sectors == 0)
+    if (im->img->trk->nr_sectors == 0)
         return;
 
-    sec_i = im->img.sec_map[im->img.trk_sec];
-    sec = &im->img.sec_info[sec_i];
-
-    if (im->img.file_sec_offsets) {
-        off = im->img.file_sec_offsets[sec_i];
-    } else {
-        off = 0;
-        for (s = im->img.sec_info; s != sec; s++)
-            off += sec_sz(s->n);
+    if (rd->prod != rd->cons) {
+        /* The encoder may be using the fetched data in place. Keep the ring
+         * cursor on it so that ring_io does not recycle it. */
+        ring_io_progress(&im->img->ring_io);
+        return;
     }
 
+    sec_i = im->img->sec_map[im->img->trk_sec];
+    sec = &im->img->sec_info[sec_i];
+
+    off = sec_data_off(im, sec_i);
     len = sec_sz(sec->n);
 
-    off += im->img.rd_sec_pos * BATCH_SIZE;
-    len -= im->img.rd_sec_pos * BATCH_SIZE;
+    off += im->img->rd_sec_pos * BATCH_SIZE;
+    len -= im->img->rd_sec_pos * BATCH_SIZE;
 
-    off += im->img.trk_off % 512;
-    ring_io_seek(&im->img.ring_io, off, FALSE, im->img.shadow);
-    ring_io_progress(&im->img.ring_io);
+    ring_io_seek(&im->img->ring_io, ring_pos(im, off), FALSE, im->img->shadow);
+    ring_io_progress(&im->img->ring_io);
 
-    if (rd->prod != rd->cons)
-        return;
-    if (im->img.track_data.cons + min_t(uint16_t, len, BATCH_SIZE)
-            > im->img.track_data.prod)
+    if (td->cons + min_t(uint16_t, len, BATCH_SIZE) > td->prod)
         return;
 
     if (len > BATCH_SIZE) {
         len = BATCH_SIZE;
-        im->img.rd_sec_pos++;
+        im->img->rd_sec_pos++;
     } else {
-        im->img.rd_sec_pos = 0;
-        if (++im->img.trk_sec >= im->img.trk->nr_sectors)
-            im->img.trk_sec = 0;
+        im->img->rd_sec_pos = 0;
+        if (++im->img->trk_sec >= im->img->trk->nr_sectors)
+            im->img->trk_sec = 0;
     }
 
-    for (uint16_t todo = len; todo > 0;) {
-        uint32_t idx = ring_io_idx(&im->img.ring_io, im->img.track_data.cons);
-        uint32_t idxend = ring_io_idxend(&im->img.ring_io);
-        uint16_t tocopy = min_t(uint16_t, todo, idxend - idx);
+    idx = ring_io_idx(&im->img->ring_io, td->cons);
+    idxend = ring_io_idxend(&im->img->ring_io);
+
+    if (!im->img->trk->invert_data && (idx + len <= idxend)) {
+        /* Common case: encode straight from the ring. */
+        im->img->sec_data = (uint8_t *)td->p + idx;
+        rd->prod++;
+        return;
+    }
+
+    /* Stage in read_data: the data wraps the ring, or must be transformed.
+     * Leave td->cons unchanged, as above. */
+    for (uint16_t done = 0; done < len;) {
+        uint16_t tocopy = min_t(uint16_t, len - done, idxend - idx);
         ASSERT(idx % 4 == 0);
         ASSERT(tocopy % 32 == 0);
-        memcpy_fast(buf, im->img.track_data.p + idx, tocopy);
-        im->img.track_data.cons += tocopy;
-        todo -= tocopy;
+        memcpy_fast(buf + done, td->p + idx, tocopy);
+        done += tocopy;
+        idx = ring_io_idx(&im->img->ring_io, td->cons + done);
     }
     process_data(im, buf, len);
 
+    im->img->sec_data = buf;
     rd->prod++;
 }
 
 static void *align_p(void *p)
 {
-    return (void *)((uint32_t)p&~3);
+    return (void *)((uintptr_t)p&~3);
 }
 
 static void check_p(void *p, struct image *im)
@@ -2300,17 +2896,17 @@ static void check_p(void *p, struct image *im)
     uint8_t *a = p, *b = (uint8_t *)im->bufs.read_data.p;
     if ((int32_t)(a-b) < BATCH_SIZE)
         F_die(FR_BAD_IMAGE);
-    im->img.heap_bottom = p;
+    im->img->heap_bottom = p;
 }
 
 /* Initialise track/sector-info structures at the top of the heap. 
  * In ascending address order: 
  * {read,write}_data (truncated to BATCH_SIZE bytes)
  * ... [ring cache]
- * im->img.trk_info (trk_map[] points into here)
- * im->img.sec_info_base (trk_info[] + sec_map[] point into here)
- * im->img.sec_map (Sector info = sec_info[sec_map[sector#]])
- * im->img.trk_map (Track info = trk_info[trk_map[track#]]) */
+ * im->img->trk_info (trk_map[] points into here)
+ * im->img->sec_info_base (trk_info[] + sec_map[] point into here)
+ * im->img->sec_map (Sector info = sec_info[sec_map[sector#]])
+ * im->img->trk_map (Track info = trk_info[trk_map[track#]]) */
 static uint8_t *init_track_map(struct image *im)
 {
     uint8_t *trk_map, *sec_map;
@@ -2320,20 +2916,20 @@ static uint8_t *init_track_map(struct image *im)
         || (im->nr_cyls < 1) || (im->nr_cyls > 255))
         F_die(FR_BAD_IMAGE);
 
-    ASSERT(im->img.trk_info == NULL);
+    ASSERT(im->img->trk_info == NULL);
 
     /* Top of heap. */
     p = (uint8_t *)im->bufs.read_data.p + im->bufs.read_data.len;
 
     trk_map = (uint8_t *)p - im->nr_cyls * im->nr_sides;
-    im->img.trk_map = trk_map;
+    im->img->trk_map = trk_map;
 
     sec_map = trk_map - 256;
-    im->img.sec_map = sec_map;
+    im->img->sec_map = sec_map;
 
     p = align_p(sec_map);
-    im->img.sec_info_base = p;
-    im->img.trk_info = p;
+    im->img->sec_info_base = p;
+    im->img->trk_info = p;
 
     check_p(p, im);
 
@@ -2348,16 +2944,16 @@ static struct raw_trk *add_track_layout(
     struct raw_trk *trk;
     unsigned int i;
 
-    ASSERT(im->img.trk_info != NULL);
+    ASSERT(im->img->trk_info != NULL);
 
     if (nr_sectors > 256)
         F_die(FR_BAD_IMAGE);
 
-    sec = im->img.sec_info_base - nr_sectors;
+    sec = im->img->sec_info_base - nr_sectors;
     trk = (struct raw_trk *)align_p(sec) - trk_idx - 1;
     check_p(trk, im);
 
-    memcpy(trk, im->img.trk_info, trk_idx * sizeof(*trk));
+    memcpy(trk, im->img->trk_info, trk_idx * sizeof(*trk));
     for (i = 0; i < trk_idx; i++)
         trk[i].sec_off += nr_sectors;
     memset(&trk[i], 0, sizeof(*trk));
@@ -2365,8 +2961,8 @@ static struct raw_trk *add_track_layout(
     trk[i].interleave = 1;
     trk[i].gap_2 = trk[i].gap_3 = trk[i].gap_4a = -1;
 
-    im->img.sec_info_base = sec;
-    im->img.trk_info = trk;
+    im->img->sec_info_base = sec;
+    im->img->trk_info = trk;
 
     return &trk[i];
 }
@@ -2376,12 +2972,12 @@ static void finalise_track_map(struct image *im)
 {
     struct raw_sec *sec;
     struct raw_trk *trk;
-    uint8_t *trk_map = im->img.trk_map;
+    uint8_t *trk_map = im->img->trk_map;
     int i, j;
 
     for (i = 0; i < im->nr_cyls*im->nr_sides; i++) {
-        trk = &im->img.trk_info[*trk_map++];
-        sec = &im->img.sec_info_base[trk->sec_off];
+        trk = &im->img->trk_info[*trk_map++];
+        sec = &im->img->sec_info_base[trk->sec_off];
         for (j = 0; j < trk->nr_sectors; j++) {
             if (sec->n > 6)
                 F_die(FR_BAD_IMAGE);
@@ -2413,7 +3009,7 @@ static void simple_layout(struct image *im, const struct simple_layout *layout)
         trk->cskew = layout->cskew;
         trk->hskew = layout->hskew;
         trk->head = layout->head;
-        sec = &im->img.sec_info_base[trk->sec_off];
+        sec = &im->img->sec_info_base[trk->sec_off];
         for (j = 0; j < layout->nr_sectors; j++) {
             sec->r = j + layout->base[i];
             sec->n = layout->no;
@@ -2450,7 +3046,7 @@ static void simple_layout(struct image *im, const struct simple_layout *layout)
 static void mfm_prep_track(struct image *im)
 {
     const uint8_t GAP_3[] = { 32, 54, 84, 116, 255, 255, 255, 255 };
-    struct raw_trk *trk = im->img.trk;
+    struct raw_trk *trk = im->img->trk;
     uint32_t tracklen;
     bool_t auto_gap_2, auto_gap_3;
     unsigned int i;
@@ -2466,20 +3062,20 @@ static void mfm_prep_track(struct image *im)
     if (trk->gap_4a < 0)
         trk->gap_4a = MFM_GAP_4A;
 
-    im->img.idx_sz = trk->gap_4a;
+    im->img->idx_sz = trk->gap_4a;
     if (trk->has_iam)
-        im->img.idx_sz += MFM_GAP_SYNC + 4 + MFM_GAP_1;
-    im->img.idam_sz = MFM_GAP_SYNC + 8 + 2 + trk->gap_2;
-    im->img.dam_sz_pre = MFM_GAP_SYNC + 4;
-    im->img.dam_sz_post = 2 + trk->gap_3;
+        im->img->idx_sz += MFM_GAP_SYNC + 4 + MFM_GAP_1;
+    im->img->idam_sz = MFM_GAP_SYNC + 8 + 2 + trk->gap_2;
+    im->img->dam_sz_pre = MFM_GAP_SYNC + 4;
+    im->img->dam_sz_post = 2 + trk->gap_3;
 
-    im->img.idam_sz += im->img.post_crc_syncs;
-    im->img.dam_sz_post += im->img.post_crc_syncs;
+    im->img->idam_sz += im->img->post_crc_syncs;
+    im->img->dam_sz_post += im->img->post_crc_syncs;
 
     /* Work out minimum track length (with no pre-index track gap). */
-    tracklen = im->img.idx_sz;
+    tracklen = im->img->idx_sz;
     for (i = 0; i < trk->nr_sectors; i++)
-        tracklen += enc_sec_sz(im, &im->img.sec_info[i]);
+        tracklen += enc_sec_sz(im, &im->img->sec_info[i]);
     tracklen *= 16;
 
     if (trk->data_rate == 0) {
@@ -2496,7 +3092,7 @@ static void mfm_prep_track(struct image *im)
         /* At ED rate the default GAP2 is 41 bytes. */
         int old_gap_2 = trk->gap_2;
         trk->gap_2 = 41;
-        im->img.idam_sz += trk->gap_2 - old_gap_2;
+        im->img->idam_sz += trk->gap_2 - old_gap_2;
         tracklen += 16 * trk->nr_sectors * (trk->gap_2 - old_gap_2);
     }
 
@@ -2506,9 +3102,9 @@ static void mfm_prep_track(struct image *im)
     /* Calculate a suitable GAP3 if not specified. */
     if ((trk->nr_sectors != 0) && auto_gap_3) {
         int space = max_t(int, 0, im->tracklen_bc - tracklen);
-        uint8_t no = im->img.sec_info[0].n;
+        uint8_t no = im->img->sec_info[0].n;
         trk->gap_3 = min_t(int, space/(16*trk->nr_sectors), GAP_3[no]);
-        im->img.dam_sz_post += trk->gap_3;
+        im->img->dam_sz_post += trk->gap_3;
         tracklen += 16 * trk->nr_sectors * trk->gap_3;
     }
 
@@ -2518,7 +3114,7 @@ static void mfm_prep_track(struct image *im)
 
     im->ticks_per_cell = ((sysclk_stk(im->stk_per_rev) * 16u)
                           / im->tracklen_bc);
-    im->img.gap_4 = (im->tracklen_bc - tracklen) / 16;
+    im->img->gap_4 = (im->tracklen_bc - tracklen) / 16;
 
     im->write_bc_ticks = sysclk_us(500) / trk->data_rate;
 
@@ -2531,8 +3127,8 @@ static bool_t mfm_read_track(struct image *im)
 {
     struct image_buf *rd = &im->bufs.read_data;
     struct image_buf *bc = &im->bufs.read_bc;
-    struct raw_trk *trk = im->img.trk;
-    uint8_t *buf = rd->p;
+    struct raw_trk *trk = im->img->trk;
+    uint8_t *buf;
     uint16_t *bc_b = bc->p;
     uint32_t bc_len, bc_mask, bc_space, bc_p, bc_c;
     uint16_t pr, crc;
@@ -2540,8 +3136,9 @@ static bool_t mfm_read_track(struct image *im)
 
     img_fetch_data(im);
 
-    if (im->img.trk->nr_sectors != 0 && rd->prod == rd->cons)
+    if (im->img->trk->nr_sectors != 0 && rd->prod == rd->cons)
         return FALSE; /* Wait for read to complete. */
+    buf = im->img->sec_data;
 
     /* Generate some MFM if there is space in the raw-bitcell ring buffer. */
     bc_p = bc->prod / 16; /* MFM words */
@@ -2557,9 +3154,9 @@ static bool_t mfm_read_track(struct image *im)
     pr = _r; })
 #define emit_byte(b) emit_raw(mfmtab[(uint8_t)(b)])
 
-    if (im->img.decode_pos == 0) {
+    if (im->img->decode_pos == 0) {
         /* Post-index track gap */
-        if (bc_space < im->img.idx_sz)
+        if (bc_space < im->img->idx_sz)
             return FALSE;
         for (i = 0; i < trk->gap_4a; i++)
             emit_byte(0x4e);
@@ -2573,31 +3170,31 @@ static bool_t mfm_read_track(struct image *im)
             for (i = 0; i < MFM_GAP_1; i++)
                 emit_byte(0x4e);
         }
-    } else if (im->img.decode_pos == (trk->nr_sectors * 4 + 1)) {
+    } else if (im->img->decode_pos == (trk->nr_sectors * 4 + 1)) {
         /* Pre-index track gap */
-        uint16_t sz = im->img.gap_4 - im->img.decode_data_pos * BATCH_SIZE;
+        uint16_t sz = im->img->gap_4 - im->img->decode_data_pos * BATCH_SIZE;
         if (bc_space < min_t(unsigned int, sz, BATCH_SIZE))
             return FALSE;
         if (sz > BATCH_SIZE) {
             sz = BATCH_SIZE;
-            im->img.decode_data_pos++;
-            im->img.decode_pos--;
+            im->img->decode_data_pos++;
+            im->img->decode_pos--;
         } else {
-            im->img.decode_data_pos = 0;
-            im->img.decode_pos = (im->img.idx_sz != 0) ? -1 : 0;
+            im->img->decode_data_pos = 0;
+            im->img->decode_pos = (im->img->idx_sz != 0) ? -1 : 0;
         }
         for (i = 0; i < sz; i++)
             emit_byte(0x4e);
     } else {
-        struct raw_sec *sec = &im->img.sec_info[im->img.sec_map[(
-                    im->img.decode_pos-1)>>2]];
-        switch ((im->img.decode_pos - 1) & 3) {
+        struct raw_sec *sec = &im->img->sec_info[im->img->sec_map[(
+                    im->img->decode_pos-1)>>2]];
+        switch ((im->img->decode_pos - 1) & 3) {
         case 0: /* IDAM */ {
             uint8_t c = im->cur_track/2;
             uint8_t h = trk->head ? trk->head-1 : im->cur_track&1;
             uint8_t idam[8] = { 0xa1, 0xa1, 0xa1, 0xfe,
                                 c, h, sec->r, sec->n };
-            if (bc_space < im->img.idam_sz)
+            if (bc_space < im->img->idam_sz)
                 return FALSE;
             for (i = 0; i < MFM_GAP_SYNC; i++)
                 emit_byte(0x00);
@@ -2608,48 +3205,48 @@ static bool_t mfm_read_track(struct image *im)
             crc = crc16_ccitt(idam, sizeof(idam), 0xffff);
             emit_byte(crc >> 8);
             emit_byte(crc);
-            for (i = 0; i < im->img.post_crc_syncs; i++)
+            for (i = 0; i < im->img->post_crc_syncs; i++)
                 emit_raw(0x4489);
             for (i = 0; i < trk->gap_2; i++)
                 emit_byte(0x4e);
             break;
         }
         case 1: /* DAM */ {
-            if (bc_space < im->img.dam_sz_pre)
+            if (bc_space < im->img->dam_sz_pre)
                 return FALSE;
             for (i = 0; i < MFM_GAP_SYNC; i++)
                 emit_byte(0x00);
             for (i = 0; i < 3; i++)
                 emit_raw(0x4489);
             emit_byte(0xfb);
-            im->img.crc = MFM_DAM_CRC;
+            im->img->crc = MFM_DAM_CRC;
             break;
         }
         case 2: /* Data */ {
             uint16_t sec_sz = sec_sz(sec->n);
-            sec_sz -= im->img.decode_data_pos * BATCH_SIZE;
+            sec_sz -= im->img->decode_data_pos * BATCH_SIZE;
             if (bc_space < min_t(unsigned int, sec_sz, BATCH_SIZE))
                 return FALSE;
             if (sec_sz > BATCH_SIZE) {
                 sec_sz = BATCH_SIZE;
-                im->img.decode_data_pos++;
-                im->img.decode_pos--;
+                im->img->decode_data_pos++;
+                im->img->decode_pos--;
             } else {
-                im->img.decode_data_pos = 0;
+                im->img->decode_data_pos = 0;
             }
-            for (i = 0; i < sec_sz; i++)
-                emit_byte(buf[i]);
-            im->img.crc = crc16_ccitt(buf, sec_sz, im->img.crc);
+            pr = bin_to_mfm_ring(bc_b, bc_mask, bc_p, buf, sec_sz, pr);
+            bc_p += sec_sz;
+            im->img->crc = crc16_ccitt(buf, sec_sz, im->img->crc);
             rd->cons++;
             break;
         }
         case 3: /* Post Data */ {
-            if (bc_space < im->img.dam_sz_post)
+            if (bc_space < im->img->dam_sz_post)
                 return FALSE;
-            crc = im->img.crc;
+            crc = im->img->crc;
             emit_byte(crc >> 8);
             emit_byte(crc);
-            for (i = 0; i < im->img.post_crc_syncs; i++)
+            for (i = 0; i < im->img->post_crc_syncs; i++)
                 emit_raw(0x4489);
             for (i = 0; i < trk->gap_3; i++)
                 emit_byte(0x4e);
@@ -2661,12 +3258,12 @@ static bool_t mfm_read_track(struct image *im)
 #undef emit_raw
 #undef emit_byte
 
-    if (im->img.trash_bc) {
-        int16_t to_consume = min_t(uint16_t, (bc_p - bc_c)*16, im->img.trash_bc);
-        im->img.trash_bc -= to_consume;
+    if (im->img->trash_bc) {
+        int16_t to_consume = min_t(uint16_t, (bc_p - bc_c)*16, im->img->trash_bc);
+        im->img->trash_bc -= to_consume;
         bc->cons += to_consume;
     }
-    im->img.decode_pos++;
+    im->img->decode_pos++;
     bc->prod = bc_p * 16;
 
     return TRUE;
@@ -2684,7 +3281,7 @@ static bool_t mfm_read_track(struct image *im)
 static void fm_prep_track(struct image *im)
 {
     const uint8_t GAP_3[] = { 27, 42, 58, 138, 255, 255, 255, 255 };
-    struct raw_trk *trk = im->img.trk;
+    struct raw_trk *trk = im->img->trk;
     uint32_t tracklen;
     bool_t auto_gap_3;
     unsigned int i;
@@ -2702,17 +3299,17 @@ static void fm_prep_track(struct image *im)
         trk->gap_4a = trk->has_iam ? 40 : 16;
     }
 
-    im->img.idx_sz = trk->gap_4a;
+    im->img->idx_sz = trk->gap_4a;
     if (trk->has_iam)
-        im->img.idx_sz += FM_GAP_SYNC + 1 + FM_GAP_1;
-    im->img.idam_sz = FM_GAP_SYNC + 5 + 2 + trk->gap_2;
-    im->img.dam_sz_pre = FM_GAP_SYNC + 1;
-    im->img.dam_sz_post = 2 + trk->gap_3;
+        im->img->idx_sz += FM_GAP_SYNC + 1 + FM_GAP_1;
+    im->img->idam_sz = FM_GAP_SYNC + 5 + 2 + trk->gap_2;
+    im->img->dam_sz_pre = FM_GAP_SYNC + 1;
+    im->img->dam_sz_post = 2 + trk->gap_3;
 
     /* Work out minimum track length (with no pre-index track gap). */
-    tracklen = im->img.idx_sz;
+    tracklen = im->img->idx_sz;
     for (i = 0; i < trk->nr_sectors; i++)
-        tracklen += enc_sec_sz(im, &im->img.sec_info[i]);
+        tracklen += enc_sec_sz(im, &im->img->sec_info[i]);
     tracklen *= 16;
 
     if (trk->data_rate == 0) {
@@ -2732,9 +3329,9 @@ static void fm_prep_track(struct image *im)
     /* Calculate a suitable GAP3 if not specified. */
     if ((trk->nr_sectors != 0) && auto_gap_3) {
         int space = max_t(int, 0, im->tracklen_bc - tracklen);
-        uint8_t no = im->img.sec_info[0].n;
+        uint8_t no = im->img->sec_info[0].n;
         trk->gap_3 = min_t(int, space/(16*trk->nr_sectors), GAP_3[no]);
-        im->img.dam_sz_post += trk->gap_3;
+        im->img->dam_sz_post += trk->gap_3;
         tracklen += 16 * trk->nr_sectors * trk->gap_3;
     }
 
@@ -2744,7 +3341,7 @@ static void fm_prep_track(struct image *im)
 
     im->ticks_per_cell = ((sysclk_stk(im->stk_per_rev) * 16u)
                           / im->tracklen_bc);
-    im->img.gap_4 = (im->tracklen_bc - tracklen) / 16;
+    im->img->gap_4 = (im->tracklen_bc - tracklen) / 16;
 
     im->write_bc_ticks = sysclk_us(500) / trk->data_rate;
 
@@ -2757,16 +3354,17 @@ static bool_t fm_read_track(struct image *im)
 {
     struct image_buf *rd = &im->bufs.read_data;
     struct image_buf *bc = &im->bufs.read_bc;
-    struct raw_trk *trk = im->img.trk;
-    uint8_t *buf = rd->p;
+    struct raw_trk *trk = im->img->trk;
+    uint8_t *buf;
     uint16_t crc, *bc_b = bc->p;
     uint32_t bc_len, bc_mask, bc_space, bc_p, bc_c;
     unsigned int i;
 
     img_fetch_data(im);
 
-    if (im->img.trk->nr_sectors != 0 && rd->prod == rd->cons)
+    if (im->img->trk->nr_sectors != 0 && rd->prod == rd->cons)
         return FALSE; /* Wait for read to complete. */
+    buf = im->img->sec_data;
 
     /* Generate some FM if there is space in the raw-bitcell ring buffer. */
     bc_p = bc->prod / 16; /* FM words */
@@ -2778,11 +3376,11 @@ static bool_t fm_read_track(struct image *im)
 #define emit_raw(r) ({                          \
     uint16_t _r = (r);                          \
     bc_b[bc_p++ & bc_mask] = htobe16(_r); })
-#define emit_byte(b) emit_raw(mfmtab[(uint8_t)(b)] | 0xaaaa)
+#define emit_byte(b) emit_raw(bintofm(b))
 
-    if (im->img.decode_pos == 0) {
+    if (im->img->decode_pos == 0) {
         /* Post-index track gap */
-        if (bc_space < im->img.idx_sz)
+        if (bc_space < im->img->idx_sz)
             return FALSE;
         for (i = 0; i < trk->gap_4a; i++)
             emit_byte(0xff);
@@ -2794,30 +3392,30 @@ static bool_t fm_read_track(struct image *im)
             for (i = 0; i < FM_GAP_1; i++)
                 emit_byte(0xff);
         }
-    } else if (im->img.decode_pos == (trk->nr_sectors * 4 + 1)) {
+    } else if (im->img->decode_pos == (trk->nr_sectors * 4 + 1)) {
         /* Pre-index track gap */
-        uint16_t sz = im->img.gap_4 - im->img.decode_data_pos * BATCH_SIZE;
+        uint16_t sz = im->img->gap_4 - im->img->decode_data_pos * BATCH_SIZE;
         if (bc_space < min_t(unsigned int, sz, BATCH_SIZE))
             return FALSE;
         if (sz > BATCH_SIZE) {
             sz = BATCH_SIZE;
-            im->img.decode_data_pos++;
-            im->img.decode_pos--;
+            im->img->decode_data_pos++;
+            im->img->decode_pos--;
         } else {
-            im->img.decode_data_pos = 0;
-            im->img.decode_pos = (im->img.idx_sz != 0) ? -1 : 0;
+            im->img->decode_data_pos = 0;
+            im->img->decode_pos = (im->img->idx_sz != 0) ? -1 : 0;
         }
         for (i = 0; i < sz; i++)
             emit_byte(0xff);
     } else {
-        struct raw_sec *sec = &im->img.sec_info[im->img.sec_map[(
-                    im->img.decode_pos-1)>>2]];
-        switch ((im->img.decode_pos - 1) & 3) {
+        struct raw_sec *sec = &im->img->sec_info[im->img->sec_map[(
+                    im->img->decode_pos-1)>>2]];
+        switch ((im->img->decode_pos - 1) & 3) {
         case 0: /* IDAM */ {
             uint8_t c = im->cur_track/2;
             uint8_t h = trk->head ? trk->head-1 : im->cur_track&1;
             uint8_t idam[5] = { 0xfe, c, h, sec->r, sec->n };
-            if (bc_space < im->img.idam_sz)
+            if (bc_space < im->img->idam_sz)
                 return FALSE;
             for (i = 0; i < FM_GAP_SYNC; i++)
                 emit_byte(0x00);
@@ -2832,36 +3430,36 @@ static bool_t fm_read_track(struct image *im)
             break;
         }
         case 1: /* DAM */ {
-            if (bc_space < im->img.dam_sz_pre)
+            if (bc_space < im->img->dam_sz_pre)
                 return FALSE;
             for (i = 0; i < FM_GAP_SYNC; i++)
                 emit_byte(0x00);
             emit_raw(fm_sync(0xfb, FM_SYNC_CLK));
-            im->img.crc = FM_DAM_CRC;
+            im->img->crc = FM_DAM_CRC;
             break;
         }
         case 2: /* Data */ {
             uint16_t sec_sz = sec_sz(sec->n);
-            sec_sz -= im->img.decode_data_pos * BATCH_SIZE;
+            sec_sz -= im->img->decode_data_pos * BATCH_SIZE;
             if (bc_space < min_t(unsigned int, sec_sz, BATCH_SIZE))
                 return FALSE;
             if (sec_sz > BATCH_SIZE) {
                 sec_sz = BATCH_SIZE;
-                im->img.decode_data_pos++;
-                im->img.decode_pos--;
+                im->img->decode_data_pos++;
+                im->img->decode_pos--;
             } else {
-                im->img.decode_data_pos = 0;
+                im->img->decode_data_pos = 0;
             }
-            for (i = 0; i < sec_sz; i++)
-                emit_byte(buf[i]);
-            im->img.crc = crc16_ccitt(buf, sec_sz, im->img.crc);
+            bin_to_fm_ring(bc_b, bc_mask, bc_p, buf, sec_sz);
+            bc_p += sec_sz;
+            im->img->crc = crc16_ccitt(buf, sec_sz, im->img->crc);
             rd->cons++;
             break;
         }
         case 3: /* Post Data */ {
-            if (bc_space < im->img.dam_sz_post)
+            if (bc_space < im->img->dam_sz_post)
                 return FALSE;
-            crc = im->img.crc;
+            crc = im->img->crc;
             emit_byte(crc >> 8);
             emit_byte(crc);
             for (i = 0; i < trk->gap_3; i++)
@@ -2874,12 +3472,12 @@ static bool_t fm_read_track(struct image *im)
 #undef emit_raw
 #undef emit_byte
 
-    if (im->img.trash_bc) {
-        int16_t to_consume = min_t(uint16_t, (bc_p - bc_c)*16, im->img.trash_bc);
-        im->img.trash_bc -= to_consume;
+    if (im->img->trash_bc) {
+        int16_t to_consume = min_t(uint16_t, (bc_p - bc_c)*16, im->img->trash_bc);
+        im->img->trash_bc -= to_consume;
         bc->cons += to_consume;
     }
-    im->img.decode_pos++;
+    im->img->decode_pos++;
     bc->prod = bc_p * 16;
 
     return TRUE;
@@ -46,6 +46,7 @@ const uint16_t mfmtab[] = {
 
 uint8_t always_inline mfmtobin(uint16_t x)
 {
+#if defined(__arm__)
     uint8_t y;
     x = be16toh(x) << 1;
     asm volatile (
@@ -60,14 +61,46 @@ uint8_t always_inline mfmtobin(uint16_t x)
         "rev %0,%0\n"
         : "=&r" (y) : "r" (x) );
     return y;
+#else /* host build (bench/) */
+    uint32_t y = be16toh(x) & 0x5555;
+    y = (y | (y >> 1)) & 0x3333;
+    y = (y | (y >> 2)) & 0x0f0f;
+    return (y | (y >> 4)) & 0xff;
+#endif
+}
+
+/* Decode two MFM words (big endian, as loaded from a bitcell ring) at once,
+ * gathering the 16 data bits by successive shift-and-mask. */
+static always_inline uint16_t mfm32tobin(uint32_t x)
+{
+    x = be32toh(x) & 0x55555555;
+    x = (x | (x >> 1)) & 0x33333333;
+    x = (x | (x >> 2)) & 0x0f0f0f0f;
+    x = (x | (x >> 4)) & 0x00ff00ff;
+    x = (x | (x >> 8)) & 0x0000ffff;
+    return x;
 }
 
 void mfm_to_bin(const void *in, void *out, unsigned int nr)
 {
     const uint16_t *_in = in;
     uint8_t *_out = out;
-    while (nr--)
+    uint16_t x;
+
+    if (nr && ((uintptr_t)_in & 2)) {
         *_out++ = mfmtobin(*_in++);
+        nr--;
+    }
+
+    for (; nr >= 2; nr -= 2) {
+        x = mfm32tobin(*(const uint32_t *)_in);
+        _in += 2;
+        *_out++ = x >> 8;
+        *_out++ = x;
+    }
+
+    if (nr)
+        *_out = mfmtobin(*_in);
 }
 
 void mfm_ring_to_bin(const uint16_t *ring, unsigned int mask,
@@ -81,6 +114,55 @@ void mfm_ring_to_bin(const uint16_t *ring, unsigned int mask,
         mfm_to_bin(ring, (uint8_t *)out + head, nr - head);
 }
 
+uint16_t bin_to_mfm_ring(uint16_t *ring, unsigned int mask,
+                         unsigned int idx, const void *in, unsigned int nr,
+                         uint16_t pr)
+{
+    const uint8_t *_in = in;
+    uint32_t x;
+
+    /* Even ring positions are word aligned (the ring length is a power of
+     * two): encode two bytes at a time, fixing up both clock bits which
+     * depend on the preceding data bit. */
+    while (nr) {
+        if (!(idx & 1) && (nr >= 2)) {
+            x = ((uint32_t)mfmtab[_in[0]] << 16) | mfmtab[_in[1]];
+            x &= ~(((uint32_t)pr << 31) | ((x >> 1) & 0x8000));
+            *(uint32_t *)&ring[idx & mask] = htobe32(x);
+            pr = x;
+            idx += 2; _in += 2; nr -= 2;
+        } else {
+            x = mfmtab[*_in++] & ~(pr << 15);
+            ring[idx++ & mask] = htobe16(x);
+            pr = x;
+            nr--;
+        }
+    }
+
+    return pr;
+}
+
+void bin_to_fm_ring(uint16_t *ring, unsigned int mask,
+                    unsigned int idx, const void *in, unsigned int nr)
+{
+    const uint8_t *_in = in;
+    uint32_t x;
+
+    /* FM clock bits do not depend on neighbouring data: encode two bytes
+     * per aligned word store. */
+    if (nr && (idx & 1)) {
+        ring[idx++ & mask] = htobe16(bintofm(*_in++));
+        nr--;
+    }
+    for (; nr >= 2; nr -= 2) {
+        x = ((uint32_t)mfmtab[_in[0]] << 16) | mfmtab[_in[1]];
+        *(uint32_t *)&ring[idx & mask] = htobe32(x | 0xaaaaaaaau);
+        idx += 2; _in += 2;
+    }
+    if (nr)
+        ring[idx & mask] = htobe16(bintofm(*_in));
+}
+
 uint16_t fm_sync(uint8_t dat, uint8_t clk)
 {
     uint16_t _dat = mfmtab[dat] & 0x5555;
@@ -88,7 +170,7 @@ uint16_t fm_sync(uint8_t dat, uint8_t clk)
     return _clk | _dat;
 }
 
-uint16_t bc_rdata_flux(struct image *im, uint16_t *tbuf, uint16_t nr)
+ramfunc uint16_t bc_rdata_flux(struct image *im, uint16_t *tbuf, uint16_t nr)
 {
     uint32_t ticks_per_cell = im->ticks_per_cell;
     uint32_t ticks = im->ticks_since_flux;
@@ -104,17 +186,9 @@ uint16_t bc_rdata_flux(struct image *im, uint16_t *tbuf, uint16_t nr)
         bc_c += 32 - y;
         im->cur_bc += 32 - y;
         im->cur_ticks += (32 - y) * ticks_per_cell;
-        while (y < 32) {
-            y++;
-            ticks += ticks_per_cell;
-            if ((int32_t)x < 0) {
-                *tbuf++ = (ticks >> 4) - 1;
-                ticks &= 15;
-                if (!--todo)
-                    goto out;
-            }
-            x <<= 1;
-        }
+        y = bc_to_flux(x, y, 32, ticks_per_cell, &ticks, &tbuf, &todo);
+        if (!todo)
+            goto out;
     }
 
     ASSERT(y == 32);
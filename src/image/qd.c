@@ -22,6 +22,10 @@ struct track_header {
 
 #define MAX_BC_SECS 4
 
+/* Sectors pinned at the start of the track: covers the ring's first fetch
+ * when the read window reopens at the start of the track. */
+#define PIN_SECS 8
+
 static void qd_seek_track(struct image *im, uint16_t track);
 
 static bool_t qd_open(struct image *im)
@@ -32,7 +36,7 @@ static bool_t qd_open(struct image *im)
     if (strncmp(&dh.sig[3], "QD", 2))
         return FALSE;
 
-    im->qd.tb = 1;
+    im->qd->tb = 1;
     im->nr_cyls = 1;
     im->nr_sides = 1;
     im->write_bc_ticks = sysclk_us(4) + 66; /* 4.917us */
@@ -50,23 +54,35 @@ static void qd_seek_track(struct image *im, uint16_t track)
     struct track_header thdr;
     uint32_t trk_off;
 
-    F_lseek(&im->fp, im->qd.tb*512 + (track/2)*16);
+    F_lseek(&im->fp, im->qd->tb*512 + (track/2)*16);
     F_read(&im->fp, &thdr, sizeof(thdr), NULL);
 
     /* Byte offset and length of track data. */
     trk_off = le32toh(thdr.offset);
-    im->qd.trk_len = le32toh(thdr.len);
+    im->qd->trk_len = le32toh(thdr.len);
 
     /* Read/write window limits in STK ticks from data start. */
-    im->qd.win_start = le32toh(thdr.win_start) * im->write_bc_ticks;
-    im->qd.win_end = le32toh(thdr.win_end) * im->write_bc_ticks;
+    im->qd->win_start = le32toh(thdr.win_start) * im->write_bc_ticks;
+    im->qd->win_end = le32toh(thdr.win_end) * im->write_bc_ticks;
 
-    im->tracklen_bc = im->qd.trk_len * 8;
+    im->tracklen_bc = im->qd->trk_len * 8;
     im->stk_per_rev = stk_sysclk(im->tracklen_bc * im->write_bc_ticks);
 
-    ring_io_init(&im->qd.ring_io, &im->fp, &im->bufs.read_data,
-            trk_off, ~0, (im->qd.trk_len+511) / 512);
-    im->qd.ring_io.trailing_secs = MAX_BC_SECS;
+    /* If the ring cannot hold the whole track then pin the head of the track
+     * in a buffer carved from the top of the ring. */
+    if (((im->qd->trk_len + 511) & ~511) > im->bufs.read_data.len) {
+        struct image_buf *rd = &im->bufs.read_data;
+        im->qd->pin_len = min_t(uint32_t, PIN_SECS*512, (rd->len/4) & ~511);
+        rd->len -= im->qd->pin_len;
+        im->qd->pin_buf = (uint8_t *)rd->p + rd->len;
+        F_lseek(&im->fp, trk_off);
+        F_read(&im->fp, im->qd->pin_buf, im->qd->pin_len, NULL);
+    }
+
+    ring_io_init(&im->qd->ring_io, &im->fp, &im->bufs.read_data,
+            trk_off, ~0, (im->qd->trk_len+511) / 512);
+    im->qd->ring_io.trailing_secs = MAX_BC_SECS;
+    im->qd->ring_io.map = im->extents;
 
     im->cur_track = track;
 }
@@ -89,17 +105,27 @@ static void qd_setup_track(
     bc->prod = bc->cons = 0;
 
     if (start_pos) {
-        /* Read mode. */
-        im->qd.ring_io.batch_secs = 2;
-        ring_io_seek(&im->qd.ring_io, (im->cur_bc/8) & ~511, FALSE, FALSE);
+        /* Read mode. Serve any pinned head of the track first, while the
+         * ring streams ahead from the end of it. */
+        uint32_t pos = (im->cur_bc/8) & ~511;
+        im->qd->ring_io.batch_secs = 2;
+        im->qd->ring_io.hold_writes = FALSE;
+        im->qd->pin_pos = pos;
+        if (pos < im->qd->pin_len)
+            pos = im->qd->pin_len;
+        ring_io_seek(&im->qd->ring_io, pos, FALSE, FALSE);
         /* Consumer may be ahead of producer, but only until the first read
          * completes. */
         bc->cons = im->cur_bc & 4095;
         *start_pos = sys_ticks;
     } else {
-        /* Write mode. */
-        im->qd.ring_io.batch_secs = 8;
-        ring_io_seek(&im->qd.ring_io, im->cur_bc/8, TRUE, FALSE);
+        /* Write mode. The write window is short, and read-ahead must keep
+         * ahead of it: hold writeback until the write ends, then drain in the
+         * gap before the window reopens. */
+        im->qd->pin_pos = im->qd->pin_len;
+        im->qd->ring_io.batch_secs = 8;
+        im->qd->ring_io.hold_writes = TRUE;
+        ring_io_seek(&im->qd->ring_io, im->cur_bc/8, TRUE, FALSE);
     }
 }
 
@@ -112,9 +138,7 @@ static bool_t qd_read_track(struct image *im)
     uint32_t bc_len, bc_mask, bc_space, bc_p, bc_c;
     unsigned int nr_sec;
 
-    ring_io_progress(&im->qd.ring_io);
-    if (rd->cons >= rd->prod)
-        return FALSE;
+    ring_io_progress(&im->qd->ring_io);
 
     /* Fill the raw-bitcell ring buffer. */
     bc_p = bc->prod / 8;
@@ -124,18 +148,37 @@ static bool_t qd_read_track(struct image *im)
     bc_space = min_t(uint32_t, bc_len, MAX_BC_SECS*512)
         - (uint16_t)(bc_p - bc_c);
 
+    if (im->qd->pin_pos < im->qd->pin_len) {
+        /* Pinned head of the track. */
+        nr_sec = min_t(unsigned int, (im->qd->pin_len - im->qd->pin_pos)/512,
+                       bc_space/512);
+        if (nr_sec == 0)
+            return FALSE;
+        while (nr_sec--) {
+            memcpy(&bc_b[bc_p & bc_mask], &im->qd->pin_buf[im->qd->pin_pos],
+                   512);
+            im->qd->pin_pos += 512;
+            bc_p += 512;
+        }
+        goto out;
+    }
+
+    if (rd->cons >= rd->prod)
+        return FALSE;
+
     nr_sec = min_t(unsigned int, (rd->prod - rd->cons)/512, bc_space/512);
     if (nr_sec == 0)
         return FALSE;
 
     while (nr_sec--) {
         memcpy(&bc_b[bc_p & bc_mask],
-               &buf[ring_io_idx(&im->qd.ring_io, rd->cons)],
+               &buf[ring_io_idx(&im->qd->ring_io, rd->cons)],
                512);
         rd->cons += 512;
         bc_p += 512;
     }
 
+out:
     barrier();
     bc->prod = bc_p * 8;
 
@@ -208,7 +251,7 @@ static bool_t qd_write_track(struct image *im)
 
     for (;;) {
 
-        uint32_t pos = ring_io_pos(&im->qd.ring_io, rd->cons);
+        uint32_t pos = ring_io_pos(&im->qd->ring_io, rd->cons);
         UINT nr;
 
         /* All bytes remaining in the raw-bitcell buffer. */
@@ -216,7 +259,7 @@ static bool_t qd_write_track(struct image *im)
         /* Limit to end of current 512-byte QD block. */
         nr = min_t(UINT, nr, 512 - (pos & 511));
         /* Limit to end of QD track. */
-        nr = min_t(UINT, nr, im->qd.trk_len - pos);
+        nr = min_t(UINT, nr, im->qd->trk_len - pos);
 
         /* Bail if no bytes to write. */
         if (nr == 0)
@@ -230,22 +273,26 @@ static bool_t qd_write_track(struct image *im)
         }
 
         /* Encode into the sector buffer for later write-out. */
-        w = rd->p + ring_io_idx(&im->qd.ring_io, rd->cons);
+        w = rd->p + ring_io_idx(&im->qd->ring_io, rd->cons);
         for (i = 0; i < nr; i++)
             *w++ = _rbit32(buf[c++ & bufmask]) >> 24;
 
+        /* Keep the pinned copy coherent. @nr stops at a block boundary. */
+        if (pos < im->qd->pin_len)
+            memcpy(&im->qd->pin_buf[pos], w - nr, nr);
+
         rd->cons += nr;
-        if (pos + nr >= im->qd.trk_len) {
-            ASSERT(pos + nr == im->qd.trk_len);
-            ring_io_flush(&im->qd.ring_io);
+        if (pos + nr >= im->qd->trk_len) {
+            ASSERT(pos + nr == im->qd->trk_len);
+            ring_io_flush(&im->qd->ring_io);
             rd->cons += 512 - pos%512;
         }
     }
 
     if (flush)
-        ring_io_flush(&im->qd.ring_io);
+        ring_io_flush(&im->qd->ring_io);
     else
-        ring_io_progress(&im->qd.ring_io);
+        ring_io_progress(&im->qd->ring_io);
 
     wr->cons = c * 8;
 
@@ -254,8 +301,8 @@ static bool_t qd_write_track(struct image *im)
 
 static void qd_sync(struct image *im)
 {
-    ring_io_sync(&im->qd.ring_io);
-    ring_io_shutdown(&im->qd.ring_io);
+    ring_io_sync(&im->qd->ring_io);
+    ring_io_shutdown(&im->qd->ring_io);
 }
 
 const struct image_handler qd_image_handler = {
@@ -267,6 +314,7 @@ const struct image_handler qd_image_handler = {
     .sync = qd_sync,
 
     .async = TRUE,
+    .state_sz = sizeof(struct qd_image),
 };
 
 /*
@@ -9,43 +9,80 @@
  * See the file COPYING for more details, or visit <http://unlicense.org>.
  */
 
-/* We buffer logging in a ring buffer. */
+/* We buffer logging in a ring buffer. Producers reserve space by atomically
+ * advancing @prod, then fill it with IRQs enabled. The filled region
+ * [cons,commit) is published only by the outermost producer, once any
+ * producers which preempted it have also finished. */
 static char ring[2048];
 #define MASK(x) ((x)&(sizeof(ring)-1))
-static unsigned int cons, prod;
-
-/* Shut loggers up while we are sending to the logging file. */
-static bool_t quiesce;
+static unsigned int cons, commit;
+static volatile unsigned int prod;
+
+/* Per-nesting-level scratch for formatting. Messages from deeper than
+ * MAX_NEST nested producers are dropped. */
+#define MAX_NEST 4
+static char scratch[MAX_NEST][128];
+static uint8_t printk_nest;
+
+/* Bytes published but not yet consumed. @commit may briefly step backwards
+ * while a producer publishes. */
+static unsigned int ring_used(void)
+{
+    int nr = commit - cons;
+    return max_t(int, nr, 0);
+}
 
 int vprintk(const char *format, va_list ap)
 {
-    static char str[128];
-    char *p, c;
-    int n;
+    unsigned int depth, len, p;
+    char *str, *q, c;
+    int n = 0;
+
+    /* Each nesting level has its own scratch buffer. Preemption is strictly
+     * LIFO, so a preempting producer always restores @printk_nest before we
+     * resume, even mid-increment. */
+    depth = printk_nest++;
+    if (depth >= MAX_NEST)
+        goto out;
+    str = scratch[depth];
 
-    IRQ_global_disable();
+    n = vsnprintf(str, sizeof(scratch[0]), format, ap);
 
-    n = vsnprintf(str, sizeof(str), format, ap);
+    /* Output length, with LF expanded to CR/LF and any CRs dropped. */
+    for (len = 0, q = str; (c = *q) != '\0'; q++)
+        len += (c == '\n') ? 2 : (c != '\r');
 
-    if (quiesce)
-        goto out;
+    /* Reserve space. If we lap the consumer, the loss is reported when the
+     * ring is next written out. */
+    do {
+        p = prod;
+    } while (cmpxchg(&prod, p, p + len) != p);
 
-    p = str;
-    while ((c = *p++) != '\0') {
+    for (q = str; (c = *q) != '\0'; q++) {
         switch (c) {
         case '\r': /* CR: ignore as we generate our own CR/LF */
             break;
         case '\n': /* LF: convert to CR/LF (usual terminal behaviour) */
-            ring[MASK(prod++)] = '\r';
+            ring[MASK(p++)] = '\r';
             /* fall through */
         default:
-            ring[MASK(prod++)] = c;
+            ring[MASK(p++)] = c;
             break;
         }
     }
 
 out:
-    IRQ_global_enable();
+    if (--printk_nest == 0) {
+        /* Outermost producer: publish everything reserved so far. A producer
+         * preempting us here publishes for itself, but we may then overwrite
+         * it with an older value, so go round again. */
+        do {
+            p = prod;
+            barrier();
+            commit = p;
+            barrier();
+        } while (p != prod);
+    }
 
     return n;
 }
@@ -62,33 +99,135 @@ int printk(const char *format, ...)
     return n;
 }
 
-void logfile_flush(FIL *file)
-{
-    unsigned int nr;
+/* The ring is appended to FFLOG.TXT, which is kept open across flushes.
+ * While an image is mounted the I/O thread writes it back in the background
+ * through the async writeback queue, so loggers are never silenced and the
+ * hot path never waits on the log file. */
+#define FLUSH_PERIOD time_ms(1000) /* Rate limit, unless the ring fills up */
+#define MAX_CHUNK    512           /* Largest single write */
+
+static struct {
+    FIL file;
+    struct timer timer;
+    time_t last;  /* Start of most recent write */
+    FOP op;       /* Write or sync in flight, if busy */
+    UINT bw;
+    bool_t busy;
+    bool_t ring;  /* In-flight write is ring data (else the lost note) */
+    bool_t dirty; /* Written since the last sync */
     char msg[20];
+} lf;
 
-    F_open(file, "FFLOG.TXT", FA_OPEN_APPEND|FA_WRITE);
+/* Is the log file open on the currently-mounted volume? */
+static bool_t logfile_open(void)
+{
+    FATFS *fs = lf.file.obj.fs;
+    return (fs != NULL) && fs->fs_type && (lf.file.obj.id == fs->id);
+}
 
-    quiesce = TRUE;
-    barrier();
+/* Find the next chunk to write: the oldest contiguous ring data, or a note
+ * of how much we lost if the ring has overflowed. */
+static unsigned int next_chunk(const char **p)
+{
+    unsigned int nr = ring_used();
 
-    if ((unsigned int)(prod-cons) > sizeof(ring)) {
-        nr = prod - cons - sizeof(ring);
-        snprintf(msg, sizeof(msg), "\r\n[lost %u]\r\n", nr);
-        F_write(file, msg, strlen(msg), NULL);
+    if (nr > sizeof(ring)) {
+        nr -= sizeof(ring);
         cons += nr;
+        snprintf(lf.msg, sizeof(lf.msg), "\r\n[lost %u]\r\n", nr);
+        *p = lf.msg;
+        lf.ring = FALSE;
+        return strlen(lf.msg);
     }
 
-    while (cons != prod) {
-        nr = min_t(unsigned int, prod-cons, sizeof(ring)-MASK(cons));
-        F_write(file, &ring[MASK(cons)], nr, NULL);
-        cons += nr;
+    *p = &ring[MASK(cons)];
+    lf.ring = TRUE;
+    return min_t(unsigned int, nr,
+                 min_t(unsigned int, sizeof(ring)-MASK(cons), MAX_CHUNK));
+}
+
+/* Account for a completed write. Loggers may have lapped us meanwhile: the
+ * next chunk reports the loss. */
+static void write_done(UINT bw)
+{
+    if (lf.ring)
+        cons += bw;
+    lf.busy = FALSE;
+}
+
+static void logfile_timer_fn(void *unused)
+{
+    F_async_notify();
+}
+
+void logfile_poll(void)
+{
+    const char *p;
+    unsigned int nr;
+
+    if (!logfile_open())
+        return;
+
+    if (lf.busy) {
+        if (!F_async_isdone(lf.op))
+            return;
+        write_done(lf.bw);
+    }
+
+    nr = ring_used();
+    if (nr == 0) {
+        if (lf.dirty) {
+            lf.dirty = FALSE;
+            lf.bw = 0;
+            lf.ring = FALSE;
+            lf.op = F_sync_async(&lf.file);
+            lf.busy = TRUE;
+        }
+        return;
+    }
+
+    if ((nr < sizeof(ring)/2) && (time_since(lf.last) < FLUSH_PERIOD)) {
+        /* Come back for it when the rate limit allows. */
+        timer_set(&lf.timer, lf.last + FLUSH_PERIOD);
+        return;
     }
 
-    barrier();
-    quiesce = FALSE;
+    nr = next_chunk(&p);
+    lf.last = time_now();
+    lf.bw = 0;
+    lf.op = F_write_async(&lf.file, p, nr, &lf.bw);
+    lf.busy = lf.dirty = TRUE;
+}
+
+void logfile_flush(void)
+{
+    const char *p;
+    unsigned int nr;
+    UINT bw;
+
+    if (!logfile_open()) {
+        if (lf.file.obj.fs == NULL)
+            timer_init(&lf.timer, logfile_timer_fn, NULL);
+        F_open(&lf.file, "FFLOG.TXT", FA_OPEN_APPEND|FA_WRITE);
+        lf.busy = FALSE;
+    }
+
+    if (lf.busy) {
+        /* The I/O thread has been stopped. Anything it did not get round to
+         * was cancelled, and is written out now instead. */
+        write_done(F_async_isdone(lf.op) ? lf.bw : 0);
+    }
+
+    while (ring_used() != 0) {
+        nr = next_chunk(&p);
+        F_write(&lf.file, p, nr, &bw);
+        write_done(bw);
+        if (bw < nr)
+            break; /* disk full */
+    }
 
-    F_close(file);
+    F_sync(&lf.file);
+    lf.dirty = FALSE;
 }
 
 /*
@@ -20,10 +20,14 @@ static struct {
     DIR dp;
     FILINFO fp;
     char buf[512];
+    /* Cursor of the background folder scan (see native_scan_step()). */
+    DIR scan_dp;
+    FILINFO scan_fp;
 } *fs;
 
 struct native_dirent {
     uint32_t dir_sect;
+    uint32_t key; /* native_sort_key() of name */
     uint16_t dir_off;
     uint8_t attr;
     char name[0];
@@ -35,12 +39,21 @@ static struct {
     struct short_slot autoboot;
     struct short_slot hxcsdfe;
     struct short_slot imgcfg;
+    /* Fast-seek cluster table for HXCSDFE.CFG. Valid if hxc_cltbl[0] != 0. */
+    DWORD hxc_cltbl[16];
     struct slot slot, clipboard;
     uint32_t cfg_cdir, cur_cdir;
     struct native_dirent **sorted;
+    struct native_index *index;
+    struct native_keys *keys;
+    /* Sorted listing: index of the first entry of each initial-letter group,
+     * built on first use. */
+#define JUMP_MAX 64
+    uint16_t jump[JUMP_MAX];
+    uint8_t nr_jump;
     struct {
         uint32_t cdir;
-        uint16_t slot;
+        uint16_t slot; /* STACK_SLOT_UNKNOWN until first needed */
     } stack[20];
     uint8_t depth;
     bool_t usb_power_fault;
@@ -55,15 +68,27 @@ static struct {
     uint8_t ffcfg_has_display_scroll_rate:1;
 } cfg;
 
+/* IMAGE_A.CFG folders are entered without listing their parents: the slot
+ * of each folder within its parent is found when the parent is returned to. */
+#define STACK_SLOT_UNKNOWN 0xffff
+
 /* If TRUE, reset to start of filename when selecting a new image. 
  * If FALSE, try to maintain scroll offset when browsing through images. */
 #define cfg_scroll_reset TRUE
 
 uint8_t board_id;
 
-#define BUTTON_SCAN_HZ 500
-#define BUTTON_SCAN_MS (1000/BUTTON_SCAN_HZ)
-static uint32_t display_ticks;
+/* Buttons are scanned every 2ms while in use, and every 16ms when all inputs
+ * have been idle for a full debounce period. A full rotary encoder is
+ * tracked by EXTI meanwhile, and its first edge restores the fast scan. */
+#define BUTTON_SCAN_MS 2
+#define BUTTON_IDLE_MS 16
+static uint8_t button_scan_ms = BUTTON_SCAN_MS;
+/* Milliseconds since the previous scan, measured from the timer deadlines:
+ * IRQ_rotary() may cut a slow period short. The remainder carries over. */
+static uint8_t button_elapsed_ms;
+static time_t button_scan_time;
+static uint32_t display_ms;
 static uint8_t display_state;
 enum { BACKLIGHT_OFF, BACKLIGHT_SWITCHING_ON, BACKLIGHT_ON };
 enum { LED_NORMAL, LED_TRACK, LED_TRACK_QUIESCENT,
@@ -73,12 +98,30 @@ static void native_get_slot_map(bool_t sorted_only);
 
 /* Hack inside the guts of FatFS. */
 void flashfloppy_fill_fileinfo(FIL *fp);
+void flashfloppy_readdir_at(DIR *dp, FILINFO *fno, DWORD ofs);
+DWORD flashfloppy_dir_crc(DIR *dp, const char *skip);
 
 #ifdef LOGFILE
 /* Logfile must be written to config dir. */
-#define logfile_flush(_file) do {               \
+#define logfile_flush() do {                    \
     fatfs.cdir = cfg.cfg_cdir;                  \
-    logfile_flush(_file);                       \
+    logfile_flush();                            \
+    fatfs.cdir = cfg.cur_cdir;                  \
+} while(0)
+#endif
+
+/* So is the performance report. */
+#define floppy_perf_report(_file, _name) do {   \
+    fatfs.cdir = cfg.cfg_cdir;                  \
+    floppy_perf_report(_file, _name);           \
+    fatfs.cdir = cfg.cur_cdir;                  \
+} while(0)
+
+#ifdef TRACE
+/* Trace file is written to config dir, like the logfile. */
+#define trace_dump(_file) do {                  \
+    fatfs.cdir = cfg.cfg_cdir;                  \
+    trace_dump(_file);                          \
     fatfs.cdir = cfg.cur_cdir;                  \
 } while(0)
 #endif
@@ -119,7 +162,7 @@ static void lcd_on(void)
 {
     if (display_type != DT_LCD_OLED)
         return;
-    display_ticks = 0;
+    display_ms = 0;
     barrier();
     display_state = BACKLIGHT_ON;
     barrier();
@@ -363,13 +406,14 @@ static uint8_t lcd_handle_backlight(uint8_t b)
         if (!b)
             display_state = BACKLIGHT_ON;
         b = 0;
-        display_ticks = 0;
+        display_ms = 0;
         break;
     case BACKLIGHT_ON:
         /* After a period with no button activity we turn the backlight off. */
         if (b)
-            display_ticks = 0;
-        if (display_ticks++ >= BUTTON_SCAN_HZ*ff_cfg.display_off_secs) {
+            display_ms = 0;
+        display_ms += button_elapsed_ms;
+        if (display_ms > 1000*ff_cfg.display_off_secs) {
             lcd_backlight(FALSE);
             display_state = BACKLIGHT_OFF;
         }
@@ -394,11 +438,12 @@ static uint8_t led_handle_display(uint8_t b)
         if (!b)
             display_state = LED_BUTTON_RELEASED;
         b = 0;
-        display_ticks = 0;
+        display_ms = 0;
         break;
     case LED_BUTTON_RELEASED:
         /* After a period with no button activity we return to track number. */
-        if (display_ticks++ >= BUTTON_SCAN_HZ*3)
+        display_ms += button_elapsed_ms;
+        if (display_ms > 1000*3)
             display_state = LED_TRACK;
         break;
     }
@@ -479,6 +524,11 @@ void IRQ_rotary(void)
         return;
     rotary = ((rotary << 2) | board_get_rotary()) & 15;
     rb = read_rotary(rotary) ?: rb;
+    if (button_scan_ms != BUTTON_SCAN_MS) {
+        /* Scan now, and then at the fast rate until idle again. */
+        button_scan_ms = BUTTON_SCAN_MS;
+        timer_set(&button_timer, time_now());
+    }
 }
 
 static void set_rotary_exti(void)
@@ -504,7 +554,11 @@ static void button_timer_fn(void *unused)
         (ff_cfg.twobutton_action & TWOBUTTON_mask) == TWOBUTTON_rotary;
     int i, twobutton_reverse = !!(ff_cfg.twobutton_action & TWOBUTTON_reverse);
 
-    cur_time++;
+    /* Advance the millisecond clock by the time since the last scan. */
+    button_elapsed_ms = time_diff(button_scan_time, button_timer.deadline)
+        / time_ms(1);
+    button_scan_time += button_elapsed_ms * time_ms(1);
+    cur_time += button_elapsed_ms;
     if ((uint16_t)(cur_time - prev_time) > 0x7fff)
         prev_time = cur_time - 0x7fff;
     velocity = 0;
@@ -517,7 +571,8 @@ static void button_timer_fn(void *unused)
     }
 
     /* We debounce the switches by waiting for them to be pressed continuously 
-     * for 32 consecutive sample periods (32 * 2ms == 64ms) */
+     * for 32 consecutive sample periods (32 * 2ms == 64ms). A press is
+     * sampled at most 16ms late when idle: the fast scan then takes over. */
     x = ~board_get_buttons();
     for (i = 0; i < 3; i++) {
         _b[i] <<= 1;
@@ -542,8 +597,8 @@ static void button_timer_fn(void *unused)
         rb = rotary_reverse[(rotary ^ (rotary >> 2)) & 3];
         if (rb == 0) {
             /* Idle: Increase threshold, decay the counter. */
-            thresh = min_t(int, thresh + BUTTON_SCAN_MS, 360);
-            count = max_t(int, count - BUTTON_SCAN_MS, 0);
+            thresh = min_t(int, thresh + button_elapsed_ms, 360);
+            count = max_t(int, count - button_elapsed_ms, 0);
         } else if (rb != dir) {
             /* Change of direction: Put the brakes on. */
             dir = rb;
@@ -576,7 +631,7 @@ static void button_timer_fn(void *unused)
             : (read_rotary(rotary) ?: rb);
         if (rb) {
             uint16_t delta = cur_time - prev_time;
-            velocity = (BUTTON_SCAN_HZ/10)/(delta?:1);
+            velocity = 100/(delta?:1);
             velocity = range_t(int, velocity, 0, 20);
             prev_time = cur_time;
         }
@@ -598,9 +653,18 @@ static void button_timer_fn(void *unused)
         break;
     }
 
+    /* Slow down once nothing is held or bouncing. Encoder types other than
+     * a plain full rotary are sampled only here, so keep the fast rate. */
+    button_scan_ms = BUTTON_SCAN_MS;
+    if (!b && ((_b[0] & _b[1] & _b[2]) == ~0u)
+        && (((ff_cfg.rotary & ROT_typemask) == ROT_none)
+            || ((ff_cfg.rotary & ~ROT_reverse) == ROT_full)))
+        button_scan_ms = BUTTON_IDLE_MS;
+
     /* Latch final button state and reset the timer. */
     buttons = b;
-    timer_set(&button_timer, button_timer.deadline + time_ms(BUTTON_SCAN_MS));
+    timer_set(&button_timer,
+              button_timer.deadline + time_ms(button_scan_ms));
 }
 
 static void canary_init(void)
@@ -633,10 +697,20 @@ static void slot_from_short_slot(
     slot->name[sizeof(short_slot->name)] = '\0';
     memcpy(slot->type, short_slot->type, sizeof(short_slot->type));
     slot->type[sizeof(short_slot->type)] = '\0';
-    slot->attributes = short_slot->attributes;
+    slot->attributes = short_slot->attributes & ~SHORT_SLOT_CONTIG;
     slot->firstCluster = short_slot->firstCluster;
     slot->size = short_slot->size;
     slot->dir_sect = slot->dir_ptr = 0;
+    slot->stat = (short_slot->attributes & SHORT_SLOT_CONTIG) ? 2 : 0;
+    slot->dir_scl = slot->dir_size = slot->dir_ofs = 0;
+}
+
+/* A contiguous (NoFatChain) file? Only exFAT tracks this: on FAT the chain
+ * status is not maintained, and may be stale. */
+static bool_t fatfs_contig(const FIL *file)
+{
+    return FF_FS_EXFAT && (file->obj.fs->fs_type == FS_EXFAT)
+        && (file->obj.stat == 2);
 }
 
 static void fatfs_to_short_slot(
@@ -646,6 +720,8 @@ static void fatfs_to_short_slot(
     unsigned int i;
 
     slot->attributes = file->obj.attr;
+    if (fatfs_contig(file))
+        slot->attributes |= SHORT_SLOT_CONTIG;
     slot->firstCluster = file->obj.sclust;
     slot->size = file->obj.objsize;
     snprintf(slot->name, sizeof(slot->name), "%s", name);
@@ -670,6 +746,12 @@ void fatfs_from_slot(FIL *file, const struct slot *slot, BYTE mode)
     file->flag = mode;
     file->dir_sect = slot->dir_sect;
     file->dir_ptr = (void *)slot->dir_ptr;
+    file->obj.stat = slot->stat;
+#if FF_FS_EXFAT
+    file->obj.c_scl = slot->dir_scl;
+    file->obj.c_size = slot->dir_size;
+    file->obj.c_ofs = slot->dir_ofs;
+#endif
 }
 
 static void fatfs_to_slot(struct slot *slot, FIL *file, const char *name)
@@ -682,6 +764,18 @@ static void fatfs_to_slot(struct slot *slot, FIL *file, const char *name)
     slot->size = file->obj.objsize;
     slot->dir_sect = file->dir_sect;
     slot->dir_ptr = (uint32_t)file->dir_ptr;
+#if FF_FS_EXFAT
+    if (file->obj.fs->fs_type == FS_EXFAT) {
+        slot->stat = file->obj.stat;
+        slot->dir_scl = file->obj.c_scl;
+        slot->dir_size = file->obj.c_size;
+        slot->dir_ofs = file->obj.c_ofs;
+    } else
+#endif
+    {
+        slot->stat = 0;
+        slot->dir_scl = slot->dir_size = slot->dir_ofs = 0;
+    }
     snprintf(slot->name, sizeof(slot->name), "%s", name);
     if ((dot = strrchr(slot->name, '.')) != NULL) {
         snprintf(slot->type, sizeof(slot->type), "%s", dot+1);
@@ -715,32 +809,37 @@ static void dump_file(void)
 #endif
 }
 
-static bool_t native_dir_next(void)
+static bool_t __native_dir_next(DIR *dp, FILINFO *fp)
 {
     for (;;) {
-        F_readdir(&fs->dp, &fs->fp);
-        if (fs->fp.fname[0] == '\0')
+        F_readdir(dp, fp);
+        if (fp->fname[0] == '\0')
             return FALSE;
         /* Skip dot files. */
-        if (fs->fp.fname[0] == '.')
+        if (fp->fname[0] == '.')
             continue;
         /* Skip hidden files/folders. */
-        if (fs->fp.fattrib & AM_HID)
+        if (fp->fattrib & AM_HID)
             continue;
         /* Allow folder navigation when LCD/OLED display is attached. */
-        if ((fs->fp.fattrib & AM_DIR) && (display_type == DT_LCD_OLED)
+        if ((fp->fattrib & AM_DIR) && (display_type == DT_LCD_OLED)
             /* Skip FF/ in root folder */
-            && ((cfg.depth != 0) || strcmp(fs->fp.fname, "FF"))
+            && ((cfg.depth != 0) || strcmp(fp->fname, "FF"))
             /* Skip __MACOSX/ zip-file resource-fork folder */
-            && strcmp(fs->fp.fname, "__MACOSX"))
+            && strcmp(fp->fname, "__MACOSX"))
             break;
         /* Allow valid image files. */
-        if (image_valid(&fs->fp))
+        if (image_valid(fp))
             break;
     }
     return TRUE;
 }
 
+static bool_t native_dir_next(void)
+{
+    return __native_dir_next(&fs->dp, &fs->fp);
+}
+
 static inline int __tolower(int c)
 {
     if ((c >= 'A') && (c <= 'Z'))
@@ -748,32 +847,585 @@ static inline int __tolower(int c)
     return c;
 }
 
+/* Sorted names mostly share long prefixes: bytes which are already equal
+ * skip the case folding. */
 int strcmp_lower(const char *s1, const char *s2)
 {
-    for (;;) {
-        int diff = __tolower(*s1) - __tolower(*s2);
-        if (diff || !*s1)
+    for (;; s1++, s2++) {
+        int diff;
+        if (*s1 == *s2) {
+            if (!*s1)
+                return 0;
+            continue;
+        }
+        if ((diff = __tolower(*s1) - __tolower(*s2)) != 0)
             return diff;
-        s1++; s2++;
     }
     return 0;
 }
 
-static int native_dir_cmp(const void *a, const void *b)
+static int strncmp_lower(const char *s1, const char *s2, size_t n)
 {
-    const struct native_dirent *da = a;
-    const struct native_dirent *db = b;
-    if ((da->attr ^ db->attr) & AM_DIR) {
+    for (; n != 0; n--, s1++, s2++) {
+        int diff;
+        if (*s1 == *s2) {
+            if (!*s1)
+                return 0;
+            continue;
+        }
+        if ((diff = __tolower(*s1) - __tolower(*s2)) != 0)
+            return diff;
+    }
+    return 0;
+}
+
+static int native_cmp(uint8_t attr_a, const char *name_a,
+                      uint8_t attr_b, const char *name_b)
+{
+    if ((attr_a ^ attr_b) & AM_DIR) {
         switch (ff_cfg.sort_priority) {
         case SORTPRI_folders:
-            return (da->attr & AM_DIR) ? -1 : 1;
+            return (attr_a & AM_DIR) ? -1 : 1;
         case SORTPRI_files:
-            return (da->attr & AM_DIR) ? 1 : -1;
+            return (attr_a & AM_DIR) ? 1 : -1;
         }
     }
+    return strcmp_lower(name_a, name_b);
+}
+
+/* The first four case-folded characters of @name, packed so that integer
+ * order is strcmp_lower() order. */
+static uint32_t native_sort_key(const char *name)
+{
+    uint32_t key = 0;
+    unsigned int i;
+
+    for (i = 0; i < 4; i++) {
+        key <<= 8;
+        if (*name)
+            key |= (uint8_t)__tolower(*name++);
+    }
+
+    return key;
+}
+
+static int native_dir_cmp(const void *a, const void *b)
+{
+    const struct native_dirent *da = a;
+    const struct native_dirent *db = b;
+    int diff;
+
+    /* Folders vs files, as configured. */
+    if ((diff = native_cmp(da->attr, "", db->attr, "")) != 0)
+        return diff;
+
+    /* Most comparisons are decided by the sort keys alone. */
+    if (da->key != db->key)
+        return (da->key < db->key) ? -1 : 1;
+
     return strcmp_lower(da->name, db->name);
 }
 
+static void native_dirent_fill(struct native_dirent *ent)
+{
+    ASSERT((unsigned int)(fs->fp.dir_ptr - fatfs.win) < 512u);
+    ent->dir_sect = fs->fp.dir_sect;
+    ent->dir_off = fs->fp.dir_ptr - fatfs.win;
+    ent->attr = fs->fp.fattrib;
+    strcpy(ent->name, fs->fp.fname);
+    ent->key = native_sort_key(ent->name);
+}
+
+/* Folders too large to sort in the arena can be sorted on disk instead, into
+ * an index file within the folder itself (folder-sort = index). The file is
+ * a header followed by the sorted dirents, padded to a fixed record size. */
+#define INDEX_NAME  "FF_INDEX.BIN"
+#define INDEX_SFN   "FF_INDEXBIN"
+#define INDEX_SIG   0x58494646 /* "FFIX" */
+#define INDEX_VER   2 /* Bumped whenever the header or native_dirent changes */
+#define INDEX_REC_MAX ((offsetof(struct native_dirent, name)    \
+                        + FF_MAX_LFN + 1 + 3) & ~3)
+
+struct native_index_hdr {
+    uint32_t sig;
+    uint16_t rec_sz;
+    uint8_t key;      /* native_index_key() at time of build */
+    uint8_t ver;      /* INDEX_VER */
+    uint32_t nr;
+    uint32_t cdir;    /* Start cluster of the indexed folder */
+    uint32_t dir_crc; /* flashfloppy_dir_crc() of the indexed folder */
+};
+
+/* Buffer for a single dirent fetched from disk. */
+union native_rec {
+    struct native_dirent ent;
+    char buf[INDEX_REC_MAX];
+};
+
+struct native_index {
+    FIL file;
+    uint16_t nr, rec_sz;
+    union native_rec rec;
+};
+
+/* Configuration which affects the folder listing and its sort order. */
+static uint8_t native_index_key(void)
+{
+    return ff_cfg.sort_priority
+        | ((display_type == DT_LCD_OLED) << 2)
+        | ((cfg.depth == 0) << 3)
+        | ((ff_cfg.host == HOST_acorn) << 4);
+}
+
+static uint32_t native_index_dir_crc(void)
+{
+    uint32_t crc;
+    F_opendir(&fs->dp, "");
+    crc = flashfloppy_dir_crc(&fs->dp, INDEX_SFN);
+    F_closedir(&fs->dp);
+    return crc;
+}
+
+static struct native_dirent *native_index_ent(unsigned int i)
+{
+    struct native_index *idx = cfg.index;
+    F_lseek(&idx->file, sizeof(struct native_index_hdr) + i * idx->rec_sz);
+    F_read(&idx->file, &idx->rec, idx->rec_sz, NULL);
+    return &idx->rec.ent;
+}
+
+static int native_index_use(struct native_index *idx)
+{
+    volume_cache_init(idx + 1, (char *)arena_alloc(0) + arena_avail());
+    volume_cache_pin_metadata(&fatfs);
+    cfg.index = idx;
+    return idx->nr;
+}
+
+/* Open the current folder's index, if it exists and is up to date. */
+static int native_index_open(void)
+{
+    struct native_index *idx = arena_alloc(0);
+    struct native_index_hdr hdr;
+    UINT nr;
+
+    if (F_try_open(&idx->file, INDEX_NAME, FA_READ))
+        return -1;
+
+    F_read(&idx->file, &hdr, sizeof(hdr), &nr);
+    if ((nr != sizeof(hdr))
+        || (hdr.sig != INDEX_SIG)
+        || (hdr.ver != INDEX_VER)
+        || (hdr.key != native_index_key())
+        || (hdr.cdir != fatfs.cdir)
+        || (hdr.nr == 0) || (hdr.nr >= 0xffff)
+        || (hdr.rec_sz > INDEX_REC_MAX)
+        || (hdr.rec_sz <= offsetof(struct native_dirent, name))
+        || (f_size(&idx->file) != sizeof(hdr) + hdr.nr * hdr.rec_sz)
+        || (hdr.dir_crc != native_index_dir_crc())) {
+        printk("%s: stale\n", INDEX_NAME);
+        F_close(&idx->file);
+        return -1;
+    }
+
+    idx->nr = hdr.nr;
+    idx->rec_sz = hdr.rec_sz;
+    return native_index_use(idx);
+}
+
+/* Max-heap of dirent pointers, ordered by native_dir_cmp(). */
+static void native_heap_up(struct native_dirent **h, unsigned int i)
+{
+    struct native_dirent *e = h[i];
+    unsigned int p;
+    for (; i != 0; i = p) {
+        p = (i - 1) / 2;
+        if (native_dir_cmp(h[p], e) >= 0)
+            break;
+        h[i] = h[p];
+    }
+    h[i] = e;
+}
+
+static void native_heap_down(struct native_dirent **h, unsigned int nr)
+{
+    struct native_dirent *e = h[0];
+    unsigned int i = 0, c;
+    while ((c = 2*i + 1) < nr) {
+        if ((c + 1 < nr) && (native_dir_cmp(h[c+1], h[c]) > 0))
+            c++;
+        if (native_dir_cmp(h[c], e) <= 0)
+            break;
+        h[i] = h[c];
+        i = c;
+    }
+    h[i] = e;
+}
+
+/* Sort the current folder into a new index file. The arena holds only a
+ * window of the listing, so the folder is scanned once per window: each
+ * scan keeps the smallest entries which sort after the last one written. */
+static int native_index_build(void)
+{
+    struct native_index *idx = arena_alloc(0);
+    struct native_index_hdr hdr;
+    struct native_dirent **heap, *ent, *last, *spare;
+    char *rec, *end = (char *)idx + arena_avail();
+    unsigned int i, nr, done, n, k, rec_sz, max_len;
+
+    if (volume_readonly())
+        return -1;
+
+    /* First scan: count the entries and find the longest name. */
+    nr = max_len = 0;
+    F_opendir(&fs->dp, "");
+    while (native_dir_next()) {
+        nr++;
+        max_len = max_t(unsigned int, max_len, strlen(fs->fp.fname));
+    }
+    F_closedir(&fs->dp);
+    if ((nr == 0) || (nr >= 0xffff))
+        return -1;
+    rec_sz = (offsetof(struct native_dirent, name) + max_len + 1 + 3) & ~3;
+
+    /* Work area: the last record written, then a heap of k record pointers
+     * and k+1 records (the heap's, plus one for the candidate entry). */
+    last = (struct native_dirent *)(idx + 1);
+    heap = (struct native_dirent **)((char *)last + rec_sz);
+    if ((char *)heap + rec_sz >= end)
+        return -1;
+    k = (end - (char *)heap - rec_sz) / (sizeof(*heap) + rec_sz);
+    if (k < 2)
+        return -1;
+    rec = (char *)&heap[k];
+
+    printk("%s: %u entries, %u per scan\n", INDEX_NAME, nr, k);
+
+    F_open(&idx->file, INDEX_NAME, FA_CREATE_ALWAYS|FA_WRITE);
+    memset(&hdr, 0, sizeof(hdr));
+    F_write(&idx->file, &hdr, sizeof(hdr), NULL);
+
+    for (done = 0; done < nr; done += n) {
+        n = 0;
+        spare = (struct native_dirent *)(rec + k*rec_sz);
+        F_opendir(&fs->dp, "");
+        while (native_dir_next()) {
+            ent = (n < k) ? (struct native_dirent *)(rec + n*rec_sz) : spare;
+            memset(ent, 0, rec_sz);
+            native_dirent_fill(ent);
+            if (done && (native_dir_cmp(ent, last) <= 0))
+                continue;
+            if (n < k) {
+                heap[n] = ent;
+                native_heap_up(heap, n++);
+            } else if (native_dir_cmp(ent, heap[0]) < 0) {
+                spare = heap[0];
+                heap[0] = ent;
+                native_heap_down(heap, n);
+            }
+        }
+        F_closedir(&fs->dp);
+        if (n == 0)
+            break; /* folder shrank under us */
+        qsort_p(heap, n, native_dir_cmp);
+        for (i = 0; i < n; i++)
+            F_write(&idx->file, heap[i], rec_sz, NULL);
+        memcpy(last, heap[n-1], rec_sz);
+    }
+
+    if (done != nr) {
+        /* Leave the zeroed header in place: the index will not validate. */
+        F_close(&idx->file);
+        return -1;
+    }
+
+    hdr.sig = INDEX_SIG;
+    hdr.ver = INDEX_VER;
+    hdr.rec_sz = rec_sz;
+    hdr.key = native_index_key();
+    hdr.nr = nr;
+    hdr.cdir = fatfs.cdir;
+    hdr.dir_crc = native_index_dir_crc();
+    F_lseek(&idx->file, 0);
+    F_write(&idx->file, &hdr, sizeof(hdr), NULL);
+    F_close(&idx->file);
+
+    F_open(&idx->file, INDEX_NAME, FA_READ);
+    idx->nr = nr;
+    idx->rec_sz = rec_sz;
+    return native_index_use(idx);
+}
+
+/* Folders too large to sort as full dirents can still be sorted in the
+ * arena as compact keys: the location of each entry plus a name prefix.
+ * Names are re-read from the directory, via the volume cache, only when
+ * prefixes tie, and when an entry is fetched for navigation. */
+#define KEY_PREFIX 8
+#define KEY_CACHE_BYTES (6*1024) /* Reserve room for 8+ cached sectors */
+struct native_key {
+    uint16_t dir_idx; /* FILINFO.dir_ofs / SZDIRE */
+    uint8_t attr;
+    char prefix[KEY_PREFIX]; /* not NUL-terminated if name is long */
+};
+
+struct native_keys {
+    uint16_t nr;
+    union native_rec rec;
+    struct native_key key[0];
+};
+
+static void native_key_read(const struct native_key *key)
+{
+    F_opendir(&fs->dp, "");
+    flashfloppy_readdir_at(&fs->dp, &fs->fp, key->dir_idx * 32);
+    F_closedir(&fs->dp);
+}
+
+static int native_key_cmp(const struct native_key *a,
+                          const struct native_key *b)
+{
+    char *name = cfg.keys->rec.ent.name;
+    int i, diff;
+
+    /* Folders vs files, as configured. */
+    if ((diff = native_cmp(a->attr, "", b->attr, "")) != 0)
+        return diff;
+
+    for (i = 0; i < KEY_PREFIX; i++) {
+        diff = __tolower(a->prefix[i]) - __tolower(b->prefix[i]);
+        if (diff || !a->prefix[i])
+            return diff;
+    }
+
+    /* Prefixes tie: compare the full names. */
+    native_key_read(a);
+    strcpy(name, fs->fp.fname);
+    native_key_read(b);
+    return strcmp_lower(name, fs->fp.fname);
+}
+
+static void native_key_swap(struct native_key *a, struct native_key *b)
+{
+    struct native_key t = *a;
+    *a = *b;
+    *b = t;
+}
+
+/* Heapsort, as it sorts in place and makes O(n log n) comparisons. */
+static void native_key_sift(struct native_key *key, unsigned int i,
+                            unsigned int nr)
+{
+    unsigned int c;
+    while ((c = 2*i + 1) < nr) {
+        if ((c + 1 < nr) && (native_key_cmp(&key[c+1], &key[c]) > 0))
+            c++;
+        if (native_key_cmp(&key[c], &key[i]) <= 0)
+            break;
+        native_key_swap(&key[c], &key[i]);
+        i = c;
+    }
+}
+
+static void native_key_sort(struct native_key *key, unsigned int nr)
+{
+    unsigned int i;
+    for (i = nr / 2; i-- != 0; )
+        native_key_sift(key, i, nr);
+    for (i = nr; i-- > 1; ) {
+        native_key_swap(&key[0], &key[i]);
+        native_key_sift(key, 0, i);
+    }
+}
+
+/* Sort the current folder as compact keys. Returns -1 if the keys do not
+ * all fit in the arena, unless @truncate is TRUE, in which case the folder
+ * is truncated (as folder-sort = always does for full dirents). Also returns
+ * -1 if an entry lies beyond the 64k directory entries a key can address. */
+static int native_keys_sort(bool_t truncate)
+{
+    struct native_keys *keys = arena_alloc(0);
+    struct native_key *key = keys->key;
+    char *end = (char *)keys + arena_avail();
+    unsigned int nr = 0;
+
+    if (arena_avail() < sizeof(*keys) + KEY_CACHE_BYTES)
+        return -1;
+
+    F_opendir(&fs->dp, "");
+    while (native_dir_next()) {
+        if ((char *)&key[nr+1] > end - KEY_CACHE_BYTES) {
+            if (!truncate) {
+                F_closedir(&fs->dp);
+                return -1;
+            }
+            break;
+        }
+        if (fs->fp.dir_ofs / 32 > 0xffff) {
+            /* Beyond what a key can locate (a huge exFAT folder). */
+            F_closedir(&fs->dp);
+            return -1;
+        }
+        key[nr].dir_idx = fs->fp.dir_ofs / 32;
+        key[nr].attr = fs->fp.fattrib;
+        memset(key[nr].prefix, 0, KEY_PREFIX);
+        memcpy(key[nr].prefix, fs->fp.fname,
+               strnlen(fs->fp.fname, KEY_PREFIX));
+        nr++;
+    }
+    F_closedir(&fs->dp);
+
+    if (nr == 0)
+        return -1;
+
+    /* Cache what remains of the arena, for re-reading names. */
+    volume_cache_init(&key[nr], end);
+    volume_cache_pin_metadata(&fatfs);
+    keys->nr = nr;
+    cfg.keys = keys;
+    native_key_sort(key, nr);
+    return nr;
+}
+
+static struct native_dirent *native_keys_ent(unsigned int i)
+{
+    struct native_keys *keys = cfg.keys;
+    native_key_read(&keys->key[i]);
+    native_dirent_fill(&keys->rec.ent);
+    return &keys->rec.ent;
+}
+
+static bool_t native_sorted(void)
+{
+    return (cfg.sorted != NULL) || (cfg.index != NULL) || (cfg.keys != NULL);
+}
+
+static void native_sorted_clear(void)
+{
+    cfg.sorted = NULL;
+    cfg.index = NULL;
+    cfg.keys = NULL;
+    cfg.nr_jump = 0;
+}
+
+static struct native_dirent *native_sorted_ent(unsigned int i)
+{
+    return cfg.index ? native_index_ent(i)
+        : cfg.keys ? native_keys_ent(i)
+        : cfg.sorted[i];
+}
+
+/* Binary search the first @nr sorted entries for @name, or for the first
+ * entry prefixed by @name if @prefix is TRUE. Returns -1 if not found. */
+static int native_sorted_find(const char *name, int nr, bool_t prefix)
+{
+    static const uint8_t attr[] = { AM_DIR, 0 };
+    struct native_dirent *ent;
+    int i, c, lo, hi, len = strlen(name), found = -1;
+
+    for (c = 0; c < ARRAY_SIZE(attr); c++) {
+        /* Lower bound of @name amongst the entries of class @attr[c]. */
+        for (lo = 0, hi = nr; lo < hi; ) {
+            i = (lo + hi) / 2;
+            ent = native_sorted_ent(i);
+            if (native_cmp(ent->attr, ent->name, attr[c], name) < 0)
+                lo = i + 1;
+            else
+                hi = i;
+        }
+        /* Scan the case-insensitive matches for the first exact match. */
+        for (i = lo; (i < nr) && ((found < 0) || (i < found)); i++) {
+            ent = native_sorted_ent(i);
+            if ((ent->attr ^ attr[c]) & AM_DIR)
+                break;
+            if (prefix ? strncmp_lower(ent->name, name, len)
+                : strcmp_lower(ent->name, name))
+                break;
+            if (prefix ? !strncmp(ent->name, name, len)
+                : !strcmp(ent->name, name)) {
+                found = i;
+                break;
+            }
+        }
+        if (ff_cfg.sort_priority == SORTPRI_none)
+            break; /* Files and folders are sorted together */
+    }
+
+    return found;
+}
+
+/* Group key of sorted entry @i: its file/folder class and lowercased initial.
+ * Compact keys hold the initial, so need not re-read the directory. */
+static int native_sorted_group(unsigned int i)
+{
+    struct native_key *key;
+    struct native_dirent *ent;
+    uint8_t attr;
+    char c;
+
+    if (cfg.keys) {
+        key = &cfg.keys->key[i];
+        attr = key->attr;
+        c = key->prefix[0];
+    } else {
+        ent = native_sorted_ent(i);
+        attr = ent->attr;
+        c = ent->name[0];
+    }
+
+    if (ff_cfg.sort_priority == SORTPRI_none)
+        attr = 0;
+    return ((attr & AM_DIR) << 8) | (uint8_t)__tolower(c);
+}
+
+/* First sorted entry after @i which starts a new group, or @nr if none.
+ * Groups are contiguous in sort order, so this is a binary search. */
+static unsigned int native_group_end(unsigned int i, unsigned int nr)
+{
+    unsigned int lo = i + 1, hi = nr, mid;
+    int g = native_sorted_group(i);
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (native_sorted_group(mid) == g)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* Slot of the first entry of the group after the one containing @slot. */
+static unsigned int native_next_group(unsigned int slot)
+{
+    unsigned int i, k, nr, depth = cfg.depth ? 1 : 0;
+
+    if (!native_sorted())
+        return slot;
+
+    nr = cfg.max_slot_nr + 1 - depth;
+    if (cfg.nr_jump == 0) {
+        for (i = 0; (i < nr) && (cfg.nr_jump < JUMP_MAX);
+             i = native_group_end(i, nr))
+            cfg.jump[cfg.nr_jump++] = i;
+    }
+
+    if (slot < depth)
+        return depth; /* ".." -> first group */
+    i = slot - depth;
+
+    for (k = 0; (k < cfg.nr_jump) && (cfg.jump[k] <= i); k++)
+        continue;
+    if (k < cfg.nr_jump)
+        i = cfg.jump[k];
+    else /* beyond the table */
+        i = native_group_end(i, nr);
+
+    if (i >= nr)
+        return ff_cfg.nav_loop ? 0 : slot;
+    return i + depth;
+}
+
 /* Returns -1 if not read & sorted. */
 static int native_read_and_sort_dir(void)
 {
@@ -787,6 +1439,11 @@ static int native_read_and_sort_dir(void)
         return -1;
 
     volume_cache_destroy();
+    native_sorted_clear();
+
+    if ((ff_cfg.folder_sort == SORT_index)
+        && ((nr = native_index_open()) >= 0))
+        return nr;
 
     F_opendir(&fs->dp, "");
     p_ent = (struct native_dirent **)end;
@@ -795,20 +1452,25 @@ static int native_read_and_sort_dir(void)
         if (!native_dir_next())
             goto complete;
         *--p_ent = ent;
-        ASSERT((unsigned int)(fs->fp.dir_ptr - fatfs.win) < 512u);
-        ent->dir_sect = fs->fp.dir_sect;
-        ent->dir_off = fs->fp.dir_ptr - fatfs.win;
-        ent->attr = fs->fp.fattrib;
-        strcpy(ent->name, fs->fp.fname);
+        native_dirent_fill(ent);
         ent = (struct native_dirent *)(
             ((uint32_t)ent + sizeof(*ent) + strlen(ent->name) + 1 + 3) & ~3);
     }
 
-    if (ff_cfg.folder_sort == SORT_always)
-        goto complete;
+    /* Full dirents do not fit: fall back to compact keys, then to the
+     * on-disk index. Only folder-sort = always will truncate the folder. */
+    F_closedir(&fs->dp);
+    if ((nr = native_keys_sort(FALSE)) >= 0)
+        return nr;
+    if ((ff_cfg.folder_sort == SORT_index)
+        && ((nr = native_index_build()) >= 0))
+        return nr;
+    if ((ff_cfg.folder_sort == SORT_always)
+        && ((nr = native_keys_sort(TRUE)) >= 0))
+        return nr;
 
     volume_cache_init(start, end);
-    cfg.sorted = NULL;
+    volume_cache_pin_metadata(&fatfs);
     return -1;
 
 complete:
@@ -819,6 +1481,7 @@ complete:
     F_closedir(&fs->dp);
 
     volume_cache_init(ent, p_ent);
+    volume_cache_pin_metadata(&fatfs);
     cfg.sorted = p_ent;
     return nr;
 }
@@ -829,14 +1492,13 @@ static void update_slot_by_name(void)
     int len = strnlen(name, 256);
     int nr = ~0, max;
 
-    if (cfg.sorted) {
+    if (native_sorted()) {
 
         max = cfg.max_slot_nr;
         if (cfg.depth)
             max--;
-        for (nr = 0; nr <= max; nr++)
-            if (!strncmp(cfg.sorted[nr]->name, name, len))
-                break;
+        if ((nr = native_sorted_find(name, max+1, TRUE)) < 0)
+            nr = max+1;
         if (cfg.depth)
             nr++;
 
@@ -913,26 +1575,45 @@ static uint8_t parse_pin_str(const char *s)
     return pin;
 }
 
-static void read_ff_cfg(void)
-{
-    enum {
+enum {
 #define x(n,o,v) FFCFG_##o,
 #include "ff_cfg_defaults.h"
 #undef x
-        FFCFG_nr
-    };
+    FFCFG_nr
+};
 
-    const static struct opt ff_cfg_opts[FFCFG_nr+1] = {
+const static struct opt ff_cfg_opts[FFCFG_nr+1] = {
 #define x(n,o,v) [FFCFG_##o] = { #n },
 #include "ff_cfg_defaults.h"
 #undef x
-    };
+};
+
+/* Without x() defined: FFCFG_HASH_*, generated by scripts/mk_config.py. */
+#include "ff_cfg_defaults.h"
+
+/* Perfect hash of the option names: must match scripts/mk_config.py. */
+static int ffcfg_lookup(const char *name)
+{
+    const static uint8_t table[1u << FFCFG_HASH_BITS] = FFCFG_HASH_TABLE;
+    const char *p = name;
+    uint32_t h = 0;
+    uint8_t i;
+
+    while (*p != '\0')
+        h = h * 31 + *p++;
+    i = table[(h * FFCFG_HASH_MUL) >> (32 - FFCFG_HASH_BITS)];
+
+    return ((i < FFCFG_nr) && !strcmp(ff_cfg_opts[i].name, name)) ? i : -1;
+}
 
+static void read_ff_cfg(void)
+{
     FRESULT fr;
     int option;
     struct opts opts = {
         .file = &fs->file,
         .opts = ff_cfg_opts,
+        .lookup = ffcfg_lookup,
         .arg = fs->buf,
         .argmax = sizeof(fs->buf)-1
     };
@@ -942,6 +1623,14 @@ static void read_ff_cfg(void)
     if (fr)
         return;
 
+    /* Read FF.CFG in bulk (multi-sector reads) into the arena, borrowing it
+     * from the volume cache. Called only from cfg_init(), while the folder
+     * is unsorted and the cache spans the rest of the arena. */
+    volume_cache_destroy();
+    opts.rbuf = arena_alloc(0);
+    opts.rbuf_len = min_t(uint32_t, arena_avail(),
+                          (f_size(&fs->file) + 511) & ~511);
+
     while ((option = get_next_opt(&opts)) != -1) {
 
         switch (option) {
@@ -1007,9 +1696,18 @@ static void read_ff_cfg(void)
             ff_cfg.write_drain =
                 !strcmp(opts.arg, "realtime") ? WDRAIN_realtime
                 : !strcmp(opts.arg, "eot") ? WDRAIN_eot
+                : !strcmp(opts.arg, "adaptive") ? WDRAIN_adaptive
                 : WDRAIN_instant;
             break;
 
+        case FFCFG_write_back_ms:
+            ff_cfg.write_back_ms = strtol(opts.arg, NULL, 10);
+            break;
+
+        case FFCFG_pin_boot_kb:
+            ff_cfg.pin_boot_kb = strtol(opts.arg, NULL, 10);
+            break;
+
         case FFCFG_index_suppression:
             ff_cfg.index_suppression = !strcmp(opts.arg, "yes");
             break;
@@ -1062,6 +1760,7 @@ static void read_ff_cfg(void)
             ff_cfg.folder_sort =
                 !strcmp(opts.arg, "never") ? SORT_never
                 : !strcmp(opts.arg, "small") ? SORT_small
+                : !strcmp(opts.arg, "index") ? SORT_index
                 : SORT_always;
             break;
 
@@ -1083,6 +1782,10 @@ static void read_ff_cfg(void)
             ff_cfg.nav_loop = !strcmp(opts.arg, "yes");
             break;
 
+        case FFCFG_nav_scan_window:
+            ff_cfg.nav_scan_window = strtol(opts.arg, NULL, 10);
+            break;
+
         case FFCFG_twobutton_action: {
             char *p, *q;
             ff_cfg.twobutton_action = TWOBUTTON_zero;
@@ -1100,6 +1803,7 @@ static void read_ff_cfg(void)
                         : !strcmp(p, "rotary-fast") ? TWOBUTTON_rotary_fast
                         : !strcmp(p, "eject") ? TWOBUTTON_eject
                         : !strcmp(p, "htu") ? TWOBUTTON_htu
+                        : !strcmp(p, "letter") ? TWOBUTTON_letter
                         : TWOBUTTON_zero;
                 }
             }
@@ -1267,11 +1971,18 @@ static void read_ff_cfg(void)
             ff_cfg.extend_image = !strcmp(opts.arg, "yes");
             break;
 
+        case FFCFG_perf_report:
+            ff_cfg.perf_report = !strcmp(opts.arg, "yes");
+            break;
+
         }
     }
 
     F_close(&fs->file);
 
+    volume_cache_init(opts.rbuf, (char *)opts.rbuf + arena_avail());
+    volume_cache_pin_metadata(&fatfs);
+
     flash_ff_cfg_update(fs->buf);
 }
 
@@ -1310,6 +2021,7 @@ static void cfg_init(void)
     cfg.dirty_slot_name = FALSE;
     cfg.hxc_mode = FALSE;
     cfg.ima_ej_flag = FALSE;
+    cfg.hxc_cltbl[0] = 0;
     cfg.slot_nr = cfg.depth = 0;
     cfg.cur_cdir = fatfs.cdir;
 
@@ -1400,8 +2112,6 @@ native_mode:
     fatfs.cdir = cfg.cur_cdir;
     lcd_write(0, 3, -1, "/");
     for (;;) {
-        int nr;
-        bool_t ok;
         /* Read next pathname section, search for its terminating slash. */
         F_read(&fs->file, fs->buf, sizeof(fs->buf), NULL);
         fs->buf[sizeof(fs->buf)-1] = '\0';
@@ -1416,23 +2126,8 @@ native_mode:
         lcd_write(0, 3, -1, fs->buf);
         if (cfg.depth == ARRAY_SIZE(cfg.stack))
             F_die(FR_PATH_TOO_DEEP);
-        /* Find slot nr, and stack it */
-        if ((nr = native_read_and_sort_dir()) != -1) {
-            while (--nr >= 0)
-                if (!strcmp(cfg.sorted[nr]->name, fs->buf))
-                    break;
-            ok = (nr >= 0);
-            cfg.sorted = NULL;
-        } else {
-            F_opendir(&fs->dp, "");
-            while ((ok = native_dir_next()) && strcmp(fs->fp.fname, fs->buf))
-                nr++;
-            F_closedir(&fs->dp);
-        }
-        if (!ok)
-            goto clear_image_a;
-        nr += cfg.depth ? 1 : 0;
-        cfg.stack[cfg.depth].slot = nr;
+        /* Stack the folder. Its slot nr is found only if we return here. */
+        cfg.stack[cfg.depth].slot = STACK_SLOT_UNKNOWN;
         cfg.stack[cfg.depth++].cdir = fatfs.cdir;
         fr = f_chdir(fs->buf);
         if (fr)
@@ -1466,12 +2161,10 @@ native_mode:
                cfg.ima_ej_flag ? "(EJ)" : "");
         native_get_slot_map(TRUE);
         cfg.slot_nr = cfg.depth ? 1 : 0;
-        if (cfg.sorted) {
+        if (native_sorted()) {
             nr = cfg.max_slot_nr + 1 - cfg.slot_nr;
-            for (i = 0; i < nr; i++)
-                if (!strcmp(cfg.sorted[i]->name, fs->buf))
-                    break;
-            ok = (i < nr);
+            i = native_sorted_find(fs->buf, nr, FALSE);
+            ok = (i >= 0);
             cfg.slot_nr += i;
         } else {
             F_opendir(&fs->dp, "");
@@ -1499,10 +2192,194 @@ clear_image_a:
     F_close(&fs->file);
     cfg.slot_nr = cfg.depth = 0;
     cfg.ima_ej_flag = FALSE;
-    cfg.sorted = NULL;
+    native_sorted_clear();
     goto out;
 }
 
+/* Unsorted folders are scanned lazily. Only as much of the folder is read
+ * as is needed to reach the current slot plus a window either side of it
+ * (nav-scan-window), and the remainder is scanned in small steps whenever
+ * the selector is idle. Checkpoints at regular intervals through the scanned
+ * part of the folder bound the cost of seeking to any slot. */
+#define SCAN_CKPTS  128
+#define SCAN_WINDOW_MAX 32
+#define SCAN_IDLE_STEP 8 /* entries per idle step */
+static struct {
+    uint32_t cdir;
+    uint32_t last;    /* dir_idx of entry nr-1 */
+    uint16_t nr;      /* entries scanned so far */
+    bool_t done;      /* end of folder reached? */
+    bool_t dp_valid;  /* fs->scan_dp positioned after entry nr-1? */
+    uint8_t ckpt_shift;
+    uint32_t ckpt[SCAN_CKPTS]; /* dir_idx of entry i<<ckpt_shift */
+    uint16_t win_base, win_nr; /* Exact positions of nearby entries */
+    uint32_t win[2*SCAN_WINDOW_MAX+1];
+} scan;
+
+static void native_scan_reset(void)
+{
+    scan.cdir = fatfs.cdir;
+    scan.nr = scan.win_nr = 0;
+    scan.done = scan.dp_valid = FALSE;
+    scan.ckpt_shift = 0;
+}
+
+static void native_scan_record(uint32_t dir_idx)
+{
+    unsigned int i, n = scan.nr++;
+    scan.last = dir_idx;
+    if (n & ((1u << scan.ckpt_shift) - 1))
+        return;
+    if ((n >> scan.ckpt_shift) == SCAN_CKPTS) {
+        /* Table full: keep every other checkpoint, at double the spacing. */
+        for (i = 0; i < SCAN_CKPTS/2; i++)
+            scan.ckpt[i] = scan.ckpt[2*i];
+        scan.ckpt_shift++;
+        if (n & ((1u << scan.ckpt_shift) - 1))
+            return;
+    }
+    scan.ckpt[n >> scan.ckpt_shift] = dir_idx;
+}
+
+static void native_slot_map_update(void)
+{
+    if (scan.nr || cfg.depth)
+        cfg.max_slot_nr = (cfg.depth ? 1 : 0) + scan.nr - 1;
+}
+
+/* Scan up to @nr further entries of the folder. */
+static void native_scan_step(unsigned int nr)
+{
+    if (scan.done || (scan.cdir != fatfs.cdir))
+        return;
+
+    if (!scan.dp_valid) {
+        F_opendir(&fs->scan_dp, "");
+        if (scan.nr != 0)
+            flashfloppy_readdir_at(&fs->scan_dp, &fs->scan_fp,
+                                   scan.last * 32);
+        scan.dp_valid = TRUE;
+    }
+
+    while (nr--) {
+        if (scan.nr == 0xffff
+            || !__native_dir_next(&fs->scan_dp, &fs->scan_fp)) {
+            scan.done = TRUE;
+            F_closedir(&fs->scan_dp);
+            break;
+        }
+        native_scan_record(fs->scan_fp.dir_ofs / 32);
+    }
+
+    native_slot_map_update();
+}
+
+/* Scan until slot @slot is known, or the whole folder is scanned. */
+static void native_scan_to(unsigned int slot)
+{
+    if (cfg.hxc_mode || native_sorted())
+        return;
+    if (cfg.depth)
+        slot = slot ? slot - 1 : 0;
+    while (!scan.done && (scan.nr <= slot))
+        native_scan_step(min_t(unsigned int, slot - scan.nr, 63) + 1);
+}
+
+/* Called while the selector is waiting for input. */
+static void native_scan_idle(void)
+{
+    if (!cfg.hxc_mode && !native_sorted())
+        native_scan_step(SCAN_IDLE_STEP);
+}
+
+/* Leave entry @i of the folder in fs->fp, or an empty name if there is no
+ * such entry. Nearby entries' positions are remembered for next time. */
+static void native_scan_seek(unsigned int i)
+{
+    unsigned int w = min_t(unsigned int, ff_cfg.nav_scan_window,
+                           SCAN_WINDOW_MAX);
+    unsigned int base, end, n;
+
+    if (scan.cdir != fatfs.cdir)
+        native_scan_reset();
+    native_scan_to(i + w + (cfg.depth ? 1 : 0));
+    if (i >= scan.nr) {
+        fs->fp.fname[0] = '\0';
+        return;
+    }
+
+    if ((i < scan.win_base) || (i >= scan.win_base + scan.win_nr)) {
+        /* Walk from the checkpoint at or before the new window. */
+        base = (i > w) ? i - w : 0;
+        end = min_t(unsigned int, i + w + 1, scan.nr);
+        n = base >> scan.ckpt_shift << scan.ckpt_shift;
+        F_opendir(&fs->dp, "");
+        flashfloppy_readdir_at(&fs->dp, &fs->fp,
+                               scan.ckpt[n >> scan.ckpt_shift] * 32);
+        scan.win_base = base;
+        scan.win_nr = 0;
+        for (;;) {
+            if (n >= base)
+                scan.win[scan.win_nr++] = fs->fp.dir_ofs / 32;
+            if ((++n >= end) || !native_dir_next())
+                break;
+        }
+        F_closedir(&fs->dp);
+        if (i >= scan.win_base + scan.win_nr) {
+            /* Folder changed under us. */
+            fs->fp.fname[0] = '\0';
+            return;
+        }
+    }
+
+    F_opendir(&fs->dp, "");
+    flashfloppy_readdir_at(&fs->dp, &fs->fp,
+                           scan.win[i - scan.win_base] * 32);
+    F_closedir(&fs->dp);
+}
+
+/* Find the slot of the subfolder with start cluster @cdir in the current
+ * folder, whose slot map is already populated. */
+static uint16_t native_find_subdir(uint32_t cdir)
+{
+    struct native_dirent *ent;
+    unsigned int i, nr, depth = cfg.depth ? 1 : 0;
+    FIL *file = &fs->file;
+
+    file->obj.fs = &fatfs;
+
+    if (native_sorted()) {
+        nr = cfg.max_slot_nr + 1 - depth;
+        for (i = 0; i < nr; i++) {
+            ent = native_sorted_ent(i);
+            if (!(ent->attr & AM_DIR))
+                continue;
+            file->dir_sect = ent->dir_sect;
+            file->dir_ptr = fatfs.win + ent->dir_off;
+            flashfloppy_fill_fileinfo(file);
+            if (file->obj.sclust == cdir)
+                return i + depth;
+        }
+        return 0;
+    }
+
+    F_opendir(&fs->dp, "");
+    for (i = 0; native_dir_next(); i++) {
+        if (!(fs->fp.fattrib & AM_DIR))
+            continue;
+        file->dir_sect = fs->fp.dir_sect;
+        file->dir_ptr = fs->fp.dir_ptr;
+        flashfloppy_fill_fileinfo(file);
+        if (file->obj.sclust == cdir)
+            break;
+    }
+    F_closedir(&fs->dp);
+    if (!fs->fp.fname[0])
+        return 0;
+    native_scan_to(i + depth);
+    return i + depth;
+}
+
 static void native_get_slot_map(bool_t sorted_only)
 {
     int i;
@@ -1516,10 +2393,10 @@ static void native_get_slot_map(bool_t sorted_only)
     } else {
         if (sorted_only)
             return;
-        F_opendir(&fs->dp, "");
-        while (native_dir_next())
-            cfg.max_slot_nr++;
-        F_closedir(&fs->dp);
+        /* Scan only as far as the current slot, for now. */
+        native_scan_reset();
+        native_scan_to(cfg.slot_nr + ff_cfg.nav_scan_window);
+        cfg.max_slot_nr = (cfg.depth ? 1 : 0) + scan.nr;
     }
 
     /* Adjust max_slot_nr. Must be at least one 'slot'. */
@@ -1539,7 +2416,7 @@ static void native_update(uint8_t slot_mode)
 {
     int i;
 
-    if ((slot_mode == CFG_READ_SLOT_NR) && !cfg.sorted)
+    if ((slot_mode == CFG_READ_SLOT_NR) && !native_sorted())
         native_get_slot_map(FALSE);
 
     if (slot_mode == CFG_WRITE_SLOT_NR) {
@@ -1610,11 +2487,12 @@ static void native_update(uint8_t slot_mode)
         goto is_dir;
     }
 
-    if (cfg.sorted) {
+    if (native_sorted()) {
 
-        struct native_dirent *ent = cfg.sorted[cfg.slot_nr-i];
+        struct native_dirent *ent = native_sorted_ent(cfg.slot_nr-i);
         snprintf(fs->fp.fname, sizeof(fs->fp.fname), ent->name);
         fs->file.obj.fs = &fatfs;
+        fs->file.obj.attr = ent->attr; /* exFAT: not in the entry we read */
         fs->file.dir_sect = ent->dir_sect;
         fs->file.dir_ptr = fatfs.win + ent->dir_off;
         flashfloppy_fill_fileinfo(&fs->file);
@@ -1625,13 +2503,7 @@ static void native_update(uint8_t slot_mode)
 
     } else {
 
-        F_opendir(&fs->dp, "");
-        while (native_dir_next()) {
-            if (i >= cfg.slot_nr)
-                break;
-            i++;
-        }
-        F_closedir(&fs->dp);
+        native_scan_seek(cfg.slot_nr - i);
         if (fs->fp.fattrib & AM_DIR) {
         is_dir:
             /* Leave the full pathname cached in fs->fp. */
@@ -1715,6 +2587,16 @@ static void hxc_cfg_update(uint8_t slot_mode)
 
     slot_from_short_slot(&cfg.slot, &cfg.hxcsdfe);
     fatfs_from_slot(&fs->file, &cfg.slot, mode);
+    /* Map HXCSDFE.CFG once, when the slot map is read. Each slot lookup then
+     * seeks directly rather than walking the FAT chain from the start. The
+     * file is only ever rewritten in place, so the map stays valid. */
+    if (slot_mode == CFG_READ_SLOT_NR) {
+        cfg.hxc_cltbl[0] = ARRAY_SIZE(cfg.hxc_cltbl);
+        fs->file.cltbl = cfg.hxc_cltbl;
+        if (f_lseek(&fs->file, CREATE_LINKMAP) != FR_OK)
+            cfg.hxc_cltbl[0] = 0;
+    }
+    fs->file.cltbl = cfg.hxc_cltbl[0] ? cfg.hxc_cltbl : NULL;
     F_read(&fs->file, &hxc->cfg, sizeof(hxc->cfg), NULL);
     if (strncmp("HXCFECFGV", hxc->cfg.signature, 9))
         goto bad_signature;
@@ -1933,6 +2815,7 @@ static void htu_choose_new_image(uint8_t b)
 
     /* Reconstitute the slot number. Reset the selected digit on overflow. */
     i = digits[0] + digits[1]*10 + digits[2]*100;
+    native_scan_to(i);
     if (i > cfg.max_slot_nr) {
         digits[pos] = 0;
         i = digits[0] + digits[1]*10 + digits[2]*100;
@@ -1965,8 +2848,10 @@ static bool_t choose_new_image(uint8_t init_b)
                 delay = time_ms(50);
             if (twobutton_action == TWOBUTTON_rotary_fast)
                 delay = time_ms(40);
-            if (time_diff(last_change, time_now()) < delay)
+            if (time_diff(last_change, time_now()) < delay) {
+                native_scan_idle();
                 continue;
+            }
             changes++;
         } else {
             /* Different button pressed. Takes immediate effect, resets 
@@ -1988,6 +2873,14 @@ static bool_t choose_new_image(uint8_t init_b)
                 cfg_update(CFG_KEEP_SLOT_NR);
                 break;
             }
+            if (twobutton_action == TWOBUTTON_letter) {
+                /* Holding both buttons repeats, at the usual decaying
+                 * rate, through successive initial letters. */
+                cfg.slot_nr = native_next_group(cfg.slot_nr);
+                cfg_update(CFG_KEEP_SLOT_NR);
+                display_write_slot(TRUE);
+                continue;
+            }
             i = cfg.slot_nr = 0;
             cfg_update(CFG_KEEP_SLOT_NR);
             if ((twobutton_action == TWOBUTTON_rotary)
@@ -2011,6 +2904,8 @@ static bool_t choose_new_image(uint8_t init_b)
                 i = 0;
                 goto b_right;
             }
+            if (i < 0)
+                native_scan_to(~0u); /* wrapping needs the folder size */
             while (i < 0)
                 i += cfg.max_slot_nr + 1;
         b_left:
@@ -2023,6 +2918,7 @@ static bool_t choose_new_image(uint8_t init_b)
             } while (!slot_valid(i));
         } else { /* b & B_RIGHT */
             i += velocity ?: 1;
+            native_scan_to(i);
             if ((i > cfg.max_slot_nr) && !ff_cfg.nav_loop) {
                 i = cfg.max_slot_nr;
                 goto b_left;
@@ -2052,33 +2948,57 @@ static void assert_volume_connected(void)
         F_die(FR_DISK_ERR);
 }
 
+/* Buffered flux below which run_floppy() defers display updates. */
+#define UI_MIN_SLACK_US 5000
+
+/* Live performance row on the FF OSD, toggled from the main menu. */
+static bool_t osd_perf;
+#define OSD_PERF_MS 500
+
 static int run_floppy(void *_b)
 {
     volatile uint8_t *pb = _b;
     time_t t_now, t_prev, t_diff;
-    int32_t update_ticks;
+    int32_t update_ticks, osd_ticks;
+    char msg[24];
 
     floppy_insert(0, &cfg.slot);
 
     led_7seg_update_track(TRUE);
 
     update_ticks = time_ms(20);
+    osd_ticks = 0;
     t_prev = time_now();
     while (((*pb = buttons) == 0) && !floppy_handle()) {
         t_now = time_now();
         t_diff = time_diff(t_prev, t_now);
-        if ((update_ticks -= t_diff) <= 0) {
-            led_7seg_update_track(FALSE);
-            lcd_write_track_info(FALSE);
-            update_ticks = time_ms(20);
-        }
-        if (display_type == DT_LCD_OLED) {
+        update_ticks -= t_diff;
+        osd_ticks -= t_diff;
+        if (display_type == DT_LCD_OLED)
             lcd_scroll.ticks -= t_diff;
-            lcd_scroll_name();
+        t_prev = t_now;
+        /* Display updates wait while the flux buffers are near their
+         * deadline: go straight back round to floppy_handle(). */
+        if (floppy_slack_us() >= UI_MIN_SLACK_US) {
+            if (update_ticks <= 0) {
+                led_7seg_update_track(FALSE);
+                lcd_write_track_info(FALSE);
+                update_ticks = time_ms(20);
+            }
+            if (display_type == DT_LCD_OLED)
+                lcd_scroll_name();
+            if (osd_perf && (osd_ticks <= 0)) {
+                floppy_perf_overlay(msg, sizeof(msg));
+                osd_overlay_write(msg);
+                osd_ticks = time_ms(OSD_PERF_MS);
+            }
         }
         canary_check();
         assert_volume_connected();
-        t_prev = t_now;
+        /* Sleep until the host, the I/O thread, or the button scan needs
+         * us. The SELA, STEP and MOTOR IRQs wake us in time to respond. */
+        if (floppy_idle())
+            thread_idle();
     }
 
     floppy_sync();
@@ -2095,30 +3015,62 @@ static void floppy_arena_setup(void)
 
     fs = arena_alloc(sizeof(*fs));
 
-    if (cfg.sorted) {
+    if (native_sorted()) {
         native_get_slot_map(FALSE);
     } else {
         unsigned int cache_len = arena_avail();
         uint8_t *cache_start = arena_alloc(0);
         volume_cache_init(cache_start, cache_start + cache_len);
+        volume_cache_pin_metadata(&fatfs);
     }
 }
 
 static void floppy_arena_teardown(void)
 {
+    scan.dp_valid = FALSE;
     fs = NULL;
     volume_cache_destroy();
 }
 
+/* Free-cluster count, for volumes whose FSINFO does not provide one. Rather
+ * than have FatFS scan the whole FAT at once, which takes seconds on a large
+ * volume, we count a few FAT (or exFAT bitmap) sectors at a time while the
+ * selector is idle. The scan restarts if clusters are allocated or freed
+ * meanwhile: FatFS tracks neither while the count is unknown.
+ * Once known, FatFS keeps the count up to date as clusters are allocated. */
+#define FREE_SCAN_STEP 1 /* FAT sectors per idle step */
+static struct {
+    WORD id;         /* fatfs.id of the volume being scanned */
+    DWORD last_clst; /* changes if clusters are allocated under our feet */
+    DWORD n_freed;   /* changes if clusters are freed (eg. image_delete()) */
+    DWORD sect, nfree;
+} free_scan;
+
+static bool_t free_space_known(void)
+{
+    return fatfs.free_clst <= fatfs.n_fatent - 2;
+}
+
 static void noinline volume_space(void)
 {
     char msg[25];
     unsigned int free = (fatfs.free_clst*fatfs.csize+1953/2)/1953 + 100/2;
     unsigned int total = (fatfs.n_fatent*fatfs.csize+1953/2)/1953 + 100/2;
-    if (fatfs.free_clst < fatfs.n_fatent-2) {
+    DWORD nclst;
+    FATFS *fsp;
+
+    /* A FAT12 FAT is at most a dozen sectors: just scan it. */
+    if (!free_space_known() && (fatfs.fs_type == FS_FAT12)
+        && (f_getfree("", &nclst, &fsp) == FR_OK))
+        free = (fatfs.free_clst*fatfs.csize+1953/2)/1953 + 100/2;
+
+    if (free_space_known()) {
         snprintf(msg, sizeof(msg), "Free:%u.%u/%u.%uG",
                  free/1000, (free%1000)/100,
                  total/1000, (total%1000)/100);
+    } else if (fatfs.fs_type != FS_FAT12) {
+        snprintf(msg, sizeof(msg), "Free:calc/%u.%uG",
+                 total/1000, (total%1000)/100);
     } else {
         snprintf(msg, sizeof(msg), "Volume: %u.%uG",
                  total/1000, (total%1000)/100);
@@ -2127,6 +3079,78 @@ static void noinline volume_space(void)
 
 }
 
+/* Called while the selector is waiting for input. */
+static void free_scan_idle(void)
+{
+    unsigned int i, n, nr = FREE_SCAN_STEP;
+    const uint8_t *p;
+    DWORD clst;
+
+    if (free_space_known() || (fatfs.fs_type == FS_FAT12))
+        return;
+
+    /* (Re)start on a new volume, or if the FAT has changed. */
+    if ((free_scan.id != fatfs.id) || (free_scan.last_clst != fatfs.last_clst)
+        || (free_scan.n_freed != fatfs.n_freed)) {
+        free_scan.id = fatfs.id;
+        free_scan.last_clst = fatfs.last_clst;
+        free_scan.n_freed = fatfs.n_freed;
+        free_scan.sect = free_scan.nfree = 0;
+    }
+
+#if FF_FS_EXFAT
+    if (fatfs.fs_type == FS_EXFAT) {
+        /* exFAT tracks allocation in a bitmap, from cluster 2. */
+        while (nr--) {
+            if (disk_read(fatfs.pdrv, (BYTE *)fs->buf,
+                          fatfs.bitbase + free_scan.sect, 1) != RES_OK)
+                F_die(FR_DISK_ERR);
+            clst = 2 + free_scan.sect++ * 512*8;
+            for (i = 0, p = (uint8_t *)fs->buf;
+                 (i < 512*8) && (clst < fatfs.n_fatent);
+                 i++, clst++)
+                free_scan.nfree += !(p[i/8] & (1u << (i&7)));
+            if (clst >= fatfs.n_fatent)
+                goto done;
+        }
+        return;
+    }
+#endif
+
+    n = (fatfs.fs_type == FS_FAT16) ? 512/2 : 512/4; /* entries per sector */
+    while (nr--) {
+        if (disk_read(fatfs.pdrv, (BYTE *)fs->buf,
+                      fatfs.fatbase + free_scan.sect, 1) != RES_OK)
+            F_die(FR_DISK_ERR);
+        clst = free_scan.sect++ * n;
+        for (i = 0, p = (uint8_t *)fs->buf;
+             (i < n) && (clst < fatfs.n_fatent);
+             i++, clst++) {
+            if (fatfs.fs_type == FS_FAT16) {
+                free_scan.nfree += !(p[0] | p[1]);
+                p += 2;
+            } else {
+                free_scan.nfree += !(p[0] | p[1] | p[2] | (p[3] & 0x0f));
+                p += 4;
+            }
+        }
+        if (clst >= fatfs.n_fatent)
+            goto done;
+    }
+    return;
+
+done:
+    /* Only a scan over an unchanging FAT gives a count worth keeping. If it
+     * changed, the next step starts over. */
+    if ((free_scan.last_clst != fatfs.last_clst)
+        || (free_scan.n_freed != fatfs.n_freed))
+        return;
+    /* FatFS will write the count back to FSINFO (FAT32 only). */
+    fatfs.free_clst = free_scan.nfree;
+    fatfs.fsi_flag |= 1;
+    volume_space();
+}
+
 /* Wait 50ms for 2-button press. */
 static uint8_t wait_twobutton_press(uint8_t b)
 {
@@ -2244,6 +3268,23 @@ static void image_copy(void)
     cfg.clipboard = cfg.slot;
 }
 
+/* Metadata cache while pasting: a few sectors. */
+#define PASTE_META_CACHE 3072
+
+/* Clone @idx (or the source's own name, if negative): @done of @size bytes. */
+static void paste_progress(int idx, uint32_t done, uint32_t size)
+{
+    char msg[lcd_columns+1];
+    /* Avoid 32-bit overflow on large images. */
+    unsigned int pc = (size >> 24) ? done / (size / 100) : done * 100 / size;
+
+    if (idx < 0)
+        snprintf(msg, sizeof(msg), "Pasting... %u%%", pc);
+    else
+        snprintf(msg, sizeof(msg), "Paste (%03u) %u%%", idx, pc);
+    lcd_write(0, 1, -1, msg);
+}
+
 static void image_paste(const char *subfolder)
 {
     time_t t;
@@ -2251,8 +3292,13 @@ static void image_paste(const char *subfolder)
     int i, baselen, todo, idx, max_idx = -1;
     char *p, *q;
     FIL *nfil;
+    FRESULT fres;
     bool_t use_basename = FALSE;
     const struct slot *slot = &cfg.clipboard;
+    uint32_t size;
+    uint8_t *meta;
+    void *buf;
+    int max;
 
     if (!slot->size || !confirm("Paste"))
         return;
@@ -2274,7 +3320,6 @@ static void image_paste(const char *subfolder)
     if (p == NULL) {
         /* Source filename is not of the form '*_000'. Does it exist at the 
          * destinaton? */
-        FRESULT fres;
         p = fs->buf + strlen(fs->buf);
         snprintf(p, sizeof(fs->buf)-(p-fs->buf), ".%s", slot->type);
         fres = f_stat(fs->buf, &fs->fp);
@@ -2333,18 +3378,35 @@ static void image_paste(const char *subfolder)
     fatfs_from_slot(&fs->file, slot, FA_READ);
     nfil = arena_alloc(sizeof(*nfil));
     F_open(nfil, fs->buf, FA_CREATE_NEW|FA_WRITE);
-    todo = f_size(&fs->file); 
+    size = todo = f_size(&fs->file);
+
+    /* Walking the source's and the clone's cluster chains in turn would
+     * thrash the sector window: cache FAT and directory sectors only. */
+    meta = arena_alloc(PASTE_META_CACHE);
+    volume_cache_init(meta, meta + PASTE_META_CACHE);
+    volume_cache_metadata_only(nfil);
+
+    /* Allocate the clone as one contiguous fragment if we can. The copy then
+     * writes straight through without stopping to allocate clusters, and the
+     * clone streams as well as the original. */
+    if ((size != 0) && ((fres = f_expand(nfil, size, 1)) != FR_OK)
+        && (fres != FR_DENIED))
+        F_die(fres);
+
+    /* Whole sectors, so that FatFS transfers straight to/from the arena. */
+    buf = arena_alloc(0);
+    max = arena_avail() & ~511;
     while (todo != 0) {
-        int nr = min_t(int, todo, arena_avail());
-        void *p = arena_alloc(0);
-        F_read(&fs->file, p, nr, NULL);
-        F_write(nfil, p, nr, NULL);
+        int nr = min_t(int, todo, max);
+        F_read(&fs->file, buf, nr, NULL);
+        F_write(nfil, buf, nr, NULL);
         todo -= nr;
+        paste_progress(use_basename ? -1 : max_idx+1, size - todo, size);
     }
     F_close(nfil);
     fatfs.cdir = cfg.cur_cdir;
     floppy_arena_setup();
-    if (!cfg.sorted)
+    if (!native_sorted())
         cfg_update(CFG_READ_SLOT_NR);
 
 out:
@@ -2376,7 +3438,7 @@ static bool_t image_delete(void)
     }
 
     cfg.slot_nr = min_t(uint16_t, cfg.slot_nr, cfg.max_slot_nr-1);
-    cfg.sorted = NULL;
+    native_sorted_clear();
     cfg_update(CFG_READ_SLOT_NR);
     ok = TRUE;
 
@@ -2384,12 +3446,34 @@ static bool_t image_delete(void)
     return ok;
 }
 
+static void storage_bench(void)
+{
+    char msg[17];
+
+    if (!confirm("Bench"))
+        return;
+
+    volume_cache_destroy();
+    volume_bench(msg, sizeof(msg));
+    floppy_arena_setup();
+    if (!native_sorted())
+        cfg_update(CFG_READ_SLOT_NR);
+
+    /* Hold the result on display until a button is pressed. */
+    lcd_write(0, 1, -1, msg);
+    while (buttons)
+        continue;
+    menu_wait_button(TRUE, "");
+}
+
 enum {
     EJM_header = 0,
     EJM_wrprot,
     EJM_copy,
     EJM_paste,
     EJM_delete,
+    EJM_stalls,
+    EJM_bench,
     EJM_exit_to_selector,
     EJM_exit_reinsert,
     EJM_nr
@@ -2415,6 +3499,7 @@ static uint8_t noinline eject_menu(uint8_t b)
         [EJM_copy]   = "Copy",
         [EJM_paste]  = "Paste",
         [EJM_delete] = "Delete",
+        [EJM_bench]  = "Bench Storage",
         [EJM_exit_to_selector] = "Exit to Selector",
         [EJM_exit_reinsert] = "Exit & Re-Insert",
     };
@@ -2446,6 +3531,10 @@ static uint8_t noinline eject_menu(uint8_t b)
                          (cfg.slot.attributes & AM_RDO) ? "N" : "FF");
                 lcd_write(0, 1, -1, msg);
                 break;
+            case EJM_stalls:
+                floppy_stall_summary(msg, sizeof(msg));
+                lcd_write(0, 1, -1, msg);
+                break;
             default:
                 lcd_write(0, 1, -1, menu_s[menu[sel]]);
                 break;
@@ -2523,6 +3612,12 @@ static uint8_t noinline eject_menu(uint8_t b)
                     break;
                 b = 0xff; /* selector */
                 goto out;
+            case EJM_stalls: /* Dump stall telemetry to the log */
+                floppy_stall_report();
+                break;
+            case EJM_bench:
+                storage_bench();
+                break;
             case EJM_exit_to_selector:
                 display_write_slot(TRUE);
                 b = 0xff; /* selector */
@@ -2568,7 +3663,7 @@ static int floppy_main(void *unused)
      * in ejected state. */
     cfg.ejected = (buttons != 0);
 
-    cfg.sorted = NULL;
+    native_sorted_clear();
     floppy_arena_setup();
 
     lcd_clear();
@@ -2613,10 +3708,21 @@ static int floppy_main(void *unused)
                 F_die(FR_BAD_IMAGE);
             }
             if (!strcmp(fs->fp.fname, "..")) {
+                uint32_t cdir = cfg.cur_cdir;
                 if (cfg.depth == 0)
                     F_die(FR_BAD_IMAGECFG);
                 fatfs.cdir = cfg.cur_cdir = cfg.stack[--cfg.depth].cdir;
                 cfg.slot_nr = cfg.stack[cfg.depth].slot;
+                if (cfg.slot_nr == STACK_SLOT_UNKNOWN) {
+                    cfg.slot_nr = 0;
+                    native_sorted_clear();
+                    cfg_update(CFG_READ_SLOT_NR);
+                    cfg.slot_nr = native_find_subdir(cdir);
+                    cfg_update(CFG_KEEP_SLOT_NR);
+                    display_write_slot(FALSE);
+                    b = buttons;
+                    goto select;
+                }
             } else {
                 if (cfg.depth == ARRAY_SIZE(cfg.stack))
                     F_die(FR_PATH_TOO_DEEP);
@@ -2626,7 +3732,7 @@ static int floppy_main(void *unused)
                 cfg.cur_cdir = fatfs.cdir;
                 cfg.slot_nr = 1;
             }
-            cfg.sorted = NULL;
+            native_sorted_clear();
             cfg_update(CFG_READ_SLOT_NR);
             display_write_slot(FALSE);
             b = buttons;
@@ -2642,7 +3748,7 @@ static int floppy_main(void *unused)
         printk("Attr: %02x Clus: %08x Size: %u\n",
                cfg.slot.attributes, cfg.slot.firstCluster, cfg.slot.size);
 
-        logfile_flush(&fs->file);
+        logfile_flush();
 
         if (cfg.ejected) {
             cfg.ejected = FALSE;
@@ -2651,6 +3757,10 @@ static int floppy_main(void *unused)
             floppy_arena_teardown();
             fres = F_call_cancellable(run_floppy, &b);
             floppy_cancel();
+            /* The overlay's figures are for the image just ejected. Remove
+             * the row, whether run_floppy() returned or was cancelled. */
+            if (osd_perf)
+                osd_overlay_write(NULL);
             assert_volume_connected();
             if ((b != 0) && (display_type == DT_LCD_OLED)) {
                 /* Immediate visual indication of button press. */
@@ -2658,7 +3768,9 @@ static int floppy_main(void *unused)
                 lcd_on();
             }
             floppy_arena_setup();
-            logfile_flush(&fs->file);
+            trace_dump(&fs->file);
+            floppy_perf_report(&fs->file, cfg.slot.name);
+            logfile_flush();
             volume_space();
         }
 
@@ -2731,6 +3843,8 @@ static int floppy_main(void *unused)
                 if (b != 0)
                     break;
                 assert_volume_connected();
+                native_scan_idle();
+                free_scan_idle();
                 delay_ms(1);
                 lcd_scroll.ticks -= time_ms(1);
                 lcd_scroll_name();
@@ -2860,6 +3974,7 @@ static void main_menu(void)
         "Factory Reset",
         "Update Firmware",
         "Configure FF OSD",
+        "OSD Perf Overlay",
         "Exit",
     };
 
@@ -2912,7 +4027,16 @@ static void main_menu(void)
             case 3: /* Configure FF OSD */
                 ff_osd_configure();
                 break;
-            case 0: case 4: /* Exit */
+            case 4: /* OSD Perf Overlay */
+                if (!has_osd)
+                    break;
+                osd_perf = !osd_perf;
+                if (!osd_perf)
+                    osd_overlay_write(NULL);
+                lcd_write(0, 1, -1, osd_perf ? "Overlay On" : "Overlay Off");
+                delay_ms(1000);
+                break;
+            case 0: case 5: /* Exit */
                 goto out;
             }
         }
@@ -3070,6 +4194,7 @@ int main(void)
     stm32_init();
     time_init();
     console_init();
+    prof_init();
     board_init();
     console_crash_on_input();
     delay_ms(200); /* 5v settle */
@@ -3085,6 +4210,10 @@ int main(void)
 
     flash_ff_cfg_read();
 
+    /* Power up the USB port first: the drive boots, and then sits out the
+     * host's attach debounce, while we initialise everything else. */
+    usbh_msc_init();
+
     floppy_init();
 
     display_init();
@@ -3103,12 +4232,11 @@ int main(void)
         }
     }
 
-    usbh_msc_init();
-
     rotary = board_get_rotary();
     set_rotary_exti();
     timer_init(&button_timer, button_timer_fn, NULL);
-    timer_set(&button_timer, time_now());
+    button_scan_time = time_now();
+    timer_set(&button_timer, button_scan_time);
 
     for (;;) {
 
@@ -0,0 +1,357 @@
+/*
+ * nor_cache.c
+ *
+ * Second-level sector cache in an external SPI NOR flash, below the RAM
+ * cache in volume.c. For boards modded with a 25-series NOR chip sharing the
+ * SD card's SPI bus (SPI2: PB13-15), selected by its own chip-select pin.
+ *
+ * The flash is a log of 4kB erase blocks, filled in turn around the whole
+ * chip so that wear is spread evenly. Each block starts with a sequence
+ * number, so that the log resumes where it left off after power-up. The
+ * index of cached sectors is held in RAM for the most recent NOR_WINDOW
+ * blocks, and is discarded whenever a volume is initialised: a stick can be
+ * modified elsewhere between connections, undetectably.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#define spi spi2
+#define CS_GPIO gpioc
+#define PIN_CS 6
+#define SPI_PIN_SPEED _10MHz
+#define NOR_CR1 (SPI_CR1_MSTR | SPI_CR1_SSM | SPI_CR1_SSI | SPI_CR1_SPE \
+                 | SPI_CR1_BR_DIV4) /* 9MHz */
+
+#define NOR_READ  0x03
+#define NOR_PP    0x02 /* Page program */
+#define NOR_SE    0x20 /* 4kB sector erase */
+#define NOR_RDSR  0x05
+#define NOR_WREN  0x06
+#define NOR_JEDEC 0x9f
+#define SR_WIP    0x01
+
+#define NOR_BLK_SZ 4096
+#define NOR_PAGE_SZ 256
+#define SECSZ 512
+/* Block layout: header, then sectors at 512-byte offsets. */
+#define NOR_SLOTS (NOR_BLK_SZ/SECSZ - 1)
+/* Blocks indexed in RAM: 64 * 7 sectors = 224kB of cached data. */
+#define NOR_WINDOW 64
+/* Runs recently read from the volume: a second read of one makes it hot. */
+#define NOR_GHOSTS 32
+/* Cap on sectors written to flash per volume read: ~1.5ms each. */
+#define NOR_FILL_MAX 8
+
+#define NOR_SIG 0x434e4646 /* "FFNC" */
+struct nor_blk_hdr {
+    uint32_t sig, seq;
+};
+
+#define NO_LBA (~(uint32_t)0)
+
+static struct {
+    bool_t probed, present;
+    uint16_t nr_blks;
+    /* Block being filled, its window entry, and the next slot in it. A full
+     * block (nr_used == NOR_SLOTS) moves on once the erase-ahead is done. */
+    uint16_t blk;
+    uint8_t win, nr_used;
+    bool_t erased; /* Erase of the following block has been started */
+    uint32_t seq;
+    uint16_t win_blk[NOR_WINDOW];
+    uint32_t lba[NOR_WINDOW][NOR_SLOTS];
+    uint32_t ghost[NOR_GHOSTS];
+    uint8_t ghost_idx;
+    uint32_t hits, fills;
+} nor;
+
+static uint32_t saved_cr1;
+
+/* Take the bus from sd_spi.c, which may not have configured it at all. */
+static void nor_acquire(void)
+{
+    rcc->apb1enr |= RCC_APB1ENR_SPI2EN;
+    saved_cr1 = spi->cr1;
+    if (saved_cr1 & SPI_CR1_SPE)
+        spi_quiesce(spi);
+    gpio_configure_pin(gpiob, 13, AFO_pushpull(SPI_PIN_SPEED)); /* CK */
+    gpio_configure_pin(gpiob, 14, GPI_pull_up); /* MISO */
+    gpio_configure_pin(gpiob, 15, AFO_pushpull(SPI_PIN_SPEED)); /* MOSI */
+    spi->cr2 = 0;
+    spi->cr1 = NOR_CR1;
+    (void)spi->dr;
+    gpio_write_pin(CS_GPIO, PIN_CS, 0);
+}
+
+static void nor_release(void)
+{
+    spi_quiesce(spi);
+    gpio_write_pin(CS_GPIO, PIN_CS, 1);
+    spi->cr1 = saved_cr1;
+    if (!(saved_cr1 & SPI_CR1_SPE)) {
+        /* Leave the bus as sd_spi.c does when no card is present. */
+        gpio_configure_pin(gpiob, 13, GPI_pull_up); /* CK */
+        gpio_configure_pin(gpiob, 15, GPI_pull_up); /* MOSI */
+        rcc->apb1enr &= ~RCC_APB1ENR_SPI2EN;
+    }
+}
+
+static void nor_cmd(uint8_t cmd, uint32_t addr)
+{
+    spi_xmit8(spi, cmd);
+    spi_xmit8(spi, addr >> 16);
+    spi_xmit8(spi, addr >> 8);
+    spi_xmit8(spi, addr);
+    spi_quiesce(spi);
+}
+
+static void nor_simple_cmd(uint8_t cmd)
+{
+    nor_acquire();
+    spi_xmit8(spi, cmd);
+    nor_release();
+}
+
+static bool_t nor_busy(void)
+{
+    uint8_t sr;
+
+    nor_acquire();
+    spi_xmit8(spi, NOR_RDSR);
+    spi_quiesce(spi);
+    sr = spi_recv8(spi);
+    nor_release();
+
+    return !!(sr & SR_WIP);
+}
+
+/* Wait out a page program. Other threads run meanwhile: the caller holds
+ * the volume (see start_op() in volume.c), so none of them touches the bus. */
+static bool_t nor_wait(void)
+{
+    time_t t = time_now();
+
+    while (nor_busy()) {
+        if (time_since(t) > time_ms(10))
+            return FALSE;
+        thread_yield();
+    }
+    return TRUE;
+}
+
+static void nor_read(uint32_t addr, void *buf, uint16_t len)
+{
+    nor_acquire();
+    nor_cmd(NOR_READ, addr);
+    spi_16bit_frame(spi);
+    (void)spi_recv_block16(spi, buf, len, 0);
+    spi_8bit_frame(spi);
+    nor_release();
+}
+
+/* Program @len bytes at @addr, which must not cross a page boundary. */
+static bool_t nor_program(uint32_t addr, const void *buf, uint16_t len)
+{
+    nor_simple_cmd(NOR_WREN);
+    nor_acquire();
+    nor_cmd(NOR_PP, addr);
+    spi_16bit_frame(spi);
+    (void)spi_xmit_block16(spi, buf, len, 0);
+    spi_8bit_frame(spi);
+    nor_release();
+    return nor_wait();
+}
+
+/* Start erasing block @blk. Completes in the background: see nor_busy().
+ * Returns FALSE if the chip did not accept the command. */
+static bool_t nor_erase(uint16_t blk)
+{
+    nor_simple_cmd(NOR_WREN);
+    nor_acquire();
+    nor_cmd(NOR_SE, blk * NOR_BLK_SZ);
+    nor_release();
+    return nor_busy();
+}
+
+static void nor_probe(void)
+{
+    struct nor_blk_hdr hdr;
+    uint32_t max_seq = 0;
+    uint8_t id[3];
+    unsigned int i;
+
+    gpio_configure_pin(CS_GPIO, PIN_CS, GPO_pushpull(SPI_PIN_SPEED, HIGH));
+
+    nor_acquire();
+    spi_xmit8(spi, NOR_JEDEC);
+    spi_quiesce(spi);
+    for (i = 0; i < sizeof(id); i++)
+        id[i] = spi_recv8(spi);
+    nor_release();
+
+    /* Capacity is 2^id[2] bytes: 512kB to 16MB (24-bit addressing). The log
+     * must be longer than the window, so that erasing ahead never destroys
+     * indexed sectors. */
+    if ((id[0] == 0x00) || (id[0] == 0xff)
+        || (id[2] < 0x13) || (id[2] > 0x18)) {
+        gpio_configure_pin(CS_GPIO, PIN_CS, GPI_pull_up);
+        return;
+    }
+    nor.nr_blks = (1u << id[2]) / NOR_BLK_SZ;
+
+    /* Resume the log after the most recently started block. */
+    nor.blk = nor.nr_blks - 1;
+    for (i = 0; i < nor.nr_blks; i++) {
+        nor_read(i * NOR_BLK_SZ, &hdr, sizeof(hdr));
+        if ((hdr.sig == NOR_SIG) && (hdr.seq != NO_LBA)
+            && (hdr.seq >= max_seq)) {
+            max_seq = hdr.seq;
+            nor.blk = i;
+        }
+    }
+    nor.seq = max_seq;
+    nor.present = TRUE;
+
+    printk("NOR cache: %02x:%02x %u kB, log at block %u\n",
+           id[0], id[1], nor.nr_blks * (NOR_BLK_SZ/1024), nor.blk);
+}
+
+void nor_cache_reset(void)
+{
+    if (!nor.probed) {
+        nor.probed = TRUE;
+        nor_probe();
+    }
+    if (!nor.present)
+        return;
+
+    if (nor.hits || nor.fills)
+        printk("NOR cache: %u hits, %u fills\n", nor.hits, nor.fills);
+    nor.hits = nor.fills = 0;
+
+    memset(nor.lba, 0xff, sizeof(nor.lba));
+    memset(nor.ghost, 0xff, sizeof(nor.ghost));
+
+    /* Treat the current block as full, and erase ahead of it. The chip may
+     * still be busy with an erase from before: then try again later. */
+    nor.nr_used = NOR_SLOTS;
+    nor.erased = !nor_busy() && nor_erase((nor.blk + 1) % nor.nr_blks);
+}
+
+static bool_t nor_lookup(uint32_t lba, unsigned int *w, unsigned int *s)
+{
+    for (*w = 0; *w < NOR_WINDOW; (*w)++)
+        for (*s = 0; *s < NOR_SLOTS; (*s)++)
+            if (nor.lba[*w][*s] == lba)
+                return TRUE;
+    return FALSE;
+}
+
+static uint32_t slot_addr(unsigned int w, unsigned int s)
+{
+    return nor.win_blk[w] * NOR_BLK_SZ + (s + 1) * SECSZ;
+}
+
+bool_t nor_cache_read(LBA_t sector, void *buf)
+{
+    unsigned int w, s;
+
+    if (!nor.present || !nor_lookup(sector, &w, &s) || nor_busy())
+        return FALSE;
+
+    nor_read(slot_addr(w, s), buf, SECSZ);
+    nor.hits++;
+    return TRUE;
+}
+
+/* Move on to the erased block following the current one. */
+static bool_t nor_next_blk(void)
+{
+    struct nor_blk_hdr hdr;
+
+    if (nor_busy())
+        return FALSE;
+    if (!nor.erased) {
+        nor.erased = nor_erase((nor.blk + 1) % nor.nr_blks);
+        return FALSE;
+    }
+
+    nor.erased = FALSE;
+    nor.blk = (nor.blk + 1) % nor.nr_blks;
+    nor.win = (nor.win + 1) % NOR_WINDOW;
+    memset(nor.lba[nor.win], 0xff, sizeof(nor.lba[nor.win]));
+    nor.win_blk[nor.win] = nor.blk;
+    nor.nr_used = 0;
+
+    hdr.sig = NOR_SIG;
+    hdr.seq = ++nor.seq;
+    if (!nor_program(nor.blk * NOR_BLK_SZ, &hdr, sizeof(hdr))) {
+        nor.nr_used = NOR_SLOTS;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static bool_t nor_ghost_hit(uint32_t lba)
+{
+    unsigned int i;
+
+    for (i = 0; i < NOR_GHOSTS; i++)
+        if (nor.ghost[i] == lba)
+            return TRUE;
+    nor.ghost[nor.ghost_idx++ % NOR_GHOSTS] = lba;
+    return FALSE;
+}
+
+void nor_cache_fill(const void *buf, LBA_t sector, UINT count, bool_t meta)
+{
+    const uint8_t *p = buf;
+    unsigned int w, s, off;
+
+    if (!nor.present || (!meta && !nor_ghost_hit(sector)))
+        return;
+
+    for (count = min_t(UINT, count, NOR_FILL_MAX); count != 0; count--) {
+        if (!nor_lookup(sector, &w, &s)) {
+            if ((nor.nr_used == NOR_SLOTS) && !nor_next_blk())
+                return;
+            s = nor.nr_used++;
+            for (off = 0; off < SECSZ; off += NOR_PAGE_SZ)
+                if (!nor_program(slot_addr(nor.win, s) + off,
+                                 p + off, NOR_PAGE_SZ))
+                    return;
+            nor.lba[nor.win][s] = sector;
+            nor.fills++;
+            if (nor.nr_used == NOR_SLOTS)
+                nor.erased = nor_erase((nor.blk + 1) % nor.nr_blks);
+        }
+        sector++;
+        p += SECSZ;
+    }
+}
+
+void nor_cache_invalidate(LBA_t sector, UINT count)
+{
+    unsigned int w, s;
+
+    if (!nor.present)
+        return;
+
+    for (w = 0; w < NOR_WINDOW; w++)
+        for (s = 0; s < NOR_SLOTS; s++)
+            if ((nor.lba[w][s] - sector) < count)
+                nor.lba[w][s] = NO_LBA;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,128 @@
+/*
+ * prof.c
+ *
+ * Hot-path profiling via the Cortex-M DWT cycle counter.
+ *
+ * Each profiled site keeps min/avg/max cycle counts (or sampled values) and
+ * a histogram with base-4 buckets: bucket i counts samples in [4^i, 4^(i+1)).
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#define NR_BUCKETS 16
+
+static struct prof {
+    uint32_t nr, min, max, last;
+    uint64_t total;
+    uint32_t hist[NR_BUCKETS];
+} prof[PROF_NR];
+
+static const char * const prof_name[PROF_NR] = {
+    [PROF_rdata_dma]   = "rdata_dma",
+    [PROF_wdata_dma]   = "wdata_dma",
+    [PROF_read_track]  = "read_track",
+    [PROF_write_track] = "write_track",
+    [PROF_ring_io]     = "ring_io",
+    [PROF_vol_status]  = "vol_status",
+    [PROF_vol_read]    = "vol_read",
+    [PROF_vol_write]   = "vol_write",
+    [PROF_vol_ioctl]   = "vol_ioctl",
+    [PROF_rio_lat_us]  = "rio_lat_us",
+    [PROF_rio_batch]   = "rio_batch",
+    [PROF_rio_trail]   = "rio_trail"
+};
+
+void prof_init(void)
+{
+    dcb->demcr |= DCB_DEMCR_TRCENA;
+    dwt->cyccnt = 0;
+    dwt->ctrl |= DWT_CTRL_CYCCNTENA;
+    prof_reset();
+}
+
+void prof_record(unsigned int id, uint32_t cycles)
+{
+    struct prof *p = &prof[id];
+    unsigned int b;
+    uint32_t oldpri;
+
+    /* Sites may be preempted by one another. Each sample updates several
+     * fields, so keep it consistent with respect to prof_print(). */
+    oldpri = IRQ_save(RESET_IRQ_PRI+1);
+
+    if (cycles < p->min)
+        p->min = cycles;
+    if (cycles > p->max)
+        p->max = cycles;
+    p->last = cycles;
+    p->total += cycles;
+    p->nr++;
+    b = (31 - __builtin_clz(cycles | 1)) >> 1;
+    p->hist[b]++;
+
+    IRQ_restore(oldpri);
+}
+
+void prof_print(unsigned int id)
+{
+    struct prof p;
+    uint64_t total;
+    uint32_t oldpri, nr;
+    unsigned int i, n;
+
+    oldpri = IRQ_save(RESET_IRQ_PRI+1);
+    p = prof[id];
+    IRQ_restore(oldpri);
+
+    if (p.nr == 0) {
+        printk("%11s: -\n", prof_name[id]);
+        return;
+    }
+
+    /* Scale down to a 32-bit division: libgcc, which has the 64-bit one, is
+     * linked only into exfat=y builds. */
+    for (total = p.total, nr = p.nr; total >> 32; total >>= 1)
+        nr >>= 1;
+
+    printk("%11s: n=%u min=%u avg=%u max=%u", prof_name[id],
+           p.nr, p.min, nr ? (uint32_t)total / nr : p.max, p.max);
+    if (id >= PROF_first_value)
+        printk(" last=%u\n", p.last);
+    else
+        printk(" cycles\n");
+
+    /* Histogram: print only the span of non-empty buckets. */
+    for (i = 0; !p.hist[i]; i++)
+        continue;
+    for (n = NR_BUCKETS; !p.hist[n-1]; n--)
+        continue;
+    printk("  4^%u:", i);
+    for (; i < n; i++)
+        printk(" %u", p.hist[i]);
+    printk("\n");
+}
+
+void prof_reset(void)
+{
+    uint32_t oldpri;
+    unsigned int i;
+
+    oldpri = IRQ_save(RESET_IRQ_PRI+1);
+    memset(prof, 0, sizeof(prof));
+    for (i = 0; i < PROF_NR; i++)
+        prof[i].min = ~0u;
+    IRQ_restore(oldpri);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -76,6 +76,9 @@ void floppy_cancel(void)
     /* Deasserts /RY and turns off motor. */
     IRQx_set_pending(motor_irq);
 
+    floppy_stall_report();
+    perf_snapshot();
+
     /* Stop DMA + timer work. */
     IRQx_disable(dma_rdata_irq);
     IRQx_disable(dma_wdata_irq);
@@ -137,6 +140,8 @@ void floppy_init(void)
     write_pin(ready,  HIGH);
 
     floppy_init_irqs();
+    timer_dma_setup();
+    tim_rdata->ccr2 = sysclk_ns(1500); /* RD: 1.5us positive pulses */
 
     timer_init(&index.timer, index_assert, NULL);
 }
@@ -144,7 +149,8 @@ void floppy_init(void)
 static void io_thread_main(void *arg) {
     while (1) {
         F_async_drain();
-        thread_yield();
+        logfile_poll();
+        F_async_sleep();
     }
 }
 
@@ -154,7 +160,6 @@ void floppy_insert(unsigned int unit, struct slot *slot)
 
     timer_dma_init();
     thread_start(&drive.io_thread, _thread1_stacktop, io_thread_main, NULL);
-    tim_rdata->ccr2 = sysclk_ns(1500); /* RD: 1.5us positive pulses */
 
     /* Drive is ready. Set output signals appropriately. */
     write_pin(media, LOW);
@@ -171,9 +176,9 @@ static void floppy_unpause_window(struct drive *drv)
 {
     struct window *w = &window;
     unsigned int i, state_times[] = {
-        drv->image->qd.win_start - rd_before_ry,
+        drv->image->qd->win_start - rd_before_ry,
         rd_before_ry,
-        drv->image->qd.win_end - drv->image->qd.win_start,
+        drv->image->qd->win_end - drv->image->qd->win_start,
         rd_after_ry };
     uint32_t oldpri, pos = window.pause_pos;
     time_t t;
@@ -207,15 +212,15 @@ static void floppy_unpause_window(struct drive *drv)
 
 static void floppy_sync_flux(void)
 {
-    const uint16_t buf_mask = ARRAY_SIZE(dma_rd->buf) - 1;
+    const uint16_t buf_mask = dma_rd->len - 1;
     struct drive *drv = &drive;
     uint16_t nr_to_wrap, nr_to_cons, nr;
     uint32_t oldpri;
 
     /* No DMA should occur until the timer is enabled. */
-    ASSERT(dma_rd->cons == (ARRAY_SIZE(dma_rd->buf) - dma_rdata.cndtr));
+    ASSERT(dma_rd->cons == (dma_rd->len - dma_rdata.cndtr));
 
-    nr_to_wrap = ARRAY_SIZE(dma_rd->buf) - dma_rd->prod;
+    nr_to_wrap = dma_rd->len - dma_rd->prod;
     nr_to_cons = (dma_rd->cons - dma_rd->prod - 1) & buf_mask;
     nr = min(nr_to_wrap, nr_to_cons);
     if (nr) {
@@ -225,7 +230,7 @@ static void floppy_sync_flux(void)
     }
 
     nr = (dma_rd->prod - dma_rd->cons) & buf_mask;
-    if (nr < buf_mask)
+    if (nr < min_t(uint16_t, buf_mask, DMA_START_SAMPLES))
         return;
 
     if (window.paused)
@@ -276,7 +281,7 @@ static bool_t dma_rd_handle(struct drive *drv)
         dma_rd->state = DMA_inactive;
         /* Reinitialise the circular buffer to empty. */
         dma_rd->cons = dma_rd->prod =
-            ARRAY_SIZE(dma_rd->buf) - dma_rdata.cndtr;
+            dma_rd->len - dma_rdata.cndtr;
         /* Free-running index timer. */
         timer_cancel(&index.timer);
         timer_set(&index.timer, index.prev_time + drv->image->stk_per_rev);
@@ -293,6 +298,11 @@ void floppy_get_track(struct track_info *ti)
     ti->writing = (dma_wr && dma_wr->state != DMA_inactive);
 }
 
+bool_t floppy_idle(void)
+{
+    return FALSE;
+}
+
 static void index_assert(void *dat)
 {
     struct drive *drv = &drive;
@@ -305,7 +315,7 @@ static void index_assert(void *dat)
 
         /* Reset the window state machine to start over. */
         w->state = WIN_rdata_on;
-        timer_set(&w->timer, now + drv->image->qd.win_start - rd_before_ry);
+        timer_set(&w->timer, now + drv->image->qd->win_start - rd_before_ry);
 
     } else {
 
@@ -350,7 +360,7 @@ static void window_timer(void *_drv)
         if (motor.on)
             write_pin(ready, LOW);
         timer_set(&w->timer,
-                  now + drv->image->qd.win_end - drv->image->qd.win_start);
+                  now + drv->image->qd->win_end - drv->image->qd->win_start);
         break;
 
     case WIN_ready_off:
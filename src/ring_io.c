@@ -13,18 +13,77 @@
 #define BIT_GET(bf, i) ((bf)[(i)/32] & (1<<((i)&31)))
 #define BIT_SET(bf, i) {(bf)[(i)/32] |= (1<<((i)&31));}
 #define BIT_CLR(bf, i) {(bf)[(i)/32] &= ~(1<<((i)&31));}
-#define BIT_ANY(bf) (bf[0] | bf[1] | bf[2] | bf[3])
+#define BIT_ANY(bf) bit_any(rio, bf)
 
 #define RING_INIT ~0
 
 static void enqueue_io(struct ring_io *rio);
 
+/* Sector bitfields shared by all ring_io instances, one ring being active at
+ * a time. Sized at mount by ring_io_reserve(). */
+static struct {
+    uint32_t *p;
+    uint16_t words;
+} bitfields;
+
+/* Old contents of a partly overwritten sector, being read for merging. Not
+ * on the smallest parts, where writers instead wait on the whole read. */
+static uint8_t *merge_buf;
+
+void ring_io_reserve(uint32_t len)
+{
+    bitfields.words = (len/512 + 31) / 32;
+    bitfields.p = arena_alloc(2 * bitfields.words * sizeof(uint32_t));
+    merge_buf = (len >= 16*1024) ? arena_alloc(512) : NULL;
+}
+
+static uint32_t bit_any(struct ring_io *rio, const uint32_t *bf)
+{
+    uint32_t x = 0;
+    unsigned int i;
+    for (i = 0; i < rio->bf_words; i++)
+        x |= bf[i];
+    return x;
+}
+
+/* Hack inside the guts of FatFS. */
+void flashfloppy_wrote_sectors(FIL *fp, LBA_t sect, UINT cnt,
+                               const BYTE *buff);
+
+/* Final writeback of a ring abandoned by ring_io_detach(). Until it completes,
+ * its source data must stay put in the (now reinitialised) ring buffer. */
+static struct {
+    FOP fop;
+    bool_t pending;
+} detached;
+
+static bool_t detached_busy(void)
+{
+    if (detached.pending && F_async_isdone(detached.fop))
+        detached.pending = FALSE;
+    return detached.pending;
+}
+
+/* Media latency and consumer data rate, learned across ring_io instances. */
+static struct {
+    uint32_t lat_us; /* Average completion time of a batch. */
+    uint32_t rate;   /* Average consumer rate, bytes per ms. */
+    uint32_t wr_lat_us; /* Average completion time of a write batch. */
+    /* write-drain=adaptive: decisions made by ring_io_drain_eager(). */
+    uint16_t nr_eager, nr_deferred;
+} tune;
+
 void ring_io_init(struct ring_io *rio, FIL *fp, struct image_buf *read_data,
         FSIZE_t off, FSIZE_t shadow_off, uint16_t sec_len)
 {
+    unsigned int i, nr_bits;
+
     ASSERT(off % 512 == 0);
     ASSERT(shadow_off == ~0 || shadow_off % 512 == 0);
     memset(rio, 0, sizeof(*rio));
+    rio->unread_bitfield = bitfields.p;
+    rio->dirty_bitfield = bitfields.p + bitfields.words;
+    memset(bitfields.p, 0, 2 * bitfields.words * sizeof(uint32_t));
     rio->fp = fp;
     rio->read_data = read_data;
     rio->f_off = off;
@@ -43,12 +102,83 @@ void ring_io_init(struct ring_io *rio, FIL *fp, struct image_buf *read_data,
     rio->ring_off = RING_INIT;
     rio->batch_secs = 1;
     rio->trailing_secs = 0;
-    ASSERT(rio->ring_len <= RING_IO_MAX_RING_LEN);
+    nr_bits = rio->ring_len / 512 << (shadow_off == ~0 ? 0 : 1);
+    ASSERT(nr_bits <= bitfields.words * 32);
+    rio->bf_words = (nr_bits + 31) / 32;
 
-    for (int i = 0; i < rio->ring_len / 512 << (shadow_off == ~0 ? 0 : 1); i++)
+    for (i = 0; i < nr_bits; i++)
         BIT_SET(rio->unread_bitfield, i);
 }
 
+static void retune(struct ring_io *rio)
+{
+    uint32_t need, lo, hi, ring_secs = rio->ring_len / 512;
+    uint8_t batch, trailing;
+
+    if (!rio->max_batch_secs)
+        return;
+
+    /* Read-ahead must cover the data consumed while a batch is in flight.
+     * Allow a margin of 2x, and cap latency to avoid overflow. */
+    need = 2 * tune.rate * min_t(uint32_t, tune.lat_us, 1000000) / 1000;
+    need = (need + 511) / 512;
+
+    /* Leave room in the ring for one batch in flight and one being
+     * consumed. */
+    hi = min_t(uint32_t, rio->max_batch_secs, max_t(uint32_t, ring_secs/2, 1));
+    lo = min_t(uint32_t, rio->min_batch_secs, hi);
+    batch = max_t(uint32_t, lo, min_t(uint32_t, need, hi));
+
+    trailing = (ring_secs > 2*batch) ? min_t(uint32_t, ring_secs - 2*batch,
+                                             rio->max_trailing_secs) : 0;
+    trailing = max_t(uint8_t, trailing, rio->min_trailing_secs);
+
+    rio->batch_secs = batch;
+    rio->trailing_secs = trailing;
+    prof_value(rio_batch, batch);
+    prof_value(rio_trail, trailing);
+}
+
+void ring_io_tune(struct ring_io *rio, uint8_t min_batch, uint8_t max_batch,
+        uint8_t min_trailing, uint8_t max_trailing)
+{
+    ASSERT(min_batch && (min_batch <= max_batch));
+    ASSERT(min_trailing <= max_trailing);
+    rio->min_batch_secs = min_batch;
+    rio->max_batch_secs = max_batch;
+    rio->min_trailing_secs = min_trailing;
+    rio->max_trailing_secs = max_trailing;
+    retune(rio);
+}
+
+/* Called on completion of each read or write batch. */
+static void tune_io(struct ring_io *rio)
+{
+    struct image_buf *rd = rio->read_data;
+    time_t now = time_now();
+    uint32_t lat_us, rate, dt;
+
+    /* ring_io_sync() batches are not representative. */
+    if (rio->disable_reading)
+        return;
+
+    lat_us = time_diff(rio->io_start, now) / TIME_MHZ;
+    tune.lat_us = tune.lat_us ? (3*tune.lat_us + lat_us) / 4 : lat_us;
+    prof_value(rio_lat_us, lat_us);
+
+    /* Sample the consumer's progress since the previous completion. */
+    dt = time_diff(rio->tune_time, now) / TIME_MHZ;
+    if (rio->tune_sampled && (rd->cons > rio->tune_cons) && dt) {
+        rate = (rd->cons - rio->tune_cons) * 1000 / dt;
+        tune.rate = tune.rate ? (3*tune.rate + rate) / 4 : rate;
+    }
+    rio->tune_sampled = TRUE;
+    rio->tune_time = now;
+    rio->tune_cons = rd->cons;
+
+    retune(rio);
+}
+
 static void progress_io(struct ring_io *rio)
 {
     thread_yield();
@@ -65,6 +195,7 @@ static void register_fop_whendone(
     ASSERT(rio->fop_cb == NULL);
     rio->fop = fop;
     rio->fop_cb = cb;
+    rio->io_start = time_now();
     thread_yield(); /* Give fop a chance to start. */
 }
 
@@ -79,9 +210,38 @@ static void sync_complete(struct ring_io *rio)
 
 static void write_complete(struct ring_io *rio)
 {
+    /* Unlike tune_io(), include ring_io_sync() batches: they are what an
+     * eager drain waits on. */
+    uint32_t lat_us = time_diff(rio->io_start, time_now()) / TIME_MHZ;
+    tune.wr_lat_us = tune.wr_lat_us ? (3*tune.wr_lat_us + lat_us) / 4 : lat_us;
+    trace(rio_write_done, 0, rio->io_cnt, 0);
+    tune_io(rio);
     enqueue_io(rio);
 }
 
+/* Write @cnt sectors at file offset @off. As for file_read(), where the
+ * extent map allows, the write goes directly to the volume. The file size is
+ * fixed after mount, so FatFS has no cluster bookkeeping to do: only its file
+ * buffer must be kept coherent, and the file marked modified so that the next
+ * sync flushes the volume. A write that crosses a fragment boundary is left
+ * to FatFS. */
+static FOP file_write(struct ring_io *rio, FSIZE_t off, const void *buf,
+        uint8_t cnt)
+{
+    FIL *fp = rio->fp;
+    uint32_t nsec;
+    LBA_t lba;
+
+    if (rio->map && ((lba = image_extents_lba(rio->map, off, &nsec)) != 0)
+            && (nsec >= cnt)) {
+        flashfloppy_wrote_sectors(fp, lba, cnt, buf);
+        return disk_write_async(0, buf, lba, cnt);
+    }
+
+    F_lseek_async(fp, off);
+    return F_write_async(fp, buf, cnt * 512, NULL);
+}
+
 static void write_start(struct ring_io *rio)
 {
     struct image_buf *rd = rio->read_data;
@@ -90,6 +250,7 @@ static void write_start(struct ring_io *rio)
     bool_t has_shadow = rio->f_shadow_off != ~0;
     ASSERT(rio->sync_needed);
     ASSERT(BIT_ANY(rio->dirty_bitfield));
+    ASSERT(!rio->z);
     /* Since seeks can rewind the reader, check for writes past the producer. */
     cons = rio->wd_cons;
     while (cons + 511 < rd->prod) {
@@ -100,11 +261,7 @@ static void write_start(struct ring_io *rio)
             break;
         cons += 512;
     }
-    if (0) printk("dirty: %08x %08x %08x %08x\n",
-            rio->dirty_bitfield[3],
-            rio->dirty_bitfield[2],
-            rio->dirty_bitfield[1],
-            rio->dirty_bitfield[0]);
+    if (0) printk("dirty: %08x\n", rio->dirty_bitfield[0]);
 
     /* Find contiguous write. */
     /* Do not take into account wd_prod, because there may be a partial sector
@@ -112,7 +269,8 @@ static void write_start(struct ring_io *rio)
     max_io_cnt = min_t(uint32_t,
             (rio->ring_len - cons % rio->ring_len) / 512,
             (rio->f_len - ring_io_pos(rio, cons)) / 512);
-    max_io_cnt = min_t(uint8_t, rio->batch_secs, max_io_cnt);
+    max_io_cnt = min_t(uint8_t, (rio->hold_writes && rio->sync_requested)
+                       ? 255 : rio->batch_secs, max_io_cnt);
     ASSERT(max_io_cnt);
 
     /* Check primary ring. */
@@ -126,9 +284,9 @@ static void write_start(struct ring_io *rio)
     }
 
     if (rio->io_cnt) {
-        F_lseek_async(rio->fp, rio->f_off + ring_io_pos(rio, cons));
-        fop = F_write_async(rio->fp, rd->p + cons % rio->ring_len,
-                rio->io_cnt * 512, NULL);
+        trace(rio_write, 0, rio->io_cnt, rio->f_off + ring_io_pos(rio, cons));
+        fop = file_write(rio, rio->f_off + ring_io_pos(rio, cons),
+                rd->p + cons % rio->ring_len, rio->io_cnt);
         register_fop_whendone(rio, fop, write_complete);
         return;
     }
@@ -144,66 +302,172 @@ static void write_start(struct ring_io *rio)
         BIT_CLR(rio->dirty_bitfield, start_bit + rio->io_cnt);
     }
     ASSERT(rio->io_cnt);
-    F_lseek_async(rio->fp, rio->f_shadow_off + ring_io_pos(rio, cons));
-    fop = F_write_async(rio->fp,
-            rd->p + rio->ring_len + cons % rio->ring_len,
-            rio->io_cnt * 512, NULL);
+    trace(rio_write, 1, rio->io_cnt,
+          rio->f_shadow_off + ring_io_pos(rio, cons));
+    fop = file_write(rio, rio->f_shadow_off + ring_io_pos(rio, cons),
+            rd->p + rio->ring_len + cons % rio->ring_len, rio->io_cnt);
     register_fop_whendone(rio, fop, write_complete);
 }
 
 static void read_complete(struct ring_io *rio)
 {
+    trace(rio_read_done, 0, rio->io_cnt, 0);
+    if (rio->z)
+        zimg_read_done(rio->z);
     for (int i = 0; i < rio->io_cnt; i++)
         BIT_CLR(rio->unread_bitfield, rio->io_idx + i);
+    tune_io(rio);
+    enqueue_io(rio);
+}
+
+/* The old tail of the covered sector is in: merge it beneath the new data,
+ * unless the writer has since completed the sector itself. */
+static void merge_complete(struct ring_io *rio)
+{
+    struct image_buf *rd = rio->read_data;
+    trace(rio_read_done, 0, 1, 0);
+    if (rio->cover_len) {
+        memcpy((uint8_t *)rd->p + rio->cover_idx*512 + rio->cover_len,
+               merge_buf + rio->cover_len, 512 - rio->cover_len);
+        BIT_CLR(rio->unread_bitfield, rio->cover_idx);
+        rio->cover_len = 0;
+    }
     enqueue_io(rio);
 }
 
+static void cancel_read(struct ring_io *rio)
+{
+    F_async_cancel(rio->fop);
+    F_async_wait(rio->fop);
+    rio->fop_cb = NULL;
+    if (rio->z)
+        zimg_read_abort(rio->z);
+}
+
+/* Read @*cnt sectors at file offset @off. A compressed container is read a
+ * block at a time: the read is truncated at the end of the block. Otherwise,
+ * where the extent map allows, issue the read directly to the volume: this
+ * skips FatFS's per-seek cluster walk. The read is then truncated at the end
+ * of the fragment. All ring_io writes are whole aligned sectors, so FatFS's
+ * file buffer never holds dirty data that such a read would miss. */
+static FOP file_read(struct ring_io *rio, FSIZE_t off, void *buf,
+        uint8_t *cnt)
+{
+    uint32_t nsec;
+    LBA_t lba;
+
+    if (rio->z)
+        return zimg_read_async(rio->z, off, buf, cnt);
+
+    if (rio->map && (lba = image_extents_lba(rio->map, off, &nsec)) != 0) {
+        *cnt = min_t(uint32_t, *cnt, nsec);
+        return disk_read_async(0, buf, lba, *cnt);
+    }
+
+    F_lseek_async(rio->fp, off);
+    return F_read_async(rio->fp, buf, *cnt * 512, NULL);
+}
+
+/* Returns the first position at or after @prod whose sector in @ring (0 is
+ * the primary ring, 1 the shadow) is not yet read. */
+static uint32_t advance_prod(struct ring_io *rio, uint32_t prod,
+        unsigned int ring)
+{
+    uint32_t base = ring ? rio->ring_len/512 : 0;
+    while (rio->rd_valid + rio->ring_len > prod) {
+        uint32_t i = (prod % rio->ring_len) / 512;
+        if (BIT_GET(rio->unread_bitfield, base + i))
+            break;
+        prod += 512;
+    }
+    return prod;
+}
+
+static void merge_start(struct ring_io *rio)
+{
+    uint8_t cnt = 1;
+    FOP fop = file_read(rio, rio->cover_off, merge_buf, &cnt);
+    trace(rio_read, 0, 1, rio->cover_off);
+    register_fop_whendone(rio, fop, merge_complete);
+}
+
+/* Is writeback held (hold_writes) until the final flush? Held data is
+ * released early once it spans half the ring. */
+static bool_t write_held(struct ring_io *rio)
+{
+    struct image_buf *rd = rio->read_data;
+    /* Leave room for read-ahead, unless the whole file is buffered. */
+    uint32_t max = (rio->ring_len == rio->f_len)
+        ? rio->ring_len : rio->ring_len/2;
+    return rio->hold_writes && !rio->sync_requested
+        && (rd->cons < rio->wd_cons + max);
+}
+
+/* A claiming writer needs read data only for the sector it is blocked on:
+ * one it did not overwrite from the start. */
+static bool_t read_deferred(struct ring_io *rio)
+{
+    struct image_buf *rd = rio->read_data;
+    if (!rio->writing || !rio->claiming || !merge_buf)
+        return FALSE;
+    return (rd->prod >= rd->cons)
+        || (rio->cover_len
+            && (rio->cover_idx == ring_io_idx(rio, rd->prod) / 512));
+}
+
 static void read_start(struct ring_io *rio)
 {
     struct image_buf *rd = rio->read_data;
     FOP fop;
-    uint32_t max_io_cnt;
-    if (0) printk("unread: %08x %08x %08x %08x\n",
-            rio->unread_bitfield[3],
-            rio->unread_bitfield[2],
-            rio->unread_bitfield[1],
-            rio->unread_bitfield[0]);
+    uint32_t max_io_cnt, prod, lead, alt_lead;
+    unsigned int ring = rio->shadow_active;
+    FSIZE_t off;
+    if (0) printk("unread: %08x\n", rio->unread_bitfield[0]);
+
+    /* The rings are filled independently. Serve the ring in use first, but
+     * once it is a couple of batches ahead of the consumer, bring the other
+     * ring level so that a side switch finds its data already buffered. */
+    prod = rd->prod;
+    if ((rio->f_shadow_off != ~0) && !(rio->writing && rio->claiming)) {
+        uint32_t cons = rd->cons & ~511;
+        lead = prod - min_t(uint32_t, prod, cons);
+        alt_lead = rio->alt_prod - min_t(uint32_t, rio->alt_prod, cons);
+        if ((rio->rd_valid + rio->ring_len > rio->alt_prod)
+                && ((rio->rd_valid + rio->ring_len <= prod)
+                    || ((lead >= 2 * rio->batch_secs * 512)
+                        && (alt_lead < lead)))) {
+            prod = rio->alt_prod;
+            ring ^= 1;
+        }
+    }
 
     /* Find contiguous read. */
     max_io_cnt = min_t(uint32_t,
-            rio->ring_len - rd->prod % rio->ring_len,
-            rio->f_len - ring_io_pos(rio, rd->prod)) / 512;
+            rio->ring_len - prod % rio->ring_len,
+            rio->f_len - ring_io_pos(rio, prod)) / 512;
     max_io_cnt = min_t(uint8_t, max_io_cnt,
-            (rio->rd_valid + rio->ring_len - rd->prod) / 512);
+            (rio->rd_valid + rio->ring_len - prod) / 512);
     max_io_cnt = min_t(uint8_t, rio->batch_secs, max_io_cnt);
     ASSERT(max_io_cnt);
 
-    /* Check primary ring. */
-    rio->io_idx = (rd->prod % rio->ring_len) / 512;
+    rio->io_idx = (prod % rio->ring_len) / 512
+        + (ring ? rio->ring_len/512 : 0);
     for (rio->io_cnt = 0; rio->io_cnt < max_io_cnt; rio->io_cnt++) {
         if (!BIT_GET(rio->unread_bitfield, rio->io_idx + rio->io_cnt))
             break;
+        if (rio->cover_len && (rio->io_idx + rio->io_cnt == rio->cover_idx))
+            break;
     }
-    if (rio->io_cnt) {
-        F_lseek_async(rio->fp, rio->f_off + ring_io_pos(rio, rd->prod));
-        fop = F_read_async(rio->fp, rd->p + rd->prod % rio->ring_len,
-                rio->io_cnt * 512, NULL);
-        register_fop_whendone(rio, fop, read_complete);
+    if (rio->io_cnt == 0) {
+        /* The reader has caught up with a partly overwritten sector. */
+        merge_start(rio);
         return;
     }
-    ASSERT(rio->f_shadow_off != ~0);
-
-    /* There must be a shadow ring read necessary. */
-    rio->io_idx += rio->ring_len/512;
-    for (rio->io_cnt = 0; rio->io_cnt < max_io_cnt; rio->io_cnt++) {
-        if (!BIT_GET(rio->unread_bitfield, rio->io_idx + rio->io_cnt))
-            break;
-    }
-    ASSERT(rio->io_cnt);
-    F_lseek_async(rio->fp, rio->f_shadow_off + ring_io_pos(rio, rd->prod));
-    fop = F_read_async(rio->fp,
-            rd->p + rio->ring_len + rd->prod % rio->ring_len,
-            rio->io_cnt * 512, NULL);
+    off = (ring ? rio->f_shadow_off : rio->f_off) + ring_io_pos(rio, prod);
+    fop = file_read(rio, off,
+            rd->p + (ring ? rio->ring_len : 0) + prod % rio->ring_len,
+            &rio->io_cnt);
+    trace(rio_read, ring, rio->io_cnt, off);
     register_fop_whendone(rio, fop, read_complete);
 }
 
@@ -240,6 +504,8 @@ static void enqueue_io(struct ring_io *rio)
     if (rd->prod + rio->batch_secs * 512 < cons)
         /* Jump forward. */
         rd->prod = cons;
+    if (has_shadow && (rio->alt_prod + rio->batch_secs * 512 < cons))
+        rio->alt_prod = cons;
 
     if (rio->ring_len == rio->f_len)
         /* Fully buffered, so no need to BIT_SET unread_bitfield. */
@@ -259,22 +525,30 @@ static void enqueue_io(struct ring_io *rio)
         }
     }
 
-    /* Advance read cursor past already read blocks. */
-    while (rio->rd_valid + rio->ring_len > rd->prod) {
-        uint32_t i = (rd->prod % rio->ring_len) / 512;
-        if (BIT_GET(rio->unread_bitfield, i))
-            break;
-        if (has_shadow && BIT_GET(rio->unread_bitfield, i + rio->ring_len/512))
-            break;
-        rd->prod += 512;
+    /* Advance read cursors past already read blocks. */
+    rd->prod = advance_prod(rio, rd->prod, rio->shadow_active);
+    if (has_shadow)
+        rio->alt_prod = advance_prod(
+            rio, max_t(uint32_t, rio->alt_prod, rio->rd_valid),
+            !rio->shadow_active);
+
+    if (rio->cover_len && BIT_GET(rio->dirty_bitfield, rio->cover_idx)) {
+        /* A partly overwritten sector is due for writeback. */
+        merge_start(rio);
+        return;
     }
 
-    if (!rio->disable_reading && rio->rd_valid + rio->ring_len > rd->prod) {
+    if (!rio->disable_reading && !read_deferred(rio)
+            && ((rio->rd_valid + rio->ring_len > rd->prod)
+                || (has_shadow
+                    && (rio->rd_valid + rio->ring_len > rio->alt_prod)))) {
         read_start(rio);
         return;
     }
 
     if (rio->sync_needed) {
+        if (write_held(rio))
+            return;
         if (BIT_ANY(rio->dirty_bitfield))
             write_start(rio);
         else if (rio->sync_requested)
@@ -288,6 +562,8 @@ void ring_io_sync(struct ring_io *rio)
     struct image_buf *rd = rio->read_data;
     uint8_t batch_secs = rio->batch_secs;
     ASSERT(!rio->writing || rio->wd_prod == rd->cons); /* Missing a flush? */
+    while (detached_busy())
+        thread_yield();
     /* Write out as quickly as possible. Avoid lingering reads, as the caller
      * will likely call ring_io_init() just after this.  */
     rio->disable_reading = TRUE;
@@ -301,10 +577,96 @@ void ring_io_sync(struct ring_io *rio)
     rio->disable_reading = FALSE;
 }
 
+void ring_io_detach(struct ring_io *rio)
+{
+    struct image_buf *rd = rio->read_data;
+    ASSERT(!rio->writing || rio->wd_prod == rd->cons); /* Missing a flush? */
+    /* Only one ring may be detached at a time. */
+    while (detached_busy())
+        thread_yield();
+    if (rio->fop_cb == read_complete) {
+        /* Reads into the abandoned ring are wasted I/O. */
+        cancel_read(rio);
+    }
+    /* Write out in the largest batches possible, but leave the last batch,
+     * and the file sync queued behind it, in flight. The async scheduler
+     * orders reads into the same memory after them. */
+    rio->disable_reading = TRUE;
+    rio->batch_secs = 255;
+    if (rio->sync_needed)
+        rio->sync_requested = TRUE;
+    for (;;) {
+        if (rio->fop_cb == NULL)
+            enqueue_io(rio);
+        if (rio->fop_cb == NULL)
+            break;
+        if (!BIT_ANY(rio->dirty_bitfield)) {
+            detached.fop = (rio->fop_cb == sync_complete)
+                ? rio->fop : F_sync_async(rio->fp);
+            detached.pending = TRUE;
+            rio->fop_cb = NULL;
+            break;
+        }
+        progress_io(rio);
+    }
+}
+
+bool_t ring_io_drain_eager(struct ring_io *rio, uint32_t budget_us)
+{
+    bool_t eager;
+
+    /* Nothing to drain? Then there is no decision to make. */
+    if (!rio->sync_needed)
+        return TRUE;
+
+    /* Until a write has been timed, assume the media is fast. */
+    eager = (tune.wr_lat_us <= budget_us);
+    if (eager)
+        tune.nr_eager++;
+    else
+        tune.nr_deferred++;
+    return eager;
+}
+
+void ring_io_write_stats(uint32_t *lat_us, uint16_t *nr_eager,
+                         uint16_t *nr_deferred)
+{
+    *lat_us = tune.wr_lat_us;
+    *nr_eager = tune.nr_eager;
+    *nr_deferred = tune.nr_deferred;
+}
+
+void ring_io_stats(void)
+{
+    if (!tune.wr_lat_us)
+        return;
+    printk("ring_io: write batch avg %u us", tune.wr_lat_us);
+    if (tune.nr_eager | tune.nr_deferred)
+        printk(", drain eager %u deferred %u",
+               tune.nr_eager, tune.nr_deferred);
+    printk("\n");
+    tune.nr_eager = tune.nr_deferred = 0;
+}
+
+bool_t ring_io_idle(struct ring_io *rio)
+{
+    return (rio->fop_cb == NULL)
+        && !detached_busy()
+        && (rio->ring_len == rio->f_len)
+        && !rio->sync_needed
+        && !BIT_ANY(rio->unread_bitfield);
+}
+
 void ring_io_shutdown(struct ring_io *rio)
 {
     if (rio->fop_cb == NULL)
         return;
+    if (rio->fop_cb == read_complete) {
+        /* The ring is being abandoned, e.g. stepped past: a read that is yet
+         * to run is wasted I/O. Its sectors simply remain unread. */
+        cancel_read(rio);
+        return;
+    }
     F_async_wait(rio->fop);
 }
 
@@ -312,12 +674,14 @@ void ring_io_seek(
         struct ring_io *rio, uint32_t pos, bool_t writing, bool_t shadow)
 {
     struct image_buf *rd = rio->read_data;
-    bool_t has_shadow = rio->f_shadow_off != ~0;
     ASSERT(!rio->writing || rio->wd_prod == rd->cons); /* Missing a flush? */
     ASSERT(!shadow || rio->f_shadow_off != ~0);
 
     rio->writing = writing;
+    if (!writing)
+        rio->claiming = FALSE;
     rio->shadow_active = shadow;
+    rio->tune_sampled = FALSE;
     if (rio->ring_off == RING_INIT) {
         rd->prod = rio->rd_valid = 0;
         rd->cons = pos % 512;
@@ -329,15 +693,11 @@ void ring_io_seek(
         rd->cons = rio->rd_valid + pos - valid_pos;
         rd->prod = rd->cons & ~511;
     }
-    /* Advance read cursor past already read blocks. */
-    while (rio->rd_valid + rio->ring_len > rd->prod) {
-        uint32_t i = (rd->prod % rio->ring_len) / 512;
-        if (BIT_GET(rio->unread_bitfield, i))
-            break;
-        if (has_shadow && BIT_GET(rio->unread_bitfield, i + rio->ring_len/512))
-            break;
-        rd->prod += 512;
-    }
+    /* Advance read cursors past already read blocks. The rings are read
+     * independently, so this promotes the shadow ring's buffered data
+     * straight into rd->prod on a side switch. */
+    rio->alt_prod = rd->prod;
+    rd->prod = advance_prod(rio, rd->prod, shadow);
     if (writing) {
         rio->wd_prod = rd->cons;
         if (!rio->sync_needed)
@@ -368,7 +728,7 @@ static void flush(struct ring_io *rio, bool_t partial)
     enqueue_io(rio);
 }
 
-void ring_io_progress(struct ring_io *rio)
+static void __ring_io_progress(struct ring_io *rio)
 {
     struct image_buf *rd = rio->read_data;
     if (rio->writing && rio->wd_prod < rd->cons) {
@@ -396,7 +756,10 @@ void ring_io_progress(struct ring_io *rio)
             && rd->cons >= rio->ring_len
             && rio->rd_valid >= rio->ring_len) {
         rd->prod -= rio->ring_len;
+        rio->alt_prod = max_t(uint32_t, rio->alt_prod, rio->rd_valid)
+            - rio->ring_len;
         rd->cons -= rio->ring_len;
+        rio->tune_cons -= min_t(uint32_t, rio->tune_cons, rio->ring_len);
         rio->rd_valid -= rio->ring_len;
         rio->ring_off += rio->ring_len;
         if (rio->ring_off >= rio->f_len)
@@ -404,6 +767,99 @@ void ring_io_progress(struct ring_io *rio)
     }
 }
 
+void ring_io_progress(struct ring_io *rio)
+{
+    PROF(ring_io, __ring_io_progress(rio));
+}
+
+uint32_t ring_io_writable(struct ring_io *rio, uint32_t len)
+{
+    struct image_buf *rd = rio->read_data;
+    uint32_t pos = rd->cons, end = rd->cons + len;
+    ASSERT(rio->writing);
+
+    /* The buffer may still be source data for a detached writeback. */
+    if (detached_busy())
+        return 0;
+
+    rio->claiming = TRUE;
+
+    while (pos < end) {
+        uint32_t blk = pos & ~511, n;
+        uint32_t i = ring_io_idx(rio, blk) / 512;
+        if (blk >= rio->rd_valid + rio->ring_len)
+            break;
+        n = min_t(uint32_t, blk + 512, end) - blk;
+        if (BIT_GET(rio->unread_bitfield, i)) {
+            /* Claim the sector only if written from its start, and no read
+             * into it is in flight. */
+            if ((rio->fop_cb == read_complete)
+                    && (i >= rio->io_idx) && (i < rio->io_idx + rio->io_cnt))
+                break;
+            if (rio->cover_len && (i == rio->cover_idx)) {
+                /* Extending the covered sector. */
+                if (pos != blk + rio->cover_len)
+                    break;
+            } else if (pos != blk) {
+                break;
+            } else if ((n != 512) && (rio->cover_len || !merge_buf
+                                      || (rio->fop_cb == merge_complete))) {
+                /* One partly written sector at a time. */
+                break;
+            }
+            if (n == 512) {
+                BIT_CLR(rio->unread_bitfield, i);
+                if (rio->cover_len && (i == rio->cover_idx))
+                    rio->cover_len = 0;
+            } else {
+                rio->cover_idx = i;
+                rio->cover_len = n;
+                rio->cover_off = (rio->shadow_active ? rio->f_shadow_off
+                                  : rio->f_off) + ring_io_pos(rio, blk);
+            }
+        }
+        pos = blk + n;
+    }
+
+    return pos - rd->cons;
+}
+
+bool_t ring_io_buffered(struct ring_io *rio, uint32_t len)
+{
+    struct image_buf *rd = rio->read_data;
+    uint32_t blk;
+
+    /* The buffer may still be source data for a detached writeback. */
+    if (detached_busy())
+        return FALSE;
+
+    /* NB. Sectors claimed by ring_io_writable() are not unread, but hold no
+     * old data: this is only valid for data not yet claimed. */
+    for (blk = rd->cons & ~511; blk < rd->cons + len; blk += 512) {
+        if ((blk >= rio->rd_valid + rio->ring_len)
+                || BIT_GET(rio->unread_bitfield, ring_io_idx(rio, blk) / 512))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+void ring_io_rewrite(struct ring_io *rio, const void *src, uint32_t len)
+{
+    struct image_buf *rd = rio->read_data;
+    uint8_t *dst = (uint8_t *)rd->p + ring_io_idx(rio, rd->cons);
+    ASSERT(rio->writing);
+
+    if ((rio->wd_prod == rd->cons) && !memcmp(dst, src, len)) {
+        /* Unchanged: pass over it without marking sectors dirty. */
+        rd->cons += len;
+        rio->wd_prod = rd->cons;
+    } else {
+        memcpy(dst, src, len);
+        rd->cons += len;
+    }
+}
+
 void ring_io_flush(struct ring_io *rio)
 {
     if (rio->writing) {
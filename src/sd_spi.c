@@ -20,6 +20,12 @@
 #define SPI_PIN_SPEED _10MHz
 #endif
 
+/* Marginal cards and wiring are slowed down as far as this on errors. */
+#define SLOWEST_SPEED_DIV SPI_CR1_BR_DIV16 /* 2.25MHz */
+
+/* Sectors read, CRC-checked, to validate the SPI clock at start of day. */
+#define PROBE_SECS 16
+
 #if 0
 #define TRC(f, a...) printk("SD: " f, ## a)
 #else
@@ -47,6 +53,11 @@ static DSTATUS status = STA_NOINIT;
 #define CT_SDHC (CT_BLOCK | CT_SD2) /* SDHC is v2.xx and fixed-block-size */
 static uint8_t cardtype;
 
+/* SPI configuration, less the baud-rate divider, which is adjusted at run
+ * time: see slow_down(). */
+static uint32_t spi_cr1;
+static uint32_t spi_div;
+
 #define spi spi2
 #define PIN_CS 12
 
@@ -173,9 +184,9 @@ static uint8_t send_cmd(uint8_t cmd, uint32_t arg)
 
 static bool_t datablock_recv(BYTE *buff, uint16_t bytes)
 {
-    uint8_t token = 0, _crc[2];
+    uint8_t token = 0;
     uint32_t start = stk_now();
-    uint16_t todo, w, crc;
+    uint16_t crc;
 
     /* Wait 100ms for data to be ready. */
     do {
@@ -188,18 +199,18 @@ static bool_t datablock_recv(BYTE *buff, uint16_t bytes)
 
     spi_16bit_frame(spi);
 
-    /* Grab the data. */
-    for (todo = bytes; todo != 0; todo -= 2) {
-        w = spi_recv16(spi);
-        *buff++ = w >> 8;
-        *buff++ = w;
+    /* Grab the data, computing its CRC on the fly. */
+    if (buff != NULL) {
+        crc = spi_recv_block16(spi, buff, bytes, 0);
+    } else {
+        /* Test read: discard the data, checking only its CRC. */
+        uint8_t scratch[32];
+        for (crc = 0; bytes != 0; bytes -= sizeof(scratch))
+            crc = spi_recv_block16(spi, scratch, sizeof(scratch), crc);
     }
 
     /* Retrieve and check the CRC. */
-    w = spi_recv16(spi);
-    _crc[0] = w >> 8;
-    _crc[1] = w;
-    crc = crc16_ccitt(_crc, 2, crc16_ccitt(buff-bytes, bytes, 0));
+    crc ^= spi_recv16(spi);
     spi_quiesce(spi);
 
     spi_8bit_frame(spi);
@@ -209,8 +220,8 @@ static bool_t datablock_recv(BYTE *buff, uint16_t bytes)
 
 static bool_t datablock_xmit(const BYTE *buff, uint8_t token)
 {
-    uint8_t res, wc = 0;
-    uint16_t crc = buff ? crc16_ccitt(buff, 512, 0) : 0;
+    uint8_t res;
+    uint16_t crc;
 
     if ((res = wait_ready()) != 0xff)
         return FALSE;
@@ -224,12 +235,8 @@ static bool_t datablock_xmit(const BYTE *buff, uint8_t token)
 
     spi_16bit_frame(spi);
 
-    /* Send the data. */
-    do {
-        uint16_t w = (uint16_t)*buff++ << 8;
-        w |= *buff++;
-        spi_xmit16(spi, w);
-    } while (--wc);
+    /* Send the data, computing its CRC on the fly. */
+    crc = spi_xmit_block16(spi, buff, 512, 0);
 
     /* Send the CRC. */
     spi_quiesce(spi);
@@ -269,6 +276,47 @@ out:
     spi_release();
 }
 
+static void set_speed(uint32_t div)
+{
+    spi_div = div;
+    spi->cr1 = spi_cr1 | div;
+}
+
+/* Step the SPI clock down after a transfer error, which on these cards is
+ * most often down to signal integrity. Returns FALSE at the slowest speed. */
+static bool_t slow_down(void)
+{
+    if (spi_div >= SLOWEST_SPEED_DIV)
+        return FALSE;
+    set_speed(spi_div + SPI_CR1_BR_DIV4);
+    printk("SD: Slowing to %ukHz\n", 18000u >> (spi_div >> 3));
+    return TRUE;
+}
+
+/* Multi-block read at the current SPI clock, checked against the data CRCs
+ * sent by the card. */
+static bool_t test_read(void)
+{
+    unsigned int todo = PROBE_SECS;
+
+    if (send_cmd(CMD(18), 0) == 0) {
+        while (datablock_recv(NULL, 512) && --todo)
+            continue;
+        send_cmd(CMD(12), 0);
+    }
+    spi_release();
+
+    return !todo;
+}
+
+/* Find the fastest clock at which the card reads back cleanly. */
+static void probe_speed(void)
+{
+    set_speed(DEFAULT_SPEED_DIV);
+    while (!test_read() && slow_down())
+        continue;
+}
+
 static bool_t sd_inserted(void)
 {
     return gpio_read_pin(gpioc, 9);
@@ -276,7 +324,7 @@ static bool_t sd_inserted(void)
 
 static DSTATUS sd_disk_initialize(BYTE pdrv)
 {
-    uint32_t start, cr1;
+    uint32_t start;
     uint16_t rcv;
     uint8_t i;
 
@@ -298,10 +346,10 @@ static DSTATUS sd_disk_initialize(BYTE pdrv)
 
     /* Configure SPI: 8-bit mode, MSB first, CPOL Low, CPHA Leading Edge. */
     spi->cr2 = 0;
-    cr1 = (SPI_CR1_MSTR | /* master */
-           SPI_CR1_SSM | SPI_CR1_SSI | /* software NSS */
-           SPI_CR1_SPE);
-    spi->cr1 = cr1 | SPI_CR1_BR_DIV128; /* ~281kHz (<400kHz) */
+    spi_cr1 = (SPI_CR1_MSTR | /* master */
+               SPI_CR1_SSM | SPI_CR1_SSI | /* software NSS */
+               SPI_CR1_SPE);
+    set_speed(SPI_CR1_BR_DIV128); /* ~281kHz (<400kHz) */
 
     /* Drain SPI I/O. */
     spi_quiesce(spi);
@@ -383,8 +431,8 @@ out:
 
     if (!(status & STA_NOINIT)) {
         delay_us(10); /* XXX small delay here stops SPI getting stuck?? */
-        spi->cr1 = cr1 | DEFAULT_SPEED_DIV;
-        printk("SD Card configured\n");
+        probe_speed();
+        printk("SD Card configured (%ukHz)\n", 18000u >> (spi_div >> 3));
         dump_cid_info();
     } else {
         /* Disable SPI. */
@@ -415,6 +463,9 @@ static DRESULT handle_sd_result(DRESULT res)
     return res;
 }
 
+/* Set by sd_disk_abort(): stop the multi-block read in progress. */
+static volatile bool_t read_abort;
+
 static DRESULT sd_disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count)
 {
     uint8_t retry = 0;
@@ -429,7 +480,12 @@ static DRESULT sd_disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count)
     if (!(cardtype & CT_BLOCK))
         sector <<= 9;
 
+    read_abort = FALSE;
     do {
+        /* Retry at a slower clock. */
+        if (retry)
+            slow_down();
+
         todo = count;
         p = buff;
 
@@ -437,20 +493,33 @@ static DRESULT sd_disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count)
         if (send_cmd(CMD((count > 1) ? 18 : 17), sector) != 0)
             continue;
 
-        while (datablock_recv(p, 512) && --todo)
+        /* datablock_recv() yields, so an abort can arrive between blocks. */
+        while (datablock_recv(p, 512) && --todo && !read_abort)
             p += 512;
 
-        /* STOP_TRANSMISSION */
+        /* STOP_TRANSMISSION: the card is then ready for the next command,
+         * whether or not the read ran to completion. */
         if (count > 1)
             send_cmd(CMD(12), 0);
 
         spi_release();
 
+        if (todo && read_abort) {
+            /* The card is fine: do not disallow further operations. */
+            printk("SD: Read aborted\n");
+            return RES_ERROR;
+        }
+
     } while (todo && (++retry < 3));
 
     return handle_sd_result(todo ? RES_ERROR : RES_OK);
 }
 
+static void sd_disk_abort(void)
+{
+    read_abort = TRUE;
+}
+
 static DRESULT sd_disk_write(
     BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count)
 {
@@ -467,6 +536,10 @@ static DRESULT sd_disk_write(
         sector <<= 9;
 
     do {
+        /* Retry at a slower clock. */
+        if (retry)
+            slow_down();
+
         todo = count;
         p = buff;
 
@@ -540,6 +613,7 @@ struct volume_ops sd_ops = {
     .read = sd_disk_read,
     .write = sd_disk_write,
     .ioctl = sd_disk_ioctl,
+    .abort = sd_disk_abort,
     .connected = sd_connected,
     .readonly = sd_readonly
 };
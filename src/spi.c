@@ -45,6 +45,55 @@ uint16_t spi_xchg16(SPI spi, uint16_t out)
     return spi->dr;
 }
 
+/* Receive a block of 16-bit frames, MSB first, into @buf. Exactly one frame
+ * is in flight at any time, so the receiver cannot overrun, but the next
+ * frame is started before the current one is stored and checksummed. This
+ * overlaps the CRC computation with the SPI transfer. Returns the CRC16-CCITT
+ * of the block, continued from @crc. */
+uint16_t spi_recv_block16(SPI spi, void *buf, uint16_t bytes, uint16_t crc)
+{
+    uint8_t *p = buf;
+    uint16_t w;
+
+    while (!(spi->sr & SPI_SR_TXE))
+        cpu_relax();
+    spi->dr = 0xffffu;
+    for (; bytes > 2; bytes -= 2) {
+        while (!(spi->sr & SPI_SR_RXNE))
+            continue;
+        w = spi->dr;
+        spi->dr = 0xffffu;
+        *p++ = w >> 8;
+        *p++ = w;
+        crc = crc16_ccitt(p-2, 2, crc);
+    }
+    while (!(spi->sr & SPI_SR_RXNE))
+        continue;
+    w = spi->dr;
+    *p++ = w >> 8;
+    *p++ = w;
+    return crc16_ccitt(p-2, 2, crc);
+}
+
+/* Transmit a block of 16-bit frames, MSB first, from @buf. The CRC is
+ * computed while each frame is shifted out. Received data is discarded.
+ * Returns the CRC16-CCITT of the block, continued from @crc. */
+uint16_t spi_xmit_block16(SPI spi, const void *buf, uint16_t bytes,
+                          uint16_t crc)
+{
+    const uint8_t *p = buf;
+
+    for (; bytes != 0; bytes -= 2) {
+        uint16_t w = ((uint16_t)p[0] << 8) | p[1];
+        while (!(spi->sr & SPI_SR_TXE))
+            cpu_relax();
+        spi->dr = w;
+        crc = crc16_ccitt(p, 2, crc);
+        p += 2;
+    }
+    return crc;
+}
+
 /*
  * Local variables:
  * mode: C
@@ -85,6 +85,9 @@ void EXC_unexpected(struct extra_exception_frame *extra)
         show_stack(psp, (uint32_t)_thread1_stacktop);
     }
 
+    /* The events leading up to the crash, for scripts/trace.py. */
+    trace_crash_dump();
+
     system_reset();
 }
 
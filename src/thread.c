@@ -10,8 +10,19 @@
  * See the file COPYING for more details, or visit <http://unlicense.org>.
  */
 
-/* Holds stack pointer. */
-static uint32_t *waiting_thread;
+/* Most threads that may exist at once, including the initial thread. */
+#define MAX_THREADS 4
+
+/* The initial (main) thread, which runs on the boot stack. */
+static struct thread thread0;
+
+/* All threads, running and switched out. */
+static struct thread *threads[MAX_THREADS] = { &thread0 };
+static unsigned int nr_threads = 1;
+static struct thread *current = &thread0;
+
+/* Stamped into a thread each time it is switched to, for round robin. */
+static uint16_t run_stamp;
 
 __attribute__((naked))
 static void _thread_yield(uint32_t *new_stack, uint32_t **save_stack_pointer) {
@@ -22,12 +33,6 @@ static void _thread_yield(uint32_t *new_stack, uint32_t **save_stack_pointer) {
         );
 }
 
-void thread_yield(void) {
-    if (!waiting_thread)
-        return;
-    _thread_yield(waiting_thread, &waiting_thread);
-}
-
 __attribute__((naked))
 static void resume(uint32_t *stack) {
     asm (
@@ -38,15 +43,93 @@ static void resume(uint32_t *stack) {
         );
 }
 
+static bool_t runnable(struct thread *t) {
+    return !t->waiting || t->waiting->signalled;
+}
+
+/* Should thread @a run in preference to thread @b? */
+static bool_t better(struct thread *a, struct thread *b) {
+    if (runnable(a) != runnable(b))
+        return runnable(a);
+    /* Round robin. */
+    return (uint16_t)(run_stamp - a->last_run)
+        > (uint16_t)(run_stamp - b->last_run);
+}
+
+/* Pick the thread to run next, other than the current thread: the runnable
+ * thread which has waited longest. Returns NULL if there is none, unless
+ * @force is set, in which case a sleeping thread may be chosen. */
+static struct thread *pick_next(bool_t force) {
+    struct thread *t, *best = NULL;
+    unsigned int i;
+
+    for (i = 0; i < nr_threads; i++) {
+        t = threads[i];
+        if ((t == current) || (!force && !runnable(t)))
+            continue;
+        if (!best || better(t, best))
+            best = t;
+    }
+
+    return best;
+}
+
+static void switch_to(struct thread *next) {
+    struct thread *prev = current;
+    current = next;
+    next->last_run = ++run_stamp;
+    _thread_yield(next->sp, &prev->sp);
+}
+
+void thread_yield(void) {
+    struct thread *next = pick_next(FALSE);
+    if (next)
+        switch_to(next);
+}
+
+void thread_idle(void) {
+    struct thread *next = pick_next(FALSE);
+    if (next) {
+        switch_to(next);
+        return;
+    }
+    /* An IRQ may make a thread runnable after the check above. With IRQs
+     * masked, WFI still wakes on it, and it is handled on unmasking. */
+    IRQ_global_disable();
+    if ((next = pick_next(FALSE)) == NULL)
+        asm volatile ("wfi" ::: "memory");
+    IRQ_global_enable();
+}
+
+void thread_wait(struct thread_event *ev) {
+    struct thread *next;
+    if (!ev->signalled) {
+        /* We are switched back to only once @ev is signalled, or when there
+         * is nothing else at all to run. */
+        current->waiting = ev;
+        if ((next = pick_next(FALSE)) != NULL)
+            switch_to(next);
+        current->waiting = NULL;
+    }
+    ev->signalled = FALSE;
+}
+
 __attribute__((used))
 static void thread_main(struct thread *thread, void (*func)(void*), void* arg) {
-    uint32_t *other_thread;
+    struct thread *next;
+    unsigned int i;
+
     func(arg);
     thread->exited = TRUE;
 
-    other_thread = waiting_thread;
-    waiting_thread = 0;
-    resume(other_thread);
+    /* Remove ourself from the thread pool, and never return. */
+    for (i = 0; threads[i] != thread; i++)
+        continue;
+    threads[i] = threads[--nr_threads];
+    next = pick_next(TRUE);
+    current = next;
+    next->last_run = ++run_stamp;
+    resume(next->sp);
     ASSERT(0); /* unreachable */
 }
 
@@ -62,7 +145,7 @@ static void _main(void) {
 
 void thread_start(struct thread *thread, uint32_t *stack, void (*func)(void*), void* arg) {
     memset(thread, 0, sizeof(*thread));
-    ASSERT(!waiting_thread);
+    ASSERT(nr_threads < MAX_THREADS);
     {
         /* r3 isn't special; it is just "not r4-r11,lr" */
         register uint32_t *stack_asm asm ("r3") = stack;
@@ -77,7 +160,9 @@ void thread_start(struct thread *thread, uint32_t *stack, void (*func)(void*), v
             : "memory");
         stack = stack_asm;
     }
-    waiting_thread = stack;
+    thread->sp = stack;
+    thread->last_run = run_stamp;
+    threads[nr_threads++] = thread;
 }
 
 bool_t thread_tryjoin(struct thread *thread) {
@@ -92,5 +177,9 @@ void thread_join(struct thread *thread) {
 }
 
 void thread_reset() {
-    waiting_thread = NULL;
+    /* cancel_call() unwinds to the initial thread behind our back, so that
+     * is the one which survives whichever thread was current. */
+    current = threads[0] = &thread0;
+    nr_threads = 1;
+    thread0.waiting = NULL;
 }
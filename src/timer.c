@@ -21,9 +21,30 @@ void IRQ_30(void) __attribute__((alias("IRQ_timer")));
  * latency incurred by reprogram_timer() and IRQ_timer(). */
 #define SLACK_TICKS 12
 
-#define TIMER_INACTIVE ((struct timer *)1ul)
+/* Timers are kept in a two-level timing wheel, so that arming or cancelling
+ * a timer costs the same however many are armed. The fine wheel spans 2^16
+ * ticks (a fine-grained reprogram_timer() deadline) in slots of 2^11 ticks,
+ * each kept sorted. The coarse wheel spans 2^21 ticks in unsorted slots of
+ * 2^16 ticks, each cascaded into the fine wheel when it is reached. Timers
+ * further out wait on an overflow list, revisited whenever the coarse wheel
+ * wraps. */
+#define FINE_SHIFT   11
+#define COARSE_SHIFT 16
+#define WRAP_SHIFT   21
+#define SLOTS        32
+#define SLOT(t, shift) (((t) >> (shift)) & (SLOTS-1))
+#define PERIOD(t, shift) ((time_t)(t) & ~((1u << (shift)) - 1))
 
-static struct timer *head;
+static struct timer *fine[SLOTS], *coarse[SLOTS], *overflow;
+static uint32_t fine_map, coarse_map;
+static unsigned int nr_active;
+
+/* Start of the current fine slot. All earlier slots are empty. */
+static time_t wheel_time;
+
+/* Deadline programmed into the hardware timer, if it is running. */
+static time_t hw_deadline;
+static bool_t hw_armed;
 
 static void reprogram_timer(int32_t delta)
 {
@@ -48,33 +69,175 @@ void timer_init(struct timer *timer, void (*cb_fn)(void *), void *cb_dat)
 {
     timer->cb_fn = cb_fn;
     timer->cb_dat = cb_dat;
-    timer->next = TIMER_INACTIVE;
+    timer->pprev = NULL;
 }
 
-static bool_t timer_is_active(struct timer *timer)
+static void set_hw_timer(time_t now, time_t deadline)
 {
-    return timer->next != TIMER_INACTIVE;
+    hw_deadline = deadline;
+    hw_armed = TRUE;
+    reprogram_timer(time_diff(now, deadline));
 }
 
-static void _timer_cancel(struct timer *timer)
+static uint32_t ror32(uint32_t x, unsigned int n)
 {
-    struct timer *t, **pprev;
+    return (x >> n) | (x << ((32 - n) & 31));
+}
+
+static void list_add(struct timer **pprev, struct timer *t)
+{
+    if ((t->next = *pprev) != NULL)
+        t->next->pprev = &t->next;
+    *pprev = t;
+    t->pprev = pprev;
+}
 
-    if (!timer_is_active(timer))
+static void list_del(struct timer *t)
+{
+    struct timer **pprev = t->pprev;
+
+    if ((*pprev = t->next) != NULL)
+        t->next->pprev = pprev;
+    t->pprev = NULL;
+
+    /* Was this the last timer in a wheel slot? */
+    if (*pprev != NULL)
         return;
+    if ((pprev >= &fine[0]) && (pprev < &fine[SLOTS]))
+        fine_map &= ~(1u << (pprev - fine));
+    else if ((pprev >= &coarse[0]) && (pprev < &coarse[SLOTS]))
+        coarse_map &= ~(1u << (pprev - coarse));
+}
+
+/* Place @t in the wheel. Returns when the wheel must next be processed on
+ * its account: its deadline, or when it is due to be cascaded. */
+static time_t wheel_insert(struct timer *t)
+{
+    struct timer **pprev;
+    time_t w = wheel_time, d = t->deadline;
+    int32_t delta = time_diff(w, d);
+    unsigned int i;
 
-    for (pprev = &head; (t = *pprev) != timer; pprev = &t->next)
-        continue;
+    /* Overdue timers belong in the current slot. */
+    if (delta < 0)
+        d = w;
 
-    *pprev = t->next;
-    t->next = TIMER_INACTIVE;
+    if (((d >> FINE_SHIFT) - (w >> FINE_SHIFT)) < SLOTS) {
+        i = SLOT(d, FINE_SHIFT);
+        for (pprev = &fine[i]; *pprev != NULL; pprev = &(*pprev)->next)
+            if (delta <= time_diff(w, (*pprev)->deadline))
+                break;
+        list_add(pprev, t);
+        fine_map |= 1u << i;
+        return t->deadline;
+    }
+
+    if (((d >> COARSE_SHIFT) - (w >> COARSE_SHIFT)) < SLOTS) {
+        i = SLOT(d, COARSE_SHIFT);
+        list_add(&coarse[i], t);
+        coarse_map |= 1u << i;
+        return PERIOD(d, COARSE_SHIFT);
+    }
+
+    list_add(&overflow, t);
+    return PERIOD(w, WRAP_SHIFT) + (1u << WRAP_SHIFT);
+}
+
+/* Re-place all timers on list @head, now that the wheel has moved on. */
+static void wheel_cascade(struct timer **head)
+{
+    struct timer *t, *next;
+
+    t = *head;
+    *head = NULL;
+    for (; t != NULL; t = next) {
+        next = t->next;
+        (void)wheel_insert(t);
+    }
+}
+
+/* When must the wheel next cascade timers from the coarse wheel, or from the
+ * overflow list? Returns FALSE if it need not. */
+static bool_t wheel_next_cascade(time_t *p)
+{
+    time_t w = wheel_time, wrap = PERIOD(w, WRAP_SHIFT) + (1u << WRAP_SHIFT);
+    uint32_t map = ror32(coarse_map, SLOT(w, COARSE_SHIFT));
+    bool_t found = FALSE;
+
+    if (map != 0) {
+        *p = PERIOD(w, COARSE_SHIFT)
+            + ((time_t)__builtin_ctz(map) << COARSE_SHIFT);
+        found = TRUE;
+    }
+
+    if ((overflow != NULL) && (!found || (time_diff(wrap, *p) > 0))) {
+        *p = wrap;
+        found = TRUE;
+    }
+
+    return found;
+}
+
+/* Bring the wheel up to date with @now. Returns the earliest timer if it is
+ * the next thing to happen, else NULL. Either way *@wake is set to when the
+ * wheel next needs to be processed. Must be called with timers armed. */
+static struct timer *wheel_update(time_t now, time_t *wake)
+{
+    struct timer *t;
+    time_t lim, b = 0, ts = 0;
+    uint32_t map;
+    bool_t cascade;
+    unsigned int n;
+
+    for (;;) {
+        /* Earliest fine-wheel timer, and the start of its slot. */
+        t = NULL;
+        if ((map = ror32(fine_map, SLOT(wheel_time, FINE_SHIFT))) != 0) {
+            n = __builtin_ctz(map);
+            t = fine[(SLOT(wheel_time, FINE_SHIFT) + n) & (SLOTS-1)];
+            ts = wheel_time + (n << FINE_SHIFT);
+        }
+        cascade = wheel_next_cascade(&b);
+
+        /* Move on to the current slot, but no further than a non-empty slot
+         * or the next cascade. */
+        lim = PERIOD(now, FINE_SHIFT);
+        if (t && (time_diff(ts, lim) > 0))
+            lim = ts;
+        if (cascade && (time_diff(b, lim) > 0))
+            lim = b;
+        if (time_diff(wheel_time, lim) > 0)
+            wheel_time = lim;
+        if (!cascade || (wheel_time != b))
+            break;
+
+        coarse_map &= ~(1u << SLOT(b, COARSE_SHIFT));
+        wheel_cascade(&coarse[SLOT(b, COARSE_SHIFT)]);
+        if (!(b & ((1u << WRAP_SHIFT) - 1)))
+            wheel_cascade(&overflow);
+    }
+
+    if (cascade && (!t || (time_diff(b, t->deadline) > 0))) {
+        *wake = b;
+        return NULL;
+    }
+
+    ASSERT(t != NULL);
+    *wake = t->deadline;
+    return t;
+}
+
+static void _timer_cancel(struct timer *timer)
+{
+    if (timer->pprev == NULL)
+        return;
+    list_del(timer);
+    nr_active--;
 }
 
 void timer_set(struct timer *timer, time_t deadline)
 {
-    struct timer *t, **pprev;
-    time_t now;
-    int32_t delta;
+    time_t now, wake;
     uint32_t oldpri;
 
     oldpri = IRQ_save(TIMER_IRQ_PRI);
@@ -84,15 +247,12 @@ void timer_set(struct timer *timer, time_t deadline)
     timer->deadline = deadline;
 
     now = time_now();
-    delta = time_diff(now, deadline);
-    for (pprev = &head; (t = *pprev) != NULL; pprev = &t->next)
-        if (delta <= time_diff(now, t->deadline))
-            break;
-    timer->next = *pprev;
-    *pprev = timer;
+    if (nr_active++ == 0)
+        wheel_time = PERIOD(now, FINE_SHIFT);
+    wake = wheel_insert(timer);
 
-    if (head == timer)
-        reprogram_timer(delta);
+    if (!hw_armed || (time_diff(wake, hw_deadline) > 0))
+        set_hw_timer(now, wake);
 
     IRQ_restore(oldpri);
 }
@@ -116,17 +276,19 @@ void timers_init(void)
 static void IRQ_timer(void)
 {
     struct timer *t;
-    int32_t delta;
+    time_t now, wake;
 
     tim->sr = 0;
+    hw_armed = FALSE;
 
-    while ((t = head) != NULL) {
-        if ((delta = time_diff(time_now(), t->deadline)) > SLACK_TICKS) {
-            reprogram_timer(delta);
+    while (nr_active != 0) {
+        now = time_now();
+        t = wheel_update(now, &wake);
+        if (!t || (time_diff(now, wake) > SLACK_TICKS)) {
+            set_hw_timer(now, wake);
             break;
         }
-        head = t->next;
-        t->next = TIMER_INACTIVE;
+        _timer_cancel(t);
         (*t->cb_fn)(t->cb_dat);
     }
 }
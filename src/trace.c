@@ -0,0 +1,122 @@
+/*
+ * trace.c
+ *
+ * Timeline trace of hot-path events.
+ *
+ * A flight recorder: events are time-stamped 16-byte records in a ring which
+ * overwrites the oldest entries. The ring is written to the volume between
+ * images, or to the serial console on a crash, and can be rendered as a
+ * timeline by scripts/trace.py.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* Number of records. Power of 2. */
+#ifndef TRACE_NR
+#define TRACE_NR 256
+#endif
+
+struct trace_rec {
+    uint32_t time;
+    uint16_t id, a;
+    uint32_t b, c;
+};
+
+struct trace_hdr {
+    char sig[4];      /* "FFTR" */
+    uint16_t version; /* 1 */
+    uint16_t tick_mhz;
+    uint32_t nr;      /* records which follow */
+    uint32_t lost;    /* older records overwritten */
+};
+
+static struct trace_rec ring[TRACE_NR];
+static volatile unsigned int prod;
+static bool_t frozen;
+
+void trace_record(unsigned int id, uint16_t a, uint32_t b, uint32_t c)
+{
+    struct trace_rec *r;
+    unsigned int p;
+
+    if (frozen)
+        return;
+
+    /* Claim a record with a single atomic increment. Preemption is LIFO, so
+     * a record is only ever torn if we lap the whole ring meanwhile. */
+    do {
+        p = prod;
+    } while (cmpxchg(&prod, p, p + 1) != p);
+
+    r = &ring[p & (TRACE_NR-1)];
+    r->time = time_now();
+    r->id = id;
+    r->a = a;
+    r->b = b;
+    r->c = c;
+}
+
+void trace_dump(FIL *file)
+{
+    struct trace_hdr hdr = {
+        .sig = "FFTR", .version = 1, .tick_mhz = TIME_MHZ };
+    unsigned int p, nr, i, n;
+
+    frozen = TRUE;
+    barrier();
+
+    p = prod;
+    nr = min_t(unsigned int, p, TRACE_NR);
+    hdr.nr = nr;
+    hdr.lost = p - nr;
+
+    F_open(file, "FFTRACE.BIN", FA_CREATE_ALWAYS|FA_WRITE);
+    F_write(file, &hdr, sizeof(hdr), NULL);
+    /* Oldest first: up to two contiguous runs of the ring. */
+    for (i = p - nr; i != p; i += n) {
+        n = min_t(unsigned int, p - i, TRACE_NR - (i & (TRACE_NR-1)));
+        F_write(file, &ring[i & (TRACE_NR-1)], n * sizeof(ring[0]), NULL);
+    }
+    F_close(file);
+
+    printk("Trace: %u events (%u lost) written to FFTRACE.BIN\n",
+           nr, hdr.lost);
+
+    prod = 0;
+    barrier();
+    frozen = FALSE;
+}
+
+void trace_crash_dump(void)
+{
+    struct trace_rec *r;
+    unsigned int p, nr, i;
+
+    frozen = TRUE;
+    barrier();
+
+    /* The ring far exceeds the console buffer, and we may be in a fault
+     * handler which the console IRQ cannot preempt: print synchronously. */
+    console_sync();
+
+    p = prod;
+    nr = min_t(unsigned int, p, TRACE_NR);
+    printk("TRACE %u %u %u\n", TIME_MHZ, nr, p - nr);
+    for (i = p - nr; i != p; i++) {
+        r = &ring[i & (TRACE_NR-1)];
+        printk("TR %x %x %x %x %x\n", r->time, r->id, r->a, r->b, r->c);
+    }
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
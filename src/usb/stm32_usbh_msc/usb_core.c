@@ -143,16 +143,27 @@ void *USB_OTG_ReadPacket(USB_OTG_CORE_HANDLE *pdev,
                          uint8_t *dest,
                          uint16_t len)
 {
-    uint32_t i;
     uint32_t count32b = (len + 3) / 4;
     __IO uint32_t *fifo = pdev->regs.DFIFO[0];
-
-    for (i = 0; i < count32b; i++) {
-        *(uint32_t *)dest = USB_OTG_READ_REG32(fifo);
-        dest += 4;
+    uint32_t *p = (uint32_t *)dest;
+
+    /* Full-size packets are 16 words: pop four at a time into word-aligned
+     * buffers. The compiler may merge the stores into STM, which requires
+     * alignment; single unaligned word stores are fine on Cortex-M3. */
+    if (((uint32_t)dest & 3) == 0) {
+        for (; count32b >= 4; count32b -= 4) {
+            uint32_t a = USB_OTG_READ_REG32(fifo);
+            uint32_t b = USB_OTG_READ_REG32(fifo);
+            uint32_t c = USB_OTG_READ_REG32(fifo);
+            uint32_t d = USB_OTG_READ_REG32(fifo);
+            p[0] = a; p[1] = b; p[2] = c; p[3] = d;
+            p += 4;
+        }
     }
+    while (count32b--)
+        *p++ = USB_OTG_READ_REG32(fifo);
 
-    return ((void *)dest);
+    return ((void *)p);
 }
 
 /**
@@ -585,8 +585,17 @@ uint32_t USB_OTG_USBH_handle_hc_n_In_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t n
         pdev->host.ErrCnt [num]= 0;
         CLEAR_HC_INT(hcreg , xfercompl);
 
-        if ((hcchar.b.eptype == EP_TYPE_CTRL)||
-            (hcchar.b.eptype == EP_TYPE_BULK))
+        if (hcchar.b.eptype == EP_TYPE_BULK)
+        {
+            /* A bulk IN URB may span many packets. The core tracks the
+             * data toggle across them: pick up the next PID from HCTSIZ. */
+            hctsiz.d32 = USB_OTG_READ_REG32(&hcreg->HCTSIZ);
+            UNMASK_HOST_INT_CHH (num);
+            USB_OTG_HC_Halt(pdev, num);
+            CLEAR_HC_INT(hcreg , nak);
+            pdev->host.hc[num].toggle_in = (hctsiz.b.pid == HC_PID_DATA1);
+        }
+        else if (hcchar.b.eptype == EP_TYPE_CTRL)
         {
             UNMASK_HOST_INT_CHH (num);
             USB_OTG_HC_Halt(pdev, num);
@@ -35,6 +35,11 @@
 HostCBWPkt_TypeDef USBH_MSC_CBWData;
 HostCSWPkt_TypeDef USBH_MSC_CSWData;
 
+/* Largest bulk IN URB, in packets (USB_OTG_HC_StartXfer limit). The IRQ
+ * handler re-arms the channel after each packet, so the whole URB streams
+ * back-to-back without waiting on this state machine. */
+#define BULK_IN_MAX_PKTS 256
+
 static uint32_t BOTStallErrorCount;   /* Keeps count of STALL Error Cases*/
 static uint8_t xfer_error_count;
 
@@ -171,13 +176,16 @@ void USBH_MSC_HandleBOTXfer (USB_OTG_CORE_HANDLE *pdev ,USBH_HOST *phost)
 
                 if(remainingDataLength > MSC_Machine.MSBulkInEpSize)
                 {
+                    uint32_t len = min_t(uint32_t, remainingDataLength,
+                                         BULK_IN_MAX_PKTS
+                                         * MSC_Machine.MSBulkInEpSize);
                     USBH_BulkReceiveData (pdev,
                                           datapointer,
-                                          MSC_Machine.MSBulkInEpSize ,
+                                          len,
                                           MSC_Machine.hc_num_in);
 
-                    remainingDataLength -= MSC_Machine.MSBulkInEpSize;
-                    datapointer = datapointer + MSC_Machine.MSBulkInEpSize;
+                    remainingDataLength -= len;
+                    datapointer = datapointer + len;
                 }
                 else if ( remainingDataLength == 0)
                 {
@@ -18,6 +18,9 @@ void IRQ_67(void) __attribute__((alias("IRQ_usb")));
 
 USB_OTG_CORE_HANDLE USB_OTG_Core;
 
+/* Signalled on USB interrupts, to wake a thread waiting on a transfer. */
+struct thread_event usb_event;
+
 void USB_OTG_BSP_Init(USB_OTG_CORE_HANDLE *pdev)
 {
     /* OTGFSPRE already clear in rcc->cfgr, OTG clock = PLL/3 */
@@ -70,6 +73,8 @@ bool_t USB_OTG_BSP_TimerFired(struct USB_OTG_BSP_Timer *t)
 static void IRQ_usb(void)
 {
     USBH_OTG_ISR_Handler(&USB_OTG_Core);
+    if (usbh_msc_irq())
+        thread_notify(&usb_event);
 }
 
 /*
@@ -15,6 +15,7 @@ static DSTATUS dstatus = STA_NOINIT;
 static bool_t msc_device_connected;
 
 extern USB_OTG_CORE_HANDLE USB_OTG_Core;
+extern struct thread_event usb_event;
 USBH_HOST USB_Host;
 
 static void USBH_USR_Init(void)
@@ -220,32 +221,263 @@ static DRESULT handle_usb_status(BYTE status)
     return RES_OK;
 }
 
-static DRESULT usb_disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count)
+/* State of the MSC command and BOT transfer state machines. */
+static uint32_t bot_state(void)
+{
+    USBH_BOTXfer_TypeDef *x = &USBH_MSC_BOTXferParam;
+    return x->CmdStateMachine | (x->BOTState << 8) | (x->BOTStateBkp << 16);
+}
+
+/* A READ(10) or WRITE(10) request. */
+struct bot_req {
+    uint8_t (*cmd)(USB_OTG_CORE_HANDLE *, uint8_t *, uint32_t, uint32_t);
+    BYTE *buff;
+    LBA_t sector;
+    UINT count;
+};
+
+/* While a disk transfer is in flight the USB IRQ drives the BOT state
+ * machine, so that each phase (CBW, data, CSW) is issued as soon as the
+ * previous one completes. The issuing thread sleeps until it is all over. */
+static volatile bool_t bot_in_irq;
+
+/* Request in flight, and a request to chain behind it: the IRQ sends the
+ * chained CBW as soon as the current CSW arrives. A chained request remains
+ * unclaimed until its caller turns up to wait for it. */
+static struct bot_req bot_cur, bot_next;
+static bool_t bot_unclaimed;
+
+/* Requests issued and completed, and the status of the last to complete. A
+ * request is only ever chained behind one which succeeded. */
+static volatile uint32_t bot_seq, bot_done;
+static volatile BYTE bot_status;
+
+/* Set by usb_disk_abort(): abandon the read being waited for. */
+static volatile bool_t bot_abort;
+#define BOT_ABORTED 0xff /* bot_wait() status */
+
+/* Some BOT transitions issue no USB traffic: step until the state settles. */
+static void bot_advance(void)
+{
+    uint32_t state;
+    unsigned int i;
+
+    for (i = 0; i < 4; i++) {
+        state = bot_state();
+        USBH_MSC_HandleBOTXfer(&USB_OTG_Core, &USB_Host);
+        if (bot_state() == state)
+            break;
+    }
+}
+
+/* Called with USB IRQ masked, or from the IRQ itself. */
+static void bot_issue(const struct bot_req *req)
+{
+    bot_cur = *req;
+    bot_seq++;
+    (void)(*req->cmd)(&USB_OTG_Core, req->buff, req->sector, 512 * req->count);
+    bot_advance();
+    bot_in_irq = TRUE;
+}
+
+bool_t usbh_msc_irq(void)
 {
     BYTE status;
 
+    if (!bot_in_irq)
+        return TRUE;
+
+    /* SOF interrupts keep this ticking, so BOT timeouts still fire. */
+    bot_advance();
+    if (!HCD_IsDeviceConnected(&USB_OTG_Core))
+        return TRUE;
+    if (USBH_MSC_BOTXferParam.BOTXferStatus == USBH_MSC_BUSY)
+        return FALSE;
+
+    status = (*bot_cur.cmd)(&USB_OTG_Core, bot_cur.buff, bot_cur.sector,
+                            512 * bot_cur.count);
+    if (status == USBH_MSC_BUSY)
+        return FALSE;
+
+    bot_status = status;
+    bot_done = bot_seq;
+    bot_in_irq = FALSE;
+    if ((status == USBH_MSC_OK) && bot_next.count) {
+        bot_issue(&bot_next);
+        bot_unclaimed = TRUE;
+    }
+    bot_next.count = 0;
+    return TRUE;
+}
+
+/* Sleep until request number @seq completes. An @abortable wait returns
+ * BOT_ABORTED early if usb_disk_abort() is called, leaving the request in
+ * flight: see bot_reset_recovery(). */
+static BYTE bot_wait(uint32_t seq, bool_t abortable)
+{
+    while ((int32_t)(bot_done - seq) < 0) {
+        if (!HCD_IsDeviceConnected(&USB_OTG_Core)) {
+            bot_in_irq = FALSE;
+            bot_unclaimed = FALSE;
+            bot_next.count = 0;
+            return USBH_MSC_FAIL;
+        }
+        if (abortable && bot_abort)
+            return BOT_ABORTED;
+        thread_wait(&usb_event);
+    }
+    /* Anything chained behind @seq was issued only because @seq succeeded. */
+    return (bot_done == seq) ? bot_status : USBH_MSC_OK;
+}
+
+/* Wait for a chained request which no caller has claimed. */
+static BYTE bot_settle(void)
+{
+    uint32_t oldpri, seq;
+    bool_t unclaimed;
+
+    oldpri = IRQ_save(USB_IRQ_PRI);
+    bot_next.count = 0;
+    unclaimed = bot_unclaimed;
+    bot_unclaimed = FALSE;
+    seq = bot_seq;
+    IRQ_restore(oldpri);
+
+    return unclaimed ? bot_wait(seq, FALSE) : USBH_MSC_OK;
+}
+
+static void bot_halt_channel(uint8_t hc_num)
+{
+    USB_OTG_HCCHAR_TypeDef hcchar;
+
+    hcchar.d32 = USB_OTG_READ_REG32(
+        &USB_OTG_Core.regs.HC_REGS[hc_num]->HCCHAR);
+    if (hcchar.b.chen)
+        USB_OTG_HC_Halt(&USB_OTG_Core, hc_num);
+}
+
+/* Abandon the request in flight, and get the device ready for the next CBW
+ * by Reset Recovery (BOT 5.3.4): a Bulk-Only Mass Storage Reset, then Clear
+ * Feature HALT on both bulk endpoints. Control transfers are not driven by
+ * the IRQ, so step the host state machine until each completes. Returns
+ * FALSE if the device must be reinitialised instead. */
+static bool_t bot_reset_recovery(void)
+{
+    USBH_HOST *phost = &USB_Host;
+    time_t start = time_now();
+    USBH_Status status = USBH_OK;
+    unsigned int step = 0;
+    uint32_t oldpri;
+
+    oldpri = IRQ_save(USB_IRQ_PRI);
+    bot_in_irq = FALSE;
+    bot_unclaimed = FALSE;
+    bot_next.count = 0;
+    bot_halt_channel(MSC_Machine.hc_num_in);
+    bot_halt_channel(MSC_Machine.hc_num_out);
+    IRQ_restore(oldpri);
+
+    while (step < 3) {
+        if (!HCD_IsDeviceConnected(&USB_OTG_Core)
+            || (time_since(start) > time_ms(500)))
+            return FALSE;
+        switch (step) {
+        case 0:
+            phost->Control.setup.b.bmRequestType = USB_H2D
+                | USB_REQ_TYPE_CLASS | USB_REQ_RECIPIENT_INTERFACE;
+            phost->Control.setup.b.bRequest = USB_REQ_BOT_RESET;
+            phost->Control.setup.b.wValue.w = 0;
+            phost->Control.setup.b.wIndex.w = 0;
+            phost->Control.setup.b.wLength.w = 0;
+            status = USBH_CtlReq(&USB_OTG_Core, phost, 0, 0);
+            break;
+        case 1:
+            status = USBH_ClrFeature(&USB_OTG_Core, phost,
+                                     MSC_Machine.MSBulkInEp,
+                                     MSC_Machine.hc_num_in);
+            break;
+        case 2:
+            status = USBH_ClrFeature(&USB_OTG_Core, phost,
+                                     MSC_Machine.MSBulkOutEp,
+                                     MSC_Machine.hc_num_out);
+            break;
+        }
+        if (status == USBH_OK) {
+            step++;
+        } else if (status != USBH_BUSY) {
+            return FALSE;
+        } else {
+            if (phost->gState == HOST_CTRL_XFER)
+                usbh_msc_process();
+            thread_yield();
+        }
+    }
+
+    /* The next command begins afresh with a CBW. */
+    USBH_MSC_Init(&USB_OTG_Core);
+    return TRUE;
+}
+
+static DRESULT usb_disk_xfer(
+    uint8_t (*cmd)(USB_OTG_CORE_HANDLE *, uint8_t *, uint32_t, uint32_t),
+    BYTE *buff, LBA_t sector, UINT count)
+{
+    struct bot_req req = { cmd, buff, sector, count };
+    uint32_t oldpri, seq;
+    UINT n;
+    BYTE status;
+
+    bot_abort = FALSE;
+    while (req.count) {
+        if (!HCD_IsDeviceConnected(&USB_OTG_Core)) {
+            bot_in_irq = FALSE;
+            bot_unclaimed = FALSE;
+            return handle_usb_status(USBH_MSC_FAIL);
+        }
+        /* The IRQ handler must not run the state machine under our feet. */
+        oldpri = IRQ_save(USB_IRQ_PRI);
+        if (bot_unclaimed) {
+            /* Claim the chained request if it is a prefix of ours, else just
+             * wait for it to get out of the way. */
+            bot_unclaimed = FALSE;
+            n = ((bot_cur.cmd == req.cmd) && (bot_cur.buff == req.buff)
+                 && (bot_cur.sector == req.sector)
+                 && (bot_cur.count <= req.count)) ? bot_cur.count : 0;
+        } else {
+            bot_issue(&req);
+            n = req.count;
+        }
+        seq = bot_seq;
+        IRQ_restore(oldpri);
+        status = bot_wait(seq, cmd == USBH_MSC_Read10);
+        if (status == BOT_ABORTED) {
+            printk("USB: Read aborted\n");
+            return bot_reset_recovery()
+                ? RES_ERROR : handle_usb_status(USBH_MSC_FAIL);
+        }
+        if (status != USBH_MSC_OK)
+            return handle_usb_status(status);
+        req.buff += n * 512;
+        req.sector += n;
+        req.count -= n;
+    }
+
+    return RES_OK;
+}
+
+static DRESULT usb_disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count)
+{
     if (pdrv || !count)
         return RES_PARERR;
     if (dstatus & STA_NOINIT)
         return RES_NOTRDY;
 
-    do {
-        if (!HCD_IsDeviceConnected(&USB_OTG_Core))
-            return handle_usb_status(USBH_MSC_FAIL);
-        status = USBH_MSC_Read10(&USB_OTG_Core, buff, sector, 512 * count);
-        USBH_MSC_HandleBOTXfer(&USB_OTG_Core, &USB_Host);
-        if (status == USBH_MSC_BUSY)
-            thread_yield();
-    } while (status == USBH_MSC_BUSY);
-
-    return handle_usb_status(status);
+    return usb_disk_xfer(USBH_MSC_Read10, buff, sector, count);
 }
 
 static DRESULT usb_disk_write(
     BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count)
 {
-    BYTE status;
-
     if (pdrv || !count)
         return RES_PARERR;
     if (dstatus & STA_NOINIT)
@@ -253,17 +485,35 @@ static DRESULT usb_disk_write(
     if (dstatus & STA_PROTECT)
         return RES_WRPRT;
 
-    do {
-        if (!HCD_IsDeviceConnected(&USB_OTG_Core))
-            return handle_usb_status(USBH_MSC_FAIL);
-        status = USBH_MSC_Write10(
-            &USB_OTG_Core, (BYTE *)buff, sector, 512 * count);
-        USBH_MSC_HandleBOTXfer(&USB_OTG_Core, &USB_Host);
-        if (status == USBH_MSC_BUSY)
-            thread_yield();
-    } while (status == USBH_MSC_BUSY);
+    return usb_disk_xfer(USBH_MSC_Write10, (BYTE *)buff, sector, count);
+}
+
+static void usb_disk_chain(
+    BYTE pdrv, bool_t write, const BYTE *buff, LBA_t sector, UINT count)
+{
+    struct bot_req req = {
+        write ? USBH_MSC_Write10 : USBH_MSC_Read10,
+        (BYTE *)buff, sector, count };
+    uint32_t oldpri;
+
+    if (!count) {
+        (void)handle_usb_status(bot_settle());
+        return;
+    }
 
-    return handle_usb_status(status);
+    if (pdrv || (dstatus & (write ? STA_NOINIT|STA_PROTECT : STA_NOINIT)))
+        return;
+
+    oldpri = IRQ_save(USB_IRQ_PRI);
+    if (!bot_unclaimed)
+        bot_next = req;
+    IRQ_restore(oldpri);
+}
+
+static void usb_disk_abort(void)
+{
+    bot_abort = TRUE;
+    thread_notify(&usb_event);
 }
 
 static DRESULT usb_disk_ioctl(BYTE pdrv, BYTE ctrl, void *buff)
@@ -293,6 +543,8 @@ struct volume_ops usb_ops = {
     .read = usb_disk_read,
     .write = usb_disk_write,
     .ioctl = usb_disk_ioctl,
+    .chain = usb_disk_chain,
+    .abort = usb_disk_abort,
     .connected = usbh_msc_connected,
     .readonly = usbh_msc_readonly
 };
@@ -322,10 +322,7 @@ void qsort_p(void *base, unsigned int nr,
 uint32_t rand(void)
 {
     static uint32_t x = 0x87a2263c;
-    x ^= x << 13;
-    x ^= x >> 17;
-    x ^= x << 5;
-    return x;
+    return x = xorshift32(x);
 }
 
 unsigned int popcount(uint32_t x)
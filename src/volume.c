@@ -18,21 +18,39 @@ static struct cache *cache;
 static bool_t interrupt;
 static bool_t inprogress;
 static void *metadata_addr;
+static void *pin_addr;
 #define SECSZ 512
 
 #if !defined(BOOTLOADER)
+/* Write-back mode: staging buffer for coalescing flushed sectors. */
+static uint8_t *wb_stage;
+static unsigned int wb_stage_secs;
+static time_t wb_last_write;
+static bool_t wb_flushing; /* A flusher owns wb_stage */
+static bool_t wb_failed;   /* Last write-back failed: retry only when idle */
+
+static DRESULT wb_flush(void);
+static void chain_settle(void);
+
 void volume_cache_init(void *start, void *end)
 {
     volume_cache_destroy();
     cache = cache_init(start, end, SECSZ);
     interrupt = FALSE;
     inprogress = FALSE;
+    wb_flushing = wb_failed = FALSE;
 }
 
 void volume_cache_destroy(void)
 {
+    if (cache) {
+        (void)wb_flush();
+        cache_stats(cache);
+    }
     cache = NULL;
     metadata_addr = NULL;
+    pin_addr = NULL;
+    wb_stage = NULL;
 }
 
 void volume_cache_metadata_only(FIL *fp)
@@ -40,10 +58,41 @@ void volume_cache_metadata_only(FIL *fp)
     /* All metadata is accessed via the per-filesystem "sector window". */
     metadata_addr = fp->obj.fs->win;
 }
+
+void volume_cache_pin_metadata(FATFS *fs)
+{
+    pin_addr = fs->win;
+}
 #endif
 
+static void cache_pin_meta(struct cache *c, const BYTE *buff,
+                           LBA_t sector, UINT count)
+{
+    /* FAT and directory sectors are worth keeping over streamed file data.
+     * Pinning fails harmlessly once the cache's pin limit is reached. */
+    if (pin_addr && (buff == pin_addr))
+        while (count--)
+            cache_pin(c, sector++);
+}
+
+static void cache_update_meta(struct cache *c, const BYTE *buff,
+                              LBA_t sector, UINT count)
+{
+    cache_update_N(c, sector, buff, count);
+    cache_pin_meta(c, buff, sector, count);
+}
+
+static void cache_fill_meta(struct cache *c, BYTE *buff,
+                            LBA_t sector, UINT count)
+{
+    cache_fill_N(c, sector, buff, count);
+    cache_pin_meta(c, buff, sector, count);
+}
+
 DSTATUS disk_initialize(BYTE pdrv)
 {
+    nor_cache_reset();
+
     /* Default to USB if inserted. */
     vol_ops = &usb_ops;
     if (!(usb_ops.initialize(pdrv) & STA_NOINIT))
@@ -77,11 +126,196 @@ static inline void end_op(void)
     }
 }
 
+#if !defined(BOOTLOADER)
+void volume_cache_writeback(void *stage, unsigned int len)
+{
+    if (cache == NULL)
+        return;
+    wb_stage = stage;
+    wb_stage_secs = len / SECSZ;
+    ASSERT(wb_stage_secs != 0);
+}
+
+static DRESULT wb_flush(void)
+{
+    DRESULT res = RES_OK;
+    const void *p;
+    uint32_t id;
+    unsigned int n;
+
+    /* One flusher at a time (main and I/O threads both flush): the other may
+     * have yielded mid-write, with its sectors in the staging buffer. */
+    while (wb_flushing)
+        thread_yield();
+    wb_flushing = TRUE;
+
+    /* Re-check the cache on every iteration: end_op() may yield to a thread
+     * which writes to the cache, or wants to destroy it. */
+    while ((res == RES_OK) && cache && cache_first_dirty(cache, &id)) {
+        /* Coalesce a run of consecutive dirty sectors in the staging buffer.
+         * Sectors are marked clean first. If we yield mid-write, another
+         * flusher must not write them again from a stale staging buffer. */
+        for (n = 0; n < wb_stage_secs; n++) {
+            if ((p = cache_clean(cache, id + n)) == NULL)
+                break;
+            memcpy(wb_stage + n*SECSZ, p, SECSZ);
+        }
+        chain_settle();
+        start_op();
+        trace(vol_write, n, id, 0);
+        PROF(vol_write, res = vol_ops->write(0, wb_stage, id, n));
+        trace(vol_write_done, res, 0, 0);
+        end_op();
+        /* On failure the sectors are dirty once more, for a later retry. */
+        while ((res != RES_OK) && cache && n--)
+            (void)cache_redirty(cache, id + n, wb_stage + n*SECSZ);
+    }
+
+    wb_flushing = FALSE;
+    wb_failed = (res != RES_OK);
+    if (res != RES_OK) {
+        printk("Write-back failed (%d)\n", res);
+        wb_last_write = time_now();
+    }
+    return res;
+}
+
+void volume_cache_flush(void)
+{
+    (void)wb_flush();
+}
+
+bool_t volume_cache_flush_idle(time_t idle)
+{
+    if (!cache || !cache_nr_dirty(cache))
+        return FALSE;
+    if (wb_failed)
+        idle = max_t(time_t, idle, time_ms(1000));
+    if (time_since(wb_last_write) >= idle)
+        (void)wb_flush();
+    return cache && cache_nr_dirty(cache);
+}
+
+/* Try to absorb a write in the cache. Returns number of sectors absorbed. */
+static UINT wb_write(const BYTE *buff, LBA_t sector, UINT count)
+{
+    UINT done = 0;
+
+    /* Only file data is written back. Metadata is written through at once,
+     * to keep the filesystem consistent if we lose power. */
+    if (!cache || !wb_stage || metadata_addr || (buff == pin_addr))
+        return 0;
+
+    while (done < count) {
+        if (!cache_write(cache, sector, buff)) {
+            /* Dirty limit reached: make room and retry. */
+            if ((wb_flush() != RES_OK) || !cache || !wb_stage
+                || !cache_write(cache, sector, buff))
+                break;
+        }
+        wb_last_write = time_now();
+        sector++;
+        buff += SECSZ;
+        done++;
+    }
+
+    return done;
+}
+
+/* A disk transfer which is known to follow the next one to reach the driver
+ * (see volume_chain()). The driver may issue it the moment its predecessor
+ * completes, but only if it will bypass the cache when it is made. */
+static struct {
+    enum { CHAIN_none, CHAIN_pending, CHAIN_issued } state;
+    bool_t write;
+    const BYTE *buff;
+    LBA_t sector;
+    UINT count;
+} chain;
+
+static bool_t chain_passthrough(void)
+{
+    struct cache *c = cache;
+    if (c == NULL)
+        return TRUE;
+    /* Cf. wb_write() and disk_read(). Sectors read from the device are
+     * reconciled with dirty cached data by cache_fill_N(). */
+    if (chain.write)
+        return !wb_stage || metadata_addr || (chain.buff == pin_addr);
+    return (metadata_addr && (chain.buff != metadata_addr))
+        || !cache_lookup(c, chain.sector);
+}
+
+/* Called just before a transfer is handed to the driver. */
+static void chain_arm(BYTE pdrv)
+{
+    if (chain.state != CHAIN_pending)
+        return;
+    chain.state = CHAIN_none;
+    if (!chain_passthrough())
+        return;
+    vol_ops->chain(pdrv, chain.write, chain.buff, chain.sector, chain.count);
+    chain.state = CHAIN_issued;
+}
+
+/* Wait for an issued transfer that nobody is going to claim. */
+static void chain_settle(void)
+{
+    if (chain.state != CHAIN_issued)
+        return;
+    chain.state = CHAIN_none;
+    if (!vol_ops->chain) /* switched volume */
+        return;
+    start_op();
+    vol_ops->chain(0, FALSE, NULL, 0, 0);
+    end_op();
+}
+
+/* Is this the transfer we chained? It may since have been extended. Returns
+ * TRUE if it has been issued already, in which case it must go straight to
+ * the driver. */
+static bool_t chain_claim(bool_t write, const BYTE *buff,
+                          LBA_t sector, UINT count)
+{
+    bool_t issued;
+
+    if ((chain.state == CHAIN_none) || (write != chain.write)
+        || (buff != chain.buff) || (sector != chain.sector)
+        || (count < chain.count)) {
+        chain_settle();
+        return FALSE;
+    }
+
+    issued = (chain.state == CHAIN_issued);
+    chain.state = CHAIN_none;
+    return issued;
+}
+
+void volume_chain(BYTE pdrv, bool_t write, const BYTE *buff,
+                  LBA_t sector, UINT count)
+{
+    chain_settle();
+    chain.state = CHAIN_none;
+    if (!count || !vol_ops->chain)
+        return;
+    chain.state = CHAIN_pending;
+    chain.write = write;
+    chain.buff = buff;
+    chain.sector = sector;
+    chain.count = count;
+}
+#else
+#define wb_write(b, s, c) 0
+#define chain_arm(p) ((void)0)
+#define chain_settle() ((void)0)
+#define chain_claim(w, b, s, c) FALSE
+#endif
+
 DSTATUS disk_status(BYTE pdrv)
 {
     DSTATUS status;
     start_op();
-    status = vol_ops->status(pdrv);
+    PROF(vol_status, status = vol_ops->status(pdrv));
     end_op();
     return status;
 }
@@ -92,17 +326,23 @@ DRESULT disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count)
     const void *p;
     struct cache *c;
 
+    if (chain_claim(FALSE, buff, sector, count))
+        goto read_tail;
+
     if (((c = cache) == NULL)
         || (metadata_addr && (buff != metadata_addr))) {
         start_op();
-        res = vol_ops->read(pdrv, buff, sector, count);
+        chain_arm(pdrv);
+        trace(vol_read, count, sector, 0);
+        PROF(vol_read, res = vol_ops->read(pdrv, buff, sector, count));
+        trace(vol_read_done, res, 0, 0);
         end_op();
         return res;
     }
 
     while (count) {
         if ((p = cache_lookup(c, sector)) == NULL)
-            goto read_tail;
+            goto read_nor;
         memcpy(buff, p, SECSZ);
         sector++;
         count--;
@@ -110,11 +350,33 @@ DRESULT disk_read(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count)
     }
     return RES_OK;
 
+read_nor:
+    /* The NOR cache shares the SD card's bus: hold the volume meanwhile. */
+    start_op();
+    while (count && nor_cache_read(sector, buff)) {
+        cache_fill_meta(c, buff, sector, 1);
+        sector++;
+        count--;
+        buff += SECSZ;
+    }
+    if (!count) {
+        end_op();
+        return RES_OK;
+    }
+    goto read_vol;
+
 read_tail:
     start_op();
-    res = vol_ops->read(pdrv, buff, sector, count);
+read_vol:
+    chain_arm(pdrv);
+    trace(vol_read, count, sector, 0);
+    PROF(vol_read, res = vol_ops->read(pdrv, buff, sector, count));
+    trace(vol_read_done, res, 0, 0);
+    /* The cache may have been destroyed while we yielded. */
+    if ((res == RES_OK) && ((c = cache) != NULL))
+        cache_fill_meta(c, buff, sector, count);
     if (res == RES_OK)
-        cache_update_N(c, sector, buff, count);
+        nor_cache_fill(buff, sector, count, pin_addr && (buff == pin_addr));
     end_op();
     return res;
 }
@@ -123,20 +385,72 @@ DRESULT disk_write(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count)
 {
     DRESULT res;
     struct cache *c;
+    UINT done;
+
+    nor_cache_invalidate(sector, count);
+
+    done = chain_claim(TRUE, buff, sector, count)
+        ? 0 : wb_write(buff, sector, count);
+    if (done == count)
+        return RES_OK;
+    buff += done * SECSZ;
+    sector += done;
+    count -= done;
+
     start_op();
-    res = vol_ops->write(pdrv, buff, sector, count);
+    chain_arm(pdrv);
+    trace(vol_write, count, sector, 0);
+    PROF(vol_write, res = vol_ops->write(pdrv, buff, sector, count));
+    trace(vol_write_done, res, 0, 0);
     if ((res == RES_OK) && ((c = cache) != NULL)
         && (!metadata_addr || (buff == metadata_addr)))
-        cache_update_N(c, sector, buff, count);
+        cache_update_meta(c, buff, sector, count);
     end_op();
     return res;
 }
 
+#if !defined(BOOTLOADER)
+bool_t volume_prefetch(LBA_t sector, void *buf)
+{
+    DRESULT res;
+    struct cache *c;
+
+    if (((c = cache) == NULL) || inprogress)
+        return FALSE;
+    if (cache_lookup(c, sector) != NULL)
+        return TRUE;
+
+    chain_settle();
+    start_op();
+    trace(vol_read, 1, sector, 0);
+    PROF(vol_read, res = vol_ops->read(0, buf, sector, 1));
+    trace(vol_read_done, res, 0, 0);
+    if (res == RES_OK)
+        cache_fill_N(c, sector, buf, 1);
+    end_op();
+    return res == RES_OK;
+}
+
+bool_t volume_cache_pin(LBA_t sector)
+{
+    struct cache *c = cache;
+    return c && cache_pin(c, sector);
+}
+
+void volume_cache_counts(uint32_t *hits, uint32_t *misses)
+{
+    *hits = *misses = 0;
+    if (cache)
+        cache_counts(cache, hits, misses);
+}
+#endif
+
 DRESULT disk_ioctl(BYTE pdrv, BYTE ctrl, void *buff)
 {
     DRESULT res;
+    chain_settle();
     start_op();
-    res = vol_ops->ioctl(pdrv, ctrl, buff);
+    PROF(vol_ioctl, res = vol_ops->ioctl(pdrv, ctrl, buff));
     end_op();
     return res;
 }
@@ -165,6 +479,20 @@ bool_t volume_interrupt(void)
     return inprogress;
 }
 
+bool_t volume_abort(void)
+{
+    if (inprogress && vol_ops->abort)
+        vol_ops->abort();
+    return volume_interrupt();
+}
+
+unsigned int volume_busy(void)
+{
+    if (!inprogress)
+        return VOL_idle;
+    return (vol_ops == &sd_ops) ? VOL_sd : VOL_usb;
+}
+
 /*
  * Local variables:
  * mode: C
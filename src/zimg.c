@@ -0,0 +1,229 @@
+/*
+ * zimg.c
+ *
+ * Block-compressed image container, decompressed transparently by ring_io.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* Decode an LZ4 block (no frame, no size prefix) of @slen bytes into @dst.
+ * Returns the decoded length, or -1 if the block is malformed or would
+ * overrun @dlen. */
+static int lz4_decode(const uint8_t *src, uint32_t slen,
+                      uint8_t *dst, uint32_t dlen)
+{
+    const uint8_t *s = src, *send = src + slen, *m;
+    uint8_t *d = dst, *dend = dst + dlen;
+    uint32_t len, moff;
+    uint8_t tok, x;
+
+    while (s < send) {
+        tok = *s++;
+
+        /* Literals. */
+        len = tok >> 4;
+        if (len == 15) {
+            do {
+                if (s >= send)
+                    return -1;
+                len += x = *s++;
+            } while (x == 255);
+        }
+        if ((len > send - s) || (len > dend - d))
+            return -1;
+        memcpy(d, s, len);
+        d += len;
+        s += len;
+        if (s >= send)
+            break; /* The final sequence is literals only. */
+
+        /* Match: may overlap its own output, so copy bytewise. */
+        if (send - s < 2)
+            return -1;
+        moff = s[0] | (s[1] << 8);
+        s += 2;
+        if ((moff == 0) || (moff > d - dst))
+            return -1;
+        len = tok & 15;
+        if (len == 15) {
+            do {
+                if (s >= send)
+                    return -1;
+                len += x = *s++;
+            } while (x == 255);
+        }
+        len += 4;
+        if (len > dend - d)
+            return -1;
+        for (m = d - moff; len != 0; len--)
+            *d++ = *m++;
+    }
+
+    return d - dst;
+}
+
+struct zimg *zimg_open(FIL *fp, struct image_buf *buf)
+{
+    struct zimg_header zh;
+    struct zimg *z;
+    uint32_t blk_size, need;
+    UINT nr;
+
+    F_lseek(fp, 0);
+    F_read(fp, &zh, sizeof(zh), &nr);
+    if ((nr != sizeof(zh)) || strncmp(zh.sig, "FFZ1", sizeof(zh.sig))
+            || (zh.blk_shift < 12) || (zh.blk_shift > 14))
+        return NULL;
+    blk_size = 1u << zh.blk_shift;
+    zh.raw_size = le32toh(zh.raw_size);
+    zh.nr_blks = le32toh(zh.nr_blks);
+    if ((zh.raw_size == 0)
+            || (zh.nr_blks != (zh.raw_size + blk_size - 1) >> zh.blk_shift))
+        return NULL;
+
+    /* Staging and decode buffers, one block each. Leave the caller at least
+     * the minimum buffer space that floppy_mount() allows. */
+    need = ((sizeof(*z) + 3) & ~3) + 2*blk_size;
+    if (buf->len < need + 10*1024)
+        return NULL;
+    buf->len = (buf->len - need) & ~511;
+    z = (struct zimg *)((uint8_t *)buf->p + buf->len);
+    memset(z, 0, sizeof(*z));
+    z->stage = (uint8_t *)z + ((sizeof(*z) + 3) & ~3);
+    z->dec = z->stage + blk_size;
+
+    z->fp = fp;
+    z->raw_size = zh.raw_size;
+    z->nr_blks = zh.nr_blks;
+    z->blk_size = blk_size;
+    z->blk_shift = zh.blk_shift;
+    z->idx_base = ~0;
+    z->dec_blk = z->stage_blk = ~0;
+
+    printk("Compressed image: %u kB in %u %u kB blocks\n",
+           z->raw_size >> 10, z->nr_blks, blk_size >> 10);
+    return z;
+}
+
+/* Returns the file offset of block @b. Entry @b+1 is always also buffered.
+ * Index misses occur only when streaming crosses into a new window, roughly
+ * every ten HD tracks (4kB blocks), and are read synchronously. */
+static uint32_t *zimg_index(struct zimg *z, uint32_t b)
+{
+    if ((z->idx_base == ~0u) || (b < z->idx_base)
+            || (b >= z->idx_base + z->idx_nr)) {
+        z->idx_base = b;
+        z->idx_nr = min_t(uint32_t, ZIMG_IDX_NR, z->nr_blks - b);
+        F_lseek_async(z->fp, sizeof(struct zimg_header) + b*4);
+        F_async_wait(F_read_async(z->fp, z->idx,
+                                  (z->idx_nr + 1) * 4, NULL));
+    }
+    return &z->idx[b - z->idx_base];
+}
+
+/* Prepare to fetch block @b into the staging buffer. Returns its length. */
+static uint32_t zimg_stage(struct zimg *z, uint32_t b)
+{
+    uint32_t *idx = zimg_index(z, b);
+    uint32_t off = le32toh(idx[0]), end = le32toh(idx[1]);
+
+    if ((end <= off) || (end - off > z->blk_size))
+        F_die(FR_BAD_IMAGE);
+    z->stage_blk = b;
+    z->stage_len = end - off;
+    F_lseek_async(z->fp, off);
+    return z->stage_len;
+}
+
+/* Decode the staging buffer. Each block decodes to exactly one block. */
+static void zimg_decode(struct zimg *z)
+{
+    if (z->stage_len == z->blk_size)
+        memcpy(z->dec, z->stage, z->blk_size);
+    else if (lz4_decode(z->stage, z->stage_len,
+                        z->dec, z->blk_size) != z->blk_size)
+        F_die(FR_BAD_IMAGE);
+    z->dec_blk = z->stage_blk;
+}
+
+void zimg_read(struct zimg *z, FSIZE_t off, void *buf, UINT len)
+{
+    uint8_t *p = buf;
+    uint32_t b, boff, n;
+
+    ASSERT(!z->pending);
+
+    while (len != 0) {
+        if (off >= z->raw_size)
+            F_die(FR_BAD_IMAGE);
+        b = off >> z->blk_shift;
+        boff = off & (z->blk_size - 1);
+        if (b != z->dec_blk) {
+            n = zimg_stage(z, b);
+            F_async_wait(F_read_async(z->fp, z->stage, n, NULL));
+            zimg_decode(z);
+        }
+        n = min_t(uint32_t, len, z->blk_size - boff);
+        memcpy(p, z->dec + boff, n);
+        p += n;
+        off += n;
+        len -= n;
+    }
+}
+
+FOP zimg_read_async(struct zimg *z, FSIZE_t off, void *buf, uint8_t *cnt)
+{
+    uint32_t b = off >> z->blk_shift;
+    uint32_t boff = off & (z->blk_size - 1), n;
+
+    ASSERT(!z->pending);
+    if (b >= z->nr_blks)
+        F_die(FR_BAD_IMAGE);
+
+    *cnt = min_t(uint32_t, *cnt, (z->blk_size - boff) / 512);
+    z->dst = buf;
+    z->dst_blk = b;
+    z->dst_off = boff;
+    z->dst_len = *cnt * 512;
+    z->pending = TRUE;
+
+    /* Successive batches mostly fall in the block last decoded. */
+    if (b == z->dec_blk)
+        return F_async_get_completed_op();
+
+    n = zimg_stage(z, b);
+    return F_read_async(z->fp, z->stage, n, NULL);
+}
+
+void zimg_read_done(struct zimg *z)
+{
+    if (!z->pending)
+        return;
+    z->pending = FALSE;
+    if (z->dst_blk != z->dec_blk) {
+        ASSERT(z->stage_blk == z->dst_blk);
+        zimg_decode(z);
+    }
+    memcpy(z->dst, z->dec + z->dst_off, z->dst_len);
+}
+
+void zimg_read_abort(struct zimg *z)
+{
+    /* The staging buffer may hold a partial read. */
+    if (z->pending && (z->dst_blk != z->dec_blk))
+        z->stage_blk = ~0;
+    z->pending = FALSE;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */